@@ -1,5 +1,7 @@
 #!/bin/bash
 mkdir -p bin
-gcc -Wall -o bin/client src/client.c
-gcc -Wall -o bin/server src/server.c
-gcc -Wall -o bin/client_salon src/client_salon.c
\ No newline at end of file
+gcc -Wall -o bin/client src/client.c -lz -lm
+gcc -Wall -o bin/server src/server.c -lz -lm
+gcc -Wall -o bin/client_salon src/client_salon.c
+gcc -Wall -o bin/bench_search src/bench_search.c -lpthread -lm
+gcc -Wall -O2 -o bin/bench_crc src/bench_crc.c
\ No newline at end of file
@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// DOCUMENTATION
+// Ce programme mesure le debit de la somme de controle CRC32C des transferts de fichiers
+// Il compare, sur un grand buffer lu par morceaux de 64 Ko comme pendant un transfert :
+// - la copie des morceaux sans somme de controle
+// - la somme de controle avec la table (ce que fait le client sans SSE4.2)
+// - la somme de controle avec l'instruction crc32 de SSE4.2
+// Les fonctions de la somme de controle sont celles de client.c
+//
+// => ./bench_crc [taille du buffer en Mo]
+//
+// La taille est de 1024 Mo par defaut
+
+#define PACKET_SIZE 65536
+// Chaque mesure est faite plusieurs fois, on garde la plus rapide
+#define NB_ESSAIS 3
+
+
+/*******************************************
+            Somme de controle
+********************************************/
+
+uint32_t crc32c_table[256];
+int crc32c_hardware = 0;
+
+void crc32c_init() {
+#if defined(__x86_64__)
+    crc32c_hardware = __builtin_cpu_supports("sse4.2") != 0;
+#endif
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+        }
+        crc32c_table[i] = crc;
+    }
+}
+
+#if defined(__x86_64__)
+// Meme somme de controle avec l'instruction crc32, 8 octets a la fois
+__attribute__((target("sse4.2")))
+uint32_t crc32c_update_hardware(uint32_t crc, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    uint64_t crc64 = (uint32_t) ~crc;
+    uint64_t word;
+    for (; length >= 8; length -= 8, bytes += 8) {
+        memcpy(&word, bytes, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t) crc64;
+    while (length-- > 0) {
+        crc = _mm_crc32_u8(crc, *bytes++);
+    }
+    return ~crc;
+}
+#endif
+
+// La somme de controle avec la table
+uint32_t crc32c_update_table(uint32_t crc, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    crc = ~crc;
+    while (length-- > 0) {
+        crc = crc32c_table[(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+
+/*******************************************
+                Mesures
+********************************************/
+
+// Les facons de traiter un morceau qui sont comparees
+#define SANS_CRC 0
+#define CRC_TABLE 1
+#define CRC_SSE42 2
+
+double maintenant() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Passe sur tout le buffer par morceaux de PACKET_SIZE, chaque morceau est copie dans packet
+// comme s'il etait lu dans le fichier, puis sa somme de controle est ajoutee selon mode
+// Renvoie la duree en secondes, la somme de controle est mise dans crc
+double mesurer(const char *buffer, size_t size, char *packet, int mode, uint32_t *crc) {
+    double debut = maintenant();
+    *crc = 0;
+    for (size_t offset = 0; offset < size; offset += PACKET_SIZE) {
+        size_t length = size - offset < PACKET_SIZE ? size - offset : PACKET_SIZE;
+        memcpy(packet, buffer + offset, length);
+        if (mode == CRC_TABLE) {
+            *crc = crc32c_update_table(*crc, packet, length);
+        }
+#if defined(__x86_64__)
+        else if (mode == CRC_SSE42) {
+            *crc = crc32c_update_hardware(*crc, packet, length);
+        }
+#endif
+        else {
+            // Sans somme de controle, on garde un octet pour que la copie ne soit pas supprimee
+            *crc ^= (unsigned char) packet[length - 1];
+        }
+    }
+    return maintenant() - debut;
+}
+
+// Affiche le meilleur debit de NB_ESSAIS mesures
+uint32_t afficher(const char *nom, const char *buffer, size_t size, char *packet, int mode) {
+    double meilleur = 0;
+    uint32_t crc = 0;
+    for (int i = 0; i < NB_ESSAIS; i++) {
+        double duree = mesurer(buffer, size, packet, mode, &crc);
+        if (i == 0 || duree < meilleur) {
+            meilleur = duree;
+        }
+    }
+    printf("%-26s %8.0f Mo/s   (%.3f s)", nom, size / meilleur / 1e6, meilleur);
+    if (mode != SANS_CRC) {
+        printf("   crc %08x", crc);
+    }
+    printf("\n");
+    return crc;
+}
+
+
+/*******************************************
+                  MAIN
+********************************************/
+
+int main(int argc, char *argv[]) {
+    size_t size = 1024;
+    if (argc > 1) {
+        size = strtoul(argv[1], NULL, 10);
+    }
+    if (size == 0) {
+        printf("Usage: %s [taille du buffer en Mo]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    size = size * 1024 * 1024;
+
+    char *buffer = malloc(size);
+    char *packet = malloc(PACKET_SIZE);
+    if (buffer == NULL || packet == NULL) {
+        perror("Erreur lors de l'allocation du buffer");
+        exit(EXIT_FAILURE);
+    }
+    // Des octets pseudo-aleatoires, toujours les memes
+    uint64_t x = 88172645463325252ULL;
+    for (size_t i = 0; i < size; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        buffer[i] = (char) x;
+    }
+
+    crc32c_init();
+    // Valeur de controle de CRC32C
+    if (crc32c_update_table(0, "123456789", 9) != 0xE3069283) {
+        printf("La somme de controle avec la table est fausse\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Buffer de %zu Mo, morceaux de %d Ko\n", size / 1024 / 1024, PACKET_SIZE / 1024);
+    afficher("Sans somme de controle", buffer, size, packet, SANS_CRC);
+    uint32_t crc_table = afficher("CRC32C avec la table", buffer, size, packet, CRC_TABLE);
+#if defined(__x86_64__)
+    if (crc32c_hardware) {
+        uint32_t crc_sse42 = afficher("CRC32C avec SSE4.2", buffer, size, packet, CRC_SSE42);
+        if (crc_sse42 != crc_table) {
+            printf("Les deux sommes de controle sont differentes\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else {
+        printf("Le processeur n'a pas SSE4.2\n");
+    }
+#else
+    printf("SSE4.2 n'existe que sur x86-64\n");
+#endif
+
+    free(packet);
+    free(buffer);
+    return 0;
+}
@@ -0,0 +1,583 @@
+// nftw, to remove the directory of the server, is an extension of POSIX
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <ftw.h>
+#include <libgen.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+
+
+// DOCUMENTATION
+// Benchmark of /search: it starts a server, fills its channel "bench" with messages,
+// then measures how long the searches take
+// The first search of the channel builds its index from the history on the disk: meanwhile,
+// another client sends messages in the channel and we measure how late they arrive
+// (the server must keep sending the messages of the channels while an index is built)
+// Then nb_queries searches of 1 to 3 words are sent one after the other, and the latencies are printed
+//
+// => ./bench_search port [nb_messages] [nb_queries]
+//
+// nb_messages is 2000000 by default
+// The server is the one next to bench_search in bin, it listens on port (and the next four ports)
+// It runs in a scratch directory of /tmp, removed at the end with the history written by the benchmark,
+// so the files of the real server (server_history, server_files...) are never touched
+
+
+/*******************************************
+               Constants
+********************************************/
+
+#define USERNAME_SIZE 10
+#define CMD_SIZE 10
+#define CHANNEL_SIZE 10
+#define MSG_SIZE 960
+#define COLOR_SIZE 10
+// The channel filled and searched
+#define BENCH_CHANNEL "bench"
+// Number of different words in the messages, the first ones are the most frequent
+#define VOCABULARY 50000
+// Number of words in a message
+#define WORDS_PER_MESSAGE 8
+// One message in RARE_EVERY has the word "rare"
+#define RARE_EVERY 100000
+// Number of messages sent with a single write while the channel is filled
+#define FILL_BATCH 1000
+// Number of microseconds between two messages of the probe while the index is built
+#define PROBE_INTERVAL 100
+
+typedef struct Message Message;
+struct Message {
+    char cmd[CMD_SIZE];
+    char from[USERNAME_SIZE];
+    char to[USERNAME_SIZE];
+    char channel[CHANNEL_SIZE];
+    char message[MSG_SIZE];
+    char color[COLOR_SIZE];
+};
+
+
+/*******************************************
+            Shared variables
+********************************************/
+
+// The main connection of the benchmark, and the one of the probe
+int dS_bench;
+int dS_probe;
+
+// The replies counted by the reader thread, protected by mutex_replies
+// A search (or a history) is followed by "list", whose reply tells that the reply before it is complete
+long nb_list_replies = 0;
+// 1 once the last message sent is in the history of the channel
+int fill_done = 0;
+// The word of the last message sent while filling
+char fill_marker[32];
+// The delays of the messages of the probe received, in microseconds
+double probe_max = 0;
+double probe_total = 0;
+long nb_probe = 0;
+pthread_mutex_t mutex_replies;
+pthread_cond_t cond_replies;
+
+// 1 while the probe sends messages
+volatile int probe_running = 0;
+// 1 once the benchmark closes its connections
+volatile int bench_done = 0;
+
+// The server started by the benchmark, and its scratch directory
+pid_t server_pid = -1;
+char scratch[64] = "";
+
+
+/*******************************************
+               Functions
+********************************************/
+
+// A function that will give the time of a monotonic clock, in microseconds
+
+double now_us() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000.0 + now.tv_nsec / 1000.0;
+}
+
+// A function that will send all the bytes of buffer on dS, and exit if it fails
+
+void send_all(int dS, const void * buffer, size_t length) {
+    const char * bytes = buffer;
+    ssize_t nb_send;
+
+    while (length > 0) {
+        nb_send = send(dS, bytes, length, 0);
+        if (nb_send <= 0) {
+            perror("Erreur lors de l'envoi");
+            exit(EXIT_FAILURE);
+        }
+        bytes = bytes + nb_send;
+        length = length - nb_send;
+    }
+}
+
+// A function that will receive one frame on dS
+// It returns 1, or 0 if the connection is closed
+// The data is acknowledged right away: the server does not wait for the acknowledgement
+// of a reply before sending the next small one (otherwise each request takes 40 ms)
+
+int recv_frame(int dS, Message * frame) {
+    char * bytes = (char *) frame;
+    size_t received = 0;
+    ssize_t nb_recv;
+    int one = 1;
+
+    while (received < sizeof(Message)) {
+        setsockopt(dS, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+        nb_recv = recv(dS, bytes + received, sizeof(Message) - received, 0);
+        if (nb_recv <= 0) {
+            return 0;
+        }
+        received = received + nb_recv;
+    }
+    return 1;
+}
+
+// A function that will send a frame made of its fields on dS
+
+void send_frame(int dS, const char * cmd, const char * from, const char * channel, const char * text) {
+    Message frame;
+
+    memset(&frame, 0, sizeof(Message));
+    strcpy(frame.cmd, cmd);
+    strcpy(frame.from, from);
+    strcpy(frame.to, "all");
+    strcpy(frame.channel, channel);
+    strcpy(frame.message, text);
+    send_all(dS, &frame, sizeof(Message));
+}
+
+// A function that will connect to the server on port and log in with username
+// It exits if the username is taken
+
+int connect_login(const char * ip, int port, const char * username) {
+    struct sockaddr_in address;
+    Message frame;
+    int dS = socket(PF_INET, SOCK_STREAM, 0);
+    int one = 1;
+
+    address.sin_family = AF_INET;
+    inet_pton(AF_INET, ip, &address.sin_addr);
+    address.sin_port = htons(port);
+    if (dS == -1 || connect(dS, (struct sockaddr *) &address, sizeof(address)) == -1) {
+        perror("Erreur lors de la connexion au serveur");
+        exit(EXIT_FAILURE);
+    }
+    // The requests are sent right away
+    setsockopt(dS, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    memset(&frame, 0, sizeof(Message));
+    strcpy(frame.from, username);
+    strcpy(frame.to, "server");
+    send_all(dS, &frame, sizeof(Message));
+    if (recv_frame(dS, &frame) == 0 || strcmp(frame.message, "true") != 0) {
+        printf("Le pseudo %s est deja pris\n", username);
+        exit(EXIT_FAILURE);
+    }
+    return dS;
+}
+
+// A function that will make the main connection dS join the channel, through the channel menu
+// It returns the connection of the menu, kept open
+
+int join_channel(const char * ip, int port, int dS, const char * username, const char * channel) {
+    struct sockaddr_in address;
+    Message frame;
+    char * ticket;
+    int dS_menu = socket(PF_INET, SOCK_STREAM, 0);
+
+    send_frame(dS, "ticket", username, "", "salon");
+    while (recv_frame(dS, &frame) == 1 && strcmp(frame.cmd, "ticket") != 0) {
+    }
+    ticket = strchr(frame.message, '/');
+    if (ticket == NULL || ticket[1] == '\0') {
+        printf("Le serveur n'a pas donne de ticket\n");
+        exit(EXIT_FAILURE);
+    }
+    address.sin_family = AF_INET;
+    inet_pton(AF_INET, ip, &address.sin_addr);
+    address.sin_port = htons(port + 3);
+    if (dS_menu == -1 || connect(dS_menu, (struct sockaddr *) &address, sizeof(address)) == -1) {
+        perror("Erreur lors de la connexion au menu des channels");
+        exit(EXIT_FAILURE);
+    }
+    send_frame(dS_menu, "ticket", username, "", ticket + 1);
+    recv_frame(dS_menu, &frame);
+    send_frame(dS_menu, "connect", username, channel, "");
+    return dS_menu;
+}
+
+// A function for the thread that reads the main connection of the benchmark
+
+void * reader_thread(void * arg) {
+    Message frame;
+    double delay;
+    double sent;
+
+    while (recv_frame(dS_bench, &frame) == 1) {
+        // Lock the mutex
+        pthread_mutex_lock(&mutex_replies);
+        if (strcmp(frame.cmd, "list") == 0) {
+            nb_list_replies = nb_list_replies + 1;
+            pthread_cond_broadcast(&cond_replies);
+        }
+        else if (strcmp(frame.cmd, "history") == 0 && strstr(frame.message, fill_marker) != NULL) {
+            fill_done = 1;
+        }
+        else if (strcmp(frame.cmd, "") == 0 && sscanf(frame.message, "probe %lf", &sent) == 1) {
+            delay = now_us() - sent;
+            probe_total = probe_total + delay;
+            nb_probe = nb_probe + 1;
+            if (delay > probe_max) {
+                probe_max = delay;
+            }
+        }
+        // Unlock the mutex
+        pthread_mutex_unlock(&mutex_replies);
+    }
+    if (bench_done == 0) {
+        printf("Connexion fermee par le serveur\n");
+        exit(EXIT_FAILURE);
+    }
+    return arg;
+}
+
+// A function for the thread of the probe, it sends messages in the channel while probe_running is 1
+
+void * probe_thread(void * arg) {
+    char text[64];
+
+    while (probe_running == 1) {
+        sprintf(text, "probe %.0f", now_us());
+        send_frame(dS_probe, "", "probe", BENCH_CHANNEL, text);
+        usleep(PROBE_INTERVAL);
+    }
+    return arg;
+}
+
+// A function that will send cmd with text on the main connection, followed by "list",
+// and wait until the reply of "list" arrives
+// It returns the time it took, in microseconds
+
+double request(const char * cmd, const char * text) {
+    Message frames[2];
+    double start;
+    long expected;
+
+    memset(frames, 0, sizeof(frames));
+    strcpy(frames[0].cmd, cmd);
+    strcpy(frames[0].from, "bench");
+    strcpy(frames[0].to, "0");
+    strcpy(frames[0].channel, BENCH_CHANNEL);
+    strcpy(frames[0].message, text);
+    strcpy(frames[1].cmd, "list");
+    strcpy(frames[1].from, "bench");
+
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_replies);
+    expected = nb_list_replies + 1;
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_replies);
+    start = now_us();
+    send_all(dS_bench, frames, sizeof(frames));
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_replies);
+    while (nb_list_replies < expected) {
+        pthread_cond_wait(&cond_replies, &mutex_replies);
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_replies);
+    return now_us() - start;
+}
+
+// A function that will give a word of the vocabulary, the first ones are chosen more often
+
+void random_word(char * word, unsigned short * seed) {
+    double u = erand48(seed);
+
+    sprintf(word, "w%d", (int) (VOCABULARY * u * u * u));
+}
+
+// A function that will fill the channel with nb_messages messages, and wait until they are all
+// in its history
+
+void fill(long nb_messages) {
+    Message * batch = calloc(FILL_BATCH, sizeof(Message));
+    unsigned short seed[3] = {1, 2, 3};
+    char word[16];
+    double start = now_us();
+    long sent = 0;
+    int nb_batch;
+    int k;
+
+    sprintf(fill_marker, "fin%d", (int) getpid());
+    while (sent < nb_messages) {
+        nb_batch = 0;
+        while (nb_batch < FILL_BATCH && sent < nb_messages) {
+            strcpy(batch[nb_batch].from, "bench");
+            strcpy(batch[nb_batch].to, "all");
+            strcpy(batch[nb_batch].channel, BENCH_CHANNEL);
+            batch[nb_batch].message[0] = '\0';
+            k = 0;
+            while (k < WORDS_PER_MESSAGE) {
+                random_word(word, seed);
+                strcat(batch[nb_batch].message, word);
+                strcat(batch[nb_batch].message, " ");
+                k = k + 1;
+            }
+            if (sent % RARE_EVERY == 0) {
+                strcat(batch[nb_batch].message, "rare");
+            }
+            if (sent == nb_messages - 1) {
+                strcat(batch[nb_batch].message, fill_marker);
+            }
+            nb_batch = nb_batch + 1;
+            sent = sent + 1;
+        }
+        send_all(dS_bench, batch, nb_batch * sizeof(Message));
+        if (sent % 200000 < FILL_BATCH) {
+            printf("%ld messages envoyes\n", sent);
+        }
+    }
+    free(batch);
+
+    // The history thread writes them after they are sent to the members
+    while (1) {
+        request("history", "1");
+        // Lock the mutex
+        pthread_mutex_lock(&mutex_replies);
+        k = fill_done;
+        // Unlock the mutex
+        pthread_mutex_unlock(&mutex_replies);
+        if (k == 1) {
+            break;
+        }
+        usleep(200000);
+    }
+    printf("Channel rempli : %ld messages en %.1f s (%.0f messages/s)\n", nb_messages,
+           (now_us() - start) / 1000000, nb_messages / ((now_us() - start) / 1000000));
+}
+
+// A function for nftw, that removes a file or an empty directory of the scratch directory
+
+int remove_entry(const char * path, const struct stat * info, int type, struct FTW * ftw) {
+    return remove(path);
+}
+
+// A function called when the benchmark ends, even after an error: it stops the server and removes its directory
+
+void stop_server() {
+    if (server_pid > 0) {
+        kill(server_pid, SIGKILL);
+        waitpid(server_pid, NULL, 0);
+        server_pid = -1;
+    }
+    if (scratch[0] != '\0') {
+        nftw(scratch, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+        scratch[0] = '\0';
+    }
+}
+
+// A function that will start the server next to the program program, on port, in a scratch directory
+// The server works in <scratch>/bin and writes in <scratch>/src, like in the directories of the project
+// It returns once the server accepts the connections
+
+void start_server(const char * program, int port) {
+    char server[PATH_MAX];
+    char directory[PATH_MAX];
+    char port_text[12];
+    struct sockaddr_in address;
+    int dS;
+    int i = 0;
+
+    if (realpath(program, server) == NULL) {
+        perror("Erreur lors de la recherche du serveur");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(server, dirname(server));
+    strcat(server, "/server");
+
+    strcpy(scratch, "/tmp/bench_search.XXXXXX");
+    if (mkdtemp(scratch) == NULL) {
+        perror("Erreur lors de la creation du repertoire du serveur");
+        exit(EXIT_FAILURE);
+    }
+    atexit(stop_server);
+    sprintf(directory, "%s/src", scratch);
+    mkdir(directory, 0755);
+    sprintf(directory, "%s/src/server_files", scratch);
+    mkdir(directory, 0755);
+    sprintf(directory, "%s/src/server_channels", scratch);
+    mkdir(directory, 0755);
+    sprintf(directory, "%s/bin", scratch);
+    mkdir(directory, 0755);
+
+    sprintf(port_text, "%d", port);
+    server_pid = fork();
+    if (server_pid == -1) {
+        perror("Erreur lors du lancement du serveur");
+        exit(EXIT_FAILURE);
+    }
+    if (server_pid == 0) {
+        // The messages of the server go in a file of its directory
+        if (chdir(directory) == -1 || freopen("../server.log", "w", stdout) == NULL) {
+            _exit(EXIT_FAILURE);
+        }
+        dup2(STDOUT_FILENO, STDERR_FILENO);
+        execl(server, server, port_text, (char *) NULL);
+        _exit(EXIT_FAILURE);
+    }
+
+    // We wait until the server listens, 5 seconds at most
+    address.sin_family = AF_INET;
+    inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+    address.sin_port = htons(port);
+    while (1) {
+        dS = socket(PF_INET, SOCK_STREAM, 0);
+        if (connect(dS, (struct sockaddr *) &address, sizeof(address)) == 0) {
+            close(dS);
+            break;
+        }
+        close(dS);
+        i = i + 1;
+        if (i == 50 || waitpid(server_pid, NULL, WNOHANG) != 0) {
+            printf("Le serveur %s ne demarre pas sur le port %d (voir %s/server.log)\n", server, port, scratch);
+            server_pid = -1;
+            scratch[0] = '\0';
+            exit(EXIT_FAILURE);
+        }
+        usleep(100000);
+    }
+    printf("Serveur lance dans %s\n", scratch);
+}
+
+// A function to sort the latencies
+
+int compare_double(const void * a, const void * b) {
+    double difference = *(const double *) a - *(const double *) b;
+
+    return (difference > 0) - (difference < 0);
+}
+
+
+/*******************************************
+                  MAIN
+********************************************/
+
+int main(int argc, char * argv[]) {
+    long nb_messages = 2000000;
+    int nb_queries = 1000;
+    unsigned short seed[3] = {4, 5, 6};
+    pthread_t reader_tid;
+    pthread_t probe_tid;
+    char query[64];
+    char word[16];
+    double * latencies;
+    double cold;
+    double total = 0;
+    int nb_words;
+    int i = 0;
+    int k;
+
+    if (argc < 2) {
+        printf("Usage: %s port [nb_messages] [nb_queries]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (argc > 2) {
+        nb_messages = atol(argv[2]);
+    }
+    if (argc > 3) {
+        nb_queries = atoi(argv[3]);
+    }
+    if (nb_messages < 1) {
+        nb_messages = 1;
+    }
+    if (nb_queries < 1) {
+        nb_queries = 1;
+    }
+    pthread_mutex_init(&mutex_replies, NULL);
+    pthread_cond_init(&cond_replies, NULL);
+
+    start_server(argv[0], atoi(argv[1]));
+    dS_bench = connect_login("127.0.0.1", atoi(argv[1]), "bench");
+    join_channel("127.0.0.1", atoi(argv[1]), dS_bench, "bench", BENCH_CHANNEL);
+    if (pthread_create(&reader_tid, NULL, reader_thread, NULL) != 0) {
+        perror("Erreur lors de la creation du thread");
+        exit(EXIT_FAILURE);
+    }
+    // The join is done once the menu has answered the next request
+    request("history", "1");
+
+    fill(nb_messages);
+
+    // The first search builds the index, the probe sends messages meanwhile
+    dS_probe = connect_login("127.0.0.1", atoi(argv[1]), "probe");
+    probe_running = 1;
+    if (pthread_create(&probe_tid, NULL, probe_thread, NULL) != 0) {
+        perror("Erreur lors de la creation du thread");
+        exit(EXIT_FAILURE);
+    }
+    cold = request("search", "rare");
+    probe_running = 0;
+    pthread_join(probe_tid, NULL);
+    // The last messages of the probe arrive
+    request("list", "");
+    printf("Premiere recherche (construction de l'index) : %.1f ms\n", cold / 1000);
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_replies);
+    if (nb_probe > 0) {
+        printf("Messages du channel pendant la construction : %ld, retard moyen %.2f ms, maximum %.2f ms\n",
+               nb_probe, probe_total / nb_probe / 1000, probe_max / 1000);
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_replies);
+
+    // The next searches use the index in memory
+    latencies = malloc(nb_queries * sizeof(double));
+    while (i < nb_queries) {
+        nb_words = 1 + i % 3;
+        query[0] = '\0';
+        k = 0;
+        while (k < nb_words) {
+            random_word(word, seed);
+            strcat(query, word);
+            strcat(query, " ");
+            k = k + 1;
+        }
+        latencies[i] = request("search", query);
+        total = total + latencies[i];
+        i = i + 1;
+    }
+    qsort(latencies, nb_queries, sizeof(double), compare_double);
+    printf("%d recherches de 1 a 3 mots : moyenne %.0f us, p50 %.0f us, p90 %.0f us, p99 %.0f us, max %.0f us\n",
+           nb_queries, total / nb_queries, latencies[nb_queries / 2], latencies[nb_queries * 9 / 10],
+           latencies[nb_queries * 99 / 100], latencies[nb_queries - 1]);
+    printf("(avec l'aller-retour d'une commande list)\n");
+    free(latencies);
+    bench_done = 1;
+    close(dS_probe);
+    shutdown(dS_bench, SHUT_RDWR);
+    pthread_join(reader_tid, NULL);
+    close(dS_bench);
+    stop_server();
+    return 0;
+}
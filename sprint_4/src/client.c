@@ -1,5 +1,13 @@
+// Les fonctions sur les fichiers (stat, fopen, fseeko...) utilisent des offsets sur 64 bits, pour les fichiers de plus de 2 Go
+#define _FILE_OFFSET_BITS 64
+// struct ucred, pour savoir qui se connecte a la socket des salons, est une extension GNU
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/random.h>
+#include <stddef.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,6 +19,17 @@
 #include <termios.h>
 #include <dirent.h>
 #include <semaphore.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <math.h>
+#include <zlib.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 // DOCUMENTATION
 // This program acts as a client which connects to a server
@@ -23,9 +42,10 @@
 // including the different commands that can be used
 
 // You can use gcc to compile this program:
-// gcc -o client client.c
+// gcc -o client client.c -lz -lm
 
-// Use : ./client <server_ip> <server_port>
+// Use : ./client <server_ip> <server_port> [-m]
+// -m : uploads, downloads and the channel menu go through the main connection
 //
 /*******************************************
             VARIABLES GLOBALES
@@ -45,8 +65,33 @@
 #define BUFFER_SIZE PSEUDO_LENGTH + PSEUDO_LENGTH + CMD_LENGTH + MSG_LENGTH + COLOR_LENGTH + CHANNEL_SIZE
 // répertoire courant
 #define FILES_DIRECTORY "../src/client_files/"
-// port pour les channels
-#define PORT_CHANNEL_START 9537
+// nom de la socket Unix pour les fenetres des channels (namespace abstrait), %d est le pid du client
+// et %016llx un nombre au hasard, pour qu'un autre utilisateur ne puisse pas prendre le nom avant nous
+#define SALON_SOCKET_NAME "projet-far-salon-%d-%016llx"
+// taille a partir de laquelle un fichier est envoye ou recu en plusieurs morceaux en parallele
+#define PARALLEL_THRESHOLD (1024 * 1024)
+// nombre de connexions utilisees pour un transfert en parallele
+#define NB_STREAMS 4
+// nombre d'essais pour transferer un morceau
+#define MAX_RETRY 3
+// nombre de fichiers demandes au serveur a chaque page du menu de download
+#define PAGE_SIZE 20
+// nombre maximal de tickets recus en attente d'etre utilises
+#define MAX_TICKETS 32
+// temps maximal d'attente d'un ticket en secondes
+#define TICKET_TIMEOUT 5
+// nombre d'octets d'un stream multiplexe envoyes avant d'attendre du credit de l'autre cote
+#define MUX_WINDOW 65536
+// nombre d'octets pas encore envoyes dans la socket au dessus duquel les donnees de fichier attendent
+#define MUX_QUEUE_LIMIT 16384
+// taille maximale d'un bloc d'un transfert compresse, avant compression
+#define COMPRESS_BLOCK 65536
+// nombre d'octets lus pour deviner si un fichier vaut la peine d'etre compresse
+#define COMPRESS_SAMPLE 4096
+// entropie (en bits par octet) au dessus de laquelle un fichier est considere comme deja compresse
+#define COMPRESS_ENTROPY 7.0
+// taille des ecritures d'un telechargement : les octets recus sont regroupes avant d'etre ecrits
+#define WRITE_BATCH (1024 * 1024)
 
 
 // pseudo de l'utilisateur
@@ -65,8 +110,10 @@ int num_files;
 int menu = 0;
 // index_cursor du fichier sélectionné dans le menu de téléchargement
 int index_cursor = 0;
-// tableau contenant les noms des fichiers
-char *files_array[100];
+// tableau contenant les noms des fichiers du menu de download, agrandi a chaque page recue
+char **files_array = NULL;
+// nombre de places allouees dans files_array
+int files_capacity = 0;
 // tableau contenant les noms des channels
 char *channel_array[200];
 // tableau contenant 1 si l'utilisateur est connecté au channel, 0 sinon
@@ -75,8 +122,25 @@ int channel_connect[200];
 int socket_channel_address;
 // socket du serveur
 int *socket_server;
-// port du channel
-int port_channel;
+// nom de la socket du channel, donne aux client_salon
+char salon_socket_name[48];
+// tickets recus du serveur, de la forme "<type>/<ticket>", en attente d'etre utilises
+char tickets[MAX_TICKETS][MSG_LENGTH];
+// nombre de tickets en attente
+int nb_tickets = 0;
+// mutex et condition pour proteger les tickets, readMessage previent les threads qui attendent un ticket
+pthread_mutex_t mutex_tickets;
+pthread_cond_t cond_tickets;
+// 1 si les fichiers et les salons passent par la connexion principale (option -m), 0 sinon
+int mode_mux = 0;
+// 1 si chaque salon s'ouvre dans une fenetre client_salon (option -w), 0 si les salons sont des onglets du client
+int mode_fenetres = 0;
+// envoi sur la connexion principale : un seul thread envoie a la fois,
+// et les messages du chat passent avant les donnees des fichiers
+pthread_mutex_t mutex_envoi;
+pthread_cond_t cond_envoi;
+int envoi_occupe = 0;
+int nb_chat_attente = 0;
 
 // Thread ids for the read and write threads 
 pthread_t readThread;
@@ -87,7 +151,13 @@ pthread_t writeThread;
 
 // Signatures des fonctions de quelques fonction utile
 void *afficher(int color, char *msg, void *args);
+void barre_onglets();
+int ouvrir_onglet(char *nom);
+void fermer_onglet(char *nom);
 void *channel_thread(void *args);
+void ouvrir_fenetre(char *channel);
+ssize_t recv_full(int socket, void *data, size_t length);
+ssize_t send_full(int socket, const void *data, size_t length);
 
 /****************************************************
             STRUCTURE DES MESSAGES
@@ -242,6 +312,35 @@ int get_socket(List *l, char *name) {
 // creer une nouvelle liste contenant les noms des channels et la socket du channel
 List *socket_channel_list;
 
+// salons dont la fenetre est en train de s'ouvrir, et messages de l'historique recus pour eux
+// les messages sont envoyes d'un coup au client_salon quand il se connecte
+#define PENDING_BACKFILL_MAX 100
+List *opening_channel_list;
+Message pending_backfill[PENDING_BACKFILL_MAX];
+int nb_pending_backfill = 0;
+pthread_mutex_t mutex_pending_backfill;
+
+// Sans l'option -w, chaque salon rejoint est un onglet du client, global est toujours le premier
+// readMessage range les messages de chaque salon dans son onglet, seul l'onglet actif s'affiche
+// les messages ecrits partent dans le salon de l'onglet actif, /tab <salon> change d'onglet
+#define ONGLET_MAX 20
+#define ONGLET_LIGNES 100
+typedef struct Onglet Onglet;
+struct Onglet {
+    char nom[CHANNEL_SIZE];
+    // les dernieres lignes du salon, deja mises en forme, de lignes[debut] a la plus recente
+    char *lignes[ONGLET_LIGNES];
+    int debut;
+    int nb_lignes;
+    // nombre de messages recus pendant que l'onglet n'etait pas affiche
+    int non_lus;
+};
+Onglet onglets[ONGLET_MAX];
+int nb_onglets = 0;
+// indice de l'onglet affiche dans onglets
+int onglet_actif = 0;
+pthread_mutex_t mutex_onglets;
+
 
 /*******************************************
             FILES DES THREADS
@@ -504,21 +603,73 @@ char* get_file() {
 }
 
 
-char * get_file_download(char *files) {
-    // Fonction pour obtenir le fichier choisi par l'utilisateur avec les flèches du clavier
-    disableCanonicalMode();
+// Demande au serveur la page suivante de la liste des fichiers et l'ajoute a files_array
+// prefix : seuls les fichiers dont le nom commence par prefix sont listes
+// order : "name", "size" ou "date", avec un "-" devant pour l'ordre inverse
+// cursor : position de la fin de la page precedente, mis a jour pour la page suivante
+// more : mis a 1 s'il reste des pages apres celle-ci
+// Renvoie le nombre de fichiers ajoutes, ou -1 si la connexion est perdue
+int fetch_page(int dS_download, char *prefix, char *order, char *cursor, int *more) {
+    Message request;
+    memset(&request, 0, sizeof(Message));
+    strcpy(request.cmd, "page");
+    strcpy(request.from, pseudo);
+    strncpy(request.to, order, PSEUDO_LENGTH - 1);
+    sprintf(request.channel, "%d", PAGE_SIZE);
+    snprintf(request.message, MSG_LENGTH, "%s/%s", prefix, cursor);
+    if (send_full(dS_download, &request, BUFFER_SIZE) == -1
+        || recv_full(dS_download, &request, BUFFER_SIZE) < BUFFER_SIZE) {
+        afficher(31, "Le serveur a ferme la connexion\n", NULL);
+        return -1;
+    }
+    request.message[MSG_LENGTH - 1] = '\0';
+    *more = (strcmp(request.color, "1") == 0);
 
-    //Efface les deux dernières lignes
-    printf("\033[2K\r\033[1A\033[2K\r");
+    // la reponse est "<cursor>/<nom>/<nom>/.../"
+    char *fin_cursor = strchr(request.message, '/');
+    if (fin_cursor == NULL) {
+        *more = 0;
+        return 0;
+    }
+    *fin_cursor = '\0';
+    strcpy(cursor, request.message);
 
-    char *file = strtok(files, "/");
-    int i = 0;
+    int nb_ajoutes = 0;
+    char *file = strtok(fin_cursor + 1, "/");
     while (file != NULL) {
-        files_array[i] = file;
+        if (num_files - 1 + nb_ajoutes == files_capacity) {
+            files_capacity = files_capacity * 2 + PAGE_SIZE;
+            files_array = realloc(files_array, files_capacity * sizeof(char *));
+        }
+        files_array[num_files - 1 + nb_ajoutes] = strdup(file);
+        nb_ajoutes++;
         file = strtok(NULL, "/");
-        i++;
     }
-    num_files = i + 1;
+    return nb_ajoutes;
+}
+
+// Fonction pour obtenir le fichier choisi par l'utilisateur avec les flèches du clavier
+// La liste est demandee au serveur page par page : une nouvelle page est chargee
+// quand le curseur arrive sur le dernier fichier affiche
+// Renvoie le nom du fichier choisi (a liberer), ou NULL pour le retour au tchat
+char * get_file_download(int dS_download, char *prefix, char *order) {
+    char cursor[MSG_LENGTH] = "";
+    int more = 0;
+
+    // num_files compte aussi la ligne "retour au tchat"
+    num_files = 1;
+    int nb_ajoutes = fetch_page(dS_download, prefix, order, cursor, &more);
+    if (nb_ajoutes == -1) {
+        num_files = 0;
+        return NULL;
+    }
+    num_files += nb_ajoutes;
+
+    disableCanonicalMode();
+
+    //Efface les deux dernières lignes
+    printf("\033[2K\r\033[1A\033[2K\r");
+
     menu = 2;
     display_files_download();
     index_cursor = 0;
@@ -539,6 +690,21 @@ char * get_file_download(char *files) {
                     index_cursor = (index_cursor + 1) % num_files;
                     break;
                    }
+            // le curseur est sur le dernier fichier : on charge la page suivante en dessous
+            if (more && index_cursor == num_files - 1) {
+                int debut = num_files - 1;
+                nb_ajoutes = fetch_page(dS_download, prefix, order, cursor, &more);
+                if (nb_ajoutes > 0) {
+                    printf("\033[35m");
+                    for (int i = debut; i < debut + nb_ajoutes; i++) {
+                        printf("   %s\n", files_array[i]);
+                    }
+                    printf("\033[0m");
+                    num_files += nb_ajoutes;
+                } else {
+                    more = 0;
+                }
+            }
         }
     } while (c != '\n'); // Sort de la boucle lorsque l'utilisateur appuie sur la touche Entrée
 
@@ -550,7 +716,7 @@ char * get_file_download(char *files) {
 
         // Récupère le nom du fichier sélectionné
         if (num_files > 0) {
-            filename = files_array[index_cursor - 1];
+            filename = strdup(files_array[index_cursor - 1]);
         }
 
     }
@@ -559,6 +725,9 @@ char * get_file_download(char *files) {
     for (int i = 0; i <= num_files; i++) {
         printf("\033[1A\033[2K\r");
     }
+    for (int i = 0; i < num_files - 1; i++) {
+        free(files_array[i]);
+    }
     menu = 0;
     num_files = 0;
     index_cursor = 0;
@@ -574,7 +743,6 @@ void *channel_menu(int *ds, char *channels){
     disableCanonicalMode();
 
     Message request[BUFFER_SIZE];
-    pthread_t thread_channel;
 
     //Efface les deux dernières lignes
     printf("\033[2K\r\033[1A\033[2K\r\033[1A\033[2K\r");
@@ -587,6 +755,8 @@ void *channel_menu(int *ds, char *channels){
     char *channel = strtok(channels, "/");
     int i = 0;
     int nb_send;
+    // 1 si un salon n'a pas pu etre rejoint parce que tous les onglets sont pris
+    int onglets_pleins = 0;
 
     while (channel != NULL) {
         if (channel[0] == '*'){
@@ -599,6 +769,7 @@ void *channel_menu(int *ds, char *channels){
         channel = strtok(NULL, "/");
         i++;
     }
+    int nb_salons = i;
 
     num_files = i + 3;
     display_channel(0);
@@ -634,22 +805,25 @@ void *channel_menu(int *ds, char *channels){
                 // Si l'utilisateur est déjà connecté au channel, on le déconnecte
                 channel_connect[index_cursor - 3] = 0;
                 int socket_channel = get_socket(socket_channel_list, channel);
-                strcpy(request->cmd, "exitm");
-                strcpy(request->from, pseudo);
-                strcpy(request->to, "salon");
-                strcpy(request->channel, channel);
-                strcpy(request->message, "");
-                strcpy(request->color, color);
-                nb_send = send(socket_channel, request, BUFFER_SIZE, 0);
-                if (nb_send == -1) {
-                    perror("Erreur lors de l'envoi du message");
-                    close(socket_channel);
-                    exit(EXIT_FAILURE);
-                } else if (nb_send == 0) {
-                    // Connection fermée par le client ou le serveur
-                    afficher(31, "Le serveur a ferme la connexion\n", NULL);
-                    close(socket_channel);
-                    exit(EXIT_FAILURE);
+                // sans l'option -w, l'onglet du salon se ferme quand on revient au tchat
+                if (mode_fenetres == 1){
+                    strcpy(request->cmd, "exitm");
+                    strcpy(request->from, pseudo);
+                    strcpy(request->to, "salon");
+                    strcpy(request->channel, channel);
+                    strcpy(request->message, "");
+                    strcpy(request->color, color);
+                    nb_send = send(socket_channel, request, BUFFER_SIZE, 0);
+                    if (nb_send == -1) {
+                        perror("Erreur lors de l'envoi du message");
+                        close(socket_channel);
+                        exit(EXIT_FAILURE);
+                    } else if (nb_send == 0) {
+                        // Connection fermée par le client ou le serveur
+                        afficher(31, "Le serveur a ferme la connexion\n", NULL);
+                        close(socket_channel);
+                        exit(EXIT_FAILURE);
+                    }
                 }
 
                 strcpy(request->cmd, "disc");
@@ -659,30 +833,37 @@ void *channel_menu(int *ds, char *channels){
                     close(socket_channel);
                     remove_element(socket_channel_list, channel);
                 }
+            }else if (channel != NULL && mode_fenetres == 0 && ouvrir_onglet(channel) == 0){
+                // sans onglet libre on ne rejoint pas le salon, ses messages n'auraient nulle part ou aller
+                onglets_pleins = 1;
+                strcpy(request->cmd, "");
             }else{
                 // Sinon on le connecte
                 channel_connect[index_cursor - 3] = 1;
                 strcpy(request->cmd, "connect");
                 // connection au channel
-                if (channel != NULL){
-                    pthread_create (&thread_channel, NULL, channel_thread, (void *) channel);
+                // sans l'option -w, l'onglet est ouvert avant que les derniers messages du salon arrivent
+                if (channel != NULL && mode_fenetres == 1){
+                    ouvrir_fenetre(channel);
                 }
             }
-            strcpy(request->from, pseudo);
-            strcpy(request->to, "server");
-            strcpy(request->channel, channel);
-            strcpy(request->message, "");
-            strcpy(request->color, color);
-            nb_send = send(*(int*)ds, request, BUFFER_SIZE, 0);
-            if (nb_send == -1) {
-                perror("Erreur lors de l'envoi du message");
-                close(*(int*)ds);
-                exit(EXIT_FAILURE);
-            } else if (nb_send == 0) {
-                // Connection fermée par le client ou le serveur
-                afficher(31, "Le serveur a ferme la connexion\n", NULL);
-                close(*(int*)ds);
-                exit(EXIT_FAILURE);
+            if (strcmp(request->cmd, "") != 0){
+                strcpy(request->from, pseudo);
+                strcpy(request->to, "server");
+                strcpy(request->channel, channel);
+                strcpy(request->message, "");
+                strcpy(request->color, color);
+                nb_send = send(*(int*)ds, request, BUFFER_SIZE, 0);
+                if (nb_send == -1) {
+                    perror("Erreur lors de l'envoi du message");
+                    close(*(int*)ds);
+                    exit(EXIT_FAILURE);
+                } else if (nb_send == 0) {
+                    // Connection fermée par le client ou le serveur
+                    afficher(31, "Le serveur a ferme la connexion\n", NULL);
+                    close(*(int*)ds);
+                    exit(EXIT_FAILURE);
+                }
             }
 
             for (int i = 0; i <= num_files; i++) {
@@ -701,7 +882,17 @@ void *channel_menu(int *ds, char *channels){
         printf("\033[1A\033[2K\r");
     }
 
-    if (index_cursor == 1){
+    // sans onglet libre on ne cree pas de salon, on le rejoindrait aussitot
+    pthread_mutex_lock(&mutex_onglets);
+    if (index_cursor == 1 && mode_fenetres == 0 && nb_onglets >= ONGLET_MAX){
+        onglets_pleins = 1;
+    }
+    pthread_mutex_unlock(&mutex_onglets);
+
+    if (index_cursor == 1 && onglets_pleins == 1){
+        enableCanonicalMode();
+
+    } else if (index_cursor == 1){
 
         enableCanonicalMode();
 
@@ -723,6 +914,10 @@ void *channel_menu(int *ds, char *channels){
             *pos = '\0';
         }
         strcpy(request->channel, nom_channel);
+        if (mode_fenetres == 0){
+            // on rejoint le salon des qu'il est cree, son onglet doit deja etre ouvert
+            ouvrir_onglet(nom_channel);
+        }
 
 
         strcpy(request->cmd, "create");
@@ -776,7 +971,9 @@ void *channel_menu(int *ds, char *channels){
             exit(EXIT_FAILURE);
         }
         
-        pthread_create (&thread_channel, NULL, channel_thread, (void *) nom_channel);
+        if (mode_fenetres == 1){
+            ouvrir_fenetre(nom_channel);
+        }
 
         for (int i = 0; i <= 5; i++) {
             printf("\033[1A\033[2K\r");
@@ -866,6 +1063,18 @@ void *channel_menu(int *ds, char *channels){
     menu = 0;
     num_files = 0;
     index_cursor = 0;
+
+    if (mode_fenetres == 0){
+        // les onglets des salons quittes dans le menu se ferment
+        for (int i = 0; i < nb_salons; i++){
+            if (channel_connect[i] == 0){
+                fermer_onglet(channel_array[i]);
+            }
+        }
+    }
+    if (onglets_pleins == 1){
+        afficher(31, "Erreur : tous les onglets sont pris, quittez un salon avant d'en rejoindre un autre\n", NULL);
+    }
     afficher(31, "", NULL);
 
 
@@ -873,10 +1082,399 @@ void *channel_menu(int *ds, char *channels){
 }
 
 
+// Recoit exactement length octets sur la socket
+// Un seul recv peut renvoyer moins d'octets que demandé (TCP est un flux), on boucle donc
+// Renvoie le nombre d'octets reçus, plus petit que length seulement si la connexion a été fermée, -1 en cas d'erreur
+ssize_t recv_full(int socket, void *data, size_t length) {
+    size_t total = 0;
+    ssize_t nb_recv;
+    while (total < length) {
+        nb_recv = recv(socket, (char *) data + total, length - total, 0);
+        if (nb_recv == -1) {
+            return -1;
+        }
+        if (nb_recv == 0) {
+            break;
+        }
+        total += nb_recv;
+    }
+    return total;
+}
+
+
+// Envoie exactement length octets sur la socket
+// MSG_NOSIGNAL : si la connexion est coupee on ne recoit pas SIGPIPE, le transfert pourra etre repris
+// Renvoie le nombre d'octets envoyés, -1 en cas d'erreur
+ssize_t send_full(int socket, const void *data, size_t length) {
+    size_t total = 0;
+    ssize_t nb_send;
+    while (total < length) {
+        nb_send = send(socket, (const char *) data + total, length - total, MSG_NOSIGNAL);
+        if (nb_send == -1) {
+            return -1;
+        }
+        total += nb_send;
+    }
+    return total;
+}
+
+
+// Les nombres du protocole de transfert (tailles, offsets, longueurs, reponses) passent toujours
+// sur 8 octets en big endian, les sommes de controle et les en-tetes de blocs sur 4 octets en big endian :
+// les fichiers de plus de 4 Go passent, et le client et le serveur peuvent avoir des architectures differentes
+
+// Envoie count nombres (4 au plus) sur 64 bits
+// Renvoie 0 si tout est envoye, -1 en cas d'erreur
+int send_int64(int socket, const long *values, int count) {
+    uint64_t data[4];
+    for (int i = 0; i < count; i++) {
+        data[i] = htobe64((uint64_t) values[i]);
+    }
+    if (send_full(socket, data, count * sizeof(uint64_t)) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+
+// Recoit count nombres (4 au plus) sur 64 bits
+// Renvoie 1 si tout est recu, 0 si la connexion est coupee ou en cas d'erreur
+int recv_int64(int socket, long *values, int count) {
+    uint64_t data[4];
+    if (recv_full(socket, data, count * sizeof(uint64_t)) < (ssize_t) (count * sizeof(uint64_t))) {
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        values[i] = (long) (int64_t) be64toh(data[i]);
+    }
+    return 1;
+}
+
+
+// Envoie count nombres (4 au plus) sur 32 bits
+// Renvoie 0 si tout est envoye, -1 en cas d'erreur
+int send_uint32(int socket, const uint32_t *values, int count) {
+    uint32_t data[4];
+    for (int i = 0; i < count; i++) {
+        data[i] = htonl(values[i]);
+    }
+    if (send_full(socket, data, count * sizeof(uint32_t)) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+
+// Recoit count nombres (4 au plus) sur 32 bits
+// Renvoie 1 si tout est recu, 0 si la connexion est coupee ou en cas d'erreur
+int recv_uint32(int socket, uint32_t *values, int count) {
+    uint32_t data[4];
+    if (recv_full(socket, data, count * sizeof(uint32_t)) < (ssize_t) (count * sizeof(uint32_t))) {
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        values[i] = ntohl(data[i]);
+    }
+    return 1;
+}
+
+
+// Table de la somme de controle CRC32C (Castagnoli), calculee au lancement du client
+// Chaque morceau d'un fichier transfere et chaque fichier envoye sur une seule connexion
+// est verifie avec cette somme de controle
+// Si le processeur a SSE4.2, on utilise son instruction crc32 a la place de la table
+uint32_t crc32c_table[256];
+int crc32c_hardware = 0;
+
+void crc32c_init() {
+#if defined(__x86_64__)
+    crc32c_hardware = __builtin_cpu_supports("sse4.2") != 0;
+#endif
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+        }
+        crc32c_table[i] = crc;
+    }
+}
+
+#if defined(__x86_64__)
+// Meme somme de controle avec l'instruction crc32, 8 octets a la fois
+__attribute__((target("sse4.2")))
+uint32_t crc32c_update_hardware(uint32_t crc, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    uint64_t crc64 = (uint32_t) ~crc;
+    uint64_t word;
+    for (; length >= 8; length -= 8, bytes += 8) {
+        memcpy(&word, bytes, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t) crc64;
+    while (length-- > 0) {
+        crc = _mm_crc32_u8(crc, *bytes++);
+    }
+    return ~crc;
+}
+#endif
+
+// Ajoute length octets a la somme de controle crc (commencer avec crc = 0)
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+#if defined(__x86_64__)
+    if (crc32c_hardware) {
+        return crc32c_update_hardware(crc, data, length);
+    }
+#endif
+    crc = ~crc;
+    while (length-- > 0) {
+        crc = crc32c_table[(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Somme de controle des length premiers octets du fichier fd
+// Sert a reprendre la somme de controle d'un transfert repris au milieu du fichier
+// Renvoie 1 si les octets ont pu etre lus, 0 sinon
+int crc32c_file(int fd, long length, uint32_t *crc) {
+    char data[65536];
+    ssize_t nb_read;
+    *crc = 0;
+    for (long offset = 0; offset < length; offset += nb_read) {
+        nb_read = length - offset < (long) sizeof(data) ? length - offset : (long) sizeof(data);
+        nb_read = pread(fd, data, nb_read, offset);
+        if (nb_read <= 0) {
+            return 0;
+        }
+        *crc = crc32c_update(*crc, data, nb_read);
+    }
+    return 1;
+}
+
+// Un fichier peut etre transfere compresse avec zlib (deflate)
+// Les donnees sont alors decoupees en blocs d'au plus COMPRESS_BLOCK octets compresses separement,
+// chaque bloc est precede de deux uint32_t : la taille de ses donnees puis la taille de ce qui suit
+// Un bloc qui ne retrecit pas est envoye tel quel (les deux tailles sont egales)
+// Les sommes de controle portent toujours sur les donnees, pas sur ce qui est envoye
+
+// Devine si les length octets du fichier fd a offset valent la peine d'etre compresses
+// L'echantillon est pris au milieu, loin des en-tetes du fichier
+// Les octets d'un fichier deja compresse (jpg, png, gif, zip...) semblent aleatoires,
+// leur entropie est proche de 8 bits par octet
+int is_compressible(int fd, long offset, long length) {
+    unsigned char sample[COMPRESS_SAMPLE];
+    long count[256] = {0};
+    double entropy = 0;
+    if (length > COMPRESS_SAMPLE) {
+        offset += (length - COMPRESS_SAMPLE) / 2;
+    }
+    ssize_t nb_read = pread(fd, sample, COMPRESS_SAMPLE, offset);
+    if (nb_read <= 0) {
+        return 0;
+    }
+    for (int i = 0; i < nb_read; i++) {
+        count[sample[i]]++;
+    }
+    for (int i = 0; i < 256; i++) {
+        if (count[i] > 0) {
+            double p = (double) count[i] / nb_read;
+            entropy -= p * log2(p);
+        }
+    }
+    return entropy < COMPRESS_ENTROPY;
+}
+
+// Envoie length octets de data (au plus COMPRESS_BLOCK) en un bloc
+// Renvoie le nombre d'octets envoyes sur la socket, -1 si la connexion est coupee
+ssize_t send_block(int socket, const char *data, uint32_t length) {
+    char compressed[COMPRESS_BLOCK];
+    uint32_t header[2] = {length, length};
+    uLongf compressed_length = length;
+    // Si le bloc compresse ne tient pas dans length octets, on envoie les donnees telles quelles
+    if (compress2((Bytef *) compressed, &compressed_length, (const Bytef *) data, length, Z_BEST_SPEED) == Z_OK
+        && compressed_length < length) {
+        header[1] = compressed_length;
+        data = compressed;
+    }
+    if (send_uint32(socket, header, 2) == -1 || send_full(socket, data, header[1]) == -1) {
+        return -1;
+    }
+    return sizeof(header) + header[1];
+}
+
+// Recoit un bloc et met ses donnees dans data (COMPRESS_BLOCK octets)
+// wire est augmente du nombre d'octets recus sur la socket
+// Renvoie le nombre d'octets de donnees, 0 si la connexion est coupee, -1 si le bloc est invalide
+ssize_t recv_block(int socket, char *data, long *wire) {
+    char compressed[COMPRESS_BLOCK];
+    uint32_t header[2];
+    uLongf length;
+    if (recv_uint32(socket, header, 2) == 0) {
+        return 0;
+    }
+    if (header[0] == 0 || header[0] > COMPRESS_BLOCK || header[1] > header[0]) {
+        return -1;
+    }
+    if (header[1] == header[0]) {
+        if (recv_full(socket, data, header[0]) < (ssize_t) header[0]) {
+            return 0;
+        }
+    } else {
+        if (recv_full(socket, compressed, header[1]) < (ssize_t) header[1]) {
+            return 0;
+        }
+        length = header[0];
+        if (uncompress((Bytef *) data, &length, (const Bytef *) compressed, header[1]) != Z_OK || length != header[0]) {
+            return -1;
+        }
+    }
+    *wire += sizeof(header) + header[1];
+    return header[0];
+}
+
+// Ecrit dans text le taux de compression d'un transfert de nb_bytes octets, "" s'il n'etait pas compresse
+void compression_ratio(char *text, long nb_bytes, long wire) {
+    text[0] = '\0';
+    if (wire > 0) {
+        sprintf(text, ", compresse %.1fx", (double) nb_bytes / wire);
+    }
+}
+
+// Ecrit dans text le debit d'un transfert de nb_bytes octets commence a start
+void transfer_rate(char *text, long nb_bytes, struct timespec start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (seconds < 0.001) {
+        seconds = 0.001;
+    }
+    sprintf(text, ", %.1f Mo/s", nb_bytes / seconds / (1024 * 1024));
+}
+
+// SHA-256 du contenu d'un fichier, le serveur range les fichiers par ce hash
+// Avant un envoi, on demande au serveur s'il a deja ce contenu pour eviter de l'envoyer
+// taille du hash en hexadecimal, avec le \0
+#define SHA256_HEX_SIZE 65
+
+typedef struct Sha256 {
+    uint32_t state[8];
+    uint64_t length; // nombre d'octets hashes
+    unsigned char block[64]; // octets en attente d'un bloc complet
+    int block_length;
+} Sha256;
+
+const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_transform(Sha256 *ctx, const unsigned char *block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t) block[i * 4] << 24) | ((uint32_t) block[i * 4 + 1] << 16)
+             | ((uint32_t) block[i * 4 + 2] << 8) | (uint32_t) block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        w[i] = (ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10)) + w[i - 7]
+             + (ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3)) + w[i - 16];
+    }
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+void sha256_init(Sha256 *ctx) {
+    const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(ctx->state, init, sizeof(init));
+    ctx->length = 0;
+    ctx->block_length = 0;
+}
+
+void sha256_update(Sha256 *ctx, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    ctx->length += length;
+    while (length > 0) {
+        // les blocs complets sont hashes directement depuis les donnees
+        if (ctx->block_length == 0 && length >= 64) {
+            sha256_transform(ctx, bytes);
+            bytes += 64;
+            length -= 64;
+            continue;
+        }
+        size_t nb_copy = 64 - ctx->block_length;
+        if (nb_copy > length) {
+            nb_copy = length;
+        }
+        memcpy(ctx->block + ctx->block_length, bytes, nb_copy);
+        ctx->block_length += nb_copy;
+        bytes += nb_copy;
+        length -= nb_copy;
+        if (ctx->block_length == 64) {
+            sha256_transform(ctx, ctx->block);
+            ctx->block_length = 0;
+        }
+    }
+}
+
+// Termine le hash et l'ecrit en hexadecimal dans hex (SHA256_HEX_SIZE octets)
+void sha256_final(Sha256 *ctx, char *hex) {
+    uint64_t bits = ctx->length * 8;
+    unsigned char padding = 0x80;
+    unsigned char length_bytes[8];
+    // un bit a 1, des zeros, puis la longueur en bits sur 8 octets
+    sha256_update(ctx, &padding, 1);
+    padding = 0;
+    while (ctx->block_length != 56) {
+        sha256_update(ctx, &padding, 1);
+    }
+    for (int i = 0; i < 8; i++) {
+        length_bytes[i] = (unsigned char) (bits >> (56 - 8 * i));
+    }
+    sha256_update(ctx, length_bytes, 8);
+    for (int i = 0; i < 8; i++) {
+        sprintf(hex + i * 8, "%08x", ctx->state[i]);
+    }
+}
+
+// Calcule le hash du contenu du fichier fd, renvoie 0 si le fichier n'a pas pu etre lu
+int sha256_file(int fd, char *hex) {
+    Sha256 ctx;
+    char data[65536];
+    ssize_t nb_read;
+    off_t offset = 0;
+    sha256_init(&ctx);
+    while ((nb_read = pread(fd, data, sizeof(data), offset)) > 0) {
+        sha256_update(&ctx, data, nb_read);
+        offset += nb_read;
+    }
+    if (nb_read == -1) {
+        return 0;
+    }
+    sha256_final(&ctx, hex);
+    return 1;
+}
+
+
+
 long get_file_size(FILE *file) {
     long size;
-    fseek(file, 0, SEEK_END);  // Déplace le curseur à la fin du fichier
-    size = ftell(file);        // Récupère la position actuelle du curseur (qui est la taille du fichier)
+    fseeko(file, 0, SEEK_END);  // Déplace le curseur à la fin du fichier
+    size = ftello(file);        // Récupère la position actuelle du curseur (qui est la taille du fichier)
     rewind(file);              // Remet le curseur au début du fichier
     return size;
 }
@@ -933,7 +1531,13 @@ void *afficher(int color, char *msg, void *args){
     printf(msg, args);
     //Change la couleur du texte en rouge
     printf("\n\033[35m");
-    printf("---------- Entrez un message (max %d caracteres) -----------\n", MSG_LENGTH - 1);
+    if (mode_fenetres == 0 && nb_onglets > 1){
+        // la ligne au dessus de la saisie montre les onglets
+        barre_onglets();
+        printf("\n");
+    } else {
+        printf("---------- Entrez un message (max %d caracteres) -----------\n", MSG_LENGTH - 1);
+    }
     //Met le texte en gras
     printf("\033[1m");
     printf("Saisie : ");
@@ -962,16 +1566,28 @@ void getCurrentTime(char* timeString, int maxBufferSize) {
 
 
 
-void print_message(Message *output){
-    char msg[BUFFER_SIZE + 50]; // car "mp de " fait 6 caracteres de plus
+// Met en forme le message dans msg (BUFFER_SIZE + 50 caracteres), tel qu'il s'affiche
+void format_message(Message *output, char *msg){
     char color_message[COLOR_LENGTH];
     char timeString[20];
     strcpy(color_message, output->color);
     strcpy(msg, color_message);
     // on met la date au debut du message
-    getCurrentTime(timeString, 20);
-    strcat(msg, timeString);
-    if (strcmp(output->cmd, "dm") == 0){
+    // pour un message de l'historique ou un mp recu hors ligne, c'est sa date d'envoi (en hexadecimal dans to) et son salon
+    if (strcmp(output->cmd, "history") == 0 || strcmp(output->cmd, "backfill") == 0 || strcmp(output->cmd, "offline") == 0){
+        time_t sent = (time_t) strtol(output->to, NULL, 16);
+        strftime(timeString, 20, "%d/%m %H:%M | ", localtime(&sent));
+        strcat(msg, timeString);
+        if (strcmp(output->channel, "global") != 0){
+            strcat(msg, "#");
+            strcat(msg, output->channel);
+            strcat(msg, " ");
+        }
+    } else {
+        getCurrentTime(timeString, 20);
+        strcat(msg, timeString);
+    }
+    if (strcmp(output->cmd, "dm") == 0 || strcmp(output->cmd, "offline") == 0){
         strcat(msg, "mp de ");
     }
     strcat(msg, output->from);
@@ -1013,7 +1629,11 @@ void print_message(Message *output){
     }
 
     strcat(msg, "\n\0");
+}
 
+void print_message(Message *output){
+    char msg[BUFFER_SIZE + 50]; // car "mp de " fait 6 caracteres de plus
+    format_message(output, msg);
     afficher(32, msg, NULL);
 }
 
@@ -1027,46 +1647,569 @@ void print_dm_envoye(Message *output){
 
 
 /*******************************************
-            THREADS DES FICHIERS
+            ONGLETS DES SALONS
 ********************************************/
 
-/***************** UPLOAD ******************/
-
+// Renvoie l'indice de l'onglet du salon, ou -1 s'il n'est pas ouvert
+// mutex_onglets doit etre verrouille
+int onglet_indice(char *nom){
+    for (int i = 0; i < nb_onglets; i++){
+        if (strcmp(onglets[i].nom, nom) == 0){
+            return i;
+        }
+    }
+    return -1;
+}
 
-void *upload_file(void* param){
-    // Fonction qui envoie un fichier au serveur (thread)
-    // On utilise un thread pour pouvoir envoyer un message au serveur pendant l'envoi du fichier
+// Affiche la barre des onglets, l'onglet actif entre crochets et le nombre de messages non lus des autres
+void barre_onglets(){
+    pthread_mutex_lock(&mutex_onglets);
+    printf("----------");
+    for (int i = 0; i < nb_onglets; i++){
+        if (i == onglet_actif){
+            printf(" \033[1m[%s]\033[0m\033[35m", onglets[i].nom);
+        } else if (onglets[i].non_lus > 0){
+            printf(" %s(%d)", onglets[i].nom, onglets[i].non_lus);
+        } else {
+            printf(" %s", onglets[i].nom);
+        }
+    }
+    printf(" ----------");
+    pthread_mutex_unlock(&mutex_onglets);
+}
 
-    struct upload_param {
-        char *filename;
-        FILE *file;
-    };
-    struct upload_param param_upload = *(struct upload_param*) param;
-    char *filename = param_upload.filename;
+// Redessine la barre des onglets au dessus de la saisie, sans toucher a ce que l'utilisateur tape
+void rafraichir_barre(){
+    if (menu != 0){
+        return;
+    }
+    printf("\0337\033[1A\r\033[2K\033[35m");
+    barre_onglets();
+    printf("\033[0m\0338");
+    fflush(stdout);
+}
 
-    FILE *fichier = (FILE*) param_upload.file;
-    if (fichier == NULL){
-        afficher(31, "Erreur lors de l'ouverture du fichier\n", NULL);
-        pthread_exit(0);
+// Efface l'ecran et affiche les dernieres lignes de l'onglet actif
+void redessiner_onglet(){
+    printf("\033[2J\033[H");
+    pthread_mutex_lock(&mutex_onglets);
+    Onglet *onglet = &onglets[onglet_actif];
+    for (int i = 0; i < onglet->nb_lignes; i++){
+        printf("%s", onglet->lignes[(onglet->debut + i) % ONGLET_LIGNES]);
     }
+    onglet->non_lus = 0;
+    pthread_mutex_unlock(&mutex_onglets);
+    printf("\n");
+    afficher(31, "", NULL);
+}
 
+// Ouvre l'onglet du salon s'il ne l'est pas deja
+// Renvoie 0 si tous les onglets sont pris, 1 sinon
+int ouvrir_onglet(char *nom){
+    int ouvert = 1;
+    pthread_mutex_lock(&mutex_onglets);
+    if (onglet_indice(nom) == -1){
+        if (nb_onglets < ONGLET_MAX){
+            memset(&onglets[nb_onglets], 0, sizeof(Onglet));
+            strcpy(onglets[nb_onglets].nom, nom);
+            nb_onglets++;
+        } else {
+            ouvert = 0;
+        }
+    }
+    pthread_mutex_unlock(&mutex_onglets);
+    return ouvert;
+}
 
+// Ferme l'onglet du salon, si c'etait l'onglet actif on revient sur global
+void fermer_onglet(char *nom){
+    int actif_ferme = 0;
+    pthread_mutex_lock(&mutex_onglets);
+    int indice = onglet_indice(nom);
+    if (indice > 0){
+        for (int i = 0; i < onglets[indice].nb_lignes; i++){
+            free(onglets[indice].lignes[(onglets[indice].debut + i) % ONGLET_LIGNES]);
+        }
+        for (int i = indice; i < nb_onglets - 1; i++){
+            onglets[i] = onglets[i + 1];
+        }
+        nb_onglets--;
+        if (onglet_actif == indice){
+            onglet_actif = 0;
+            actif_ferme = 1;
+        } else if (onglet_actif > indice){
+            onglet_actif--;
+        }
+    }
+    pthread_mutex_unlock(&mutex_onglets);
+    if (actif_ferme == 1){
+        redessiner_onglet();
+    } else {
+        rafraichir_barre();
+    }
+}
 
-    long size_file = 0;
-    size_file = get_file_size(fichier);
-    //printf("Taille du fichier : %ld\n", size_file);
+// Affiche l'onglet du salon, renvoie 0 s'il n'est pas ouvert
+int changer_onglet(char *nom){
+    pthread_mutex_lock(&mutex_onglets);
+    int indice = onglet_indice(nom);
+    if (indice != -1){
+        onglet_actif = indice;
+    }
+    pthread_mutex_unlock(&mutex_onglets);
+    if (indice == -1){
+        return 0;
+    }
+    redessiner_onglet();
+    return 1;
+}
 
-    Message *request = malloc(sizeof(Message));
+// Range le message dans l'onglet de son salon, et l'affiche si c'est l'onglet actif
+// Renvoie 0 si le salon n'a pas d'onglet
+int recevoir_onglet(Message *output){
+    char msg[BUFFER_SIZE + 50];
+    format_message(output, msg);
 
-    int dS = socket(AF_INET, SOCK_STREAM, 0);
+    pthread_mutex_lock(&mutex_onglets);
+    int indice = onglet_indice(output->channel);
+    if (indice == -1){
+        pthread_mutex_unlock(&mutex_onglets);
+        return 0;
+    }
+    Onglet *onglet = &onglets[indice];
+    if (onglet->nb_lignes == ONGLET_LIGNES){
+        // on oublie la ligne la plus ancienne
+        free(onglet->lignes[onglet->debut]);
+        onglet->debut = (onglet->debut + 1) % ONGLET_LIGNES;
+        onglet->nb_lignes--;
+    }
+    onglet->lignes[(onglet->debut + onglet->nb_lignes) % ONGLET_LIGNES] = strdup(msg);
+    onglet->nb_lignes++;
+    int actif = (indice == onglet_actif);
+    if (actif == 0){
+        onglet->non_lus++;
+    }
+    pthread_mutex_unlock(&mutex_onglets);
+
+    if (actif == 1){
+        afficher(32, msg, NULL);
+    } else {
+        rafraichir_barre();
+    }
+    return 1;
+}
+
+// Nom du salon de l'onglet actif, ou partent les messages ecrits
+void salon_actif(char *nom){
+    pthread_mutex_lock(&mutex_onglets);
+    strcpy(nom, onglets[onglet_actif].nom);
+    pthread_mutex_unlock(&mutex_onglets);
+}
+
+
+/*******************************************
+            THREADS DES FICHIERS
+********************************************/
+
+// Envoie une trame sur la connexion principale, tous les threads qui y envoient passent par ici
+// bulk vaut 1 pour les donnees d'un fichier, qui attendent qu'aucun message du chat ne soit en attente
+// Renvoie le nombre d'octets envoyes, ou -1 en cas d'erreur
+ssize_t send_server(Message *trame, int bulk){
+    ssize_t nb_send;
+    pthread_mutex_lock(&mutex_envoi);
+    if (bulk == 0) {
+        nb_chat_attente++;
+    }
+    while (envoi_occupe == 1 || (bulk == 1 && nb_chat_attente > 0)) {
+        pthread_cond_wait(&cond_envoi, &mutex_envoi);
+    }
+    if (bulk == 0) {
+        nb_chat_attente--;
+    }
+    envoi_occupe = 1;
+    pthread_mutex_unlock(&mutex_envoi);
+
+    nb_send = send_full(*socket_server, trame, BUFFER_SIZE);
+
+    pthread_mutex_lock(&mutex_envoi);
+    envoi_occupe = 0;
+    pthread_cond_broadcast(&cond_envoi);
+    pthread_mutex_unlock(&mutex_envoi);
+    return nb_send;
+}
+
+
+/*******************************************
+            STREAMS MULTIPLEXES
+********************************************/
+
+// En mode -m, les uploads, les downloads et le menu des salons passent par la connexion
+// principale au lieu des ports +1, +2 et +3
+// Chaque stream est une trame Message de commande "mux" :
+//   - to est l'operation : "open", "data", "credit" ou "close"
+//   - channel est le numero du stream
+//   - color est le type du stream pour "open", le nombre d'octets de message pour "data",
+//     et le nombre d'octets rendus pour "credit"
+//   - message contient les donnees pour "data"
+// Chaque cote peut envoyer MUX_WINDOW octets d'un stream, puis attend que l'autre cote
+// lui rende du credit une fois les donnees transmises
+// connect_server renvoie une extremite d'une socketpair, le reste du code l'utilise comme une socket
+// vers le serveur, et deux threads font passer les donnees entre la socketpair et la connexion principale
+
+typedef struct MuxStream MuxStream;
+struct MuxStream {
+    int id; // numero du stream
+    int fd; // notre extremite de la socketpair
+    char in_buffer[MUX_WINDOW]; // donnees recues du serveur pas encore ecrites dans la socketpair (buffer circulaire)
+    int in_start;
+    int in_length;
+    int in_closed; // 1 quand le serveur a ferme son cote
+    long credit; // nombre d'octets que l'on peut encore envoyer au serveur
+    int closed; // 1 si la connexion principale est perdue
+    int nb_threads; // nombre de threads qui utilisent encore le stream, le dernier le libere
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    MuxStream *next;
+};
+
+// liste des streams ouverts
+MuxStream *mux_streams = NULL;
+// numero du prochain stream
+int mux_next_id = 1;
+pthread_mutex_t mutex_mux_streams;
+
+// Envoie une trame du stream au serveur
+int mux_send(MuxStream *stream, char *operation, char *argument, char *data, int length, int bulk){
+    Message trame;
+    memset(&trame, 0, sizeof(Message));
+    strcpy(trame.cmd, "mux");
+    strcpy(trame.from, pseudo);
+    strcpy(trame.to, operation);
+    snprintf(trame.channel, CHANNEL_SIZE, "%d", stream->id);
+    strcpy(trame.color, argument);
+    if (length > 0) {
+        memcpy(trame.message, data, length);
+    }
+    return send_server(&trame, bulk) != -1;
+}
+
+// Appelee par les deux threads du stream quand ils se terminent, le dernier libere le stream
+void mux_release(MuxStream *stream){
+    pthread_mutex_lock(&mutex_mux_streams);
+    pthread_mutex_lock(&stream->mutex);
+    stream->nb_threads--;
+    int last = (stream->nb_threads == 0);
+    pthread_mutex_unlock(&stream->mutex);
+    if (last) {
+        MuxStream **previous = &mux_streams;
+        while (*previous != stream) {
+            previous = &(*previous)->next;
+        }
+        *previous = stream->next;
+    }
+    pthread_mutex_unlock(&mutex_mux_streams);
+
+    if (last) {
+        close(stream->fd);
+        pthread_mutex_destroy(&stream->mutex);
+        pthread_cond_destroy(&stream->cond);
+        free(stream);
+    }
+
+    pthread_t ThreadId = pthread_self(); // The id of the thread, will be used to cleanup thread once finished
+
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_ended_threads);
+    // We put the thread id in the queue of ended threads
+    enqueue(ended_threads, ThreadId);
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_ended_threads);
+
+    // Increment the semaphore to indicate that a thread has ended
+    sem_post(&thread_end);
+}
+
+// Thread qui ecrit dans la socketpair les donnees recues du serveur et lui rend le credit
+void *mux_write_thread(void *arg){
+    MuxStream *stream = arg;
+    char data[MSG_LENGTH];
+    char credit[12];
+    int length;
+    int write_ok = 1; // 0 quand l'autre extremite de la socketpair est fermee
+
+    pthread_mutex_lock(&stream->mutex);
+    while (stream->closed == 0) {
+        if (stream->in_length == 0) {
+            if (stream->in_closed == 1) {
+                break;
+            }
+            pthread_cond_wait(&stream->cond, &stream->mutex);
+            continue;
+        }
+        // on prend les donnees jusqu'a la fin du buffer circulaire
+        length = stream->in_length;
+        if (length > MUX_WINDOW - stream->in_start) {
+            length = MUX_WINDOW - stream->in_start;
+        }
+        if (length > MSG_LENGTH) {
+            length = MSG_LENGTH;
+        }
+        memcpy(data, stream->in_buffer + stream->in_start, length);
+        stream->in_start = (stream->in_start + length) % MUX_WINDOW;
+        stream->in_length -= length;
+        pthread_mutex_unlock(&stream->mutex);
+
+        if (write_ok == 1 && send_full(stream->fd, data, length) == -1) {
+            write_ok = 0;
+        }
+        sprintf(credit, "%d", length);
+        mux_send(stream, "credit", credit, NULL, 0, 0);
+
+        pthread_mutex_lock(&stream->mutex);
+    }
+    pthread_mutex_unlock(&stream->mutex);
+
+    // l'autre extremite ne recevra plus rien
+    shutdown(stream->fd, SHUT_WR);
+    mux_release(stream);
+    pthread_exit(0);
+}
+
+// Thread qui lit la socketpair et envoie les donnees au serveur quand il nous a donne du credit
+void *mux_read_thread(void *arg){
+    MuxStream *stream = arg;
+    char data[MSG_LENGTH];
+    char length_text[12];
+    int length;
+    int nb_read;
+    int unsent;
+    int continuer = 1;
+
+    while (continuer) {
+        pthread_mutex_lock(&stream->mutex);
+        while (stream->credit == 0 && stream->closed == 0) {
+            pthread_cond_wait(&stream->cond, &stream->mutex);
+        }
+        length = MSG_LENGTH;
+        if (stream->credit < length) {
+            length = stream->credit;
+        }
+        continuer = (stream->closed == 0);
+        pthread_mutex_unlock(&stream->mutex);
+        if (!continuer) {
+            break;
+        }
+
+        nb_read = recv(stream->fd, data, length, 0);
+        if (nb_read <= 0) {
+            break;
+        }
+
+        // on attend qu'il reste peu de donnees a envoyer dans la socket,
+        // pour qu'un message du chat envoye apres ne soit pas retarde
+        unsent = 0;
+        ioctl(*socket_server, SIOCOUTQNSD, &unsent);
+        while (unsent > MUX_QUEUE_LIMIT && continuer) {
+            usleep(1000);
+            ioctl(*socket_server, SIOCOUTQNSD, &unsent);
+            pthread_mutex_lock(&stream->mutex);
+            continuer = (stream->closed == 0);
+            pthread_mutex_unlock(&stream->mutex);
+        }
+
+        pthread_mutex_lock(&stream->mutex);
+        stream->credit -= nb_read;
+        pthread_mutex_unlock(&stream->mutex);
+
+        sprintf(length_text, "%d", nb_read);
+        if (continuer && mux_send(stream, "data", length_text, data, nb_read, 1) == 0) {
+            continuer = 0;
+        }
+    }
+
+    // notre cote du stream est ferme, on previent le serveur
+    pthread_mutex_lock(&stream->mutex);
+    continuer = (stream->closed == 0);
+    pthread_mutex_unlock(&stream->mutex);
+    if (continuer) {
+        mux_send(stream, "close", "", NULL, 0, 0);
+    }
+    mux_release(stream);
+    pthread_exit(0);
+}
+
+// Ouvre un stream de type kind ("upload", "download" ou "salon") sur la connexion principale
+// Renvoie l'extremite de la socketpair a utiliser comme une socket vers le serveur, ou -1
+int mux_open(char *kind){
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+        perror("Erreur lors de la creation de la socketpair");
+        return -1;
+    }
+
+    MuxStream *stream = malloc(sizeof(MuxStream));
+    stream->fd = sv[0];
+    stream->in_start = 0;
+    stream->in_length = 0;
+    stream->in_closed = 0;
+    stream->credit = MUX_WINDOW;
+    stream->closed = 0;
+    stream->nb_threads = 2;
+    pthread_mutex_init(&stream->mutex, NULL);
+    pthread_cond_init(&stream->cond, NULL);
+
+    pthread_mutex_lock(&mutex_mux_streams);
+    stream->id = mux_next_id++;
+    stream->next = mux_streams;
+    mux_streams = stream;
+    pthread_mutex_unlock(&mutex_mux_streams);
+
+    // le serveur doit recevoir l'ouverture avant les donnees
+    if (mux_send(stream, "open", kind, NULL, 0, 0) == 0) {
+        perror("Erreur lors de l'ouverture du stream");
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, mux_write_thread, stream) != 0
+        || pthread_create(&thread, NULL, mux_read_thread, stream) != 0) {
+        perror("Erreur lors de la creation du thread");
+        exit(EXIT_FAILURE);
+    }
+    return sv[1];
+}
+
+// Traite une trame "mux" recue sur la connexion principale
+void mux_receive(Message *trame){
+    int id = atoi(trame->channel);
+    trame->color[COLOR_LENGTH - 1] = '\0';
+
+    pthread_mutex_lock(&mutex_mux_streams);
+    MuxStream *stream = mux_streams;
+    while (stream != NULL && stream->id != id) {
+        stream = stream->next;
+    }
+    if (stream != NULL) {
+        pthread_mutex_lock(&stream->mutex);
+        if (strcmp(trame->to, "data") == 0) {
+            int length = atoi(trame->color);
+            // le serveur ne peut pas envoyer plus que le credit qu'on lui a donne
+            if (length >= 0 && length <= MSG_LENGTH && length <= MUX_WINDOW - stream->in_length) {
+                int end = (stream->in_start + stream->in_length) % MUX_WINDOW;
+                if (length > MUX_WINDOW - end) {
+                    memcpy(stream->in_buffer + end, trame->message, MUX_WINDOW - end);
+                    memcpy(stream->in_buffer, trame->message + MUX_WINDOW - end, length - (MUX_WINDOW - end));
+                } else {
+                    memcpy(stream->in_buffer + end, trame->message, length);
+                }
+                stream->in_length += length;
+            }
+        } else if (strcmp(trame->to, "credit") == 0) {
+            stream->credit += atoi(trame->color);
+        } else if (strcmp(trame->to, "close") == 0) {
+            stream->in_closed = 1;
+        }
+        pthread_cond_broadcast(&stream->cond);
+        pthread_mutex_unlock(&stream->mutex);
+    }
+    pthread_mutex_unlock(&mutex_mux_streams);
+}
+
+// Ferme tous les streams quand la connexion principale est perdue
+void mux_close_all(){
+    pthread_mutex_lock(&mutex_mux_streams);
+    for (MuxStream *stream = mux_streams; stream != NULL; stream = stream->next) {
+        pthread_mutex_lock(&stream->mutex);
+        stream->closed = 1;
+        pthread_cond_broadcast(&stream->cond);
+        pthread_mutex_unlock(&stream->mutex);
+        shutdown(stream->fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&mutex_mux_streams);
+}
+
+
+// Demande un ticket au serveur sur la connexion principale pour le port de type kind
+// ("upload", "download" ou "salon"), et attend que readMessage le recoive
+// Le ticket est ecrit dans ticket, renvoie 1 si on a recu un ticket, 0 sinon
+// Les tickets d'un meme type sont interchangeables, on prend le premier recu
+int get_ticket(char *kind, char *ticket){
+    Message request;
+    memset(&request, 0, sizeof(Message));
+    strcpy(request.cmd, "ticket");
+    strcpy(request.from, pseudo);
+    strcpy(request.to, "Serveur");
+    strcpy(request.channel, "global");
+    strcpy(request.message, kind);
+    if (send_server(&request, 0) == -1) {
+        perror("Erreur lors de la demande de ticket");
+        return 0;
+    }
+
+    struct timespec timeout;
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_sec += TICKET_TIMEOUT;
+
+    size_t len_kind = strlen(kind);
+    int trouve = -1;
+    int expire = 0;
+    pthread_mutex_lock(&mutex_tickets);
+    while (trouve == -1 && expire == 0) {
+        for (int i = 0; i < nb_tickets && trouve == -1; i++) {
+            if (strncmp(tickets[i], kind, len_kind) == 0 && tickets[i][len_kind] == '/') {
+                trouve = i;
+            }
+        }
+        if (trouve == -1 && pthread_cond_timedwait(&cond_tickets, &mutex_tickets, &timeout) != 0) {
+            expire = 1;
+        }
+    }
+    if (trouve != -1) {
+        strcpy(ticket, tickets[trouve] + len_kind + 1);
+        // on retire le ticket de la liste
+        nb_tickets--;
+        if (trouve != nb_tickets) {
+            memmove(tickets[trouve], tickets[nb_tickets], MSG_LENGTH);
+        }
+    }
+    pthread_mutex_unlock(&mutex_tickets);
+
+    // le serveur envoie un ticket vide s'il n'a pas pu en creer un
+    if (trouve == -1 || ticket[0] == '\0') {
+        afficher(31, "Le serveur n'a pas donne de ticket\n", NULL);
+        return 0;
+    }
+    return 1;
+}
+
+
+// Ouvre une nouvelle connexion vers le serveur sur le port server_port + port_offset
+// +1 pour le port d'upload, +2 pour le port de download, +3 pour le port des salons
+// Le serveur ne sait pas a quel client appartient la connexion, on lui envoie donc
+// d'abord un ticket demande sur la connexion principale
+// En mode -m, ouvre un stream sur la connexion principale a la place
+// Renvoie la socket connectee, ou -1 si la connexion a echoue
+int connect_server(int port_offset){
+    char *kinds[4] = {"", "upload", "download", "salon"};
+    if (mode_mux == 1) {
+        return mux_open(kinds[port_offset]);
+    }
+
+    Message msg_ticket;
+    memset(&msg_ticket, 0, sizeof(Message));
+    if (get_ticket(kinds[port_offset], msg_ticket.message) == 0) {
+        return -1;
+    }
+    strcpy(msg_ticket.cmd, "ticket");
+    strcpy(msg_ticket.from, pseudo);
+    strcpy(msg_ticket.to, "Serveur");
+
+    int dS = socket(AF_INET, SOCK_STREAM, 0);
     if (dS == -1) {
         perror("Erreur lors de la creation de la socket");
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
-    //printf("Socket Créé\n");
     struct sockaddr_in aS;
-
     aS.sin_family = AF_INET;
     int result = inet_pton(AF_INET, server_ip, &(aS.sin_addr));
     if (result == 0) {
@@ -1077,118 +2220,529 @@ void *upload_file(void* param){
         exit(EXIT_FAILURE);
     }
 
-    aS.sin_port = htons(server_port + 1); // +1 pour le port d'upload du fichier
+    aS.sin_port = htons(server_port + port_offset);
     socklen_t lgA = sizeof(struct sockaddr_in) ;
     if (connect(dS, (struct sockaddr *) &aS, lgA) == -1) {
         perror("Erreur connect client");
+        close(dS);
+        return -1;
+    }
+
+    // envoi du ticket, premier message de la connexion
+    if (send_full(dS, &msg_ticket, BUFFER_SIZE) == -1) {
+        perror("Erreur lors de l'envoi du ticket");
+        close(dS);
+        return -1;
+    }
+    return dS;
+}
+
+
+// Parametres d'un thread qui envoie ou recoit un morceau d'un fichier
+// Les gros fichiers sont decoupes en NB_STREAMS morceaux envoyes en parallele,
+// chacun sur sa propre connexion
+struct chunk_param {
+    char *filename; // nom du fichier
+    char *hash; // SHA-256 du fichier, le serveur le verifie une fois tous les morceaux recus
+    int fd; // descripteur du fichier local, lu ou ecrit avec pread/pwrite
+    long file_size; // taille totale du fichier
+    long offset; // debut du morceau
+    long length; // taille du morceau
+    int ok; // 1 si le morceau a ete transfere et verifie
+    long wire; // octets passes sur la socket si le morceau etait compresse, 0 sinon
+};
+
+
+/***************** UPLOAD ******************/
+
+
+void *upload_chunk(void *param){
+    // Fonction qui envoie un morceau d'un fichier au serveur (thread)
+    // Le serveur ecrit le morceau a sa place dans le fichier et verifie sa somme de controle
+    // Si le morceau est corrompu ou si la connexion est coupee, on le renvoie (MAX_RETRY fois au plus)
+    struct chunk_param *chunk = (struct chunk_param *) param;
+    Message request;
+    long header[3];
+    long status;
+    char buffer[COMPRESS_BLOCK];
+    int nb_read;
+    ssize_t nb_send;
+    long nb_read_total;
+    uint32_t crc;
+    int attempt = 0;
+    // Les morceaux qui semblent deja compresses sont envoyes tels quels
+    int compressed = is_compressible(chunk->fd, chunk->offset, chunk->length);
+    int packet_size = compressed ? COMPRESS_BLOCK : BUFFER_SIZE;
+
+    chunk->ok = 0;
+    while (chunk->ok == 0 && attempt < MAX_RETRY){
+        attempt++;
+        int dS = connect_server(1); // +1 pour le port d'upload du fichier
+        if (dS == -1){
+            continue;
+        }
+
+        // La commande "chunk" indique au serveur que cette connexion ne transporte qu'un morceau
+        memset(&request, 0, sizeof(Message));
+        strcpy(request.cmd, "chunk");
+        strcpy(request.from, pseudo);
+        strcpy(request.to, compressed ? "deflate" : "server");
+        // Le serveur range les morceaux selon le hash et le nom du fichier
+        sprintf(request.message, "%s/%s", chunk->hash, chunk->filename);
+        strcpy(request.color, color);
+        header[0] = chunk->file_size;
+        header[1] = chunk->offset;
+        header[2] = chunk->length;
+        if (send_full(dS, &request, BUFFER_SIZE) == -1 || send_int64(dS, header, 3) == -1){
+            close(dS);
+            continue;
+        }
+
+        // Envoie les donnees du morceau en calculant sa somme de controle
+        crc = 0;
+        nb_read_total = 0;
+        chunk->wire = 0;
+        while (nb_read_total < chunk->length){
+            nb_read = packet_size;
+            if (chunk->length - nb_read_total < packet_size){
+                nb_read = chunk->length - nb_read_total;
+            }
+            nb_read = pread(chunk->fd, buffer, nb_read, chunk->offset + nb_read_total);
+            if (nb_read <= 0){
+                break;
+            }
+            nb_send = compressed ? send_block(dS, buffer, nb_read) : send_full(dS, buffer, nb_read);
+            if (nb_send == -1){
+                break;
+            }
+            crc = crc32c_update(crc, buffer, nb_read);
+            nb_read_total += nb_read;
+            chunk->wire += compressed ? nb_send : 0;
+        }
+
+        // Envoie la somme de controle, le serveur repond 1 si le morceau est correct
+        if (nb_read_total == chunk->length
+            && send_uint32(dS, &crc, 1) != -1
+            && recv_int64(dS, &status, 1) == 1){
+            if (status == 1){
+                chunk->ok = 1;
+            } else if (status == -1){
+                // Le fichier complet n'a pas le hash annonce, il faut tout renvoyer
+                attempt = MAX_RETRY;
+            }
+        }
+        close(dS);
+    }
+
+    pthread_exit(0);
+}
+
+
+// Demande au serveur s'il a deja le contenu du fichier, de hash hash
+// S'il l'a, il le range sous le nom filename et le fichier n'a pas besoin d'etre envoye
+// Renvoie 1 si le serveur a le fichier, 0 s'il faut l'envoyer
+int server_has_file(char *filename, char *hash){
+    Message request;
+    long status = 0;
+    int dS = connect_server(1); // +1 pour le port d'upload du fichier
+    if (dS == -1) {
+        return 0;
+    }
+    memset(&request, 0, sizeof(Message));
+    strcpy(request.cmd, "have");
+    strcpy(request.from, pseudo);
+    strcpy(request.to, "server");
+    snprintf(request.message, MSG_LENGTH, "%s/%s", hash, filename);
+    if (send_full(dS, &request, BUFFER_SIZE) == -1 || recv_int64(dS, &status, 1) == 0) {
+        status = 0;
+    }
+    close(dS);
+    return status == 1;
+}
+
+
+int upload_stream(char *filename, FILE *fichier, long size_file, long *offset, long *nb_read_total, long *wire){
+    // Envoie le fichier sur une seule connexion, a partir de l'octet ou le serveur en est
+    // offset recoit l'octet de reprise, nb_read_total le nombre d'octets du fichier que le serveur a
+    // Si le fichier ne semble pas deja compresse, il est envoye en blocs compresses
+    // et wire recoit le nombre d'octets passes sur la socket (0 si le fichier n'est pas compresse)
+    // A la fin on envoie la somme de controle de tout le fichier, le serveur la compare avec la sienne
+    // Renvoie 1 si le fichier est envoye et verifie, 0 si la connexion a ete coupee,
+    // -1 si la somme de controle est fausse (le serveur a supprime son fichier partiel)
+    Message request;
+    char buffer[COMPRESS_BLOCK];
+    int nb_read = 0;
+    ssize_t nb_send;
+    uint32_t crc = 0;
+    long status = 0;
+    int compressed = is_compressible(fileno(fichier), 0, size_file);
+    int packet_size = compressed ? COMPRESS_BLOCK : BUFFER_SIZE;
+
+    int dS = connect_server(1); // +1 pour le port d'upload du fichier
+    if (dS == -1) {
         exit(EXIT_FAILURE);
     }
 
     //printf("Socket Connecté\n");
     // Formatage du message
-    strcpy(request->cmd, "upload");
-    strcpy(request->from, pseudo);
-    strcpy(request->to, "server");
-    strcpy(request->message, filename);
-    strcpy(request->color, color);
-
-    // Envoie le nom du fichier au serveur
+    memset(&request, 0, sizeof(Message));
+    strcpy(request.cmd, "upload");
+    strcpy(request.from, pseudo);
+    strcpy(request.to, compressed ? "deflate" : "server");
+    strcpy(request.message, filename);
+    strcpy(request.color, color);
+
+    // Envoie le nom du fichier au serveur puis la taille du fichier
     //printf("Envoie du nom du fichier au serveur\n");
-    int nb_send = send(dS, request, BUFFER_SIZE, 0);
-    if (nb_send == -1) {
+    if (send_full(dS, &request, BUFFER_SIZE) == -1 || send_int64(dS, &size_file, 1) == -1) {
         perror("Erreur lors de l'envoi du message");
         close(dS);
         exit(EXIT_FAILURE);
-    } else if (nb_send == 0) {
-        // Connection fermée par le client ou le serveur
+    }
+
+    // Le serveur renvoie le nombre d'octets qu'il a deja recu lors d'un envoi precedent interrompu
+    // On reprend l'envoi a partir de cet octet
+    *offset = 0;
+    if (recv_int64(dS, offset, 1) == 0) {
         afficher(31, "Le serveur a ferme la connexion\n", NULL);
         close(dS);
         exit(EXIT_FAILURE);
     }
-
-
-    // Envoie la taille du fichier au serveur
-    //printf("Envoie de la taille du fichier au serveur\n");
-    nb_send = send(dS, &size_file, sizeof(long), 0);
-    if (nb_send == -1) {
-        perror("Erreur lors de l'envoi du message");
+    // -1 : le serveur n'a pas de place pour ecrire le fichier en ce moment
+    if (*offset < 0) {
+        afficher(31, "Le serveur ne peut pas recevoir le fichier pour l'instant\n", NULL);
+        *offset = 0;
+        *nb_read_total = 0;
         close(dS);
-        exit(EXIT_FAILURE);
-    } else if (nb_send == 0) {
-        // Connection fermée par le client ou le serveur
-        afficher(31, "Le serveur a ferme la connexion\n", NULL);
+        return 0;
+    }
+    // La somme de controle couvre aussi les octets que le serveur a deja
+    *nb_read_total = *offset;
+    if (crc32c_file(fileno(fichier), *offset, &crc) == 0) {
         close(dS);
-        exit(EXIT_FAILURE);
+        return 0;
     }
+    fseeko(fichier, *offset, SEEK_SET);
 
-
-    char buffer[BUFFER_SIZE];
-    int nb_read_total = 0;
-    int nb_read = 0;
     //printf("Envoie du fichier au serveur\n");
     // Envoie le fichier au serveur
-    while(nb_read_total < size_file){
-        nb_read = fread(buffer, 1, BUFFER_SIZE, fichier);
-        nb_read_total += nb_read;
-        // ajouter /0 a la fin du buffer si le fichier est plus petit que BUFFER_SIZE
-        if (nb_read < BUFFER_SIZE){ // inutile mais pour un code robuste
-            buffer[nb_read] = '\0';
-        }
-        //printf("Taille du fichier : %ld, Taille lu: %d\n, Taille lu total:%d\n", size_file, nb_read, nb_read_total);
-        if (nb_read < BUFFER_SIZE){
-            nb_send = send(dS, buffer, nb_read, 0);
-        }else{
-            nb_send = send(dS, buffer, BUFFER_SIZE, 0);
+    *wire = 0;
+    while(*nb_read_total < size_file){
+        nb_read = fread(buffer, 1, packet_size, fichier);
+        if (nb_read <= 0){
+            break;
         }
-        //printf("Taille envoye: %d\n", nb_send);
-        //printf("Message envoye: %s\n", buffer);
+        // MSG_NOSIGNAL : si la connexion est coupee on ne recoit pas SIGPIPE, l'envoi pourra etre repris
+        nb_send = compressed ? send_block(dS, buffer, nb_read) : send_full(dS, buffer, nb_read);
         if (nb_send == -1) {
-            perror("Erreur lors de l'envoi du message");
-            close(dS);
-            exit(EXIT_FAILURE);
-        } else if (nb_send == 0) {
             // Connection fermée par le client ou le serveur
-            afficher(31, "Le serveur a ferme la connexion\n", NULL);
-            close(dS);
-            exit(EXIT_FAILURE);
+            break;
         }
-        bzero(buffer, BUFFER_SIZE);
+        *nb_read_total += nb_read;
+        *wire += compressed ? nb_send : 0;
+        crc = crc32c_update(crc, buffer, nb_read);
     }
 
-    char msg[150];
-    sprintf(msg, "Fichier envoye : %s (taille : %d/%ld)\n", filename, nb_read_total, size_file);
+    if (*nb_read_total < size_file
+        || send_uint32(dS, &crc, 1) == -1
+        || recv_int64(dS, &status, 1) == 0){
+        close(dS);
+        return 0;
+    }
+    close(dS);
+    return status == 1 ? 1 : -1;
+}
 
-    afficher(32, msg, NULL);
+
+void *upload_file(void* param){
+    // Fonction qui envoie un fichier au serveur (thread)
+    // On utilise un thread pour pouvoir envoyer un message au serveur pendant l'envoi du fichier
+    // Un fichier de plus de PARALLEL_THRESHOLD octets est decoupe en morceaux envoyes en parallele
+
+    struct upload_param {
+        char *filename;
+        FILE *file;
+    };
+    struct upload_param param_upload = *(struct upload_param*) param;
+    char *filename = param_upload.filename;
+
+    FILE *fichier = (FILE*) param_upload.file;
+    if (fichier == NULL){
+        afficher(31, "Erreur lors de l'ouverture du fichier\n", NULL);
+        pthread_exit(0);
+    }
+
+
+
+    long size_file = 0;
+    size_file = get_file_size(fichier);
+    //printf("Taille du fichier : %ld\n", size_file);
+
+    char msg[MSG_LENGTH + 150];
+    char hash[SHA256_HEX_SIZE];
+
+    // Sans le hash, le serveur ne peut pas verifier les morceaux : le fichier est envoye en une fois
+    int hashed = sha256_file(fileno(fichier), hash);
+
+    if (hashed == 1 && server_has_file(filename, hash)){
+        // Le serveur a deja ce contenu, rien a envoyer
+        sprintf(msg, "Fichier envoye : %s (taille : %ld/%ld, deja present sur le serveur)\n", filename, size_file, size_file);
+        afficher(32, msg, NULL);
+    } else if (hashed == 1 && size_file >= PARALLEL_THRESHOLD){
+        // Envoi en parallele : un thread et une connexion par morceau
+        pthread_t chunk_threads[NB_STREAMS];
+        struct chunk_param chunks[NB_STREAMS];
+        long chunk_size = (size_file + NB_STREAMS - 1) / NB_STREAMS;
+        long nb_sent = 0;
+        long nb_compressed = 0; // octets des morceaux compresses, avant et apres compression
+        long wire = 0;
+        char ratio[40];
+        int i;
+        for (i = 0; i < NB_STREAMS; i++){
+            chunks[i].filename = filename;
+            chunks[i].hash = hash;
+            chunks[i].fd = fileno(fichier);
+            chunks[i].file_size = size_file;
+            chunks[i].offset = i * chunk_size;
+            chunks[i].length = chunk_size;
+            if (chunks[i].offset + chunk_size > size_file){
+                chunks[i].length = size_file - chunks[i].offset;
+            }
+            if (pthread_create(&chunk_threads[i], NULL, upload_chunk, &chunks[i]) != 0) {
+                perror("Erreur lors de la creation du thread d'envoi");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (i = 0; i < NB_STREAMS; i++){
+            pthread_join(chunk_threads[i], NULL);
+            if (chunks[i].ok == 1){
+                nb_sent += chunks[i].length;
+                if (chunks[i].wire > 0){
+                    nb_compressed += chunks[i].length;
+                    wire += chunks[i].wire;
+                }
+            }
+        }
+        compression_ratio(ratio, nb_compressed, wire);
+
+        if (nb_sent < size_file){
+            sprintf(msg, "Envoi interrompu : %s (taille : %ld/%ld), relancez /upload\n", filename, nb_sent, size_file);
+            afficher(31, msg, NULL);
+        } else {
+            sprintf(msg, "Fichier envoye : %s (taille : %ld/%ld, %d connexions%s)\n", filename, nb_sent, size_file, NB_STREAMS, ratio);
+            afficher(32, msg, NULL);
+        }
+    } else {
+        // Si la somme de controle est fausse, le serveur a jete son fichier partiel
+        // et on renvoie tout le fichier (MAX_RETRY fois au plus)
+        long offset = 0;
+        long nb_read_total = 0;
+        long wire = 0;
+        char ratio[40];
+        int result;
+        int attempt = 0;
+        do {
+            result = upload_stream(filename, fichier, size_file, &offset, &nb_read_total, &wire);
+            attempt++;
+        } while (result == -1 && attempt < MAX_RETRY);
+        compression_ratio(ratio, nb_read_total - offset, wire);
+
+        if (result == 0){
+            sprintf(msg, "Envoi interrompu : %s (taille : %ld/%ld), relancez /upload pour le reprendre\n", filename, nb_read_total, size_file);
+            afficher(31, msg, NULL);
+        } else if (result == -1){
+            sprintf(msg, "Somme de controle incorrecte pour %s, relancez /upload\n", filename);
+            afficher(31, msg, NULL);
+        } else if (offset > 0){
+            sprintf(msg, "Fichier envoye : %s (taille : %ld/%ld, reprise a l'octet %ld%s)\n", filename, nb_read_total, size_file, offset, ratio);
+            afficher(32, msg, NULL);
+        } else {
+            sprintf(msg, "Fichier envoye : %s (taille : %ld/%ld%s)\n", filename, nb_read_total, size_file, ratio);
+            afficher(32, msg, NULL);
+        }
+    }
     //printf("Fermeture de la socket\n");
     fclose(fichier);
-    close(dS);
     //printf("Fichier fermé\n");
-    free(request);
+    free(filename);
 
     pthread_t ThreadId = pthread_self(); // The id of the thread, will be used to cleanup thread once finished
 
-    // Lock the mutex
-    pthread_mutex_lock(&mutex_ended_threads);
-    // We put the thread id in the queue of ended threads
-    enqueue(ended_threads, ThreadId);
-    // Unlock the mutex
-    pthread_mutex_unlock(&mutex_ended_threads);
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_ended_threads);
+    // We put the thread id in the queue of ended threads
+    enqueue(ended_threads, ThreadId);
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_ended_threads);
+
+    // Increment the semaphore to indicate that a thread has ended
+    sem_post(&thread_end);
+
+
+    //printf("Fichier envoyé\n");
+    pthread_exit(0);
+}
+
+
+/***************** DOWNLOAD ******************/
+
+int write_batch(int fd, char *batch, long *batch_length, long batch_offset){
+    // Ecrit les batch_length octets regroupes dans batch a batch_offset dans fd, puis vide batch
+    // Renvoie 0, ou -1 si l'ecriture a echoue
+    long nb_written = 0;
+    while (nb_written < *batch_length){
+        ssize_t nb_write = pwrite(fd, batch + nb_written, *batch_length - nb_written, batch_offset + nb_written);
+        if (nb_write <= 0){
+            perror("Erreur lors de l'ecriture du fichier");
+            return -1;
+        }
+        nb_written += nb_write;
+    }
+    *batch_length = 0;
+    return 0;
+}
+
+
+int download_range(int dS, char *filename, long offset, long length, int fd, int full, long *file_size, long *nb_recv_total, long *wire){
+    // Demande au serveur une partie du fichier et l'ecrit a sa place dans fd avec pwrite
+    // Les octets recus sont regroupes par WRITE_BATCH octets avant d'etre ecrits
+    // length = 0 pour aller jusqu'a la fin du fichier
+    // full = 1 pour que la somme de controle couvre aussi les octets avant offset, deja dans fd
+    // On accepte que le serveur envoie les octets compresses, wire recoit alors
+    // le nombre d'octets passes sur la socket (0 si le serveur ne les a pas compresses)
+    // file_size recoit la taille totale du fichier, nb_recv_total le nombre d'octets recus
+    // Renvoie 1 si la partie est complete et sa somme de controle correcte,
+    // 0 si la connexion a ete coupee, -1 si la somme de controle est fausse
+    Message request;
+    long range[2];
+    char packet[COMPRESS_BLOCK];
+    int nb_recv;
+    int nb_to_read;
+    long compressed = 0;
+    uint32_t crc = 0;
+    uint32_t crc_server;
+
+    *nb_recv_total = 0;
+    *wire = 0;
+    memset(&request, 0, sizeof(Message));
+    strcpy(request.cmd, "get");
+    strcpy(request.from, pseudo);
+    strcpy(request.to, "deflate");
+    strcpy(request.message, filename);
+    strcpy(request.color, color);
+    if (full){
+        strcpy(request.channel, "full");
+    }
+    range[0] = offset;
+    range[1] = length;
+    if (send_full(dS, &request, BUFFER_SIZE) == -1 || send_int64(dS, range, 2) == -1){
+        return 0;
+    }
+
+    // Le serveur envoie la taille du fichier, 1 s'il compresse les octets, puis les octets demandes
+    if (recv_int64(dS, file_size, 1) == 0 || *file_size < 0
+        || recv_int64(dS, &compressed, 1) == 0){
+        return 0;
+    }
+    // Meme calcul que le serveur pour savoir combien d'octets on va recevoir
+    if (offset > *file_size){
+        offset = *file_size;
+    }
+    if (full && crc32c_file(fd, offset, &crc) == 0){
+        perror("Erreur lors de la lecture du fichier");
+        return 0;
+    }
+    long nb_expected = *file_size - offset;
+    if (length > 0 && length < nb_expected){
+        nb_expected = length;
+    }
+
+    char *batch = malloc(WRITE_BATCH);
+    long batch_length = 0;
+    int complete = 1;
+    if (batch == NULL){
+        perror("Erreur d'allocation");
+        exit(EXIT_FAILURE);
+    }
+    while (*nb_recv_total < nb_expected){
+        if (compressed == 1){
+            nb_recv = recv_block(dS, packet, wire);
+        } else {
+            nb_to_read = BUFFER_SIZE;
+            if (nb_expected - *nb_recv_total < BUFFER_SIZE){
+                nb_to_read = nb_expected - *nb_recv_total;
+            }
+            nb_recv = recv(dS, packet, nb_to_read, 0);
+        }
+        // Si le serveur ferme la connexion avant la fin, ce qui a ete recu est garde pour une reprise
+        if (nb_recv <= 0 || nb_recv > nb_expected - *nb_recv_total) {
+            complete = 0;
+            break;
+        }
+        // Le lot est ecrit quand le paquet ne tient plus dedans
+        if (batch_length + nb_recv > WRITE_BATCH
+            && write_batch(fd, batch, &batch_length, offset + *nb_recv_total - batch_length) == -1){
+            *nb_recv_total -= batch_length;
+            free(batch);
+            return 0;
+        }
+        memcpy(batch + batch_length, packet, nb_recv);
+        batch_length += nb_recv;
+        crc = crc32c_update(crc, packet, nb_recv);
+        *nb_recv_total += nb_recv;
+    }
+    // On ecrit ce qui reste, meme si la connexion a ete coupee
+    if (write_batch(fd, batch, &batch_length, offset + *nb_recv_total - batch_length) == -1){
+        complete = 0;
+        *nb_recv_total -= batch_length;
+    }
+    free(batch);
+    if (!complete){
+        return 0;
+    }
+
+    // Puis la somme de controle des octets envoyes
+    if (recv_uint32(dS, &crc_server, 1) == 0){
+        return 0;
+    }
+    if (crc_server != crc){
+        return -1;
+    }
+    return 1;
+}
 
-    // Increment the semaphore to indicate that a thread has ended
-    sem_post(&thread_end);
 
+void *download_chunk(void *param){
+    // Fonction qui telecharge un morceau d'un fichier sur sa propre connexion (thread)
+    // Si le morceau est corrompu ou si la connexion est coupee, on le redemande (MAX_RETRY fois au plus)
+    struct chunk_param *chunk = (struct chunk_param *) param;
+    long file_size;
+    long nb_recv_total;
+    int attempt = 0;
+
+    chunk->ok = 0;
+    while (chunk->ok == 0 && attempt < MAX_RETRY){
+        attempt++;
+        int dS = connect_server(2); // +2 pour le port du download du fichier
+        if (dS == -1){
+            continue;
+        }
+        if (download_range(dS, chunk->filename, chunk->offset, chunk->length, chunk->fd, 0, &file_size, &nb_recv_total, &chunk->wire) == 1
+            && file_size == chunk->file_size){
+            chunk->ok = 1;
+        }
+        close(dS);
+    }
 
-    //printf("Fichier envoyé\n");
     pthread_exit(0);
 }
 
 
-/***************** DOWNLOAD ******************/
-
 void * download_file(void* param){
     // Fonction qui télécharge un fichier du serveur (thread)
     // Prend en argument le nom du fichier à télécharger et la socket du serveur
     // On utilise un thread pour pouvoir envoyer un message au serveur pendant le téléchargement du fichier
+    // Un fichier de plus de PARALLEL_THRESHOLD octets est telecharge en morceaux, en parallele
     struct download_param {
         char *filename;
         int *dS;
@@ -1197,7 +2751,7 @@ void * download_file(void* param){
 
     int dS = *(param_download.dS);
 
-    Message buffer[BUFFER_SIZE];
+    Message request;
     char *filename = param_download.filename;
 
     if (filename == NULL){ // retour au tchat
@@ -1205,78 +2759,158 @@ void * download_file(void* param){
         pthread_exit(0);
     }
 
-    // On envoit le nom du fichier au serveur
-    strcpy(buffer->message, filename);
-    int nb_recv = send(dS, buffer, BUFFER_SIZE, 0);
-    if (nb_recv == -1) {
-        perror("Erreur lors de la reception du message");
-        close(dS);
-        exit(EXIT_FAILURE);
-    } else if (nb_recv == 0) {
-        // Connection fermée par le client ou le serveur
-        afficher(31, "Le serveur a ferme la connexion\n", NULL);
-        close(dS);
-        exit(EXIT_FAILURE);
+    // Le fichier est d'abord reçu dans un fichier partiel "<nom>.part"
+    // Si un fichier partiel existe deja, c'est qu'un telechargement precedent a ete interrompu
+    // On reprend alors a partir de la fin du fichier partiel au lieu de tout recommencer
+    char path[MSG_LENGTH + 50];
+    char path_part[MSG_LENGTH + 60];
+    sprintf(path, "%s%s", FILES_DIRECTORY, filename);
+    sprintf(path_part, "%s%s.part", FILES_DIRECTORY, filename);
+
+    long offset = 0; // position a partir de laquelle on demande le fichier
+    struct stat stat_part;
+    if (stat(path_part, &stat_part) == 0){
+        offset = stat_part.st_size;
     }
-    
-    // on recoit la taille du fichier selectionner
-    long file_size;
-    nb_recv = recv(dS, &file_size, sizeof(long), 0);
-    if (nb_recv == -1) {
-        perror("Erreur lors de la reception du message");
-        close(dS);
-        exit(EXIT_FAILURE);
-    } else if (nb_recv == 0) {
-        // Connection fermée par le client ou le serveur
+
+    // On demande la taille du fichier pour savoir s'il faut le telecharger en parallele
+    long file_size = -1;
+    memset(&request, 0, sizeof(Message));
+    strcpy(request.cmd, "size");
+    strcpy(request.from, pseudo);
+    strcpy(request.to, "server");
+    strcpy(request.message, filename);
+    strcpy(request.color, color);
+    if (send_full(dS, &request, BUFFER_SIZE) == -1 || recv_int64(dS, &file_size, 1) == 0) {
         afficher(31, "Le serveur a ferme la connexion\n", NULL);
         close(dS);
         exit(EXIT_FAILURE);
     }
 
-
-    // puis on recoit le fichier
-    FILE *fichier = NULL;
-    char path[100];
-    strcpy(path, FILES_DIRECTORY);
-    strcat(path, filename);
-    fichier = fopen(path, "w");
-    if (fichier == NULL) {
-        perror("Erreur lors de la creation du fichier");
-        exit(EXIT_FAILURE);
+    char msg[MSG_LENGTH + 150];
+    long nb_received = 0; // nombre d'octets du fichier presents dans le fichier partiel
+    long nb_compressed = 0; // octets recus compresses, avant et apres compression
+    long wire = 0;
+    char ratio[40];
+    char rate[40];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int result = 0;
+    int fd = -1;
+
+    if (file_size < 0){
+        sprintf(msg, "Le fichier %s n'existe plus sur le serveur\n", filename);
+        afficher(31, msg, NULL);
+    } else if (offset > file_size){
+        // Si le fichier partiel est plus grand que le fichier du serveur, il ne correspond pas a ce fichier
+        // On le supprime, le prochain /download recommencera depuis le debut
+        remove(path_part);
+        sprintf(msg, "Fichier partiel invalide pour %s, relancez le telechargement\n", filename);
+        afficher(31, msg, NULL);
+    } else {
+        fd = open(path_part, O_RDWR | O_CREAT, 0644);
+        if (fd == -1) {
+            perror("Erreur lors de la creation du fichier");
+            exit(EXIT_FAILURE);
+        }
     }
 
-    char packet[BUFFER_SIZE];
-    int nb_read_total = 0;
-    while(1){
-        nb_recv = recv(dS, packet, BUFFER_SIZE, 0);
-        if (nb_recv == -1) {
-            perror("Erreur lors de la reception");
-            exit(EXIT_FAILURE);
+    if (fd != -1 && offset == 0 && file_size >= PARALLEL_THRESHOLD){
+        // Telechargement en parallele : un thread et une connexion par morceau
+        pthread_t chunk_threads[NB_STREAMS];
+        struct chunk_param chunks[NB_STREAMS];
+        long chunk_size = (file_size + NB_STREAMS - 1) / NB_STREAMS;
+        int i;
+        for (i = 0; i < NB_STREAMS; i++){
+            chunks[i].filename = filename;
+            chunks[i].fd = fd;
+            chunks[i].file_size = file_size;
+            chunks[i].offset = i * chunk_size;
+            chunks[i].length = chunk_size;
+            if (chunks[i].offset + chunk_size > file_size){
+                chunks[i].length = file_size - chunks[i].offset;
+            }
+            if (pthread_create(&chunk_threads[i], NULL, download_chunk, &chunks[i]) != 0) {
+                perror("Erreur lors de la creation du thread de telechargement");
+                exit(EXIT_FAILURE);
+            }
         }
-        // If ever a client disconnect while we are receiving the messages
-        // or if he has sent everything and closed the socket
-        if (nb_recv == 0) {
-            //printf("Socket ferme : Le serveur a fini de upload\n");
-            break;
+        result = 1;
+        for (i = 0; i < NB_STREAMS; i++){
+            pthread_join(chunk_threads[i], NULL);
+            // Seuls les premiers morceaux complets a la suite sont gardes pour une reprise
+            if (chunks[i].ok == 1 && chunks[i].wire > 0){
+                nb_compressed += chunks[i].length;
+                wire += chunks[i].wire;
+            }
+            if (chunks[i].ok == 1 && result == 1){
+                nb_received += chunks[i].length;
+            } else {
+                result = 0;
+            }
+        }
+        // Le fichier partiel ne doit contenir que des octets verifies et sans trou
+        if (result == 0 && ftruncate(fd, nb_received) == -1){
+            perror("Erreur lors de la troncature du fichier");
+        }
+    } else if (fd != -1){
+        // Telechargement sur une seule connexion, a la suite du fichier partiel
+        // La somme de controle couvre tout le fichier, y compris ce qui a ete recu avant une reprise
+        // Si elle est fausse, on ne sait pas quels octets sont corrompus : on vide le fichier partiel
+        // et on recommence depuis le debut (MAX_RETRY fois au plus)
+        long nb_recv_total = 0;
+        for (int attempt = 0; attempt < MAX_RETRY; attempt++){
+            result = download_range(dS, filename, offset, 0, fd, 1, &file_size, &nb_recv_total, &wire);
+            if (result != -1){
+                break;
+            }
+            offset = 0;
+            if (ftruncate(fd, 0) == -1){
+                perror("Erreur lors de la troncature du fichier");
+                break;
+            }
         }
-        nb_read_total += nb_recv;
+        nb_received = offset + nb_recv_total;
+        nb_compressed = nb_recv_total;
+    }
 
-        
-        // If the nb_recv_total greater than the file_size, we stop the loop
-        if (nb_read_total >= file_size + 1000) {
-            break;
+    if (fd != -1){
+        // Le fichier doit etre sur le disque avant de prendre son vrai nom,
+        // sinon une coupure de courant pourrait laisser un fichier incomplet sous ce nom
+        if (result == 1 && fsync(fd) == -1){
+            perror("Erreur lors de la synchronisation du fichier");
+            result = 0;
+        }
+        // We close the file
+        close(fd);
+
+        if (result == 1){
+            // Le fichier est complet, on lui donne son vrai nom
+            if (rename(path_part, path) == -1){
+                perror("Erreur lors du renommage du fichier");
+            }
+            compression_ratio(ratio, nb_compressed, wire);
+            // Le debit ne compte que les octets recus par ce telechargement
+            transfer_rate(rate, nb_received - offset, start);
+            if (offset > 0){
+                sprintf(msg, "Fichier reçu : %s (taille : %ld/%ld, reprise a l'octet %ld%s%s)\n", filename, nb_received, file_size, offset, ratio, rate);
+            } else if (file_size >= PARALLEL_THRESHOLD){
+                sprintf(msg, "Fichier reçu : %s (taille : %ld/%ld, %d connexions%s%s)\n", filename, nb_received, file_size, NB_STREAMS, ratio, rate);
+            } else {
+                sprintf(msg, "Fichier reçu : %s (taille : %ld/%ld%s%s)\n", filename, nb_received, file_size, ratio, rate);
+            }
+            afficher(32, msg, NULL);
+        } else if (result == -1){
+            sprintf(msg, "Somme de controle incorrecte pour %s, relancez /download\n", filename);
+            afficher(31, msg, NULL);
+        } else {
+            sprintf(msg, "Telechargement interrompu : %s (taille : %ld/%ld), relancez /download pour le reprendre\n", filename, nb_received, file_size);
+            afficher(31, msg, NULL);
         }
-                
-        // We write in the file
-        fwrite(packet, sizeof(char), nb_recv, fichier);
     }
+    close(dS);
+    free(filename);
 
-    char msg[150];
-    sprintf(msg, "Fichier reçu : %s (taille : %d/%ld)\n", filename, nb_read_total, file_size);
-    afficher(32, msg, NULL);
-    // We close the file
-    fclose(fichier);
-    
     pthread_t ThreadId = pthread_self(); // The id of the thread, will be used to cleanup thread once finished
 
 
@@ -1297,41 +2931,146 @@ void * download_file(void* param){
             THREADS DES CHANNELS
 ********************************************/
 
-void * channel_thread(void *arg){
-    //prend en argument le nom du salon
-    int nb_send;
-    int nb_recv;
-
+// La fenetre d'un salon qui vient de se connecter a la socket des salons
+typedef struct FenetreSalon FenetreSalon;
+struct FenetreSalon {
+    int socket;
     char channel[CHANNEL_SIZE];
-    strcpy(channel, (char*) arg);
+};
 
-    char command[100];
-    //prend en parametre le port, le pseudo et la couleur sans le \ devant la couleur
-    sprintf(command, "gnome-terminal -- ./client_salon %d %s %s %s", port_channel, pseudo, color, channel);
+// Thread qui lance la fenetre du salon, elle se connecte ensuite a la socket des salons
+void *fenetre_thread(void *arg){
+    char command[200];
+    //prend en parametre la socket, le pseudo, la couleur sans le \ devant et le salon
+    snprintf(command, sizeof(command), "gnome-terminal -- ./client_salon %s %s %s %s", salon_socket_name, pseudo, color, (char *) arg);
     system(command);
+    free(arg);
+    return NULL;
+}
 
+// Ouvre la fenetre du salon (option -w)
+// l'historique du salon arrive avant que sa fenetre soit connectee, on le garde de cote jusque la
+void ouvrir_fenetre(char *channel){
+    pthread_t thread_fenetre;
 
+    pthread_mutex_lock(&mutex_pending_backfill);
+    if (is_in_list(opening_channel_list, channel) == 0){
+        add(opening_channel_list, channel, -1);
+    }
+    pthread_mutex_unlock(&mutex_pending_backfill);
+    if (pthread_create(&thread_fenetre, NULL, fenetre_thread, strdup(channel)) == 0){
+        pthread_detach(thread_fenetre);
+    }
+}
 
+// Thread qui accepte les fenetres des salons sur la socket des salons (option -w)
+// la socket est visible de tous les programmes de la machine : seuls ceux de l'utilisateur sont acceptes
+// chaque fenetre envoie d'abord le nom de son salon, c'est lui qui dit a quel salon elle va,
+// pas l'ordre des connexions. Une connexion refusee est fermee et on attend la suivante
+void *accept_salon_thread(void *arg){
     int newSocket;
-    struct sockaddr_in address;
-    int addrlen = sizeof(address);
+    struct ucred credentials;
+    socklen_t credentials_length;
+    struct timeval delai;
+    Message premier;
+    FenetreSalon *fenetre;
+    pthread_t thread_channel;
+    int attendu;
 
-    if ((newSocket = accept(socket_channel_address, (struct sockaddr *)&address, (socklen_t *)&addrlen)) < 0) {
-        perror("accept failed");
-        exit(EXIT_FAILURE);
+    while (1){
+        if ((newSocket = accept(socket_channel_address, NULL, NULL)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("accept failed");
+            exit(EXIT_FAILURE);
+        }
+
+        credentials_length = sizeof(credentials);
+        if (getsockopt(newSocket, SOL_SOCKET, SO_PEERCRED, &credentials, &credentials_length) == -1
+            || credentials.uid != getuid()){
+            close(newSocket);
+            continue;
+        }
+
+        // une connexion qui n'envoie rien ne bloque pas les fenetres suivantes
+        delai.tv_sec = 2;
+        delai.tv_usec = 0;
+        setsockopt(newSocket, SOL_SOCKET, SO_RCVTIMEO, &delai, sizeof(delai));
+        if (recv_full(newSocket, &premier, sizeof(Message)) != sizeof(Message) || strcmp(premier.cmd, "salon") != 0){
+            close(newSocket);
+            continue;
+        }
+        delai.tv_sec = 0;
+        setsockopt(newSocket, SOL_SOCKET, SO_RCVTIMEO, &delai, sizeof(delai));
+        premier.channel[CHANNEL_SIZE - 1] = '\0';
+
+        // seul un salon dont la fenetre est en train de s'ouvrir est attendu
+        pthread_mutex_lock(&mutex_pending_backfill);
+        attendu = is_in_list(opening_channel_list, premier.channel);
+        pthread_mutex_unlock(&mutex_pending_backfill);
+        if (attendu == 0){
+            close(newSocket);
+            continue;
+        }
+
+        fenetre = malloc(sizeof(FenetreSalon));
+        fenetre->socket = newSocket;
+        strcpy(fenetre->channel, premier.channel);
+        if (pthread_create(&thread_channel, NULL, channel_thread, fenetre) != 0){
+            perror("Erreur lors de la creation du thread du salon");
+            close(newSocket);
+            free(fenetre);
+        }
     }
+    return arg;
+}
+
+void * channel_thread(void *arg){
+    //prend en argument la fenetre du salon qui vient de se connecter
+    int nb_send;
+    int nb_recv;
 
+    FenetreSalon *fenetre = (FenetreSalon *) arg;
+    int newSocket = fenetre->socket;
+    char channel[CHANNEL_SIZE];
+    strcpy(channel, fenetre->channel);
+    free(fenetre);
 
     // verifier si le channel est deja ouvert
     if (is_in_list(socket_channel_list, channel) == 1){
         //printf("Channel deja ouvert\n");
         close(newSocket);
+        pthread_mutex_lock(&mutex_pending_backfill);
+        remove_element(opening_channel_list, channel);
+        pthread_mutex_unlock(&mutex_pending_backfill);
         pthread_exit(0);
     }
 
     // ajouter le channel a la liste des channels ouvert
     add(socket_channel_list, channel, newSocket);
 
+    // envoie d'un coup au salon l'historique recu pendant l'ouverture de la fenetre
+    // readMessage attend le mutex, donc les messages suivants arrivent apres
+    pthread_mutex_lock(&mutex_pending_backfill);
+    Message *backfill = malloc(PENDING_BACKFILL_MAX * sizeof(Message));
+    int nb_backfill = 0;
+    int nb_kept = 0;
+    for (int i = 0; i < nb_pending_backfill; i++){
+        if (strcmp(pending_backfill[i].channel, channel) == 0){
+            backfill[nb_backfill++] = pending_backfill[i];
+        } else {
+            pending_backfill[nb_kept++] = pending_backfill[i];
+        }
+    }
+    nb_pending_backfill = nb_kept;
+    remove_element(opening_channel_list, channel);
+    if (nb_backfill > 0 && send_full(newSocket, backfill, nb_backfill * sizeof(Message)) == -1){
+        perror("Erreur lors de l'envoi de l'historique au salon");
+    }
+    pthread_mutex_unlock(&mutex_pending_backfill);
+    free(backfill);
+
     Message request[BUFFER_SIZE];
     while (1){
         nb_recv = recv(newSocket, request, BUFFER_SIZE, 0);
@@ -1361,7 +3100,7 @@ void * channel_thread(void *arg){
         }
         
         strcpy(request->channel, channel);
-        nb_send = send(*socket_server, request, BUFFER_SIZE, 0);
+        nb_send = send_server(request, 0);
         if (nb_send == -1) {
             perror("Erreur lors de l'envoi du message");
             close(*socket_server);
@@ -1459,16 +3198,23 @@ void *readMessage(void *arg) {
 
         // Recoit le message des autres clients
 
-        nb_recv = recv(dS, response, BUFFER_SIZE, 0);
+        // les trames des streams arrivent a la suite, on attend le Message entier
+        nb_recv = recv_full(dS, response, BUFFER_SIZE);
         if (nb_recv == -1) {
             perror("Erreur lors de la reception du message");
             close(dS);
             exit(EXIT_FAILURE);
-        } else if (nb_recv == 0) {
+        } else if (nb_recv < BUFFER_SIZE) {
             // Connection closed by client or server
             break;
         }
 
+        if (strcmp(response->cmd, "mux") == 0) {
+            // trame d'un stream multiplexe
+            mux_receive(response);
+            continue;
+        }
+
         if (strcmp(response->cmd, "finserv") == 0) {
             // Si le serveur envoie "finserv", on ferme la connexion
             afficher(31, "Le serveur a ferme la connexion\n", NULL);
@@ -1477,6 +3223,53 @@ void *readMessage(void *arg) {
             break;
         }
 
+        if (strcmp(response->cmd, "ticket") == 0) {
+            // Ticket demande par get_ticket, on le met de cote et on previent les threads qui attendent
+            pthread_mutex_lock(&mutex_tickets);
+            if (nb_tickets < MAX_TICKETS) {
+                strcpy(tickets[nb_tickets], response->message);
+                nb_tickets++;
+            }
+            pthread_cond_broadcast(&cond_tickets);
+            pthread_mutex_unlock(&mutex_tickets);
+            continue;
+        }
+
+        if (strcmp(response->cmd, "history") == 0) {
+            // Message de l'historique demande avec /history ou /search, affiche dans le tchat
+            print_message(response);
+            continue;
+        }
+
+        if (mode_fenetres == 0) {
+            // Les salons sont des onglets : les messages des salons vont dans leur onglet
+            if (strcmp(response->cmd, "end") == 0) {
+                afficher(31, "Le salon %s a ete supprime\n", response->channel);
+                fermer_onglet(response->channel);
+                continue;
+            }
+            if ((strcmp(response->cmd, "") == 0 || strcmp(response->cmd, "backfill") == 0)
+                && recevoir_onglet(response) == 1) {
+                continue;
+            }
+            print_message(response);
+            continue;
+        }
+
+        if (strcmp(response->cmd, "backfill") == 0) {
+            // Derniers messages d'un salon qu'on vient de rejoindre
+            // si sa fenetre s'ouvre encore, on les garde pour channel_thread
+            pthread_mutex_lock(&mutex_pending_backfill);
+            if (is_in_list(opening_channel_list, response->channel) == 1) {
+                if (nb_pending_backfill < PENDING_BACKFILL_MAX) {
+                    pending_backfill[nb_pending_backfill++] = *response;
+                }
+                pthread_mutex_unlock(&mutex_pending_backfill);
+                continue;
+            }
+            pthread_mutex_unlock(&mutex_pending_backfill);
+        }
+
         if (strcmp(response->channel, "global") == 0) {
             print_message(response);
         } else {
@@ -1500,6 +3293,7 @@ void *readMessage(void *arg) {
 
     }
 
+    mux_close_all();
     free(response);
     pthread_exit(0);
 }
@@ -1553,11 +3347,37 @@ void *writeMessage(void *arg) {
             continue;
         }
 
+        // Si l'input est "/tab", affiche les onglets ouverts, "/tab salon" affiche l'onglet du salon
+        if (mode_fenetres == 0 && strncmp(input, "/tab", 4) == 0 && (input[4] == '\0' || input[4] == ' ')){
+            char *nom = input + 4;
+            while (*nom == ' '){
+                nom++;
+            }
+            if (*nom == '\0'){
+                char liste[MSG_LENGTH];
+                strcpy(liste, "Onglets :");
+                pthread_mutex_lock(&mutex_onglets);
+                for (int i = 0; i < nb_onglets; i++){
+                    snprintf(liste + strlen(liste), sizeof(liste) - strlen(liste) - 1, " %s%.*s(%d)", i == onglet_actif ? "*" : "", CHANNEL_SIZE - 1, onglets[i].nom, onglets[i].non_lus);
+                }
+                pthread_mutex_unlock(&mutex_onglets);
+                strcat(liste, "\n");
+                afficher(32, liste, NULL);
+            } else if (changer_onglet(nom) == 0){
+                afficher(31, "Erreur : le salon %s n'a pas d'onglet, rejoignez-le avec /salon\n", nom);
+            }
+            continue;
+        }
+
         // Formatage du message
+        // sans l'option -w, le message part dans le salon de l'onglet actif
         strcpy(request->cmd, "");
         strcpy(request->from, pseudo);
         strcpy(request->to, "all");
         strcpy(request->channel, "global");
+        if (mode_fenetres == 0){
+            salon_actif(request->channel);
+        }
         strcpy(request->message, input);
         strcpy(request->color, color);
 
@@ -1567,6 +3387,22 @@ void *writeMessage(void *arg) {
             strcpy(request->cmd, "fin");
         }
 
+        // Dans l'onglet d'un salon, "/exit" quitte le salon et ferme l'onglet
+        if (mode_fenetres == 0 && strcmp(input, "/exit") == 0){
+            if (strcmp(request->channel, "global") == 0){
+                afficher(31, "Erreur : on ne peut pas quitter global, pour quitter veuillez saisir '/fin'\n", NULL);
+                continue;
+            }
+            strcpy(request->cmd, "exit");
+            if (send_server(request, 0) == -1) {
+                perror("Erreur lors de l'envoi du message");
+                close(dS);
+                exit(EXIT_FAILURE);
+            }
+            fermer_onglet(request->channel);
+            continue;
+        }
+
         if (strcmp(input, "/who") == 0){
             strcpy(request->cmd, "who");
         }
@@ -1594,6 +3430,54 @@ void *writeMessage(void *arg) {
             strcpy(request->message, traitement);
         }
 
+        // Si l'input est "/history [salon] [nombre]", demande au serveur les derniers messages du salon
+        if (strcmp(traitement, "/history") == 0){
+            strcpy(request->cmd, "history");
+            strcpy(request->message, "20");
+            char *argument = strtok(NULL, " ");
+            if (argument != NULL && atoi(argument) == 0){
+                strncpy(request->channel, argument, CHANNEL_SIZE - 1);
+                request->channel[CHANNEL_SIZE - 1] = '\0';
+                argument = strtok(NULL, " ");
+            }
+            if (argument != NULL){
+                snprintf(request->message, MSG_LENGTH, "%d", atoi(argument));
+            }
+        }
+
+        // Si l'input est "/search [#salon] [-7j|-12h|-30m] mots", cherche les messages du salon qui ont tous les mots
+        // -7j, -12h ou -30m ne cherche que dans les 7 derniers jours, les 12 dernieres heures ou les 30 dernieres minutes
+        if (strcmp(traitement, "/search") == 0){
+            strcpy(request->cmd, "search");
+            strcpy(request->message, "");
+            strcpy(request->to, "0");
+            char *argument = strtok(NULL, " ");
+            if (argument != NULL && argument[0] == '#'){
+                strncpy(request->channel, argument + 1, CHANNEL_SIZE - 1);
+                request->channel[CHANNEL_SIZE - 1] = '\0';
+                argument = strtok(NULL, " ");
+            }
+            long duree;
+            char unite;
+            if (argument != NULL && sscanf(argument, "-%ld%c", &duree, &unite) == 2 && duree > 0
+                && (unite == 'j' || unite == 'h' || unite == 'm')){
+                duree = duree * (unite == 'j' ? 86400 : unite == 'h' ? 3600 : 60);
+                snprintf(request->to, PSEUDO_LENGTH, "%08lx", (unsigned long) (time(NULL) - duree));
+                argument = strtok(NULL, " ");
+            }
+            while (argument != NULL){
+                if (strlen(request->message) + strlen(argument) + 2 < MSG_LENGTH){
+                    strcat(request->message, argument);
+                    strcat(request->message, " ");
+                }
+                argument = strtok(NULL, " ");
+            }
+            if (strlen(request->message) == 0){
+                afficher(31, "Erreur : veuillez entrer des mots a chercher\n  /search [#salon] [-7j|-12h|-30m] <mots>\n", NULL);
+                continue;
+            }
+        }
+
         // Si l'input est "/upload fichier" envoie "upload" au server
         // Si le fichier n'est pas spécifié, demande le fichier à uploader
         if (strcmp(traitement, "/upload") == 0){
@@ -1636,7 +3520,8 @@ void *writeMessage(void *arg) {
                 char *filename;
                 FILE *file;
             } param;
-            param.filename = traitement;
+            // le thread garde sa propre copie du nom, input sera reutilise pour le prochain message
+            param.filename = strdup(traitement);
             param.file = fichier;
 
             if (pthread_create(&uploadThread, NULL, upload_file, &param) != 0) {
@@ -1648,69 +3533,44 @@ void *writeMessage(void *arg) {
         }
 
 
-        // Si l'input est "/download" envoie "download" au server
+        // Si l'input est "/download [-t ordre] [prefixe]" ouvre une connexion sur le port de download
+        // et affiche les fichiers du serveur dont le nom commence par prefixe, dans l'ordre choisi
         if (strcmp(traitement, "/download") == 0){
-            strcpy(request->cmd, "download");
-            strcpy(request->message, "Demande de fichier au serveur");
-            // Envoie le message au serveur
-            nb_send = send(dS, request, BUFFER_SIZE, 0);
-            if (nb_send == -1) {
-                perror("Erreur lors de l'envoi du message");
-                close(dS);
-                exit(EXIT_FAILURE);
-            } else if (nb_send == 0) {
-                // Connection fermée par le client ou le serveur
-                afficher(31, "Le serveur a ferme la connexion\n", NULL);
-                close(dS);
-                break;
-            }
-
-            int dS_download = socket(AF_INET, SOCK_STREAM, 0);
-            if (dS_download == -1) {
-                perror("Erreur lors de la creation de la socket");
-                exit(EXIT_FAILURE);
-            }
-
-            //printf("Socket Créé\n");
-            struct sockaddr_in aS;
-
-            aS.sin_family = AF_INET;
-            int result = inet_pton(AF_INET, server_ip, &(aS.sin_addr));
-            if (result == 0) {
-                fprintf(stderr, "Invalid address\n");
-                exit(EXIT_FAILURE);
-            } else if (result == -1) {
-                perror("inet_pton");
-                exit(EXIT_FAILURE);
+            char *order = "name";
+            char *prefix = "";
+            traitement = strtok(NULL, " ");
+            if (traitement != NULL && strcmp(traitement, "-t") == 0) {
+                order = strtok(NULL, " ");
+                traitement = strtok(NULL, " ");
+                char *ordres[6] = {"name", "size", "date", "-name", "-size", "-date"};
+                int valide = 0;
+                for (int i = 0; i < 6 && order != NULL; i++) {
+                    if (strcmp(order, ordres[i]) == 0) {
+                        valide = 1;
+                    }
+                }
+                if (!valide) {
+                    afficher(31, "Erreur : ordre inconnu\n  /download [-t name|size|date|-name|-size|-date] [prefixe]\n", NULL);
+                    continue;
+                }
             }
-
-            aS.sin_port = htons(server_port + 2); // +2 pour le port du download du fichier
-            socklen_t lgA = sizeof(struct sockaddr_in) ;
-            if (connect(dS_download, (struct sockaddr *) &aS, lgA) == -1) {
-                perror("Erreur connect client");
-                exit(EXIT_FAILURE);
+            if (traitement != NULL) {
+                prefix = traitement;
             }
 
-            // reception des fichiers disponibles dans un struct message, les fichiers sont séparés par des "/"
-            int nb_recv = recv(dS_download, request, BUFFER_SIZE, 0);
-            if (nb_recv == -1) {
-                perror("Erreur lors de la reception du message");
-                close(dS);
-                exit(EXIT_FAILURE);
-            } else if (nb_recv == 0) {
-                // Connection fermée par le client ou le serveur
-                afficher(31, "Le serveur a ferme la connexion\n", NULL);
-                close(dS);
-                exit(EXIT_FAILURE);
+            int dS_download = connect_server(2); // +2 pour le port du download du fichier
+            if (dS_download == -1) {
+                continue;
             }
 
-            char * filename = get_file_download(request->message);
+            char * filename = get_file_download(dS_download, prefix, order);
 
             struct download_param {
                 char *filename;
                 int *dS;
             } param;
 
+            // get_file_download renvoie une copie du nom, le thread la libere
             param.filename = filename;
             param.dS = &dS_download;
             pthread_t downloadThread;
@@ -1723,53 +3583,20 @@ void *writeMessage(void *arg) {
             continue;
         }
 
+        // Si l'input est "/salon" ouvre une connexion sur le port des salons
         if (strcmp(traitement, "/salon") == 0){
-            strcpy(request->cmd, "salon");
-            strcpy(request->message, "Demande de changement de salon");
-
-            // Envoie le message au serveur
-            nb_send = send(dS, request, BUFFER_SIZE, 0);
-            if (nb_send == -1) {
-                perror("Erreur lors de l'envoi du message");
-                close(dS);
-                exit(EXIT_FAILURE);
-            } else if (nb_send == 0) {
-                // Connection fermée par le client ou le serveur
-                afficher(31, "Le serveur a ferme la connexion\n", NULL);
-                close(dS);
-                break;
-            }
-
-            //nouvelle socket +3 pour le port du salon
-            int dS_salon = socket(AF_INET, SOCK_STREAM, 0);
+            int dS_salon = connect_server(3); // +3 pour le port du salon
             if (dS_salon == -1) {
-                perror("Erreur lors de la creation de la socket");
-                exit(EXIT_FAILURE);
-            }
-            struct sockaddr_in aS;
-            aS.sin_family = AF_INET;
-            int result = inet_pton(AF_INET, server_ip, &(aS.sin_addr));
-            if (result == 0) {
-                fprintf(stderr, "Invalid address\n");
-                exit(EXIT_FAILURE);
-            } else if (result == -1) {
-                perror("inet_pton");
-                exit(EXIT_FAILURE);
-            }
-            aS.sin_port = htons(server_port + 3); // +3 pour le port du salon
-            socklen_t lgA = sizeof(struct sockaddr_in) ;
-            if (connect(dS_salon, (struct sockaddr *) &aS, lgA) == -1) {
-                perror("Erreur connect client");
-                exit(EXIT_FAILURE);
+                continue;
             }
 
             // reception des salons disponibles dans un struct message, les salons sont séparés par des "/"
-            int nb_recv = recv(dS_salon, request, BUFFER_SIZE, 0);
+            int nb_recv = recv_full(dS_salon, request, BUFFER_SIZE);
             if (nb_recv == -1) {
                 perror("Erreur lors de la reception du message");
                 close(dS);
                 exit(EXIT_FAILURE);
-            } else if (nb_recv == 0) {
+            } else if (nb_recv < BUFFER_SIZE) {
                 // Connection fermée par le client ou le serveur
                 afficher(31, "Le serveur a ferme la connexion\n", NULL);
                 close(dS);
@@ -1786,7 +3613,7 @@ void *writeMessage(void *arg) {
 
 
         // Envoie le message au serveur
-        nb_send = send(dS, request, BUFFER_SIZE, 0);
+        nb_send = send_server(request, 0);
         if (nb_send == -1) {
             perror("Erreur lors de l'envoi du message");
             close(dS);
@@ -1808,8 +3635,12 @@ void *writeMessage(void *arg) {
 
         if (strcmp(request->cmd, "dm") == 0){
             print_dm_envoye(request);
-        } else {
-            print_message(request);
+        } else if (strcmp(request->cmd, "history") != 0 && strcmp(request->cmd, "search") != 0){
+            // la demande d'historique ou de recherche n'est pas un message, les messages arrivent du serveur
+            // un message d'un salon est range dans son onglet
+            if (mode_fenetres == 1 || strcmp(request->cmd, "") != 0 || recevoir_onglet(request) == 0){
+                print_message(request);
+            }
         }
 
     }
@@ -1841,13 +3672,26 @@ void handle_sigint(int sig) {
 
 int main(int argc, char *argv[]) {
 
-    if (argc != 3) {
+    if (argc < 3) {
         printf("Error: You must provide exactly 2 arguments.\n\
-                Usage: %s <server_ip> <server_port>\n", argv[0]);
+                Usage: %s <server_ip> <server_port> [-m] [-w]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
     server_ip = argv[1];
     server_port = atoi(argv[2]);
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0) {
+            // -m : les fichiers et les salons passent par la connexion principale
+            mode_mux = 1;
+        } else if (strcmp(argv[i], "-w") == 0) {
+            // -w : chaque salon s'ouvre dans une fenetre gnome-terminal
+            mode_fenetres = 1;
+        } else {
+            printf("Error: Unknown option %s.\n\
+                Usage: %s <server_ip> <server_port> [-m] [-w]\n", argv[i], argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
 
 
     system("clear"); // Efface l'écran
@@ -1979,43 +3823,55 @@ int main(int argc, char *argv[]) {
 
     } while (pseudo_valide == 0);
 
-    // Creation de socket pour communiquer avec les channels
-    struct sockaddr_in address;
-    
-    // Creation du socket
-    if ((socket_channel_address = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("socket failed");
-        exit(EXIT_FAILURE);
-    }
-    
+    // Creation de socket pour communiquer avec les fenetres des channels (option -w)
+    // C'est une socket Unix du namespace abstrait : son nom vient du pid du client, il n'y a pas
+    // de port libre a chercher, et elle disparait avec le client
+    struct sockaddr_un address;
 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    port_channel = PORT_CHANNEL_START;
-    int bind_result;
-    printf("Recherche d'un port disponible pour le socket channel\n");
-    do {
-        address.sin_port = htons(port_channel);
-        
-        bind_result = bind(socket_channel_address, (struct sockaddr *)&address, sizeof(address));
-        
-        if (bind_result == 0) {
-            printf("Bind du socket channel reussi\n");
-            break;
-        } else {
-            port_channel++;
-        }  
+    if (mode_fenetres == 1) {
+        if ((socket_channel_address = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+            perror("socket failed");
+            exit(EXIT_FAILURE);
+        }
 
-    }while (bind_result != 0 && port_channel < 65535);
-    
-    // Ecoute sur la socket
-    if (listen(socket_channel_address, 3) < 0) {
-        perror("listen failed");
-        exit(EXIT_FAILURE);
+        unsigned long long hasard = 0;
+        if (getrandom(&hasard, sizeof(hasard), 0) != sizeof(hasard)) {
+            perror("getrandom failed");
+            exit(EXIT_FAILURE);
+        }
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        sprintf(salon_socket_name, SALON_SOCKET_NAME, (int) getpid(), hasard);
+        // le premier octet de sun_path a 0 met le nom dans le namespace abstrait
+        strcpy(address.sun_path + 1, salon_socket_name);
+        if (bind(socket_channel_address, (struct sockaddr *)&address,
+                 offsetof(struct sockaddr_un, sun_path) + 1 + strlen(salon_socket_name)) == -1) {
+            perror("bind failed");
+            exit(EXIT_FAILURE);
+        }
+
+        // Ecoute sur la socket
+        if (listen(socket_channel_address, 3) < 0) {
+            perror("listen failed");
+            exit(EXIT_FAILURE);
+        }
     }
 
 
     socket_channel_list = new_list();
+    opening_channel_list = new_list();
+    pthread_mutex_init(&mutex_pending_backfill, NULL);
+    if (mode_fenetres == 1) {
+        pthread_t accept_salon_tid;
+        if (pthread_create(&accept_salon_tid, NULL, accept_salon_thread, NULL) != 0) {
+            perror("Erreur lors de la creation du thread des salons");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_mutex_init(&mutex_onglets, NULL);
+    if (mode_fenetres == 0) {
+        ouvrir_onglet("global");
+    }
 
 
     // Gestion du signal SIGINT (Ctrl+C)
@@ -2031,6 +3887,14 @@ int main(int argc, char *argv[]) {
     pthread_mutex_init(&mutex_ended_threads, NULL);
     sem_init(&thread_end, 0, 0);
 
+    // Calcul de la table des sommes de controle
+    crc32c_init();
+    pthread_mutex_init(&mutex_tickets, NULL);
+    pthread_cond_init(&cond_tickets, NULL);
+    pthread_mutex_init(&mutex_envoi, NULL);
+    pthread_cond_init(&cond_envoi, NULL);
+    pthread_mutex_init(&mutex_mux_streams, NULL);
+
     // Initialise the shared queue of disconnected clients
     ended_threads = new_queue();
 
@@ -2075,7 +3939,9 @@ int main(int argc, char *argv[]) {
     close(dS);
 
     // fermuture port channel
-    close(socket_channel_address);
+    if (mode_fenetres == 1) {
+        close(socket_channel_address);
+    }
 
     return EXIT_SUCCESS;
 }
\ No newline at end of file
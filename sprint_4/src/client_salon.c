@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <stddef.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,8 +34,7 @@
 char pseudo[PSEUDO_LENGTH]; // pseudo de l'utilisateur
 char *array_color [11] = {"\033[32m", "\033[33m", "\033[34m", "\033[35m", "\033[36m", "\033[91m", "\033[92m", "\033[93m", "\033[94m", "\033[95m", "\033[96m"};
 char color[COLOR_LENGTH]; // couleur attribuée à l'utilisateur
-char *server_ip; // ip du serveur
-int server_port; // port du serveur
+char *socket_name; // nom de la socket Unix du client (namespace abstrait)
 char channel_nom[CHANNEL_SIZE]; // nom du salon
 
 // The thread ids of the read and write threads
@@ -127,7 +128,13 @@ void print_message(Message *output){
     strcpy(color_message, output->color);
     strcpy(msg, color_message);
     // on met la date au debut du message
-    getCurrentTime(timeString, 20);
+    // pour un message de l'historique, c'est sa date d'envoi (en hexadecimal dans to)
+    if (strcmp(output->cmd, "backfill") == 0){
+        time_t sent = (time_t) strtol(output->to, NULL, 16);
+        strftime(timeString, 20, "%d/%m %H:%M | ", localtime(&sent));
+    } else {
+        getCurrentTime(timeString, 20);
+    }
     strcat(msg, timeString);
     if (strcmp(output->cmd, "dm") == 0){
         strcat(msg, "mp de ");
@@ -205,7 +212,8 @@ void *readMessage(void *arg) {
 
         // Recoit le message des autres clients
 
-        nb_recv = recv(dS, response, BUFFER_SIZE, 0);
+        // l'historique arrive en un seul envoi, on attend chaque Message entier
+        nb_recv = recv(dS, response, BUFFER_SIZE, MSG_WAITALL);
         if (nb_recv == -1) {
             perror("Erreur lors de la reception du message");
             close(dS);
@@ -406,15 +414,14 @@ void handle_sigint(int sig) {
 
 
 int main(int argc, char *argv[]) {
-    // prend en argument le port du serveur, le pseudo et la couleur du client
+    // prend en argument le nom de la socket du client, le pseudo, la couleur du client et le nom du salon
 
     if (argc != 5) {
-        printf("Error: You must provide exactly 3 arguments.\n\
-                Usage: ./client <server_port> <pseudo> <color>\n");
+        printf("Error: You must provide exactly 4 arguments.\n\
+                Usage: ./client_salon <socket> <pseudo> <color> <channel>\n");
         exit(EXIT_FAILURE);
     }
-    server_ip = "127.0.0.1";
-    server_port = atoi(argv[1]);
+    socket_name = argv[1];
     strcpy(pseudo, argv[2]);
     strcpy(color, argv[3]);
     strcpy(channel_nom, argv[4]);
@@ -426,7 +433,8 @@ int main(int argc, char *argv[]) {
 
     printf("Debut programme client\n");
 
-    int dS = socket(PF_INET, SOCK_STREAM, 0);
+    // Le client attend les salons sur une socket Unix du namespace abstrait
+    int dS = socket(AF_UNIX, SOCK_STREAM, 0);
     if (dS == -1) {
         perror("Erreur creation socket");
         exit(EXIT_FAILURE);
@@ -434,26 +442,17 @@ int main(int argc, char *argv[]) {
 
     printf("Socket Créé\n");
 
-    struct sockaddr_in aS;
+    struct sockaddr_un aS;
 
-    aS.sin_family = AF_INET;
-    int result = inet_pton(AF_INET, server_ip, &(aS.sin_addr));
-    if (result == 0) {
-        fprintf(stderr, "Invalid address\n");
-        exit(EXIT_FAILURE);
-    } else if (result == -1) {
-        perror("inet_pton");
+    memset(&aS, 0, sizeof(aS));
+    aS.sun_family = AF_UNIX;
+    if (strlen(socket_name) + 1 >= sizeof(aS.sun_path)) {
+        fprintf(stderr, "Invalid socket name\n");
         exit(EXIT_FAILURE);
     }
-
-    /*
-        Adresse Internet
-        struct in_addr {
-            uint32_t    s_addr;   Adresse dans l'ordre d'octets réseau
-        };
-    */
-    aS.sin_port = htons(server_port);
-    socklen_t lgA = sizeof(struct sockaddr_in) ;
+    // le premier octet de sun_path a 0 : le nom est dans le namespace abstrait
+    strcpy(aS.sun_path + 1, socket_name);
+    socklen_t lgA = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(socket_name);
     if (connect(dS, (struct sockaddr *) &aS, lgA) == -1) {
         perror("Erreur connect client");
         exit(EXIT_FAILURE);
@@ -461,13 +460,24 @@ int main(int argc, char *argv[]) {
 
     printf("Socket Connecté\n");
 
+    // Le premier message dit au client de quel salon est cette fenetre
+    Message salon;
+    memset(&salon, 0, sizeof(Message));
+    strcpy(salon.cmd, "salon");
+    strcpy(salon.from, pseudo);
+    strcpy(salon.channel, channel_nom);
+    if (send(dS, &salon, sizeof(Message), 0) == -1) {
+        perror("Erreur lors de l'envoi du message");
+        exit(EXIT_FAILURE);
+    }
+
     // Gestion du signal SIGINT (Ctrl+C)
     signal(SIGINT, handle_sigint);
 
 
     system("clear"); // Efface l'écran
     printf("Bienvenue sur le salon %s !\n", channel_nom);
-    printf("Vous etes connecte au serveur %s:%s en tant que %s.\n\n", server_ip, argv[1], pseudo);
+    printf("Vous etes connecte en tant que %s.\n\n", pseudo);
 
 
     // Lancement du thread de lecture
@@ -1,3 +1,6 @@
+// The file functions (stat, fopen, pread...) use 64-bit offsets, so files bigger than 2 GiB work
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -10,19 +13,37 @@
 #include <time.h>
 #include <dirent.h>
 #include <signal.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/random.h>
+#include <netinet/tcp.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <linux/futex.h>
+#include <limits.h>
+#include <linux/memfd.h>
+#include <sys/syscall.h>
+#include <math.h>
+#include <zlib.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 // DOCUMENTATION
 // This program acts as a server to relay messages between multiple clients
 // It uses the TCP protocol
 // It takes one argument, the port to use
+// and optionally the other servers of the federation to link with (see Federation mesh)
 
 // Please read the README.md file for more information
 // including the different commands that can be used
 
 // You can use gcc to compile this program:
-// gcc -o serv server.c
+// gcc -o serv server.c -lz -lm
 
-// Use : ./serv <port>
+// Use : ./serv <port> [-f <ip>:<port>]...
 
 /**************************************************
                     Constants
@@ -42,6 +63,100 @@
 #define CHANNEL_SIZE 10
 // Buffer size for messages (this is the total size of the message)
 #define BUFFER_SIZE USERNAME_SIZE + USERNAME_SIZE + CHANNEL_SIZE + CMD_SIZE + MSG_SIZE + COLOR_SIZE
+// The directory of the files that can be downloaded
+#define FILES_DIRECTORY "../src/server_files/"
+// The directory of the partial uploads
+#define PARTIAL_DIRECTORY "../src/server_partial/"
+// The directory of the store, where each content is kept once, named by its hash
+#define BLOBS_DIRECTORY "../src/server_blobs/"
+// The size of a SHA-256 hash written in hexadecimal, with the \0
+#define SHA256_HEX_SIZE 65
+// Maximum number of chunks a file can be split into for a parallel upload
+#define MAX_CHUNKS 16
+// Number of seconds after which a parallel upload that got no chunk is abandoned
+#define CHUNKED_UPLOAD_TIMEOUT 600
+// Maximum number of tickets waiting to be used
+#define MAX_TICKETS 128
+// Number of seconds a ticket can be used after it has been issued
+#define TICKET_LIFETIME 60
+// Number of bytes of a multiplexed stream that can be sent before the other side gives credit back
+#define MUX_WINDOW 65536
+// Maximum number of multiplexed streams a client can have open at the same time
+// Each one takes MUX_WINDOW bytes and three threads on the server
+#define MUX_MAX_STREAMS 16
+// Number of bytes not yet sent in the main connection of a client above which a send waits
+// (TCP_NOTSENT_LOWAT), so the chat messages are never queued behind a lot of file data
+#define MUX_QUEUE_LIMIT 16384
+// Maximum size of a block of a compressed transfer, before compression
+#define COMPRESS_BLOCK 65536
+// Number of bytes of a file read to guess if it is worth compressing
+#define COMPRESS_SAMPLE 4096
+// Entropy (in bits per byte) above which a file is considered as already compressed
+#define COMPRESS_ENTROPY 7.0
+// Maximum number of bytes of files kept in memory for the downloads
+#define CACHE_SIZE (64 * 1024 * 1024)
+// Files bigger than this are never kept in memory
+#define CACHE_FILE_MAX (8 * 1024 * 1024)
+// The directory of the history of the channels
+#define HISTORY_DIRECTORY "../src/server_history/"
+// Maximum size of a segment of the history of a channel
+#define HISTORY_SEGMENT_SIZE (4 * 1024 * 1024)
+// Maximum number of messages waiting to be written in the history
+#define HISTORY_PENDING_MAX 4096
+// Maximum number of messages of the history sent for one request
+#define HISTORY_REPLY_MAX 100
+// Number of the last messages of each channel kept in memory, sent to a client who joins the channel
+#define HISTORY_RING_SIZE 50
+// Number of lists of words in the search index of a channel
+#define SEARCH_BUCKETS 4096
+// Maximum length of a word in the search index, longer words are cut
+#define SEARCH_WORD_SIZE 24
+// Maximum number of words in a search
+#define SEARCH_QUERY_WORDS 8
+// Number of lists of the channel actors, chosen by the hash of the channel name
+#define ACTOR_BUCKETS 64
+// Maximum number of threads that run the channel actors
+#define CHANNEL_WORKERS_MAX 16
+// Maximum number of messages of the channels waiting to be sent to a client, a client who lets
+// more of them wait is disconnected
+#define OUTBOX_MAX 1024
+// Maximum number of messages of the channels sent to a client with a single write
+#define OUTBOX_BATCH 16
+// The directory of the mailboxes, where the direct messages sent to disconnected clients wait
+#define MAILBOX_DIRECTORY "../src/server_mailbox/"
+// Maximum number of messages waiting in the mailbox of a client
+#define MAILBOX_MAX 100
+// The configuration file of the server, read again when the server receives SIGHUP
+#define CONFIG_FILE "../src/server.conf"
+// Maximum number of links with the other servers of the federation
+#define FEDERATION_LINKS_MAX 16
+// Size of the identifier of a server of the federation, 16 hexadecimal digits
+#define NODE_ID_SIZE 17
+// Number of seconds to wait before connecting again to a server of the federation
+#define FEDERATION_RETRY 2
+// Number of frames in the shared memory ring of a server
+#define FEDERATION_RING_SLOTS 1024
+// Number of seconds a ring can stay full before the link with its server is cut,
+// and a frame can stay taken but not written before the reader skips it
+#define FEDERATION_RING_WAIT 5
+// The first bytes of a shared memory ring
+#define FEDERATION_RING_MAGIC 0x46415252
+// Maximum size of the secret shared by the servers of the federation, with the '\0'
+#define FEDERATION_SECRET_SIZE 128
+// Number of seconds a server has to send its "hello" frame
+#define FEDERATION_HELLO_TIMEOUT 5
+// Maximum number of buffers of an upload waiting to be written on the disk
+#define WRITER_BUFFERS 4
+// Size of these buffers, the file is written by blocks of this size
+#define WRITER_BUFFER_SIZE (1024 * 1024)
+// Alignment of these buffers in memory
+#define WRITER_ALIGN 4096
+// Number of buffers shared by all the uploads, allocated when the server starts
+#define WRITER_POOL_BUFFERS 32
+// Number of threads that write the buffers of all the uploads on the disk
+#define WRITER_THREADS 4
+// Number of seconds an upload waits for a free buffer when it starts, before it is refused
+#define WRITER_WAIT 5
 
 
 /****************************************************
@@ -254,8 +369,13 @@ pthread_mutex_t mutex_tab_username;
 // Array of Lists for the channels that each client is in
 List * tab_channel[MAX_CLIENT];
 
-// Mutex to protect the tab_channel array
-pthread_mutex_t mutex_tab_channel;
+// The main connection of each client, 0 once he is disconnecting: he can join a channel
+// only while it is set, so the actors don't need the tab_client array (see channel_leave_all)
+int tab_channel_dS[MAX_CLIENT];
+
+// Mutexes to protect the tab_channel and tab_channel_dS arrays, one for each client
+// The List of a client is changed by the actors of the channels (see Channel actors)
+pthread_mutex_t mutex_tab_channel[MAX_CLIENT];
 
 // A semaphore to indicate the number of free spots in the tab_client array
 sem_t free_spot;
@@ -299,6 +419,226 @@ Queue * ended_threads;
 pthread_mutex_t mutex_ended_threads;
 
 
+/**************************************
+    Shared variables for chunked uploads
+***************************************/
+
+// A file uploaded in parallel is split into chunks
+// each chunk is sent on its own connection and handled by its own thread
+// This struct keeps track of the chunks of a file that have been received and verified
+// An upload is known by the SHA-256 the client declares for the file and by its name,
+// so two clients sending different contents under the same name never share a partial file
+typedef struct ChunkedUpload ChunkedUpload;
+struct ChunkedUpload {
+    // The SHA-256 of the file, checked once every chunk is received
+    char hash[SHA256_HEX_SIZE];
+    // The name of the file
+    char name[NAME_MAX + 1];
+    // The total size of the file
+    long size;
+    // The partial file, every chunk is written in it at its offset
+    char path[sizeof(PARTIAL_DIRECTORY) + SHA256_HEX_SIZE + NAME_MAX + 10];
+    int fd;
+    // The offsets of the chunks already received
+    long done_offsets[MAX_CHUNKS];
+    // The number of chunks already received
+    int nb_done;
+    // The number of bytes already received
+    long bytes_done;
+    // The number of threads receiving a chunk of the file
+    int nb_writers;
+    // 1 once the file is complete, while it is put in the store
+    int storing;
+    // The last time a chunk started or ended, to abandon the uploads of the clients who gave up
+    time_t last_activity;
+    ChunkedUpload * next;
+};
+
+// The list of the chunked uploads in progress
+ChunkedUpload * chunked_uploads = NULL;
+
+// Mutex to protect the chunked_uploads list
+pthread_mutex_t mutex_chunked_uploads;
+
+
+/**************************************
+   Shared variables for the main connections
+***************************************/
+
+// Several threads can send on the main connection of a client: his own thread,
+// the threads of the other clients (send_to_all, dm) and the threads of his multiplexed streams
+// A frame must be sent entirely before another one starts, and the chat messages go before the file data
+// The channel actors never send themselves, a client who reads slowly would stop all the channels
+// of their worker: they put the messages in the outbox of the client, and the thread of his sender
+// sends them (see sender_thread)
+typedef struct Sender Sender;
+struct Sender {
+    // The mutex to protect the fields below
+    pthread_mutex_t mutex;
+    // The condition to wait until the connection is free
+    pthread_cond_t cond;
+    // 1 while a thread is sending a frame on the connection
+    int busy;
+    // The number of chat messages waiting to be sent
+    int nb_chat_waiting;
+    // The messages of the channels waiting to be sent, OUTBOX_MAX at most, from outbox_first,
+    // and the main connection each of them is for
+    struct Message * outbox;
+    int * outbox_dS;
+    int outbox_first;
+    int nb_outbox;
+    // The connection on which the thread of the sender is sending messages of the outbox, 0 if none
+    int outbox_sending;
+    // The connection that was shut down because its outbox was full, 0 if none
+    int outbox_refused;
+    // The condition to wake up the thread of the sender, and to wait until it has sent its messages
+    pthread_cond_t cond_outbox;
+};
+
+// Array of the senders, one for each spot of the tab_client array
+Sender tab_sender[MAX_CLIENT];
+
+
+/**************************************
+       Shared variables for tickets
+***************************************/
+
+// Before opening a connection on the upload, download or channel socket,
+// a client asks for a ticket on his main connection with the command "ticket"
+// The first thing he sends on the new connection is this ticket,
+// this is how we know which client the connection belongs to
+// A ticket can only be used once, and only for the socket it was asked for
+typedef struct Ticket Ticket;
+struct Ticket {
+    // The value of the ticket, 0 if this spot is free
+    uint64_t value;
+    // The indice of the client who asked for the ticket
+    int client_indice;
+    // The socket the ticket is for: "upload", "download" or "salon"
+    char kind[CMD_SIZE];
+    // The time after which the ticket can no longer be used
+    time_t expiry;
+};
+
+// Array of the tickets waiting to be used
+Ticket tab_ticket[MAX_TICKETS];
+
+// Mutex to protect the tab_ticket array
+pthread_mutex_t mutex_tab_ticket;
+
+
+/**************************************
+  Shared variables for the transfer scheduler
+***************************************/
+
+// Every upload and download goes through the scheduler, so that all the transfers together
+// never use more than the bandwidth of the configuration (bytes per second, 0 for no limit).
+// The chat doesn't go through the scheduler: with a limit a bit below the bandwidth of the
+// network, the chat messages never wait behind the data of the files.
+// When the transfers want more than the limit, the bandwidth is shared fairly:
+// first between the clients, then between the transfers of a same client
+// (see sched_charge)
+typedef struct Transfer Transfer;
+struct Transfer {
+    // The indice of the client the transfer belongs to
+    int client_indice;
+    // The number of bytes charged to the transfer (see sched_start)
+    long served;
+    // The number of bytes the transfer waits for, 0 if it doesn't wait
+    long want;
+    Transfer * next;
+};
+
+// The list of the transfers in progress
+Transfer * sched_transfers = NULL;
+
+// The number of bytes charged to each client, and his number of transfers in progress
+long sched_client_served[MAX_CLIENT];
+int sched_client_transfers[MAX_CLIENT];
+
+// The limit in bytes per second, 0 for no limit
+long sched_rate = 0;
+// The bytes that can be sent right now, they come back at sched_rate bytes per second
+// up to sched_burst bytes
+double sched_tokens = 0;
+long sched_burst = 0;
+// The last time the tokens came back
+struct timespec sched_last;
+
+// Set by the SIGHUP handler, the configuration is read again by the next transfer or the presence thread
+volatile sig_atomic_t sched_reload = 0;
+
+// Mutex and condition to protect the scheduler and wake up the waiting transfers
+pthread_mutex_t mutex_sched;
+pthread_cond_t cond_sched;
+
+
+/**************************************
+    Shared variables for the federation
+***************************************/
+
+// Several servers can be linked to form a mesh (see Federation mesh)
+// A link is a connection with another server, made on the port of that server + 4
+// The servers on the same machine also write the messages of the channels in the shared
+// memory ring of each other (see Federation links)
+typedef struct FederationRing FederationRing;
+typedef struct FederationLink FederationLink;
+struct FederationLink {
+    // The socket of the link, 0 if this spot is free
+    int socket;
+    // The identifier of the server at the other end
+    char node[NODE_ID_SIZE];
+    // The channels in which the server at the other end has members
+    List * channels;
+    // The shared memory ring of the server at the other end, NULL if it is on another machine
+    FederationRing * ring;
+    // 1 once the server at the other end has sent "ready": it knows this link, so the frames can be sent
+    int ready;
+    // The mutex to protect the fields above and the sends on the socket
+    pthread_mutex_t mutex;
+};
+
+// Array of the links with the other servers
+FederationLink federation_links[FEDERATION_LINKS_MAX];
+
+// Mutex locked while a link is put in or removed from the federation_links array
+pthread_mutex_t mutex_federation_links;
+
+// The identifier of this server, chosen at random when it starts
+char node_id[NODE_ID_SIZE];
+
+// The socket that accepts the links of the other servers
+int federation_socket;
+
+// The shared memory ring where the other servers of the machine write, NULL if there is none
+FederationRing * federation_ring = NULL;
+
+// The file of the ring (memfd), the other servers open it with /proc/<pid>/fd/<fd>
+int federation_ring_fd = -1;
+
+// The boot_id of the machine, to know if another server is on the same machine
+char federation_boot_id[40];
+
+// The secret that the other servers must send in their "hello" frame, read in the configuration file
+// Without a secret, only the servers of this machine can link with this server
+char federation_secret[FEDERATION_SECRET_SIZE] = "";
+
+// The users connected to the other servers
+typedef struct RemoteUser RemoteUser;
+struct RemoteUser {
+    char username[USERNAME_SIZE];
+    // The indice of the link of his server in the federation_links array
+    int link;
+    RemoteUser * next;
+};
+
+// The list of the users connected to the other servers
+RemoteUser * remote_users = NULL;
+
+// Mutex to protect the remote_users list
+pthread_mutex_t mutex_remote_users;
+
+
 
 /**************************************
            Utility functions
@@ -391,266 +731,5738 @@ int get_free_spot() {
     return -1;
 }
 
-// Struct for the messages
-typedef struct Message Message;
-struct Message {
-    // The command
-    // For possible commands, please read the documentation
-    char cmd[CMD_SIZE];
-    // The username of the client who will receive the message
-    // It can be Server if the message is sent from the server
-    char from[USERNAME_SIZE];
-    // The username of the client who sent the message
-    // It can be Server if the message is sent to the server
-    char to[USERNAME_SIZE];
-    // The channel name
-    char channel[CHANNEL_SIZE];
-    // The message
-    char message[MSG_SIZE];
-    // The color of the message
-    char color[COLOR_SIZE];
-};
+// A function that will receive exactly length bytes from the socket
+// A single recv can return less than what was asked for (TCP is a stream),
+// so we loop until everything has arrived
+// It returns the number of bytes received, which is only smaller than length
+// if the client closed the connection, or -1 if there was an error
+
+ssize_t recv_full(int socket, void * data, size_t length) {
+    size_t total = 0;
+    ssize_t nb_recv;
+    while (total < length) {
+        nb_recv = recv(socket, (char *) data + total, length - total, 0);
+        if (nb_recv == -1) {
+            return -1;
+        }
+        if (nb_recv == 0) {
+            break;
+        }
+        total = total + nb_recv;
+    }
+    return total;
+}
 
+// A function that will send exactly length bytes on the socket
+// It returns the number of bytes sent, or -1 if there was an error
+// MSG_NOSIGNAL is used so a client that disconnects doesn't kill the server with SIGPIPE
 
-// A function that will take as an argument the index of the client
-// and a pointer to a Message struct, and will send the message to all the clients
-// except the client who sent the message
+ssize_t send_full(int socket, const void * data, size_t length) {
+    size_t total = 0;
+    ssize_t nb_send;
+    while (total < length) {
+        nb_send = send(socket, (const char *) data + total, length - total, MSG_NOSIGNAL);
+        if (nb_send == -1) {
+            return -1;
+        }
+        total = total + nb_send;
+    }
+    return total;
+}
 
-void send_to_all(int client_indice, Message * buffer) {
+// The numbers of the transfer protocol (sizes, offsets, lengths, answers) are always sent
+// on 8 bytes in big endian, and the checksums and block headers on 4 bytes in big endian
+// This way files bigger than 4 GiB work, and a client and a server that don't have
+// the same architecture understand each other
+
+// A function that will send count numbers (at most 4) on 64 bits
+// It returns 0 if they were sent, -1 if there was an error
+
+int send_int64(int socket, const long * values, int count) {
+    uint64_t data[4];
     int i = 0;
-    int nb_send;
-    // If the client_indice is -1, it means that the message is sent by the server
-    if (client_indice != -1){
-        // Lock the mutex
-        pthread_mutex_lock(&mutex_tab_username);
-        strcpy(buffer->from, tab_username[client_indice]);
-        // Unlock the mutex
-        pthread_mutex_unlock(&mutex_tab_username);
+    while (i < count) {
+        data[i] = htobe64((uint64_t) values[i]);
+        i++;
     }
-    // Lock the mutex
-    pthread_mutex_lock(&mutex_tab_client);
-    pthread_mutex_lock(&mutex_tab_channel);
+    if (send_full(socket, data, count * sizeof(uint64_t)) == -1) {
+        return -1;
+    }
+    return 0;
+}
 
-    printf("Channel sent to : %s by client : %d \n", buffer->channel, client_indice + 1);
-    printf("Message sent : %s by client : %d \n\n", buffer->message, client_indice + 1);
+// A function that will receive count numbers (at most 4) on 64 bits
+// It returns 1 if they were received, 0 if the client disconnected or there was an error
 
-    // If the channel is empty, we send to global
-    if (strcmp(buffer->channel, "") == 0) {
-        strcpy(buffer->channel, "global");
-        // This shouldn't happen, so we print a warning
-        printf("Warning: client has forgotten channel\n");
+int recv_int64(int socket, long * values, int count) {
+    uint64_t data[4];
+    int i = 0;
+    if (recv_full(socket, data, count * sizeof(uint64_t)) < (ssize_t) (count * sizeof(uint64_t))) {
+        return 0;
     }
-
-    while( i < MAX_CLIENT){
-        // We can't send the message to ourselves
-        // also, if a client disconnects, we don't send the message to him
-        if (tab_client[i] != 0 && i != client_indice) {
-            // If the client is in the same channel as the channel from which the message was sent
-            if(is_in_list(tab_channel[i], buffer->channel) == 1){
-                nb_send = send(tab_client[i], buffer, BUFFER_SIZE, 0);
-                if (nb_send == -1) {
-                    perror("Erreur lors de l'envoi");
-                    printf("L'erreur est dans le thread du client: %d\n", client_indice + 1);
-                    exit(EXIT_FAILURE);
-                }
-                // If ever a client disconnect while we are sending the messages
-                if (nb_send == 0) {
-                    printf("Le client: %d s'est deconnecte, donc le message ne s'est pas envoye a lui\n", i + 1);
-                    // We don't break here because we want to send the message to the other clients
-                }
-            }
-        }
-        i = i + 1;
+    while (i < count) {
+        values[i] = (long) (int64_t) be64toh(data[i]);
+        i++;
     }
-    // Unlock the mutex
-    pthread_mutex_unlock(&mutex_tab_client);
-    pthread_mutex_unlock(&mutex_tab_channel);
+    return 1;
 }
 
-// A function that will handle the SIGINT signal, it will tell the clients that the server is closing
-// and it will close the sockets, destroy the mutexes and semaphores, and free the memory
+// A function that will send count numbers (at most 4) on 32 bits
+// It returns 0 if they were sent, -1 if there was an error
 
-void handle_interrupt(int signum){
-    printf("\nLe serveur va fermer\n");
-    // We send a message to all the clients to tell them that the server is closing
-    Message msg_buffer;
-    Message * buffer = &msg_buffer;
-    strcpy(buffer->cmd, "finserv");
-    strcpy(buffer->from, "Serveur");
-    strcpy(buffer->to, "all");
-    strcpy(buffer->channel, "global");
-    strcpy(buffer->message, "Le serveur va fermer. Au revoir!");
-    send_to_all(-1, buffer);
-    // We close the sockets
-    close(dS);
-    close(upload_socket);
-    close(download_socket);
-    close(channel_socket);
-    // We close the sockets of all of the clients
+int send_uint32(int socket, const uint32_t * values, int count) {
+    uint32_t data[4];
     int i = 0;
-    // Lock the mutex
-    pthread_mutex_lock(&mutex_tab_client_connecting);
-    pthread_mutex_lock(&mutex_Threads_id);
-    while (i < MAX_CLIENT) {
-        if (tab_client_connecting[i] != 0) {
-            pthread_cancel(Threads_id[i]);
-            close(tab_client_connecting[i]);
-        }
-        i = i + 1;
-    }  
-    // Unlock the mutex
-    pthread_mutex_unlock(&mutex_tab_client_connecting);
-    pthread_mutex_unlock(&mutex_Threads_id);
-
-    printf("Socket clients fermes\n");
+    while (i < count) {
+        data[i] = htonl(values[i]);
+        i++;
+    }
+    if (send_full(socket, data, count * sizeof(uint32_t)) == -1) {
+        return -1;
+    }
+    return 0;
+}
 
-    // Destroy all the semaphores and mutexes
-    sem_destroy(&free_spot);
-    sem_destroy(&thread_end);
-    pthread_mutex_destroy(&mutex_tab_client_connecting);
-    pthread_mutex_destroy(&mutex_tab_client);
-    pthread_mutex_destroy(&mutex_tab_username);
-    pthread_mutex_destroy(&mutex_upload_socket);
-    pthread_mutex_destroy(&mutex_download_socket);
-    pthread_mutex_destroy(&mutex_Threads_id);
-    pthread_mutex_destroy(&mutex_ended_threads);
-
-    printf("Nettoyage termine\n");
-    printf("Derniers reglages...\n");
+// A function that will receive count numbers (at most 4) on 32 bits
+// It returns 1 if they were received, 0 if the client disconnected or there was an error
 
-    // Wait one second
-    sleep(1);
-    // We free the memory
-    free(ended_threads);
-    printf("Fermeture du serveur terminee avec success\n");
-    // We exit the program
-    exit(0);
+int recv_uint32(int socket, uint32_t * values, int count) {
+    uint32_t data[4];
+    int i = 0;
+    if (recv_full(socket, data, count * sizeof(uint32_t)) < (ssize_t) (count * sizeof(uint32_t))) {
+        return 0;
+    }
+    while (i < count) {
+        values[i] = ntohl(data[i]);
+        i++;
+    }
+    return 1;
 }
 
 
-/*********************************************
-       Upload and Download Thread Functions
-**********************************************/
-
+/**************************************
+           Checksum functions
+***************************************/
 
-// A function for a thread that will accept a connection using the socket 
-// for uploads and will create and receive the file and write in the file
+// We use a CRC32C (Castagnoli) checksum to verify each chunk of a transfer
+// and every file sent on a single connection
+// The table is computed once at the start of the server
+// If the processor has SSE4.2, its crc32 instruction is used instead of the table
 
-void * upload_file_thread(void * arg){
-    int nb_recv; // The number of bytes received
-    Message msg_buffer; // The buffer for the messages
-    Message * buffer = &msg_buffer; // A pointer to the buffer
-    int dS_thread_upload; // The socket for the upload for the accept
-    int continue_thread = 1; // A variable to know if we continue the thread or not
-    long file_size; // The size of the file
-    char path[MSG_SIZE]; // The path of the file
-    FILE * file; // The file
+uint32_t crc32c_table[256];
 
-    pthread_t ThreadId = pthread_self(); // The id of the thread, will be used to cleanup thread once finished
+// 1 if the processor has the crc32 instruction
+int crc32c_hardware = 0;
 
-    // Initialise file_addr and length
-    struct sockaddr_in file_addr;
-    socklen_t length_file_addr;
+// A function that will fill the crc32c_table
 
-    // We accept the connection
-    length_file_addr = sizeof(struct sockaddr_in);
-    dS_thread_upload = accept(upload_socket, (struct sockaddr*) &file_addr,&length_file_addr) ;
-    if (dS_thread_upload == -1) {
-        perror("Erreur lors de l'accept");
-        exit(EXIT_FAILURE);
+void crc32c_init() {
+    uint32_t crc;
+    int i = 0;
+    int j;
+#if defined(__x86_64__)
+    crc32c_hardware = __builtin_cpu_supports("sse4.2") != 0;
+#endif
+    while (i < 256) {
+        crc = i;
+        j = 0;
+        while (j < 8) {
+            if (crc & 1) {
+                crc = (crc >> 1) ^ 0x82F63B78;
+            }
+            else {
+                crc = crc >> 1;
+            }
+            j = j + 1;
+        }
+        crc32c_table[i] = crc;
+        i = i + 1;
     }
+}
 
-    // We receive the name of the file
-    nb_recv = recv(dS_thread_upload, buffer, BUFFER_SIZE, 0);
-    if (nb_recv == -1) {
-        perror("Erreur lors de la reception upload client");
-        exit(EXIT_FAILURE);
+// A function that will add length bytes of data to a checksum
+// Start with crc = 0, and give back the result to continue the checksum
+
+#if defined(__x86_64__)
+// The same checksum with the crc32 instruction, 8 bytes at a time
+// It is only called if crc32c_hardware is 1
+
+__attribute__((target("sse4.2")))
+uint32_t crc32c_update_hardware(uint32_t crc, const void * data, size_t length) {
+    const unsigned char * bytes = data;
+    uint64_t crc64 = (uint32_t) ~crc;
+    uint64_t word;
+    while (length >= 8) {
+        memcpy(&word, bytes, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        bytes = bytes + 8;
+        length = length - 8;
     }
-    // If ever a client disconnect while we are receiving the messages
-    if (nb_recv == 0) {
-        printf("Le client s'est deconnecte dans le file upload\n");
-        continue_thread = 0;
+    crc = (uint32_t) crc64;
+    while (length > 0) {
+        crc = _mm_crc32_u8(crc, *bytes);
+        bytes = bytes + 1;
+        length = length - 1;
     }
+    return ~crc;
+}
+#endif
 
-    // File creation
-    if (continue_thread == 1){
-        printf("Le nom du fichier est: %s\n", buffer->message);
-
-        // We create the file
-        strcpy(path, "../src/server_files/");
-        strcat(path, buffer->message);
-        file = fopen(path, "w");
-        if (file == NULL) {
-            perror("Erreur lors de la creation du fichier");
-            continue_thread = 0;
-            exit(EXIT_FAILURE);
-        }
+uint32_t crc32c_update(uint32_t crc, const void * data, size_t length) {
+    const unsigned char * bytes = data;
+#if defined(__x86_64__)
+    if (crc32c_hardware == 1) {
+        return crc32c_update_hardware(crc, data, length);
     }
+#endif
+    crc = ~crc;
+    while (length > 0) {
+        crc = crc32c_table[(crc ^ *bytes) & 0xFF] ^ (crc >> 8);
+        bytes = bytes + 1;
+        length = length - 1;
+    }
+    return ~crc;
+}
 
-    // We receive the size of the file
-    if (continue_thread == 1){
-        printf("Le fichier %s a ete cree\n", buffer->message);
-
-        // We receive the size of the file
-        nb_recv = recv(dS_thread_upload, &file_size, sizeof(long), 0);
-        if (nb_recv == -1) {
-            perror("Erreur lors de la reception upload client");
-            exit(EXIT_FAILURE);
+// A function that will compute the checksum of the length first bytes of the file fd
+// It is used to continue the checksum of a transfer that resumes in the middle of a file
+// It returns 1 if the bytes could be read, 0 otherwise
+
+int crc32c_file(int fd, long length, uint32_t * crc) {
+    char data[65536];
+    long offset = 0;
+    ssize_t nb_read;
+    *crc = 0;
+    while (offset < length) {
+        nb_read = sizeof(data);
+        if (length - offset < nb_read) {
+            nb_read = length - offset;
         }
-        // If ever a client disconnect while we are receiving the messages
-        if (nb_recv == 0) {
-            printf("Le client s'est deconnecte dans le file upload\n");
-            continue_thread = 0;
+        nb_read = pread(fd, data, nb_read, offset);
+        if (nb_read <= 0) {
+            return 0;
         }
+        *crc = crc32c_update(*crc, data, nb_read);
+        offset = offset + nb_read;
     }
+    return 1;
+}
 
-    // Packet for the file data
-    char packet[BUFFER_SIZE];
-    int nb_recv_total = 0;
-    
-    // We receive the data in the file
-    if (continue_thread == 1){
-        while(1){
-            nb_recv = recv(dS_thread_upload, packet, BUFFER_SIZE, 0);
-            if (nb_recv == -1) {
-                perror("Erreur lors de la reception");
-                exit(EXIT_FAILURE);
-            }
-            // If ever a client disconnect while we are receiving the messages
-            // or if he has sent everything and closed the socket
-            if (nb_recv == 0) {
-                printf("Socket ferme : Le client a fini de upload\n");
-                break;
-            }
-            nb_recv_total = nb_recv_total + nb_recv;
 
-            
-            // If the nb_recv_total greater than the file_size, we stop the loop
-            if (nb_recv_total >= file_size + 1000) {
-                break;
-            }
-                    
-            // We write in the file
-            fwrite(packet, sizeof(char), nb_recv, file);
+/**************************************
+         Compression functions
+***************************************/
+
+// A file can be sent compressed with zlib (deflate), the receiver tells if he accepts it
+// The data is then cut into blocks of at most COMPRESS_BLOCK bytes, each compressed on its own,
+// and each block is sent after two uint32_t: the length of its data, then the length of what follows
+// A block that doesn't get smaller is sent as it is (the two lengths are equal),
+// so an incompressible part of a file only costs the 8 bytes of the header
+// The checksums are always computed on the data, not on what is sent
+
+// A function that will guess if the length bytes of the file fd at offset are worth compressing
+// If data is not NULL, it is the content of the file in memory and fd is not used
+// It computes the entropy of a sample taken in the middle, away from the headers of the file: the bytes of an already compressed file
+// (jpg, png, gif, zip...) look random, they carry about 8 bits of information per byte
+// It returns 1 if the sample has less than COMPRESS_ENTROPY bits per byte, 0 otherwise
+
+int is_compressible(int fd, const char * data, long offset, long length) {
+    unsigned char sample[COMPRESS_SAMPLE];
+    long count[256] = {0};
+    double entropy = 0;
+    double p;
+    ssize_t nb_read;
+    int i;
+
+    if (length > COMPRESS_SAMPLE) {
+        offset = offset + (length - COMPRESS_SAMPLE) / 2;
+    }
+    if (data != NULL) {
+        nb_read = length < COMPRESS_SAMPLE ? length : COMPRESS_SAMPLE;
+        memcpy(sample, data + offset, nb_read);
+    }
+    else {
+        nb_read = pread(fd, sample, COMPRESS_SAMPLE, offset);
+    }
+    if (nb_read <= 0) {
+        return 0;
+    }
+    i = 0;
+    while (i < nb_read) {
+        count[sample[i]] = count[sample[i]] + 1;
+        i = i + 1;
+    }
+    i = 0;
+    while (i < 256) {
+        if (count[i] > 0) {
+            p = (double) count[i] / nb_read;
+            entropy = entropy - p * log2(p);
         }
-        // We close the file
-        fclose(file);
-        printf("Le fichier a ete ferme\n");
-        printf("nb_recv_total: %d\n", nb_recv_total);
-        printf("La taille du fichier est: %ld\n", file_size);
+        i = i + 1;
     }
+    return entropy < COMPRESS_ENTROPY;
+}
 
-    // We close the socket
-    close(dS_thread_upload);
-    
-    // We put the ThreadId in the queue
-    // Lock the mutex
-    pthread_mutex_lock(&mutex_ended_threads);
-    enqueue(ended_threads, ThreadId);
-    // Unlock the mutex
-    pthread_mutex_unlock(&mutex_ended_threads);
+// A function that will send length bytes of data (at most COMPRESS_BLOCK) as one block
+// It returns the number of bytes sent on the socket, -1 if the client disconnected
 
-    // We increment the semaphore
+ssize_t send_block(int socket, const char * data, uint32_t length) {
+    char compressed[COMPRESS_BLOCK];
+    uint32_t header[2];
+    uLongf compressed_length = length;
+
+    header[0] = length;
+    // If the compressed block doesn't fit in length bytes, we send the data as it is
+    if (compress2((Bytef *) compressed, &compressed_length, (const Bytef *) data, length, Z_BEST_SPEED) == Z_OK
+        && compressed_length < length) {
+        header[1] = compressed_length;
+        data = compressed;
+    }
+    else {
+        header[1] = length;
+    }
+    if (send_uint32(socket, header, 2) == -1 || send_full(socket, data, header[1]) == -1) {
+        return -1;
+    }
+    return sizeof(header) + header[1];
+}
+
+// A function that will receive one block and put its data in data (COMPRESS_BLOCK bytes)
+// wire is increased by the number of bytes received on the socket
+// It returns the number of bytes of data, 0 if the client disconnected, -1 if the block is invalid
+
+ssize_t recv_block(int socket, char * data, long * wire) {
+    char compressed[COMPRESS_BLOCK];
+    uint32_t header[2];
+    uLongf length;
+
+    if (recv_uint32(socket, header, 2) == 0) {
+        return 0;
+    }
+    if (header[0] == 0 || header[0] > COMPRESS_BLOCK || header[1] > header[0]) {
+        return -1;
+    }
+    // A block that has the same length is not compressed
+    if (header[1] == header[0]) {
+        if (recv_full(socket, data, header[0]) < (ssize_t) header[0]) {
+            return 0;
+        }
+    }
+    else {
+        if (recv_full(socket, compressed, header[1]) < (ssize_t) header[1]) {
+            return 0;
+        }
+        length = header[0];
+        if (uncompress((Bytef *) data, &length, (const Bytef *) compressed, header[1]) != Z_OK || length != header[0]) {
+            return -1;
+        }
+    }
+    *wire = *wire + sizeof(header) + header[1];
+    return header[0];
+}
+
+
+/**************************************
+             Hash functions
+***************************************/
+
+// We use SHA-256 to name the files of the store by their content
+// Two files with the same content have the same hash, so they are only stored once
+
+typedef struct Sha256 Sha256;
+struct Sha256 {
+    // The state of the hash
+    uint32_t state[8];
+    // The number of bytes hashed
+    uint64_t length;
+    // The bytes waiting for a full block of 64 bytes
+    unsigned char block[64];
+    int block_length;
+};
+
+const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// A function that will add a block of 64 bytes to the hash
+
+void sha256_transform(Sha256 * ctx, const unsigned char * block) {
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = ((uint32_t) block[i * 4] << 24) | ((uint32_t) block[i * 4 + 1] << 16)
+             | ((uint32_t) block[i * 4 + 2] << 8) | (uint32_t) block[i * 4 + 3];
+    }
+    for (i = 16; i < 64; i++) {
+        w[i] = (ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10)) + w[i - 7]
+             + (ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3)) + w[i - 16];
+    }
+    a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3];
+    e = ctx->state[4]; f = ctx->state[5]; g = ctx->state[6]; h = ctx->state[7];
+    for (i = 0; i < 64; i++) {
+        t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+// A function that will start a new hash
+
+void sha256_init(Sha256 * ctx) {
+    ctx->state[0] = 0x6a09e667; ctx->state[1] = 0xbb67ae85; ctx->state[2] = 0x3c6ef372; ctx->state[3] = 0xa54ff53a;
+    ctx->state[4] = 0x510e527f; ctx->state[5] = 0x9b05688c; ctx->state[6] = 0x1f83d9ab; ctx->state[7] = 0x5be0cd19;
+    ctx->length = 0;
+    ctx->block_length = 0;
+}
+
+// A function that will add length bytes of data to the hash
+
+void sha256_update(Sha256 * ctx, const void * data, size_t length) {
+    const unsigned char * bytes = data;
+    size_t nb_copy;
+    ctx->length = ctx->length + length;
+    while (length > 0) {
+        // The full blocks are hashed directly from the data
+        if (ctx->block_length == 0 && length >= 64) {
+            sha256_transform(ctx, bytes);
+            bytes = bytes + 64;
+            length = length - 64;
+            continue;
+        }
+        nb_copy = 64 - ctx->block_length;
+        if (nb_copy > length) {
+            nb_copy = length;
+        }
+        memcpy(ctx->block + ctx->block_length, bytes, nb_copy);
+        ctx->block_length = ctx->block_length + nb_copy;
+        bytes = bytes + nb_copy;
+        length = length - nb_copy;
+        if (ctx->block_length == 64) {
+            sha256_transform(ctx, ctx->block);
+            ctx->block_length = 0;
+        }
+    }
+}
+
+// A function that will end the hash and write it in hexadecimal in hex (SHA256_HEX_SIZE bytes)
+
+void sha256_final(Sha256 * ctx, char * hex) {
+    uint64_t bits = ctx->length * 8;
+    unsigned char padding = 0x80;
+    unsigned char length_bytes[8];
+    int i;
+
+    // The hash ends with a 1 bit, zeros, then the length in bits on 8 bytes
+    sha256_update(ctx, &padding, 1);
+    padding = 0;
+    while (ctx->block_length != 56) {
+        sha256_update(ctx, &padding, 1);
+    }
+    for (i = 0; i < 8; i++) {
+        length_bytes[i] = (unsigned char) (bits >> (56 - 8 * i));
+    }
+    sha256_update(ctx, length_bytes, 8);
+    for (i = 0; i < 8; i++) {
+        sprintf(hex + i * 8, "%08x", ctx->state[i]);
+    }
+}
+
+// A function that will compute the hash of the content of the file fd
+// It returns 0 if the file couldn't be read
+
+int sha256_file(int fd, char * hex) {
+    Sha256 ctx;
+    char data[65536];
+    ssize_t nb_read;
+    off_t offset = 0;
+
+    sha256_init(&ctx);
+    while ((nb_read = pread(fd, data, sizeof(data), offset)) > 0) {
+        sha256_update(&ctx, data, nb_read);
+        offset = offset + nb_read;
+    }
+    if (nb_read == -1) {
+        return 0;
+    }
+    sha256_final(&ctx, hex);
+    return 1;
+}
+
+/**************************************
+             Content store
+***************************************/
+
+// Every file of server_files is a hard link to a file of server_blobs named by the hash
+// of its content, so two files with the same content only take the disk space once
+// A file of server_blobs is only kept while a name of server_files links to it:
+// its number of links is then at least 2
+// The files of server_files must never be modified in place, a new content is always
+// written elsewhere then renamed in server_files (this is what the uploads do)
+
+// A function that will make FILES_DIRECTORY/name a link to the content hash
+// The name is replaced atomically, a client never sees a missing file
+// It returns 1 if the link was made, 0 otherwise
+
+int blob_link(const char * hash, const char * name) {
+    char path_blob[sizeof(BLOBS_DIRECTORY) + SHA256_HEX_SIZE];
+    char path_file[sizeof(FILES_DIRECTORY) + NAME_MAX + 1];
+    char path_link[sizeof(PARTIAL_DIRECTORY) + NAME_MAX + 10];
+    struct stat stat_blob;
+    struct stat stat_file;
+
+    sprintf(path_blob, "%s%s", BLOBS_DIRECTORY, hash);
+    sprintf(path_file, "%s%s", FILES_DIRECTORY, name);
+    if (stat(path_blob, &stat_blob) == -1) {
+        return 0;
+    }
+    // If the name is already a link to the content, there is nothing to do
+    if (stat(path_file, &stat_file) == 0 && stat_file.st_ino == stat_blob.st_ino && stat_file.st_dev == stat_blob.st_dev) {
+        return 1;
+    }
+    // We make the link next to the partial uploads, then rename it over the name
+    sprintf(path_link, "%s%s.link", PARTIAL_DIRECTORY, name);
+    unlink(path_link);
+    if (link(path_blob, path_link) == -1) {
+        perror("Erreur lors de la creation du lien");
+        return 0;
+    }
+    if (rename(path_link, path_file) == -1) {
+        perror("Erreur lors du deplacement du lien");
+        unlink(path_link);
+        return 0;
+    }
+    return 1;
+}
+
+// A function that will put the file path, whose content has the given hash, in the store,
+// and make FILES_DIRECTORY/name a link to it
+// If the content is already in the store, the file path is not needed anymore and is removed,
+// except if it is the file FILES_DIRECTORY/name itself, which is replaced by the link
+// It returns 1 if the file is in the store, 0 otherwise
+
+int blob_store(const char * path, const char * hash, const char * name) {
+    char path_blob[sizeof(BLOBS_DIRECTORY) + SHA256_HEX_SIZE];
+    char path_file[sizeof(FILES_DIRECTORY) + NAME_MAX + 1];
+    int result;
+
+    sprintf(path_blob, "%s%s", BLOBS_DIRECTORY, hash);
+    sprintf(path_file, "%s%s", FILES_DIRECTORY, name);
+    // If the content is new, the file becomes the content of the store
+    // The store is created again if it was removed while the server runs
+    result = link(path, path_blob);
+    if (result == -1 && errno == ENOENT && mkdir(BLOBS_DIRECTORY, 0755) == 0) {
+        printf("Le dossier server_blobs a ete recree\n");
+        result = link(path, path_blob);
+    }
+    if (result == -1 && errno != EEXIST) {
+        perror("Erreur lors de l'ajout au magasin");
+        return 0;
+    }
+    if (blob_link(hash, name) == 0) {
+        return 0;
+    }
+    if (strcmp(path, path_file) != 0) {
+        unlink(path);
+    }
+    return 1;
+}
+
+// A function that will remove the content hash from the store if no name links to it anymore
+
+void blob_release(const char * hash) {
+    char path_blob[sizeof(BLOBS_DIRECTORY) + SHA256_HEX_SIZE];
+    struct stat stat_blob;
+
+    sprintf(path_blob, "%s%s", BLOBS_DIRECTORY, hash);
+    if (stat(path_blob, &stat_blob) == 0 && stat_blob.st_nlink == 1) {
+        unlink(path_blob);
+        printf("Contenu %s supprime du magasin\n", hash);
+    }
+}
+
+// A function that will remove from the store the contents that no name links to,
+// for example if the server stopped between an upload and its link
+
+void blob_clean() {
+    struct dirent * entry;
+    DIR * directory = opendir(BLOBS_DIRECTORY);
+    if (directory == NULL) {
+        printf("Unable to open directory.\n");
+        return;
+    }
+    while ((entry = readdir(directory)) != NULL) {
+        if (strlen(entry->d_name) == SHA256_HEX_SIZE - 1) {
+            blob_release(entry->d_name);
+        }
+    }
+    closedir(directory);
+}
+
+
+/**************************************
+              File cache
+***************************************/
+
+// The files downloaded the most are kept in memory, so that they are not read again from the disk
+// for every client. The cache is keyed by the hash of the content: a file overwritten by an upload
+// gets a new hash, so its old content can never be sent under its name. The old content is
+// also removed from the cache as soon as the catalog sees the change (see cache_remove).
+// The cache keeps at most CACHE_SIZE bytes, the least recently used files are removed first.
+// A file is read from the store (BLOBS_DIRECTORY), whose files never change.
+
+typedef struct CacheEntry CacheEntry;
+struct CacheEntry {
+    // The hash of the content
+    char hash[SHA256_HEX_SIZE];
+    // The content, NULL while it is being read
+    char * data;
+    long size;
+    // 1 while the content is being read from the disk
+    int loading;
+    // The number of downloads using the content, it can't be freed before they end
+    int users;
+    // 1 if the entry is in the list of the cache
+    int in_cache;
+    // The list of the cache, from the most recently used to the least recently used
+    CacheEntry * previous;
+    CacheEntry * next;
+};
+
+CacheEntry * cache_first = NULL;
+CacheEntry * cache_last = NULL;
+// The number of bytes in the cache
+long cache_used = 0;
+// The number of downloads served from the cache, and the number that had to read the disk
+long cache_hits = 0;
+long cache_misses = 0;
+
+// Mutex to protect the cache, and condition to wait for a content being read by another download
+pthread_mutex_t mutex_cache;
+pthread_cond_t cond_cache;
+
+// A function that will take an entry out of the list of the cache
+// The mutex_cache must be locked
+
+void cache_unlink(CacheEntry * entry) {
+    if (entry->previous != NULL) {
+        entry->previous->next = entry->next;
+    }
+    else {
+        cache_first = entry->next;
+    }
+    if (entry->next != NULL) {
+        entry->next->previous = entry->previous;
+    }
+    else {
+        cache_last = entry->previous;
+    }
+    entry->previous = NULL;
+    entry->next = NULL;
+    entry->in_cache = 0;
+    cache_used = cache_used - entry->size;
+}
+
+// A function that will put an entry at the start of the list of the cache (most recently used)
+// The mutex_cache must be locked
+
+void cache_push(CacheEntry * entry) {
+    entry->previous = NULL;
+    entry->next = cache_first;
+    if (cache_first != NULL) {
+        cache_first->previous = entry;
+    }
+    else {
+        cache_last = entry;
+    }
+    cache_first = entry;
+    entry->in_cache = 1;
+    cache_used = cache_used + entry->size;
+}
+
+// A function that will free an entry if it is out of the cache and no download uses it anymore
+// The mutex_cache must be locked
+
+void cache_free(CacheEntry * entry) {
+    if (entry->users == 0 && entry->in_cache == 0) {
+        free(entry->data);
+        free(entry);
+    }
+}
+
+// A function that will give the content of hash (size bytes), from the cache if it is there
+// Otherwise the content is read from the store, and kept in the cache if there is room for it:
+// the least recently used files that no download is using are removed to make room
+// It returns NULL if the content is too big or can't be read: the caller reads the file itself
+// The entry must be given back with cache_close
+
+CacheEntry * cache_get(const char * hash, long size) {
+    char path[sizeof(BLOBS_DIRECTORY) + SHA256_HEX_SIZE];
+    long nb_read_total = 0;
+    ssize_t nb_read;
+    int fd;
+    CacheEntry * entry;
+    CacheEntry * current;
+    CacheEntry * previous;
+
+    if (size < 0 || size > CACHE_FILE_MAX) {
+        return NULL;
+    }
+
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_cache);
+    entry = cache_first;
+    while (entry != NULL && strcmp(entry->hash, hash) != 0) {
+        entry = entry->next;
+    }
+    if (entry != NULL) {
+        // If another download is reading the content, we wait for it
+        entry->users = entry->users + 1;
+        while (entry->loading == 1) {
+            pthread_cond_wait(&cond_cache, &mutex_cache);
+        }
+        if (entry->data == NULL) {
+            entry->users = entry->users - 1;
+            cache_free(entry);
+            // Unlock the mutex
+            pthread_mutex_unlock(&mutex_cache);
+            return NULL;
+        }
+        cache_hits = cache_hits + 1;
+        if (entry->in_cache == 1) {
+            cache_unlink(entry);
+            cache_push(entry);
+        }
+        printf("Cache : %s deja en memoire (%ld hits, %ld misses)\n", hash, cache_hits, cache_misses);
+        // Unlock the mutex
+        pthread_mutex_unlock(&mutex_cache);
+        return entry;
+    }
+
+    // The content is not in the cache, we make room for it
+    cache_misses = cache_misses + 1;
+    entry = malloc(sizeof(CacheEntry));
+    strcpy(entry->hash, hash);
+    entry->data = NULL;
+    entry->size = size;
+    entry->loading = 1;
+    entry->users = 1;
+    entry->in_cache = 0;
+    entry->previous = NULL;
+    entry->next = NULL;
+    current = cache_last;
+    while (current != NULL && cache_used + size > CACHE_SIZE) {
+        previous = current->previous;
+        if (current->users == 0) {
+            cache_unlink(current);
+            cache_free(current);
+        }
+        current = previous;
+    }
+    // If every file in the cache is being downloaded, the content is only kept for this download
+    if (cache_used + size <= CACHE_SIZE) {
+        cache_push(entry);
+    }
+    printf("Cache : %s lu sur le disque (%ld hits, %ld misses)\n", hash, cache_hits, cache_misses);
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_cache);
+
+    // We read the content outside of the mutex
+    char * data = malloc(size + 1);
+    sprintf(path, "%s%s", BLOBS_DIRECTORY, hash);
+    fd = open(path, O_RDONLY);
+    while (data != NULL && fd != -1 && nb_read_total < size) {
+        nb_read = pread(fd, data + nb_read_total, size - nb_read_total, nb_read_total);
+        if (nb_read <= 0) {
+            break;
+        }
+        nb_read_total = nb_read_total + nb_read;
+    }
+    if (fd == -1 || nb_read_total < size) {
+        free(data);
+        data = NULL;
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_cache);
+    entry->data = data;
+    entry->loading = 0;
+    if (data == NULL && entry->in_cache == 1) {
+        cache_unlink(entry);
+    }
+    // The downloads waiting for this content can continue
+    pthread_cond_broadcast(&cond_cache);
+    if (data == NULL) {
+        entry->users = entry->users - 1;
+        cache_free(entry);
+        entry = NULL;
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_cache);
+    return entry;
+}
+
+// A function that will give back a file read with cache_pread:
+// the entry of the cache if the file came from the cache, otherwise fd is closed
+
+void cache_close(CacheEntry * entry, int fd) {
+    if (fd != -1) {
+        close(fd);
+    }
+    if (entry == NULL) {
+        return;
+    }
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_cache);
+    entry->users = entry->users - 1;
+    cache_free(entry);
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_cache);
+}
+
+// A function that will read length bytes of a file at offset,
+// from the cache if entry is not NULL, otherwise from fd
+// It returns the number of bytes read, 0 at the end of the file, -1 on error
+
+ssize_t cache_pread(CacheEntry * entry, int fd, void * data, size_t length, long offset) {
+    if (entry == NULL) {
+        return pread(fd, data, length, offset);
+    }
+    if (offset >= entry->size) {
+        return 0;
+    }
+    if (length > entry->size - offset) {
+        length = entry->size - offset;
+    }
+    memcpy(data, entry->data + offset, length);
+    return length;
+}
+
+// A function that will remove a content from the cache, when no file has this content anymore
+// The downloads using it can finish, it is freed after them
+
+void cache_remove(const char * hash) {
+    CacheEntry * entry;
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_cache);
+    entry = cache_first;
+    while (entry != NULL && strcmp(entry->hash, hash) != 0) {
+        entry = entry->next;
+    }
+    if (entry != NULL) {
+        cache_unlink(entry);
+        cache_free(entry);
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_cache);
+}
+
+
+/**************************************
+              File catalog
+***************************************/
+
+// The server keeps in memory the list of the files of server_files, with their size,
+// their date of modification and the hash of their content
+// The list is read once at the start of the server, then a thread watches the directory
+// with inotify and updates the entries of the files that change
+// The listings sent to the clients are built from this list, without reading the directory
+
+typedef struct CatalogEntry CatalogEntry;
+struct CatalogEntry {
+    // The name of the file
+    char name[NAME_MAX + 1];
+    // The size of the file in bytes
+    long size;
+    // The date of the last modification of the file
+    time_t mtime;
+    // The inode of the file, to know if the file changed since we computed its hash
+    ino_t inode;
+    // The SHA-256 hash of the content of the file, its name in the store
+    char hash[SHA256_HEX_SIZE];
+};
+
+// Array of the files, sorted by name
+CatalogEntry * catalog = NULL;
+// The number of files in the catalog, and the number of entries allocated
+int catalog_count = 0;
+int catalog_capacity = 0;
+// Mutex to protect the catalog
+pthread_mutex_t mutex_catalog;
+
+// The positions of the files of the catalog in the order of their size and of their date
+// (see send_file_page), the order by name is the catalog itself
+// They are sorted again by the first page asked after a change of the catalog
+int * catalog_order[3] = {NULL, NULL, NULL};
+// 1 if catalog_order[sort] is up to date with the catalog
+int catalog_order_valid[3] = {0, 0, 0};
+
+// A function that will return the position of the file name in the catalog,
+// or the position where it should be inserted if it is not in the catalog
+// The mutex of the catalog must be locked
+
+int catalog_search(const char * name, int * found) {
+    int low = 0;
+    int high = catalog_count;
+    int middle;
+    int compare;
+    *found = 0;
+    while (low < high) {
+        middle = (low + high) / 2;
+        compare = strcmp(catalog[middle].name, name);
+        if (compare == 0) {
+            *found = 1;
+            return middle;
+        }
+        if (compare < 0) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// A function that will give the hash and the size of the file name
+// It returns 1 if the file is in the catalog, 0 otherwise
+
+int catalog_get(const char * name, char * hash, long * size) {
+    int found;
+    int position;
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_catalog);
+    position = catalog_search(name, &found);
+    if (found == 1) {
+        strcpy(hash, catalog[position].hash);
+        *size = catalog[position].size;
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_catalog);
+    return found;
+}
+
+// A function that will remove the file name from the catalog
+
+void catalog_remove(const char * name) {
+    int found;
+    int position;
+    char hash[SHA256_HEX_SIZE] = "";
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_catalog);
+    position = catalog_search(name, &found);
+    if (found == 1) {
+        strcpy(hash, catalog[position].hash);
+        memmove(&catalog[position], &catalog[position + 1], (catalog_count - position - 1) * sizeof(CatalogEntry));
+        catalog_count = catalog_count - 1;
+        // The files must be sorted again by size and by date
+        memset(catalog_order_valid, 0, sizeof(catalog_order_valid));
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_catalog);
+
+    // The old content is not sent anymore under this name
+    // If it was the last name of this content, the content is removed from the store
+    if (hash[0] != '\0') {
+        cache_remove(hash);
+        blob_release(hash);
+    }
+}
+
+// A function that will read the file name of server_files and put it in the catalog
+// The file is also put in the store, so a file copied in server_files by hand is deduplicated too
+// If the hash of the content is already known (an upload computes it), it is given in known_hash,
+// otherwise it is NULL and the file is read to compute it
+// If the file doesn't exist anymore, or is not a regular file, it is removed from the catalog
+
+void catalog_update(const char * name, const char * known_hash) {
+    char path[sizeof(FILES_DIRECTORY) + NAME_MAX + 1];
+    struct stat stat_file;
+    CatalogEntry entry;
+    char old_hash[SHA256_HEX_SIZE] = ""; // The hash of the previous content of the file
+    int fd;
+    int found;
+    int position;
+
+    if (strlen(name) > NAME_MAX) {
+        return;
+    }
+    sprintf(path, "%s%s", FILES_DIRECTORY, name);
+    if (stat(path, &stat_file) == -1 || !S_ISREG(stat_file.st_mode)) {
+        catalog_remove(name);
+        return;
+    }
+
+    // If the file didn't change since we computed its hash, there is nothing to do
+    // This is the case for the events caused by our own links
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_catalog);
+    position = catalog_search(name, &found);
+    if (found == 1 && catalog[position].inode == stat_file.st_ino && catalog[position].size == stat_file.st_size
+        && catalog[position].mtime == stat_file.st_mtime) {
+        found = 2;
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_catalog);
+    if (found == 2) {
+        return;
+    }
+
+    // We compute the hash outside of the mutex, it can take some time for a big file
+    strcpy(entry.name, name);
+    if (known_hash != NULL) {
+        strcpy(entry.hash, known_hash);
+    }
+    else {
+        fd = open(path, O_RDONLY);
+        if (fd == -1 || sha256_file(fd, entry.hash) == 0) {
+            if (fd != -1) {
+                close(fd);
+            }
+            catalog_remove(name);
+            return;
+        }
+        close(fd);
+    }
+    // The file becomes a link to the content in the store
+    blob_store(path, entry.hash, name);
+    if (stat(path, &stat_file) == -1) {
+        catalog_remove(name);
+        return;
+    }
+    entry.size = stat_file.st_size;
+    entry.mtime = stat_file.st_mtime;
+    entry.inode = stat_file.st_ino;
+
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_catalog);
+    position = catalog_search(name, &found);
+    if (found == 0) {
+        if (catalog_count == catalog_capacity) {
+            catalog_capacity = catalog_capacity * 2 + 16;
+            catalog = realloc(catalog, catalog_capacity * sizeof(CatalogEntry));
+            if (catalog == NULL) {
+                perror("Erreur lors de l'allocation du catalogue");
+                exit(EXIT_FAILURE);
+            }
+        }
+        memmove(&catalog[position + 1], &catalog[position], (catalog_count - position) * sizeof(CatalogEntry));
+        catalog_count = catalog_count + 1;
+    }
+    else if (strcmp(catalog[position].hash, entry.hash) != 0) {
+        strcpy(old_hash, catalog[position].hash);
+    }
+    catalog[position] = entry;
+    // The files must be sorted again by size and by date
+    memset(catalog_order_valid, 0, sizeof(catalog_order_valid));
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_catalog);
+
+    // The previous content of the name may not be used anymore
+    if (old_hash[0] != '\0') {
+        cache_remove(old_hash);
+        blob_release(old_hash);
+    }
+}
+
+// A function that will read the whole directory server_files and put every file in the catalog
+
+void catalog_load() {
+    struct dirent * entry;
+    DIR * directory = opendir(FILES_DIRECTORY);
+    if (directory == NULL) {
+        printf("Unable to open directory.\n");
+        return;
+    }
+    while ((entry = readdir(directory)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            catalog_update(entry->d_name, NULL);
+        }
+    }
+    closedir(directory);
+}
+
+// A function for a thread that will watch server_files with inotify and update the catalog
+// The watch is created before the directory is read, so no change can be missed
+// It takes as an argument a pointer to the inotify file descriptor
+
+void * catalog_thread(void * arg) {
+    int fd_inotify = *(int *) arg;
+    // inotify events must be read in a buffer aligned like the struct
+    char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event * event;
+    ssize_t nb_read;
+    char * position;
+
+    while (1) {
+        nb_read = read(fd_inotify, events, sizeof(events));
+        if (nb_read <= 0) {
+            if (nb_read == -1 && errno == EINTR) {
+                continue;
+            }
+            perror("Erreur lors de la lecture de inotify");
+            break;
+        }
+        position = events;
+        while (position < events + nb_read) {
+            event = (const struct inotify_event *) position;
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Some events were lost, we read the whole directory again
+                catalog_load();
+            }
+            else if (event->len > 0) {
+                if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    catalog_remove(event->name);
+                }
+                else {
+                    // A file was written, moved in (the uploads are renamed in server_files) or changed
+                    catalog_update(event->name, NULL);
+                }
+            }
+            position = position + sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    pthread_exit(0);
+}
+
+// A function that will fill the catalog and launch the thread that keeps it up to date
+
+void catalog_start() {
+    static int fd_inotify;
+    pthread_t catalog_tid;
+
+    pthread_mutex_init(&mutex_catalog, NULL);
+    // The directory of the files and the store are created at the first start
+    if (mkdir(FILES_DIRECTORY, 0755) == -1 && errno != EEXIST) {
+        perror("Erreur lors de la creation du dossier server_files");
+        exit(EXIT_FAILURE);
+    }
+    if (mkdir(BLOBS_DIRECTORY, 0755) == -1 && errno != EEXIST) {
+        perror("Erreur lors de la creation du dossier server_blobs");
+        exit(EXIT_FAILURE);
+    }
+    fd_inotify = inotify_init1(IN_CLOEXEC);
+    if (fd_inotify == -1) {
+        perror("Erreur lors de la creation de inotify");
+        exit(EXIT_FAILURE);
+    }
+    if (inotify_add_watch(fd_inotify, FILES_DIRECTORY, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ATTRIB) == -1) {
+        perror("Erreur lors de la surveillance de server_files");
+        exit(EXIT_FAILURE);
+    }
+    catalog_load();
+    blob_clean();
+    printf("Catalogue charge : %d fichiers\n", catalog_count);
+
+    if (pthread_create(&catalog_tid, NULL, catalog_thread, (void *) &fd_inotify) != 0) {
+        perror("Erreur lors de la creation du thread");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/**************************************
+            Ticket functions
+***************************************/
+
+// A function that will create a ticket of the given kind for the client
+// It returns the value of the ticket, or 0 if there is no free spot for a ticket
+
+uint64_t new_ticket(int client_indice, char * kind) {
+    uint64_t value = 0;
+    time_t now = time(NULL);
+    int i = 0;
+
+    // The value is random so a client can't guess the ticket of another client
+    while (value == 0) {
+        if (getrandom(&value, sizeof(uint64_t), 0) != sizeof(uint64_t)) {
+            perror("Erreur lors de la creation du ticket");
+            return 0;
+        }
+    }
+
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_tab_ticket);
+    // We look for a free spot, or for a ticket that has expired
+    while (i < MAX_TICKETS && tab_ticket[i].value != 0 && tab_ticket[i].expiry >= now) {
+        i = i + 1;
+    }
+    if (i < MAX_TICKETS) {
+        tab_ticket[i].value = value;
+        tab_ticket[i].client_indice = client_indice;
+        strcpy(tab_ticket[i].kind, kind);
+        tab_ticket[i].expiry = now + TICKET_LIFETIME;
+    }
+    else {
+        value = 0;
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_tab_ticket);
+    return value;
+}
+
+// A function that will use the ticket, so it can't be used again
+// It returns the indice of the client who asked for the ticket,
+// or -1 if the ticket doesn't exist, has expired, or isn't of the given kind
+
+int use_ticket(uint64_t value, char * kind) {
+    int client_indice = -1;
+    int i = 0;
+
+    if (value == 0) {
+        return -1;
+    }
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_tab_ticket);
+    while (i < MAX_TICKETS && tab_ticket[i].value != value) {
+        i = i + 1;
+    }
+    if (i < MAX_TICKETS) {
+        if (strcmp(tab_ticket[i].kind, kind) == 0 && tab_ticket[i].expiry >= time(NULL)) {
+            client_indice = tab_ticket[i].client_indice;
+        }
+        // The ticket is used, even if it was for another socket
+        tab_ticket[i].value = 0;
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_tab_ticket);
+    return client_indice;
+}
+
+// A function that will remove all the tickets of a client, used when he disconnects
+
+void revoke_tickets(int client_indice) {
+    int i = 0;
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_tab_ticket);
+    while (i < MAX_TICKETS) {
+        if (tab_ticket[i].client_indice == client_indice) {
+            tab_ticket[i].value = 0;
+        }
+        i = i + 1;
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_tab_ticket);
+}
+
+// A function that will receive the ticket that the client sends
+// at the beginning of a connection, and check it
+// It returns the indice of the client, or -1 if the ticket is not valid
+
+int check_ticket(int dS_connection, char * kind) {
+    char ticket[BUFFER_SIZE]; // The Message with the ticket, the ticket is in the message field
+    uint64_t value;
+    int client_indice;
+
+    if (recv_full(dS_connection, ticket, BUFFER_SIZE) < BUFFER_SIZE) {
+        printf("Le client s'est deconnecte avant d'envoyer son ticket\n");
+        return -1;
+    }
+    // The message field starts after cmd, from, to and channel
+    ticket[BUFFER_SIZE - COLOR_SIZE - 1] = '\0';
+    value = strtoull(ticket + CMD_SIZE + USERNAME_SIZE + USERNAME_SIZE + CHANNEL_SIZE, NULL, 16);
+    client_indice = use_ticket(value, kind);
+    if (client_indice == -1) {
+        printf("Ticket %s invalide\n", kind);
+    }
+    return client_indice;
+}
+
+
+// Struct for the messages
+typedef struct Message Message;
+struct Message {
+    // The command
+    // For possible commands, please read the documentation
+    char cmd[CMD_SIZE];
+    // The username of the client who will receive the message
+    // It can be Server if the message is sent from the server
+    char from[USERNAME_SIZE];
+    // The username of the client who sent the message
+    // It can be Server if the message is sent to the server
+    char to[USERNAME_SIZE];
+    // The channel name
+    char channel[CHANNEL_SIZE];
+    // The message
+    char message[MSG_SIZE];
+    // The color of the message
+    char color[COLOR_SIZE];
+};
+
+
+/**************************************
+            Channel history
+***************************************/
+
+// Every message said in a channel is kept on the disk, in HISTORY_DIRECTORY<channel>/
+// The messages of a channel are appended to segments: files named <number>.log of at most
+// HISTORY_SEGMENT_SIZE bytes, a new segment is started when the last one is full
+// A record of a segment is a HistoryHeader followed by "<from>\0<color>\0<message>"
+// Next to each segment, <number>.idx has one HistoryIndex per record, in the same order,
+// so the readers map the index and the segment in memory (mmap) and go straight to the records
+// send_to_all doesn't write on the disk, it gives the message to the history thread
+// The history thread writes all the messages waiting, then synchronises the files it wrote
+// once for the whole batch (group commit), instead of once per message
+
+typedef struct HistoryHeader HistoryHeader;
+struct HistoryHeader {
+    // The number of bytes after the header
+    uint32_t length;
+    // The CRC32C checksum of these bytes
+    uint32_t crc;
+    // The time the message was sent, in seconds since 1970
+    int64_t time;
+};
+
+typedef struct HistoryIndex HistoryIndex;
+struct HistoryIndex {
+    // The time the message was sent
+    int64_t time;
+    // The offset of the record in the segment
+    int64_t offset;
+};
+
+// A message waiting to be written by the history thread
+typedef struct HistoryRecord HistoryRecord;
+struct HistoryRecord {
+    char channel[CHANNEL_SIZE];
+    char from[USERNAME_SIZE];
+    char color[COLOR_SIZE];
+    char message[MSG_SIZE];
+    long time;
+    // 1 if the channel was deleted, its history is removed instead
+    int deleted;
+    HistoryRecord * next;
+};
+
+// The last segment of a channel, where the history thread appends
+// Only the history thread uses it
+typedef struct HistoryChannel HistoryChannel;
+struct HistoryChannel {
+    char name[CHANNEL_SIZE];
+    int segment;
+    int fd_log;
+    int fd_index;
+    // The size of the segment and its number of records
+    long log_size;
+    long nb_records;
+    // 1 if the files were written since they were last synchronised
+    int dirty;
+    HistoryChannel * next;
+};
+
+// The messages waiting to be written, from the oldest to the newest
+HistoryRecord * history_first = NULL;
+HistoryRecord * history_last = NULL;
+int history_pending = 0;
+
+// The channels the history thread has written in
+HistoryChannel * history_channels = NULL;
+
+// Mutex to protect the messages waiting
+// The history thread waits for messages on cond_history,
+// and send_to_all waits on cond_history_space if HISTORY_PENDING_MAX messages are waiting
+pthread_mutex_t mutex_history;
+pthread_cond_t cond_history;
+pthread_cond_t cond_history_space;
+
+// A function that will check that a channel name can be used as a directory name
+// It returns 1 if it can, 0 otherwise
+
+int history_valid_name(const char * channel) {
+    return channel[0] != '\0' && channel[0] != '.' && strchr(channel, '/') == NULL
+        && strlen(channel) < CHANNEL_SIZE;
+}
+
+int history_compare_segments(const void * a, const void * b) {
+    return *(const int *) a - *(const int *) b;
+}
+
+// A function that will find the segments of a channel
+// segments receives their numbers from the oldest to the newest, it must be freed
+// It returns the number of segments
+
+int history_segments(const char * channel, int ** segments) {
+    char path[sizeof(HISTORY_DIRECTORY) + CHANNEL_SIZE];
+    DIR * directory;
+    struct dirent * entry;
+    int nb_segments = 0;
+    int size = 0;
+    int segment;
+    char end[8];
+
+    *segments = NULL;
+    sprintf(path, "%s%s", HISTORY_DIRECTORY, channel);
+    directory = opendir(path);
+    if (directory == NULL) {
+        return 0;
+    }
+    while ((entry = readdir(directory)) != NULL) {
+        if (sscanf(entry->d_name, "%d.%7s", &segment, end) == 2 && strcmp(end, "log") == 0 && segment > 0) {
+            if (nb_segments == size) {
+                size = size * 2 + 8;
+                *segments = realloc(*segments, size * sizeof(int));
+            }
+            (*segments)[nb_segments] = segment;
+            nb_segments = nb_segments + 1;
+        }
+    }
+    closedir(directory);
+    qsort(*segments, nb_segments, sizeof(int), history_compare_segments);
+    return nb_segments;
+}
+
+// A function that will open the files of a segment, they are created if they don't exist
+// The end of the segment is after its last record that is complete and in the index
+// If repair is 1, what is after it (the server stopped between the two writes) is removed
+// This is only done at the start of the server (see history_repair): a file mapped by a reader
+// (history_map) that gets shorter kills the reader with SIGBUS
+// Otherwise the next records are written over it
+// It returns 1 if the files are open, 0 otherwise
+
+int history_open_segment(HistoryChannel * history, int repair) {
+    char path[sizeof(HISTORY_DIRECTORY) + CHANNEL_SIZE + 20];
+    struct stat stat_log;
+    struct stat stat_index;
+    HistoryIndex entry;
+    HistoryHeader header;
+    long end = 0;
+
+    sprintf(path, "%s%s/%08d.log", HISTORY_DIRECTORY, history->name, history->segment);
+    history->fd_log = open(path, O_RDWR | O_CREAT, 0644);
+    sprintf(path, "%s%s/%08d.idx", HISTORY_DIRECTORY, history->name, history->segment);
+    history->fd_index = open(path, O_RDWR | O_CREAT, 0644);
+    if (history->fd_log == -1 || history->fd_index == -1
+        || fstat(history->fd_log, &stat_log) == -1 || fstat(history->fd_index, &stat_index) == -1) {
+        perror("Erreur lors de l'ouverture de l'historique");
+        if (history->fd_log != -1) {
+            close(history->fd_log);
+        }
+        if (history->fd_index != -1) {
+            close(history->fd_index);
+        }
+        history->fd_log = -1;
+        history->fd_index = -1;
+        return 0;
+    }
+
+    // The last complete record gives the end of the segment
+    history->nb_records = stat_index.st_size / sizeof(HistoryIndex);
+    while (history->nb_records > 0) {
+        if (pread(history->fd_index, &entry, sizeof(entry), (history->nb_records - 1) * sizeof(HistoryIndex)) == sizeof(entry)
+            && pread(history->fd_log, &header, sizeof(header), entry.offset) == sizeof(header)
+            && entry.offset + (long) sizeof(header) + header.length <= stat_log.st_size) {
+            end = entry.offset + sizeof(header) + header.length;
+            break;
+        }
+        history->nb_records = history->nb_records - 1;
+    }
+    if (repair == 1 && (ftruncate(history->fd_index, history->nb_records * sizeof(HistoryIndex)) == -1
+        || ftruncate(history->fd_log, end) == -1)) {
+        perror("Erreur lors de la reparation de l'historique");
+    }
+    history->log_size = end;
+    history->dirty = 0;
+    return 1;
+}
+
+// A function that will repair the last segment of every channel that has a history
+// (see history_open_segment), before the history thread and the readers start
+
+void history_repair() {
+    HistoryChannel history;
+    DIR * directory;
+    struct dirent * entry;
+    int * segments;
+    int nb_segments;
+
+    directory = opendir(HISTORY_DIRECTORY);
+    if (directory == NULL) {
+        return;
+    }
+    while ((entry = readdir(directory)) != NULL) {
+        if (entry->d_type == DT_DIR && history_valid_name(entry->d_name) == 1) {
+            nb_segments = history_segments(entry->d_name, &segments);
+            if (nb_segments > 0) {
+                strcpy(history.name, entry->d_name);
+                history.segment = segments[nb_segments - 1];
+                if (history_open_segment(&history, 1) == 1) {
+                    close(history.fd_log);
+                    close(history.fd_index);
+                }
+            }
+            free(segments);
+        }
+    }
+    closedir(directory);
+}
+
+// A function that will give the last segment of a channel, opened for the history thread
+// Its files are not open if they couldn't be opened
+// It returns NULL if the history of the channel can't be written
+
+HistoryChannel * history_open(const char * channel) {
+    char path[sizeof(HISTORY_DIRECTORY) + CHANNEL_SIZE];
+    HistoryChannel * history = history_channels;
+    int * segments;
+    int nb_segments;
+
+    while (history != NULL) {
+        if (strcmp(history->name, channel) == 0) {
+            return history;
+        }
+        history = history->next;
+    }
+
+    sprintf(path, "%s%s", HISTORY_DIRECTORY, channel);
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        perror("Erreur lors de la creation du dossier de l'historique");
+        return NULL;
+    }
+    history = malloc(sizeof(HistoryChannel));
+    strcpy(history->name, channel);
+    nb_segments = history_segments(channel, &segments);
+    history->segment = 1;
+    if (nb_segments > 0) {
+        history->segment = segments[nb_segments - 1];
+    }
+    free(segments);
+    history_open_segment(history, 0);
+    history->next = history_channels;
+    history_channels = history;
+    return history;
+}
+
+// A function that will synchronise the files of a segment on the disk
+
+void history_sync(HistoryChannel * history) {
+    if (history->dirty == 1) {
+        if (fdatasync(history->fd_log) == -1 || fdatasync(history->fd_index) == -1) {
+            perror("Erreur lors de la synchronisation de l'historique");
+        }
+        history->dirty = 0;
+    }
+}
+
+// A function that will append a message to the history of its channel
+// It returns the number of the record (see the search index), or -1 if it couldn't be written
+
+long history_write(HistoryRecord * record) {
+    HistoryChannel * history = history_open(record->channel);
+    char data[sizeof(HistoryHeader) + USERNAME_SIZE + COLOR_SIZE + MSG_SIZE];
+    HistoryHeader header;
+    HistoryIndex entry;
+    char * payload = data + sizeof(HistoryHeader);
+    size_t length = 0;
+
+    if (history == NULL) {
+        return -1;
+    }
+
+    // The record is "<from>\0<color>\0<message>"
+    strcpy(payload, record->from);
+    length = strlen(record->from) + 1;
+    strcpy(payload + length, record->color);
+    length = length + strlen(record->color) + 1;
+    memcpy(payload + length, record->message, strlen(record->message));
+    length = length + strlen(record->message);
+    header.length = length;
+    header.crc = crc32c_update(0, payload, length);
+    header.time = record->time;
+    memcpy(data, &header, sizeof(header));
+
+    // If the segment is full, we start the next one
+    if (history->log_size > 0 && history->log_size + sizeof(header) + length > HISTORY_SEGMENT_SIZE) {
+        history_sync(history);
+        close(history->fd_log);
+        close(history->fd_index);
+        history->segment = history->segment + 1;
+        history->fd_log = -1;
+    }
+    // If the files of the segment couldn't be opened, we try again for each message
+    if (history->fd_log == -1 && history_open_segment(history, 0) == 0) {
+        return -1;
+    }
+
+    // The record is written before its index, so an index never gives an incomplete record
+    entry.time = record->time;
+    entry.offset = history->log_size;
+    if (pwrite(history->fd_log, data, sizeof(header) + length, history->log_size) != (ssize_t) (sizeof(header) + length)
+        || pwrite(history->fd_index, &entry, sizeof(entry), history->nb_records * sizeof(HistoryIndex)) != sizeof(entry)) {
+        perror("Erreur lors de l'ecriture de l'historique");
+        return -1;
+    }
+    history->log_size = history->log_size + sizeof(header) + length;
+    history->nb_records = history->nb_records + 1;
+    history->dirty = 1;
+    return ((long) history->segment << 32) | (history->nb_records - 1);
+}
+
+// A function that will remove the history of a deleted channel
+
+void history_remove(const char * channel) {
+    HistoryChannel ** previous = &history_channels;
+    HistoryChannel * history;
+    char path[sizeof(HISTORY_DIRECTORY) + CHANNEL_SIZE + 20];
+    int * segments;
+    int nb_segments;
+    int i = 0;
+
+    while (*previous != NULL) {
+        history = *previous;
+        if (strcmp(history->name, channel) == 0) {
+            *previous = history->next;
+            if (history->fd_log != -1) {
+                close(history->fd_log);
+                close(history->fd_index);
+            }
+            free(history);
+            break;
+        }
+        previous = &history->next;
+    }
+
+    nb_segments = history_segments(channel, &segments);
+    while (i < nb_segments) {
+        sprintf(path, "%s%s/%08d.log", HISTORY_DIRECTORY, channel, segments[i]);
+        remove(path);
+        sprintf(path, "%s%s/%08d.idx", HISTORY_DIRECTORY, channel, segments[i]);
+        remove(path);
+        i = i + 1;
+    }
+    free(segments);
+    sprintf(path, "%s%s", HISTORY_DIRECTORY, channel);
+    rmdir(path);
+}
+
+// The words of the messages of a channel are kept in a search index (inverted index), in memory
+// For each word, the index has the list of the records where it is (postings), from the oldest to the newest
+// A record is numbered by its segment and its place in the index of the segment: (segment << 32) | place
+// The postings are compact: each number is written as the difference with the previous one,
+// on 7 bits per byte (the high bit says that another byte follows), so most of them take 1 or 2 bytes
+// The index of a channel is built from its segments the first time the channel is searched,
+// then the history thread adds each message it writes
+// It is built without the mutex_search, so the history thread never waits for it: once it is built,
+// the messages written meanwhile are added and it is put with the others
+
+typedef struct SearchPostings SearchPostings;
+struct SearchPostings {
+    char word[SEARCH_WORD_SIZE];
+    unsigned char * data;
+    long size;
+    long capacity;
+    // The number of records, and the last one
+    long count;
+    long last;
+    SearchPostings * next;
+};
+
+typedef struct SearchIndex SearchIndex;
+struct SearchIndex {
+    char name[CHANNEL_SIZE];
+    // The postings of the words, in lists chosen by the hash of the word
+    SearchPostings * buckets[SEARCH_BUCKETS];
+    // The last record added
+    long last;
+    SearchIndex * next;
+};
+
+// The indexes of the channels that were searched
+SearchIndex * search_indexes = NULL;
+
+// Mutex to protect the search indexes
+pthread_mutex_t mutex_search;
+
+// Incremented each time an index is removed, an index built meanwhile can be of a deleted channel
+long search_generation = 0;
+
+// A function that will read the next word of a text, from *text
+// Letters and digits are part of words, and so are the bytes of accented letters (UTF-8)
+// The word is put in word in lower case (accented capitals like É too), and *text is moved after it
+// It returns 1 if there was a word, 0 at the end of the text
+
+int search_next_word(const char ** text, char * word) {
+    const unsigned char * c = (const unsigned char *) *text;
+    int length = 0;
+
+    while (*c != '\0' && *c < 128 && !(*c >= 'a' && *c <= 'z') && !(*c >= 'A' && *c <= 'Z') && !(*c >= '0' && *c <= '9')) {
+        c = c + 1;
+    }
+    while (*c >= 128 || (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9')) {
+        if (*c == 0xC3 && c[1] >= 0x80 && c[1] <= 0x9E && c[1] != 0x97) {
+            // An accented capital in UTF-8, its lower case is 0x20 further
+            if (length < SEARCH_WORD_SIZE - 2) {
+                word[length] = *c;
+                word[length + 1] = c[1] + 0x20;
+                length = length + 2;
+            }
+            c = c + 2;
+            continue;
+        }
+        if (length < SEARCH_WORD_SIZE - 1) {
+            word[length] = (*c >= 'A' && *c <= 'Z') ? *c - 'A' + 'a' : *c;
+            length = length + 1;
+        }
+        c = c + 1;
+    }
+    word[length] = '\0';
+    *text = (const char *) c;
+    return length > 0;
+}
+
+// A function that will find the postings of a word in the index of a channel
+// If create is 1, empty postings are created if the word isn't in the index
+// It returns NULL if the word isn't in the index
+
+SearchPostings * search_postings(SearchIndex * index, const char * word, int create) {
+    unsigned int hash = 2166136261u;
+    const char * c = word;
+    SearchPostings * postings;
+
+    // FNV-1a hash
+    while (*c != '\0') {
+        hash = (hash ^ (unsigned char) *c) * 16777619u;
+        c = c + 1;
+    }
+    postings = index->buckets[hash % SEARCH_BUCKETS];
+    while (postings != NULL) {
+        if (strcmp(postings->word, word) == 0) {
+            return postings;
+        }
+        postings = postings->next;
+    }
+    if (create == 0) {
+        return NULL;
+    }
+    postings = malloc(sizeof(SearchPostings));
+    strcpy(postings->word, word);
+    postings->data = NULL;
+    postings->size = 0;
+    postings->capacity = 0;
+    postings->count = 0;
+    postings->last = 0;
+    postings->next = index->buckets[hash % SEARCH_BUCKETS];
+    index->buckets[hash % SEARCH_BUCKETS] = postings;
+    return postings;
+}
+
+// A function that will add the words of the text of the record number to the index of a channel
+// The records must be added from the oldest to the newest, a record already added is ignored
+
+void search_index_text(SearchIndex * index, long number, const char * text) {
+    char word[SEARCH_WORD_SIZE];
+    SearchPostings * postings;
+    unsigned long delta;
+
+    if (number <= index->last) {
+        return;
+    }
+    index->last = number;
+    while (search_next_word(&text, word) == 1) {
+        postings = search_postings(index, word, 1);
+        // The word can be several times in the message
+        if (postings->last == number) {
+            continue;
+        }
+        if (postings->size + 10 > postings->capacity) {
+            postings->capacity = postings->capacity * 2 + 16;
+            postings->data = realloc(postings->data, postings->capacity);
+        }
+        delta = number - postings->last;
+        while (delta >= 128) {
+            postings->data[postings->size] = (delta & 127) | 128;
+            postings->size = postings->size + 1;
+            delta = delta >> 7;
+        }
+        postings->data[postings->size] = delta;
+        postings->size = postings->size + 1;
+        postings->count = postings->count + 1;
+        postings->last = number;
+    }
+}
+
+// A function that will give the index of a channel, or NULL if it isn't in memory
+// The mutex_search must be locked
+
+SearchIndex * search_index_find(const char * channel) {
+    SearchIndex * index = search_indexes;
+
+    while (index != NULL && strcmp(index->name, channel) != 0) {
+        index = index->next;
+    }
+    return index;
+}
+
+// A function that will add a message written by the history thread to the index of its channel
+// If the index isn't in memory, nothing is done, it will be built from the disk
+
+void search_index_add(const char * channel, long number, const char * text) {
+    SearchIndex * index;
+
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_search);
+    index = search_index_find(channel);
+    if (index != NULL) {
+        search_index_text(index, number, text);
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_search);
+}
+
+// A function that will remove the index of a deleted channel from memory
+
+// A function that will free an index and its postings
+
+void search_index_free(SearchIndex * index) {
+    SearchPostings * postings;
+    int i = 0;
+
+    while (i < SEARCH_BUCKETS) {
+        while (index->buckets[i] != NULL) {
+            postings = index->buckets[i];
+            index->buckets[i] = postings->next;
+            free(postings->data);
+            free(postings);
+        }
+        i = i + 1;
+    }
+    free(index);
+}
+
+// A function that will remove the index of a deleted channel from memory
+
+void search_index_remove(const char * channel) {
+    SearchIndex ** previous = &search_indexes;
+    SearchIndex * index;
+
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_search);
+    search_generation = search_generation + 1;
+    while (*previous != NULL && strcmp((*previous)->name, channel) != 0) {
+        previous = &(*previous)->next;
+    }
+    index = *previous;
+    if (index != NULL) {
+        *previous = index->next;
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_search);
+    if (index != NULL) {
+        search_index_free(index);
+    }
+}
+
+// A function for the thread that writes the history
+// It takes all the messages waiting at once, writes them, and synchronises each file written once
+// While it synchronises, the next messages wait and will be written together
+
+void * history_thread(void * arg) {
+    HistoryRecord * batch;
+    HistoryRecord * record;
+    HistoryChannel * history;
+    long number;
+
+    while (1) {
+        // Lock the mutex
+        pthread_mutex_lock(&mutex_history);
+        while (history_first == NULL) {
+            pthread_cond_wait(&cond_history, &mutex_history);
+        }
+        batch = history_first;
+        history_first = NULL;
+        history_last = NULL;
+        history_pending = 0;
+        pthread_cond_broadcast(&cond_history_space);
+        // Unlock the mutex
+        pthread_mutex_unlock(&mutex_history);
+
+        while (batch != NULL) {
+            record = batch;
+            batch = batch->next;
+            if (record->deleted == 1) {
+                history_remove(record->channel);
+                search_index_remove(record->channel);
+            }
+            else {
+                number = history_write(record);
+                if (number != -1) {
+                    search_index_add(record->channel, number, record->message);
+                }
+            }
+            free(record);
+        }
+
+        history = history_channels;
+        while (history != NULL) {
+            if (history->fd_log != -1) {
+                history_sync(history);
+            }
+            history = history->next;
+        }
+    }
+    return arg;
+}
+
+// A function that will give a record to the history thread
+// It only waits if HISTORY_PENDING_MAX records are already waiting
+
+void history_push(HistoryRecord * record) {
+    record->next = NULL;
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_history);
+    while (history_pending >= HISTORY_PENDING_MAX) {
+        pthread_cond_wait(&cond_history_space, &mutex_history);
+    }
+    if (history_last == NULL) {
+        history_first = record;
+    }
+    else {
+        history_last->next = record;
+    }
+    history_last = record;
+    history_pending = history_pending + 1;
+    pthread_cond_signal(&cond_history);
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_history);
+}
+
+// A function that will map a file of the history in memory, read only
+// size receives the size of the file
+// It returns NULL if the file is empty or can't be mapped
+
+char * history_map(const char * path, long * size) {
+    struct stat stat_file;
+    char * data = NULL;
+    int fd = open(path, O_RDONLY);
+
+    *size = 0;
+    if (fd == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &stat_file) == 0 && stat_file.st_size > 0) {
+        data = mmap(NULL, stat_file.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            data = NULL;
+        }
+        else {
+            *size = stat_file.st_size;
+        }
+    }
+    close(fd);
+    return data;
+}
+
+// A function that will read the record of a segment given by an entry of its index
+// The message is put in message with the command "history", and the time of the message in hexadecimal in to
+// It returns 1 if the record is valid, 0 otherwise
+
+int history_decode(const char * log, long log_size, const HistoryIndex * entry, const char * channel, Message * message) {
+    HistoryHeader header;
+    const char * payload;
+    const char * color;
+    const char * text;
+    const char * end;
+
+    if (entry->offset < 0 || entry->offset + (long) sizeof(header) > log_size) {
+        return 0;
+    }
+    memcpy(&header, log + entry->offset, sizeof(header));
+    payload = log + entry->offset + sizeof(header);
+    if (entry->offset + (long) sizeof(header) + header.length > log_size
+        || crc32c_update(0, payload, header.length) != header.crc) {
+        return 0;
+    }
+    end = payload + header.length;
+    color = memchr(payload, '\0', header.length);
+    if (color == NULL || color - payload >= USERNAME_SIZE) {
+        return 0;
+    }
+    color = color + 1;
+    text = memchr(color, '\0', end - color);
+    if (text == NULL || text - color >= COLOR_SIZE || end - (text + 1) >= MSG_SIZE) {
+        return 0;
+    }
+    text = text + 1;
+
+    memset(message, 0, sizeof(Message));
+    strcpy(message->cmd, "history");
+    strcpy(message->from, payload);
+    sprintf(message->to, "%08lx", (unsigned long) header.time);
+    strcpy(message->channel, channel);
+    strcpy(message->color, color);
+    memcpy(message->message, text, end - text);
+    return 1;
+}
+
+// A function that will read the last messages of a segment
+// The messages are put before end, the newest one just before it
+// It returns the number of messages read, count at most
+
+int history_read_segment(const char * channel, int segment, int count, Message * end) {
+    char path[sizeof(HISTORY_DIRECTORY) + CHANNEL_SIZE + 20];
+    char * log;
+    char * index;
+    long log_size;
+    long index_size;
+    long i;
+    int nb_read = 0;
+
+    sprintf(path, "%s%s/%08d.idx", HISTORY_DIRECTORY, channel, segment);
+    index = history_map(path, &index_size);
+    sprintf(path, "%s%s/%08d.log", HISTORY_DIRECTORY, channel, segment);
+    log = history_map(path, &log_size);
+    if (index != NULL && log != NULL) {
+        i = index_size / sizeof(HistoryIndex) - 1;
+        while (i >= 0 && nb_read < count) {
+            if (history_decode(log, log_size, (HistoryIndex *) index + i, channel, end - nb_read - 1) == 1) {
+                nb_read = nb_read + 1;
+            }
+            i = i - 1;
+        }
+    }
+    if (index != NULL) {
+        munmap(index, index_size);
+    }
+    if (log != NULL) {
+        munmap(log, log_size);
+    }
+    return nb_read;
+}
+
+// A function that will read the last count messages of a channel
+// They are put in messages, from the oldest to the newest
+// It returns the number of messages read
+
+int history_read(const char * channel, int count, Message * messages) {
+    int * segments;
+    int nb_segments;
+    int nb_read = 0;
+
+    if (history_valid_name(channel) == 0) {
+        return 0;
+    }
+    nb_segments = history_segments(channel, &segments);
+    while (nb_segments > 0 && nb_read < count) {
+        nb_segments = nb_segments - 1;
+        nb_read = nb_read + history_read_segment(channel, segments[nb_segments], count - nb_read, messages + count - nb_read);
+    }
+    free(segments);
+    memmove(messages, messages + count - nb_read, nb_read * sizeof(Message));
+    return nb_read;
+}
+
+// A function that will add to the search index of a channel the records of its history
+// that are after index->last
+// The index isn't shared yet, or the mutex_search is locked
+
+void search_index_load(SearchIndex * index, const char * channel) {
+    char path[sizeof(HISTORY_DIRECTORY) + CHANNEL_SIZE + 20];
+    Message message;
+    int * segments;
+    int nb_segments;
+    char * log;
+    char * entries;
+    long log_size;
+    long entries_size;
+    long i;
+    int j = 0;
+
+    nb_segments = history_segments(channel, &segments);
+    while (j < nb_segments) {
+        // The segments before the last record are already in the index
+        if (segments[j] < (index->last >> 32)) {
+            j = j + 1;
+            continue;
+        }
+        sprintf(path, "%s%s/%08d.idx", HISTORY_DIRECTORY, channel, segments[j]);
+        entries = history_map(path, &entries_size);
+        sprintf(path, "%s%s/%08d.log", HISTORY_DIRECTORY, channel, segments[j]);
+        log = history_map(path, &log_size);
+        i = 0;
+        if (segments[j] == (index->last >> 32)) {
+            i = (index->last & 0xFFFFFFFF) + 1;
+        }
+        while (entries != NULL && log != NULL && i < entries_size / (long) sizeof(HistoryIndex)) {
+            if (history_decode(log, log_size, (HistoryIndex *) entries + i, channel, &message) == 1) {
+                search_index_text(index, ((long) segments[j] << 32) | i, message.message);
+            }
+            i = i + 1;
+        }
+        if (entries != NULL) {
+            munmap(entries, entries_size);
+        }
+        if (log != NULL) {
+            munmap(log, log_size);
+        }
+        j = j + 1;
+    }
+    free(segments);
+}
+
+// A function that will give the search index of a channel, built the first time
+// It is built with the mutex_search unlocked, the mutex_search must be locked when it is called
+// and it is locked again when the function returns
+
+SearchIndex * search_index_get(const char * channel) {
+    SearchIndex * index = search_index_find(channel);
+    SearchIndex * built;
+    long generation;
+
+    while (index == NULL) {
+        generation = search_generation;
+        // Unlock the mutex
+        pthread_mutex_unlock(&mutex_search);
+        built = calloc(1, sizeof(SearchIndex));
+        strcpy(built->name, channel);
+        search_index_load(built, channel);
+        // Lock the mutex
+        pthread_mutex_lock(&mutex_search);
+        index = search_index_find(channel);
+        if (index == NULL && generation == search_generation) {
+            // The messages written while it was built were not added by the history thread
+            search_index_load(built, channel);
+            built->next = search_indexes;
+            search_indexes = built;
+            index = built;
+        }
+        else {
+            // Another search built it first, or the channel was deleted meanwhile (then it is built again)
+            // Unlock the mutex
+            pthread_mutex_unlock(&mutex_search);
+            search_index_free(built);
+            // Lock the mutex
+            pthread_mutex_lock(&mutex_search);
+            index = search_index_find(channel);
+        }
+    }
+    return index;
+}
+
+// A function that will read the next record of postings, at *position, and move *position after it
+// previous is the record read before it (0 for the first one)
+// It returns the record
+
+long search_postings_next(const SearchPostings * postings, long * position, long previous) {
+    long delta = 0;
+    int shift = 0;
+
+    while (postings->data[*position] & 128) {
+        delta = delta | ((long) (postings->data[*position] & 127) << shift);
+        shift = shift + 7;
+        *position = *position + 1;
+    }
+    delta = delta | ((long) postings->data[*position] << shift);
+    *position = *position + 1;
+    return previous + delta;
+}
+
+// A function that will keep in records (nb_records numbers, sorted) only the records
+// that are also in postings
+// It returns the number of records kept
+
+long search_intersect(long * records, long nb_records, const SearchPostings * postings) {
+    long position = 0;
+    long number = 0;
+    long kept = 0;
+    long i = 0;
+
+    while (position < postings->size && i < nb_records) {
+        number = search_postings_next(postings, &position, number);
+        while (i < nb_records && records[i] < number) {
+            i = i + 1;
+        }
+        if (i < nb_records && records[i] == number) {
+            records[kept] = number;
+            kept = kept + 1;
+            i = i + 1;
+        }
+    }
+    return kept;
+}
+
+// A function that will search the messages of a channel that have all the words of text
+// and were sent after since (in seconds since 1970, 0 for all of them)
+// The newest count messages found are put in messages, from the oldest to the newest,
+// with the command "history" like the history
+// It returns the number of messages found
+
+int search_history(const char * channel, const char * text, long since, int count, Message * messages) {
+    char path[sizeof(HISTORY_DIRECTORY) + CHANNEL_SIZE + 20];
+    char word[SEARCH_WORD_SIZE];
+    SearchPostings * words[SEARCH_QUERY_WORDS];
+    SearchIndex * index;
+    long * records = NULL;
+    long nb_records = 0;
+    int nb_words = 0;
+    int smallest = 0;
+    int missing = 0;
+    int nb_found = 0;
+    int segment = 0;
+    char * log = NULL;
+    char * entries = NULL;
+    long log_size = 0;
+    long entries_size = 0;
+    long place;
+    long i;
+    int j = 0;
+
+    if (history_valid_name(channel) == 0) {
+        return 0;
+    }
+
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_search);
+    index = search_index_get(channel);
+    while (nb_words < SEARCH_QUERY_WORDS && search_next_word(&text, word) == 1) {
+        words[nb_words] = search_postings(index, word, 0);
+        if (words[nb_words] == NULL) {
+            missing = 1;
+            break;
+        }
+        if (words[nb_words]->count < words[smallest]->count) {
+            smallest = nb_words;
+        }
+        nb_words = nb_words + 1;
+    }
+    // The records of the rarest word are kept if the other words are in them too
+    if (missing == 0 && nb_words > 0) {
+        records = malloc(words[smallest]->count * sizeof(long));
+        place = 0;
+        while (nb_records < words[smallest]->count) {
+            records[nb_records] = search_postings_next(words[smallest], &place, nb_records > 0 ? records[nb_records - 1] : 0);
+            nb_records = nb_records + 1;
+        }
+        while (j < nb_words) {
+            if (j != smallest) {
+                nb_records = search_intersect(records, nb_records, words[j]);
+            }
+            j = j + 1;
+        }
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_search);
+
+    // The records are read from the newest, until count are found or they are older than since
+    i = nb_records - 1;
+    while (i >= 0 && nb_found < count) {
+        if ((int) (records[i] >> 32) != segment) {
+            if (entries != NULL) {
+                munmap(entries, entries_size);
+            }
+            if (log != NULL) {
+                munmap(log, log_size);
+            }
+            segment = records[i] >> 32;
+            sprintf(path, "%s%s/%08d.idx", HISTORY_DIRECTORY, channel, segment);
+            entries = history_map(path, &entries_size);
+            sprintf(path, "%s%s/%08d.log", HISTORY_DIRECTORY, channel, segment);
+            log = history_map(path, &log_size);
+        }
+        place = records[i] & 0xffffffff;
+        if (entries != NULL && log != NULL && place < entries_size / (long) sizeof(HistoryIndex)) {
+            if (((HistoryIndex *) entries)[place].time < since) {
+                break;
+            }
+            if (history_decode(log, log_size, (HistoryIndex *) entries + place, channel, messages + count - nb_found - 1) == 1) {
+                nb_found = nb_found + 1;
+            }
+        }
+        i = i - 1;
+    }
+    if (entries != NULL) {
+        munmap(entries, entries_size);
+    }
+    if (log != NULL) {
+        munmap(log, log_size);
+    }
+    free(records);
+    memmove(messages, messages + count - nb_found, nb_found * sizeof(Message));
+    return nb_found;
+}
+
+// The last HISTORY_RING_SIZE messages of a channel, kept in memory
+// They are ready to be sent: command "history" and time in hexadecimal in to
+// A client who joins the channel receives them all at once (see send_backfill)
+typedef struct HistoryRing HistoryRing;
+struct HistoryRing {
+    char name[CHANNEL_SIZE];
+    Message messages[HISTORY_RING_SIZE];
+    // The oldest message, and the number of messages
+    int first;
+    int count;
+    HistoryRing * next;
+};
+
+HistoryRing * history_rings = NULL;
+
+// Mutex to protect the rings
+pthread_mutex_t mutex_history_ring;
+
+// A function that will give the ring of a channel
+// The first time, after the server started, it is filled with the last messages of the history on the disk
+// The mutex_history_ring must be locked
+
+HistoryRing * history_ring_get(const char * channel) {
+    HistoryRing * ring = history_rings;
+
+    while (ring != NULL) {
+        if (strcmp(ring->name, channel) == 0) {
+            return ring;
+        }
+        ring = ring->next;
+    }
+    ring = malloc(sizeof(HistoryRing));
+    strcpy(ring->name, channel);
+    ring->first = 0;
+    ring->count = history_read(channel, HISTORY_RING_SIZE, ring->messages);
+    ring->next = history_rings;
+    history_rings = ring;
+    return ring;
+}
+
+// A function that will copy the messages of the ring of a channel in messages (HISTORY_RING_SIZE at most),
+// from the oldest to the newest
+// It returns the number of messages
+
+int history_ring_copy(const char * channel, Message * messages) {
+    HistoryRing * ring;
+    int i = 0;
+
+    if (history_valid_name(channel) == 0) {
+        return 0;
+    }
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_history_ring);
+    ring = history_ring_get(channel);
+    while (i < ring->count) {
+        memcpy(&messages[i], &ring->messages[(ring->first + i) % HISTORY_RING_SIZE], sizeof(Message));
+        i = i + 1;
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_history_ring);
+    return i;
+}
+
+// A function that will add a message sent in a channel to the history of the channel
+// It is also put in the ring of the channel
+
+void history_append(Message * buffer) {
+    HistoryRecord * record;
+    HistoryRing * ring;
+    Message * message;
+    long now = time(NULL);
+
+    if (history_valid_name(buffer->channel) == 0) {
+        return;
+    }
+
+    // The message is put in the ring as it will be sent, the oldest message is replaced if the ring is full
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_history_ring);
+    ring = history_ring_get(buffer->channel);
+    if (ring->count < HISTORY_RING_SIZE) {
+        message = &ring->messages[(ring->first + ring->count) % HISTORY_RING_SIZE];
+        ring->count = ring->count + 1;
+    }
+    else {
+        message = &ring->messages[ring->first];
+        ring->first = (ring->first + 1) % HISTORY_RING_SIZE;
+    }
+    memcpy(message, buffer, sizeof(Message));
+    strcpy(message->cmd, "history");
+    sprintf(message->to, "%08lx", (unsigned long) now);
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_history_ring);
+
+    record = malloc(sizeof(HistoryRecord));
+    strcpy(record->channel, buffer->channel);
+    strcpy(record->from, buffer->from);
+    strcpy(record->color, buffer->color);
+    strcpy(record->message, buffer->message);
+    record->time = now;
+    record->deleted = 0;
+    history_push(record);
+}
+
+// A function that will remove the history of a channel that is deleted
+// It is removed after the messages already waiting, so none of them is left behind
+
+void history_delete(const char * channel) {
+    HistoryRecord * record;
+
+    if (history_valid_name(channel) == 0) {
+        return;
+    }
+    // The ring is emptied, it must not be read again from the disk before the history is removed
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_history_ring);
+    history_ring_get(channel)->count = 0;
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_history_ring);
+
+    record = malloc(sizeof(HistoryRecord));
+    memset(record, 0, sizeof(HistoryRecord));
+    strcpy(record->channel, channel);
+    record->deleted = 1;
+    history_push(record);
+}
+
+// A function that will start the history thread
+
+void history_start() {
+    pthread_t history_tid;
+
+    if (mkdir(HISTORY_DIRECTORY, 0755) == -1 && errno != EEXIST) {
+        perror("Erreur lors de la creation du dossier server_history");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&mutex_history, NULL);
+    pthread_mutex_init(&mutex_history_ring, NULL);
+    pthread_mutex_init(&mutex_search, NULL);
+    pthread_cond_init(&cond_history, NULL);
+    pthread_cond_init(&cond_history_space, NULL);
+    history_repair();
+    if (pthread_create(&history_tid, NULL, history_thread, NULL) != 0) {
+        perror("Erreur lors de la creation du thread de l'historique");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+// A function that will send count frames on the main connection dS of the client client_indice
+// They are sent with a single write, and no other frame can come between them
+// Every thread that sends on a main connection uses it, so two frames are never mixed
+// If bulk is 1, the frame carries file data of a multiplexed stream,
+// and it waits until no chat message is waiting to be sent
+// It returns the number of bytes sent, or -1 if there was an error
+
+ssize_t send_client_frames(int client_indice, int dS, Message * frames, int count, int bulk) {
+    ssize_t nb_send;
+    Sender * sender = &tab_sender[client_indice];
+
+    // Lock the mutex
+    pthread_mutex_lock(&sender->mutex);
+    if (bulk == 0) {
+        sender->nb_chat_waiting = sender->nb_chat_waiting + 1;
+    }
+    while (sender->busy == 1 || (bulk == 1 && sender->nb_chat_waiting > 0)) {
+        pthread_cond_wait(&sender->cond, &sender->mutex);
+    }
+    if (bulk == 0) {
+        sender->nb_chat_waiting = sender->nb_chat_waiting - 1;
+    }
+    sender->busy = 1;
+    // Unlock the mutex, the other threads wait on busy
+    pthread_mutex_unlock(&sender->mutex);
+
+    nb_send = send_full(dS, frames, count * sizeof(Message));
+
+    // Lock the mutex
+    pthread_mutex_lock(&sender->mutex);
+    sender->busy = 0;
+    pthread_cond_broadcast(&sender->cond);
+    // Unlock the mutex
+    pthread_mutex_unlock(&sender->mutex);
+    return nb_send;
+}
+
+// A function that will send one frame on the main connection dS of the client client_indice
+// (see send_client_frames)
+
+ssize_t send_client(int client_indice, int dS, Message * buffer, int bulk) {
+    return send_client_frames(client_indice, dS, buffer, 1, bulk);
+}
+
+// A function that will put count frames in the outbox of the client client_indice, for his main
+// connection dS, they will be sent by the thread of his sender in this order
+// It never waits: if the outbox is full, the client doesn't read his messages and he is disconnected
+// (his thread will clean up)
+// It returns 0, or -1 if the frames were not put in the outbox
+
+int send_outbox(int client_indice, int dS, Message * frames, int count) {
+    Sender * sender = &tab_sender[client_indice];
+    int position;
+    int i = 0;
+
+    // Lock the mutex
+    pthread_mutex_lock(&sender->mutex);
+    if (sender->nb_outbox + count > OUTBOX_MAX || sender->outbox_refused == dS) {
+        if (sender->outbox_refused != dS) {
+            sender->outbox_refused = dS;
+            printf("Le client: %d ne lit pas ses messages, il est deconnecte\n", client_indice + 1);
+            shutdown(dS, SHUT_RDWR);
+        }
+        // Unlock the mutex
+        pthread_mutex_unlock(&sender->mutex);
+        return -1;
+    }
+    while (i < count) {
+        position = (sender->outbox_first + sender->nb_outbox) % OUTBOX_MAX;
+        sender->outbox_dS[position] = dS;
+        memcpy(&sender->outbox[position], &frames[i], sizeof(Message));
+        sender->nb_outbox = sender->nb_outbox + 1;
+        i = i + 1;
+    }
+    pthread_cond_broadcast(&sender->cond_outbox);
+    // Unlock the mutex
+    pthread_mutex_unlock(&sender->mutex);
+    return 0;
+}
+
+// A function that will forget the messages waiting in the outbox of the client client_indice,
+// when he disconnects, and wait until the thread of the sender no longer sends on dS
+// Then dS can be closed: its number can't be used by the sender for another connection
+
+void outbox_clear(int client_indice, int dS) {
+    Sender * sender = &tab_sender[client_indice];
+
+    // The messages being sent fail right away
+    shutdown(dS, SHUT_RDWR);
+    // Lock the mutex
+    pthread_mutex_lock(&sender->mutex);
+    sender->nb_outbox = 0;
+    sender->outbox_refused = 0;
+    while (sender->outbox_sending == dS) {
+        pthread_cond_wait(&sender->cond_outbox, &sender->mutex);
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&sender->mutex);
+}
+
+// A function for the thread of the sender of a spot of the tab_client array,
+// it sends the messages of its outbox, OUTBOX_BATCH at most with a single write
+// arg is a pointer to the indice of the spot
+
+void * sender_thread(void * arg) {
+    int client_indice = *(int *) arg;
+    Sender * sender = &tab_sender[client_indice];
+    Message frames[OUTBOX_BATCH];
+    int count;
+    int dS;
+
+    free(arg);
+    while (1) {
+        // Lock the mutex
+        pthread_mutex_lock(&sender->mutex);
+        while (sender->nb_outbox == 0) {
+            pthread_cond_wait(&sender->cond_outbox, &sender->mutex);
+        }
+        // The frames sent together are for the same connection
+        dS = sender->outbox_dS[sender->outbox_first];
+        count = 0;
+        while (count < OUTBOX_BATCH && sender->nb_outbox > 0 && sender->outbox_dS[sender->outbox_first] == dS) {
+            memcpy(&frames[count], &sender->outbox[sender->outbox_first], sizeof(Message));
+            sender->outbox_first = (sender->outbox_first + 1) % OUTBOX_MAX;
+            sender->nb_outbox = sender->nb_outbox - 1;
+            count = count + 1;
+        }
+        sender->outbox_sending = dS;
+        // Unlock the mutex
+        pthread_mutex_unlock(&sender->mutex);
+
+        if (send_client_frames(client_indice, dS, frames, count, 0) == -1) {
+            // The client is disconnecting, his thread will clean up
+            printf("Le client: %d s'est deconnecte, donc le message ne s'est pas envoye a lui\n", client_indice + 1);
+        }
+
+        // Lock the mutex
+        pthread_mutex_lock(&sender->mutex);
+        sender->outbox_sending = 0;
+        pthread_cond_broadcast(&sender->cond_outbox);
+        // Unlock the mutex
+        pthread_mutex_unlock(&sender->mutex);
+    }
+    return arg;
+}
+
+
+// A function that will send to the client client_indice the last messages of the channel buffer->channel
+// buffer->message is the number of messages he wants (HISTORY_REPLY_MAX at most)
+// Each message is sent with the command "history" (see history_decode), all of them with a single write
+// The client must be in the channel
+// It returns -1 if there was an error while sending, 0 otherwise
+
+int send_history(int client_indice, int dS, Message * buffer) {
+    Message * messages;
+    int count = atoi(buffer->message);
+    int nb_read = 0;
+    int member;
+    ssize_t nb_send = 0;
+
+    buffer->channel[CHANNEL_SIZE - 1] = '\0';
+    if (count <= 0 || count > HISTORY_REPLY_MAX) {
+        count = HISTORY_REPLY_MAX;
+    }
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_tab_channel[client_indice]);
+    member = is_in_list(tab_channel[client_indice], buffer->channel);
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_tab_channel[client_indice]);
+
+    messages = malloc(count * sizeof(Message));
+    if (member == 1) {
+        nb_read = history_read(buffer->channel, count, messages);
+    }
+    if (nb_read > 0) {
+        nb_send = send_client_frames(client_indice, dS, messages, nb_read, 0);
+    }
+    free(messages);
+
+    // If there is nothing to send, we tell the client why
+    if (nb_read == 0) {
+        strcpy(buffer->to, buffer->from);
+        strcpy(buffer->from, "Serveur");
+        strcpy(buffer->cmd, "error");
+        if (member == 1) {
+            sprintf(buffer->message, "L'historique du channel %s est vide", buffer->channel);
+        }
+        else {
+            sprintf(buffer->message, "Vous n'etes pas dans le channel %s", buffer->channel);
+        }
+        strcpy(buffer->channel, "global");
+        nb_send = send_client(client_indice, dS, buffer, 0);
+    }
+    if (nb_send == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+// A function that will send to the client client_indice the messages of the channel buffer->channel
+// (global if it is empty) that have all the words of buffer->message
+// buffer->to is the time in hexadecimal from which the messages are searched, 0 for all of them
+// The newest HISTORY_REPLY_MAX messages found are sent like the history, all of them with a single write
+// The client must be in the channel
+// It returns -1 if there was an error while sending, 0 otherwise
+
+int send_search(int client_indice, int dS, Message * buffer) {
+    Message * messages = malloc(HISTORY_REPLY_MAX * sizeof(Message));
+    long since;
+    int nb_found = 0;
+    int member;
+    ssize_t nb_send = 0;
+
+    buffer->channel[CHANNEL_SIZE - 1] = '\0';
+    buffer->to[USERNAME_SIZE - 1] = '\0';
+    buffer->message[MSG_SIZE - 1] = '\0';
+    if (strcmp(buffer->channel, "") == 0) {
+        strcpy(buffer->channel, "global");
+    }
+    since = strtol(buffer->to, NULL, 16);
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_tab_channel[client_indice]);
+    member = is_in_list(tab_channel[client_indice], buffer->channel);
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_tab_channel[client_indice]);
+
+    if (member == 1) {
+        nb_found = search_history(buffer->channel, buffer->message, since, HISTORY_REPLY_MAX, messages);
+    }
+    if (nb_found > 0) {
+        nb_send = send_client_frames(client_indice, dS, messages, nb_found, 0);
+    }
+    free(messages);
+
+    // If nothing was found, we tell the client why
+    if (nb_found == 0) {
+        strcpy(buffer->to, buffer->from);
+        strcpy(buffer->from, "Serveur");
+        strcpy(buffer->cmd, "error");
+        if (member == 1) {
+            sprintf(buffer->message, "Aucun message du channel %s ne correspond a la recherche", buffer->channel);
+        }
+        else {
+            sprintf(buffer->message, "Vous n'etes pas dans le channel %s", buffer->channel);
+        }
+        strcpy(buffer->channel, "global");
+        nb_send = send_client(client_indice, dS, buffer, 0);
+    }
+    if (nb_send == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+// A function that will send to the client client_indice, who just joined the channel,
+// the last messages of the channel kept in its ring, for his main connection dS
+// They are sent with the command "backfill", so the client shows them in the window of the channel
+// and not with the replies of /history
+
+void send_backfill(int client_indice, int dS, char * channel) {
+    Message * messages = malloc(HISTORY_RING_SIZE * sizeof(Message));
+    int nb_messages = history_ring_copy(channel, messages);
+    int i = 0;
+
+    while (i < nb_messages) {
+        strcpy(messages[i].cmd, "backfill");
+        i = i + 1;
+    }
+
+    // The actor of the channel puts them in his outbox, before the next messages of the channel
+    if (nb_messages > 0) {
+        send_outbox(client_indice, dS, messages, nb_messages);
+    }
+    free(messages);
+}
+
+
+/*********************************************
+              Federation links
+**********************************************/
+
+// The servers of the federation send each other frames: a type, the identifier of the server
+// that sends the frame, and a Message
+//   "hello"   : the first frame of a link, in both directions
+//   "ready"   : the server has the link in its federation_links array, the next frames can be sent
+//   "sub"     : the server now has members in message.channel
+//   "unsub"   : the server no longer has members in message.channel
+//   "msg"     : message is sent in its channel, by a client of the server
+//   "online"  : message.from is now connected to the server
+//   "offline" : message.from is no longer connected to the server
+//   "dm"      : message is a dm for message.to, who is connected to the other server
+// A message of a channel is only sent to the servers that have members in the channel
+
+typedef struct FederationFrame FederationFrame;
+struct FederationFrame {
+    char type[CMD_SIZE];
+    char node[NODE_ID_SIZE];
+    Message message;
+};
+
+// The frames don't go through the sockets between two servers on the same machine: each server
+// has a ring of frames in shared memory (a memfd), the other servers write in it and it reads it
+// All the frames of a link go through the ring once it is ready, so they are read in the order
+// they were sent (the socket only carries "hello" and "ready", and tells when the link is cut)
+// Each slot has a sequence: the writer of the frame at position p waits for the sequence p,
+// and writes p + 1 once the frame is in the slot, then the reader writes p + FEDERATION_RING_SLOTS
+// A writer takes a position by incrementing tail, so several servers can write at the same time
+// The reader sleeps on the futex when the ring is empty, the writers wake it up
+// The writers sleep on space when the ring is full, the reader wakes them up
+// A writer that dies (or is stopped) between taking a position and writing p + 1 would block the reader:
+// after FEDERATION_RING_WAIT seconds, the reader writes p + FEDERATION_RING_SLOTS itself and skips the slot
+// Both sides change the sequence with a compare and swap, so a writer that comes back too late
+// sees that it lost the slot and writes its frame again at another position
+
+struct FederationSlot {
+    uint64_t sequence;
+    FederationFrame frame;
+};
+
+struct FederationRing {
+    // FEDERATION_RING_MAGIC and the identifier of the server that reads the ring
+    uint32_t magic;
+    char node[NODE_ID_SIZE];
+    // Incremented after each frame written, the reader waits on it
+    uint32_t futex;
+    // 1 while the reader is going to sleep
+    uint32_t sleeping;
+    // Incremented when a slot is freed while writers wait, they wait on it
+    uint32_t space;
+    // 1 while writers wait for a free slot
+    uint32_t waiting;
+    // The position of the next frame to write
+    uint64_t tail;
+    struct FederationSlot slots[FEDERATION_RING_SLOTS];
+};
+
+// A function that will wait on or wake up a futex, the word can be in shared memory
+// (no FUTEX_PRIVATE_FLAG)
+
+long futex(uint32_t * word, int operation, uint32_t value, const struct timespec * timeout) {
+    return syscall(SYS_futex, word, operation, value, timeout, NULL, 0);
+}
+
+// A function that will write a frame in the ring of another server
+// It returns 0, or -1 if the ring is full or the reader skipped the slot before the frame was written
+
+int federation_ring_push(FederationRing * ring, FederationFrame * frame) {
+    struct FederationSlot * slot;
+    uint64_t position = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint64_t expected;
+    int64_t difference;
+
+    while (1) {
+        slot = &ring->slots[position % FEDERATION_RING_SLOTS];
+        difference = (int64_t) (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - position);
+        if (difference == 0) {
+            // The slot is free, we take the position if no other writer took it first
+            if (__atomic_compare_exchange_n(&ring->tail, &position, position + 1, 0,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        else if (difference < 0) {
+            // The ring is full, the reader hasn't read the frame of the last turn yet
+            return -1;
+        }
+        else {
+            // Another writer took the position
+            position = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    memcpy(&slot->frame, frame, sizeof(FederationFrame));
+    expected = position;
+    if (!__atomic_compare_exchange_n(&slot->sequence, &expected, position + 1, 0,
+                                     __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+    __atomic_add_fetch(&ring->futex, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->sleeping, __ATOMIC_SEQ_CST) == 1) {
+        futex(&ring->futex, FUTEX_WAKE, 1, NULL);
+    }
+    return 0;
+}
+
+// A function that will send a frame of type to the server of the link
+// The frame goes through its ring if it is on the same machine, never through the socket
+// If its ring is full, we wait outside the mutex of the link (the other links keep sending)
+// If the send fails or the ring stays full, the link is shut down, its thread will clean it up
+
+void federation_send(int link, const char * type, Message * message) {
+    FederationLink * federation_link = &federation_links[link];
+    FederationFrame frame;
+    FederationRing * ring;
+    struct timespec timeout;
+    time_t deadline = time(NULL) + FEDERATION_RING_WAIT;
+    uint32_t seen;
+
+    memset(&frame, 0, sizeof(FederationFrame));
+    strcpy(frame.type, type);
+    strcpy(frame.node, node_id);
+    if (message != NULL) {
+        memcpy(&frame.message, message, sizeof(Message));
+    }
+    // Lock the mutex
+    pthread_mutex_lock(&federation_link->mutex);
+    // Before "ready", the other server is told everything by federation_introduce
+    while (federation_link->socket != 0 && federation_link->ready == 1 && federation_link->ring != NULL) {
+        ring = federation_link->ring;
+        // The reader wakes us up if it frees a slot after we see the ring full
+        __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+        seen = __atomic_load_n(&ring->space, __ATOMIC_SEQ_CST);
+        if (federation_ring_push(ring, &frame) == 0) {
+            // Unlock the mutex
+            pthread_mutex_unlock(&federation_link->mutex);
+            return;
+        }
+        if (time(NULL) >= deadline) {
+            printf("L'anneau du serveur %s est plein, le lien est coupe\n", federation_link->node);
+            shutdown(federation_link->socket, SHUT_RDWR);
+            break;
+        }
+        // The ring is only unmapped with the mutex locked: while it is unlocked, the address
+        // is only given to the kernel, and it is read again once the mutex is locked
+        // Unlock the mutex
+        pthread_mutex_unlock(&federation_link->mutex);
+        timeout.tv_sec = 1;
+        timeout.tv_nsec = 0;
+        futex(&ring->space, FUTEX_WAIT, seen, &timeout);
+        // Lock the mutex
+        pthread_mutex_lock(&federation_link->mutex);
+    }
+    if (federation_link->socket != 0 && federation_link->ready == 1 && federation_link->ring == NULL
+        && send_full(federation_link->socket, &frame, sizeof(FederationFrame)) == -1) {
+        shutdown(federation_link->socket, SHUT_RDWR);
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&federation_link->mutex);
+}
+
+// A function that will send a frame of type to all the servers of the federation
+
+void federation_send_all(const char * type, Message * message) {
+    int link = 0;
+
+    while (link < FEDERATION_LINKS_MAX) {
+        federation_send(link, type, message);
+        link = link + 1;
+    }
+}
+
+// A function that will tell the server of the link (all the servers if link is -1)
+// that this server has members in channel ("sub") or no longer has any ("unsub")
+
+void federation_subscribe(int link, const char * type, const char * channel) {
+    Message message;
+
+    memset(&message, 0, sizeof(Message));
+    strcpy(message.channel, channel);
+    if (link == -1) {
+        federation_send_all(type, &message);
+    }
+    else {
+        federation_send(link, type, &message);
+    }
+}
+
+// A function that will tell all the servers that username is connected ("online")
+// or no longer connected ("offline") to this server
+
+void federation_presence(const char * type, const char * username) {
+    Message message;
+
+    memset(&message, 0, sizeof(Message));
+    strcpy(message.from, username);
+    federation_send_all(type, &message);
+}
+
+// A function that will send a message of a channel to the servers that have members in the channel
+
+void federation_forward(Message * message) {
+    int link = 0;
+    int subscribed;
+
+    while (link < FEDERATION_LINKS_MAX) {
+        // Lock the mutex
+        pthread_mutex_lock(&federation_links[link].mutex);
+        subscribed = federation_links[link].socket != 0
+            && is_in_list(federation_links[link].channels, message->channel);
+        // Unlock the mutex
+        pthread_mutex_unlock(&federation_links[link].mutex);
+        if (subscribed == 1) {
+            federation_send(link, "msg", message);
+        }
+        link = link + 1;
+    }
+}
+
+
+/*********************************************
+              Channel actors
+**********************************************/
+
+// Each channel is owned by an actor: it has the members of the channel and a mailbox of events
+// (a client joins, a client leaves, a message is sent, the channel is deleted)
+// The events of a channel are handled one after the other, in the order they were posted,
+// so its members and its messages never need a lock shared with the other channels
+// An actor is created by the first event of its channel, and freed once it has no member
+// and no event waiting
+// The actors are spread by the hash of their name over the workers, one thread per core
+// A worker handles all the events waiting for an actor, then goes to the next actor with events
+// The other servers of the federation are told when a channel gets its first member here or loses
+// its last one, and the messages of the clients are forwarded to the servers with members
+// The arrivals and departures of the users are put together: the members receive one digest
+// for each window of the configuration instead of one message for each of them
+
+typedef struct ChannelEvent ChannelEvent;
+struct ChannelEvent {
+    // CHANNEL_JOIN, CHANNEL_LEAVE, CHANNEL_BROADCAST, CHANNEL_DELETE, CHANNEL_ANNOUNCE,
+    // CHANNEL_ARRIVAL, CHANNEL_DEPARTURE or CHANNEL_DIGEST
+    int type;
+    // The client who joins, leaves or sends the message (-1 for the server or another server)
+    // For CHANNEL_ANNOUNCE, the indice of the link with the server to tell
+    int client;
+    // The main connection of the client who joins
+    int dS;
+    // 1 if the client who joins receives the last messages of the channel
+    int backfill;
+    // The message sent
+    Message message;
+    // If it isn't NULL, it is posted once the event is handled
+    sem_t * done;
+    ChannelEvent * next;
+};
+
+#define CHANNEL_JOIN 0
+#define CHANNEL_LEAVE 1
+#define CHANNEL_BROADCAST 2
+#define CHANNEL_DELETE 3
+#define CHANNEL_ANNOUNCE 4
+#define CHANNEL_ARRIVAL 5
+#define CHANNEL_DEPARTURE 6
+#define CHANNEL_DIGEST 7
+
+typedef struct ChannelActor ChannelActor;
+struct ChannelActor {
+    char name[CHANNEL_SIZE];
+    // The worker that handles the events of the channel
+    int worker;
+    // The main connection of each member, 0 if the client isn't in the channel
+    // Only the worker of the actor uses it
+    int members[MAX_CLIENT];
+    // The number of members
+    int nb_members;
+    // The users who arrived in the channel (1) or left it (-1) since the last digest
+    // Only the worker of the actor uses them
+    char presence_names[MAX_CLIENT][USERNAME_SIZE];
+    int presence_moves[MAX_CLIENT];
+    int presence_clients[MAX_CLIENT];
+    int nb_presence;
+    // The time of the next digest, 1 if the actor waits for it, and the next actor waiting
+    // They are protected by mutex_presence
+    struct timespec presence_deadline;
+    int presence_queued;
+    ChannelActor * next_presence;
+    // The mutex to protect the mailbox and scheduled
+    pthread_mutex_t mutex;
+    // The events waiting, from the oldest to the newest
+    ChannelEvent * first;
+    ChannelEvent * last;
+    // 1 if the actor is in the queue of its worker, or the worker is handling its events
+    int scheduled;
+    // The next actor in the queue of the worker
+    ChannelActor * next_ready;
+    // The number of threads that got the actor with channel_actor and haven't posted their event yet
+    // It is incremented with the mutex of its list locked and decremented with its mutex locked,
+    // the actor can't be freed before 0
+    int refs;
+    // The next actor in the same list of channel_actors
+    ChannelActor * next;
+};
+
+typedef struct ChannelWorker ChannelWorker;
+struct ChannelWorker {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    // The actors that have events waiting
+    ChannelActor * first;
+    ChannelActor * last;
+};
+
+// The actors, in lists chosen by the hash of their name, each list has its mutex
+ChannelActor * channel_actors[ACTOR_BUCKETS];
+pthread_mutex_t mutex_channel_actors[ACTOR_BUCKETS];
+
+ChannelWorker channel_workers[CHANNEL_WORKERS_MAX];
+int nb_channel_workers = 0;
+
+// The number of milliseconds during which the arrivals and departures of a channel are put
+// together before the digest is sent, 0 to send each of them right away (see sched_load_config)
+long presence_window = 0;
+
+// The actors waiting for their digest, from the first to the last deadline (see presence_thread)
+ChannelActor * presence_first = NULL;
+ChannelActor * presence_last = NULL;
+
+// Mutex and condition to protect the presence_window, the actors waiting for their digest,
+// and wake up the presence thread
+pthread_mutex_t mutex_presence;
+pthread_cond_t cond_presence;
+
+// A function that will give the hash of a channel name (FNV-1a)
+
+unsigned int channel_hash(const char * name) {
+    unsigned int hash = 2166136261u;
+
+    while (*name != '\0') {
+        hash = (hash ^ (unsigned char) *name) * 16777619u;
+        name = name + 1;
+    }
+    return hash;
+}
+
+// A function that will give the actor of a channel, it is created if it doesn't exist
+// The actor can't be freed until the caller has posted its event (see channel_post)
+
+ChannelActor * channel_actor(const char * channel) {
+    unsigned int hash = channel_hash(channel);
+    int bucket = hash % ACTOR_BUCKETS;
+    ChannelActor * actor;
+
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_channel_actors[bucket]);
+    actor = channel_actors[bucket];
+    while (actor != NULL && strcmp(actor->name, channel) != 0) {
+        actor = actor->next;
+    }
+    if (actor == NULL) {
+        actor = calloc(1, sizeof(ChannelActor));
+        strcpy(actor->name, channel);
+        actor->worker = (hash / ACTOR_BUCKETS) % nb_channel_workers;
+        pthread_mutex_init(&actor->mutex, NULL);
+        actor->next = channel_actors[bucket];
+        channel_actors[bucket] = actor;
+    }
+    __atomic_add_fetch(&actor->refs, 1, __ATOMIC_SEQ_CST);
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_channel_actors[bucket]);
+    return actor;
+}
+
+// A function that will put an event in the mailbox of an actor, got with channel_actor
+// If the actor had no event waiting, it is put in the queue of its worker
+// The actor is released with the event in its mailbox, so it can't be freed before handling it
+
+void channel_post(ChannelActor * actor, ChannelEvent * event) {
+    ChannelWorker * worker = &channel_workers[actor->worker];
+    int wake = 0;
+
+    event->next = NULL;
+    // Lock the mutex
+    pthread_mutex_lock(&actor->mutex);
+    if (actor->last == NULL) {
+        actor->first = event;
+    }
+    else {
+        actor->last->next = event;
+    }
+    actor->last = event;
+    __atomic_sub_fetch(&actor->refs, 1, __ATOMIC_SEQ_CST);
+    if (actor->scheduled == 0) {
+        actor->scheduled = 1;
+        wake = 1;
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&actor->mutex);
+
+    if (wake == 1) {
+        // Lock the mutex
+        pthread_mutex_lock(&worker->mutex);
+        actor->next_ready = NULL;
+        if (worker->last == NULL) {
+            worker->first = actor;
+        }
+        else {
+            worker->last->next_ready = actor;
+        }
+        worker->last = actor;
+        pthread_cond_signal(&worker->cond);
+        // Unlock the mutex
+        pthread_mutex_unlock(&worker->mutex);
+    }
+}
+
+// A function that will create an event for the channel and post it
+// If wait is 1, it returns once the event is handled
+
+void channel_event(const char * channel, int type, int client, int dS, int backfill, Message * message, int wait) {
+    ChannelEvent * event = malloc(sizeof(ChannelEvent));
+    sem_t done;
+
+    event->type = type;
+    event->client = client;
+    event->dS = dS;
+    event->backfill = backfill;
+    if (message != NULL) {
+        memcpy(&event->message, message, sizeof(Message));
+    }
+    event->done = NULL;
+    if (wait == 1) {
+        sem_init(&done, 0, 0);
+        event->done = &done;
+    }
+    channel_post(channel_actor(channel), event);
+    if (wait == 1) {
+        sem_wait(&done);
+        sem_destroy(&done);
+    }
+}
+
+// A function that will send a message to the members of the channel, except the client client
+// (-1 for a message of the server or of another server), and keep it in the history
+// If forward is 1, it goes to the other servers with members in the channel too
+
+void channel_broadcast(ChannelActor * actor, int client, Message * message, int forward) {
+    int i = 0;
+
+    while (i < MAX_CLIENT) {
+        // We can't send the message to ourselves
+        if (actor->members[i] != 0 && i != client) {
+            send_outbox(i, actor->members[i], message, 1);
+        }
+        i = i + 1;
+    }
+    // The messages of the channels are kept in their history
+    if (strcmp(message->cmd, "") == 0) {
+        history_append(message);
+    }
+    if (forward == 1) {
+        federation_forward(message);
+    }
+}
+
+// A function that will ask the presence thread for the digest of the channel at the end of the window
+// It returns 0 if the window is 0: the arrivals and departures are sent right away
+
+int presence_schedule(ChannelActor * actor) {
+    long window;
+
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_presence);
+    window = presence_window;
+    if (window > 0 && actor->presence_queued == 0) {
+        actor->presence_queued = 1;
+        clock_gettime(CLOCK_REALTIME, &actor->presence_deadline);
+        actor->presence_deadline.tv_nsec = actor->presence_deadline.tv_nsec + (window % 1000) * 1000000;
+        actor->presence_deadline.tv_sec = actor->presence_deadline.tv_sec + window / 1000
+            + actor->presence_deadline.tv_nsec / 1000000000;
+        actor->presence_deadline.tv_nsec = actor->presence_deadline.tv_nsec % 1000000000;
+        actor->next_presence = NULL;
+        if (presence_last == NULL) {
+            presence_first = actor;
+        }
+        else {
+            presence_last->next_presence = actor;
+        }
+        presence_last = actor;
+        pthread_cond_signal(&cond_presence);
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_presence);
+    return window > 0;
+}
+
+// A function that will send to the members of the channel, and to the other servers, one message
+// with the users who arrived and the users who left since the last digest
+
+void channel_digest(ChannelActor * actor) {
+    Message digest;
+    // A digest about one client only isn't sent to him, like the message it replaces
+    int client = actor->nb_presence == 1 ? actor->presence_clients[0] : -1;
+    int move = 1;
+    int nb_names;
+    int i;
+
+    memset(&digest, 0, sizeof(Message));
+    strcpy(digest.from, "Serveur");
+    strcpy(digest.to, "all");
+    strcpy(digest.channel, actor->name);
+    while (move >= -1) {
+        nb_names = 0;
+        i = 0;
+        while (i < actor->nb_presence) {
+            if (actor->presence_moves[i] == move) {
+                if (nb_names == 0) {
+                    if (digest.message[0] != '\0') {
+                        strcat(digest.message, ". ");
+                    }
+                    // Everyone is in global: arriving in it is connecting to the server
+                    if (strcmp(actor->name, "global") == 0) {
+                        strcat(digest.message, move == 1 ? "Connectes : " : "Deconnectes : ");
+                    }
+                    else {
+                        strcat(digest.message, move == 1 ? "Rejoignent le channel : " : "Quittent le channel : ");
+                    }
+                }
+                else {
+                    strcat(digest.message, ", ");
+                }
+                strcat(digest.message, actor->presence_names[i]);
+                nb_names = nb_names + 1;
+            }
+            i = i + 1;
+        }
+        move = move - 2;
+    }
+    actor->nb_presence = 0;
+    if (digest.message[0] != '\0') {
+        channel_broadcast(actor, client, &digest, 1);
+    }
+}
+
+// A function that will add an arrival (move 1) or a departure (move -1) to the next digest of the channel
+// A user who leaves before the digest of his arrival, or comes back before the digest of his departure,
+// isn't in it at all
+
+void channel_presence(ChannelActor * actor, int client, const char * username, int move) {
+    int i = 0;
+
+    while (i < actor->nb_presence) {
+        if (strcmp(actor->presence_names[i], username) == 0) {
+            if (actor->presence_moves[i] != move) {
+                actor->nb_presence = actor->nb_presence - 1;
+                strcpy(actor->presence_names[i], actor->presence_names[actor->nb_presence]);
+                actor->presence_moves[i] = actor->presence_moves[actor->nb_presence];
+                actor->presence_clients[i] = actor->presence_clients[actor->nb_presence];
+            }
+            return;
+        }
+        i = i + 1;
+    }
+    // The digest is full, it is sent before the end of the window
+    if (actor->nb_presence == MAX_CLIENT) {
+        channel_digest(actor);
+    }
+    strcpy(actor->presence_names[actor->nb_presence], username);
+    actor->presence_moves[actor->nb_presence] = move;
+    actor->presence_clients[actor->nb_presence] = client;
+    actor->nb_presence = actor->nb_presence + 1;
+}
+
+// A function that will handle an event of a channel, in the worker of its actor
+
+void channel_handle(ChannelActor * actor, ChannelEvent * event) {
+    int i = 0;
+
+    if (event->type == CHANNEL_JOIN) {
+        // A client who disconnected before the event was handled doesn't join
+        // The channel is put in his list with the same lock as his connection: once channel_leave_all
+        // has cleared it, no channel can be added and it sees all the channels he joined
+        // Lock the mutex
+        pthread_mutex_lock(&mutex_tab_channel[event->client]);
+        if (tab_channel_dS[event->client] != event->dS) {
+            event->dS = 0;
+        }
+        else if (is_in_list(tab_channel[event->client], actor->name) == 0) {
+            add(tab_channel[event->client], actor->name);
+        }
+        // Unlock the mutex
+        pthread_mutex_unlock(&mutex_tab_channel[event->client]);
+        if (event->dS != 0) {
+            if (actor->members[event->client] == 0) {
+                actor->nb_members = actor->nb_members + 1;
+                if (actor->nb_members == 1) {
+                    federation_subscribe(-1, "sub", actor->name);
+                }
+            }
+            actor->members[event->client] = event->dS;
+            // The messages sent after this event reach him after the last messages of the channel
+            if (event->backfill == 1) {
+                send_backfill(event->client, event->dS, actor->name);
+            }
+        }
+    }
+
+    if (event->type == CHANNEL_LEAVE) {
+        if (actor->members[event->client] != 0) {
+            actor->nb_members = actor->nb_members - 1;
+            if (actor->nb_members == 0) {
+                federation_subscribe(-1, "unsub", actor->name);
+            }
+        }
+        actor->members[event->client] = 0;
+        // Lock the mutex
+        pthread_mutex_lock(&mutex_tab_channel[event->client]);
+        if (strcmp(actor->name, "global") != 0) {
+            remove_element(tab_channel[event->client], actor->name);
+        }
+        // Unlock the mutex
+        pthread_mutex_unlock(&mutex_tab_channel[event->client]);
+    }
+
+    if (event->type == CHANNEL_BROADCAST) {
+        // The messages of our clients go to the other servers with members in the channel
+        channel_broadcast(actor, event->client, &event->message, event->client != -1);
+    }
+
+    if (event->type == CHANNEL_ARRIVAL || event->type == CHANNEL_DEPARTURE) {
+        // Without window, the message of the client is sent like the others
+        if (presence_schedule(actor) == 0) {
+            channel_broadcast(actor, event->client, &event->message, 1);
+        }
+        else {
+            channel_presence(actor, event->client, event->message.from, event->type == CHANNEL_ARRIVAL ? 1 : -1);
+        }
+    }
+
+    if (event->type == CHANNEL_DIGEST) {
+        if (actor->nb_presence > 0) {
+            channel_digest(actor);
+        }
+    }
+
+    if (event->type == CHANNEL_DELETE) {
+        // We tell the members that the channel is deleted, and they are no longer in it
+        while (i < MAX_CLIENT) {
+            if (actor->members[i] != 0) {
+                send_outbox(i, actor->members[i], &event->message, 1);
+                actor->members[i] = 0;
+                // Lock the mutex
+                pthread_mutex_lock(&mutex_tab_channel[i]);
+                remove_element(tab_channel[i], actor->name);
+                // Unlock the mutex
+                pthread_mutex_unlock(&mutex_tab_channel[i]);
+            }
+            i = i + 1;
+        }
+        if (actor->nb_members > 0) {
+            actor->nb_members = 0;
+            federation_subscribe(-1, "unsub", actor->name);
+        }
+        // Its history is removed too, a new channel with the same name starts empty
+        history_delete(actor->name);
+    }
+
+    if (event->type == CHANNEL_ANNOUNCE) {
+        // A server that just linked learns if this server has members in the channel
+        if (actor->nb_members > 0) {
+            federation_subscribe(event->client, "sub", actor->name);
+        }
+    }
+}
+
+// A function that will free an actor that has no member and nothing to do, in its worker
+// The actor is removed from its list first, so a new event of the channel creates a new actor
+
+void channel_release(ChannelActor * actor) {
+    int bucket = channel_hash(actor->name) % ACTOR_BUCKETS;
+    ChannelActor ** previous;
+    int unused;
+
+    if (actor->nb_members > 0 || actor->nb_presence > 0) {
+        return;
+    }
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_channel_actors[bucket]);
+    // Lock the mutex
+    pthread_mutex_lock(&actor->mutex);
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_presence);
+    unused = actor->scheduled == 0 && actor->first == NULL && actor->presence_queued == 0
+        && __atomic_load_n(&actor->refs, __ATOMIC_SEQ_CST) == 0;
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_presence);
+    // Unlock the mutex
+    pthread_mutex_unlock(&actor->mutex);
+    if (unused == 1) {
+        previous = &channel_actors[bucket];
+        while (*previous != actor) {
+            previous = &(*previous)->next;
+        }
+        *previous = actor->next;
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_channel_actors[bucket]);
+    if (unused == 1) {
+        pthread_mutex_destroy(&actor->mutex);
+        free(actor);
+    }
+}
+
+// A function for the threads that run the actors
+// arg is the ChannelWorker of the thread
+
+void * channel_worker(void * arg) {
+    ChannelWorker * worker = (ChannelWorker *) arg;
+    ChannelActor * actor;
+    ChannelEvent * events;
+    ChannelEvent * event;
+    int again;
+
+    while (1) {
+        // Lock the mutex
+        pthread_mutex_lock(&worker->mutex);
+        while (worker->first == NULL) {
+            pthread_cond_wait(&worker->cond, &worker->mutex);
+        }
+        actor = worker->first;
+        worker->first = actor->next_ready;
+        if (worker->first == NULL) {
+            worker->last = NULL;
+        }
+        // Unlock the mutex
+        pthread_mutex_unlock(&worker->mutex);
+
+        // We take all the events waiting, the next ones will wait for the next turn of the actor
+        // Lock the mutex
+        pthread_mutex_lock(&actor->mutex);
+        events = actor->first;
+        actor->first = NULL;
+        actor->last = NULL;
+        // Unlock the mutex
+        pthread_mutex_unlock(&actor->mutex);
+
+        while (events != NULL) {
+            event = events;
+            events = events->next;
+            channel_handle(actor, event);
+            if (event->done != NULL) {
+                sem_post(event->done);
+            }
+            free(event);
+        }
+
+        // If events were posted meanwhile, the actor goes back at the end of the queue
+        // Lock the mutex
+        pthread_mutex_lock(&actor->mutex);
+        again = actor->first != NULL;
+        if (again == 0) {
+            actor->scheduled = 0;
+        }
+        // Unlock the mutex
+        pthread_mutex_unlock(&actor->mutex);
+        if (again == 0) {
+            channel_release(actor);
+        }
+        if (again == 1) {
+            // Lock the mutex
+            pthread_mutex_lock(&worker->mutex);
+            actor->next_ready = NULL;
+            if (worker->last == NULL) {
+                worker->first = actor;
+            }
+            else {
+                worker->last->next_ready = actor;
+            }
+            worker->last = actor;
+            // Unlock the mutex
+            pthread_mutex_unlock(&worker->mutex);
+        }
+    }
+    return arg;
+}
+
+// A function that will make the client client_indice join a channel
+// If backfill is 1, he receives the last messages of the channel first
+
+void channel_join(int client_indice, const char * channel, int backfill) {
+    int dS;
+
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_tab_channel[client_indice]);
+    dS = tab_channel_dS[client_indice];
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_tab_channel[client_indice]);
+    if (dS != 0) {
+        channel_event(channel, CHANNEL_JOIN, client_indice, dS, backfill, NULL, 0);
+    }
+}
+
+// A function that will make the client client_indice leave a channel
+
+void channel_leave(int client_indice, const char * channel) {
+    channel_event(channel, CHANNEL_LEAVE, client_indice, 0, 0, NULL, 0);
+}
+
+// A function that will make the client client_indice, who is disconnecting, leave every channel
+// His connection is cleared from tab_channel_dS first, so he can't join another channel meanwhile
+// It returns once no actor can send on his connection anymore, so it can be closed
+
+void channel_leave_all(int client_indice) {
+    char (* names)[CHANNEL_SIZE];
+    ElementList * element;
+    int nb_names = 0;
+    int i = 0;
+
+    // We copy his channels, the actors remove them from the list
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_tab_channel[client_indice]);
+    tab_channel_dS[client_indice] = 0;
+    names = malloc((tab_channel[client_indice]->count + 1) * CHANNEL_SIZE);
+    element = tab_channel[client_indice]->premier;
+    while (element != NULL) {
+        strcpy(names[nb_names], element->name);
+        nb_names = nb_names + 1;
+        element = element->next;
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_tab_channel[client_indice]);
+
+    while (i < nb_names) {
+        channel_event(names[i], CHANNEL_LEAVE, client_indice, 0, 0, NULL, 1);
+        i = i + 1;
+    }
+    free(names);
+}
+
+// A function that will delete a channel: its members receive buffer (command "end") and leave it
+
+void channel_delete(Message * buffer) {
+    channel_event(buffer->channel, CHANNEL_DELETE, -1, 0, 0, buffer, 0);
+}
+
+// A function that will start the workers of the actors, one for each core
+
+void channel_start() {
+    pthread_t worker_tid;
+    int i = 0;
+
+    nb_channel_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nb_channel_workers < 1) {
+        nb_channel_workers = 1;
+    }
+    if (nb_channel_workers > CHANNEL_WORKERS_MAX) {
+        nb_channel_workers = CHANNEL_WORKERS_MAX;
+    }
+    while (i < ACTOR_BUCKETS) {
+        pthread_mutex_init(&mutex_channel_actors[i], NULL);
+        i = i + 1;
+    }
+    pthread_mutex_init(&mutex_presence, NULL);
+    pthread_cond_init(&cond_presence, NULL);
+    i = 0;
+    while (i < nb_channel_workers) {
+        pthread_mutex_init(&channel_workers[i].mutex, NULL);
+        pthread_cond_init(&channel_workers[i].cond, NULL);
+        if (pthread_create(&worker_tid, NULL, channel_worker, &channel_workers[i]) != 0) {
+            perror("Erreur lors de la creation d'un thread des channels");
+            exit(EXIT_FAILURE);
+        }
+        i = i + 1;
+    }
+    printf("Channels geres par %d threads\n", nb_channel_workers);
+}
+
+// A function that will send a message to all the clients in the channel buffer->channel,
+// except the client client_indice who sent it (-1 if the message is sent by the server)
+// The actor of the channel sends it, if wait is 1 the function returns once it is sent
+
+void send_to_channel(int client_indice, Message * buffer, int wait) {
+    // If the client_indice is -1, it means that the message is sent by the server
+    if (client_indice != -1){
+        // Lock the mutex
+        pthread_mutex_lock(&mutex_tab_username);
+        strcpy(buffer->from, tab_username[client_indice]);
+        // Unlock the mutex
+        pthread_mutex_unlock(&mutex_tab_username);
+    }
+
+    printf("Channel sent to : %s by client : %d \n", buffer->channel, client_indice + 1);
+    printf("Message sent : %s by client : %d \n\n", buffer->message, client_indice + 1);
+
+    // If the channel is empty, we send to global
+    if (strcmp(buffer->channel, "") == 0) {
+        strcpy(buffer->channel, "global");
+        // This shouldn't happen, so we print a warning
+        printf("Warning: client has forgotten channel\n");
+    }
+
+    channel_event(buffer->channel, CHANNEL_BROADCAST, client_indice, 0, 0, buffer, wait);
+}
+
+// A function that will take as an argument the index of the client
+// and a pointer to a Message struct, and will send the message to all the clients
+// of the channel except the client who sent the message
+
+void send_to_all(int client_indice, Message * buffer) {
+    send_to_channel(client_indice, buffer, 0);
+}
+
+// A function that will tell the members of the channel buffer->channel that the client client_indice
+// arrived in it (type CHANNEL_ARRIVAL) or left it (type CHANNEL_DEPARTURE)
+// buffer->message is sent as it is if there is no window, otherwise the client is in the next digest
+
+void send_presence(int client_indice, Message * buffer, int type) {
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_tab_username);
+    strcpy(buffer->from, tab_username[client_indice]);
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_tab_username);
+
+    channel_event(buffer->channel, type, client_indice, 0, 0, buffer, 0);
+}
+
+// The pipe where the SIGINT handler writes, the shutdown_thread waits on it
+// (a signal handler can't lock a mutex or allocate memory, it can only write in a pipe)
+int interrupt_pipe[2];
+
+// The handler of SIGINT, it wakes up the shutdown_thread that closes the server
+
+void handle_interrupt(int signum) {
+    int saved_errno = errno;
+    char byte = 1;
+
+    // If the pipe is full, the server is already closing
+    if (write(interrupt_pipe[1], &byte, 1) == -1) {
+        errno = saved_errno;
+    }
+}
+
+// A function for the thread that closes the server once SIGINT is received:
+// it tells the clients that the server is closing and it cuts their sockets
+// The mutexes and semaphores are not destroyed, the other threads can still be using them,
+// everything is freed when the process ends
+
+void * shutdown_thread(void * arg) {
+    Message msg_buffer;
+    Message * buffer = &msg_buffer;
+    char byte;
+    int i = 0;
+
+    while (read(interrupt_pipe[0], &byte, 1) != 1) {
+    }
+    printf("\nLe serveur va fermer\n");
+    // We send a message to all the clients to tell them that the server is closing
+    memset(buffer, 0, sizeof(Message));
+    strcpy(buffer->cmd, "finserv");
+    strcpy(buffer->from, "Serveur");
+    strcpy(buffer->to, "all");
+    strcpy(buffer->channel, "global");
+    strcpy(buffer->message, "Le serveur va fermer. Au revoir!");
+    send_to_channel(-1, buffer, 1);
+
+    // We cut the sockets of all of the clients, their threads stop by themselves
+    // (they are not closed here, a thread could use the number of a socket opened after)
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_tab_client_connecting);
+    while (i < MAX_CLIENT) {
+        if (tab_client_connecting[i] != 0) {
+            shutdown(tab_client_connecting[i], SHUT_RDWR);
+        }
+        i = i + 1;
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_tab_client_connecting);
+
+    printf("Socket clients fermes\n");
+    printf("Derniers reglages...\n");
+
+    // Wait one second
+    sleep(1);
+    printf("Fermeture du serveur terminee avec success\n");
+    // We exit the program, the sockets are closed and the memory is freed
+    exit(0);
+    return arg;
+}
+
+
+/*********************************************
+           Offline direct messages
+**********************************************/
+
+// Every username that connected once has a mailbox: the file MAILBOX_DIRECTORY<username>
+// A dm sent to a known username that isn't connected is appended to his mailbox, as the frame
+// that will be sent to him: command "offline", and the time it was sent in hexadecimal in to
+// At most MAILBOX_MAX messages wait in a mailbox, the next ones are refused
+// When the client connects with the username, his whole mailbox is emptied and sent with a single write
+
+// Mutex to protect the mailboxes
+// It is also locked while a username is given to a client and his mailbox is sent,
+// so a dm is either in the mailbox or sent after it
+pthread_mutex_t mutex_mailbox;
+
+// A function that will put in path the file of the mailbox of username
+// It returns 1, or 0 if the username can't be used as a file name
+
+int mailbox_path(const char * username, char * path) {
+    if (username[0] == '\0' || username[0] == '.' || strchr(username, '/') != NULL
+        || strlen(username) >= USERNAME_SIZE) {
+        return 0;
+    }
+    sprintf(path, "%s%s", MAILBOX_DIRECTORY, username);
+    return 1;
+}
+
+// A function that will put a dm in the mailbox of buffer->to
+// The mutex_mailbox must be locked
+// It returns 1 if the dm was put in the mailbox, 0 if the username is unknown, -1 if the mailbox is full
+
+int mailbox_store(Message * buffer) {
+    char path[sizeof(MAILBOX_DIRECTORY) + USERNAME_SIZE];
+    struct stat stat_mailbox;
+    Message frame;
+    int fd;
+    int result = 1;
+
+    buffer->to[USERNAME_SIZE - 1] = '\0';
+    if (mailbox_path(buffer->to, path) == 0) {
+        return 0;
+    }
+    fd = open(path, O_WRONLY | O_APPEND);
+    if (fd == -1) {
+        return 0;
+    }
+    memcpy(&frame, buffer, sizeof(Message));
+    strcpy(frame.cmd, "offline");
+    sprintf(frame.to, "%08lx", (unsigned long) time(NULL));
+    strcpy(frame.channel, "global");
+    if (fstat(fd, &stat_mailbox) == -1 || stat_mailbox.st_size >= MAILBOX_MAX * (long) sizeof(Message)) {
+        result = -1;
+    }
+    // The dm is on the disk before the sender is told it will be delivered
+    else if (write(fd, &frame, sizeof(Message)) != sizeof(Message) || fdatasync(fd) == -1) {
+        perror("Erreur lors de l'ecriture dans une boite aux lettres");
+        result = -1;
+    }
+    close(fd);
+    return result;
+}
+
+// A function that will take the dms of the mailbox of username, who just connected, and empty it
+// If he has no mailbox yet, it is created, so the dms sent to him from now on are kept
+// The dms are sent by the caller once the mutex_mailbox is unlocked: a client who reads slowly
+// must not stop the dms of everyone else
+// The mutex_mailbox must be locked
+// It returns the dms, to free, and their number in nb_frames (NULL if there are none)
+
+Message * mailbox_take(const char * username, long * nb_frames) {
+    char path[sizeof(MAILBOX_DIRECTORY) + USERNAME_SIZE];
+    struct stat stat_mailbox;
+    Message * frames = NULL;
+    int fd;
+
+    *nb_frames = 0;
+    if (mailbox_path(username, path) == 0) {
+        return NULL;
+    }
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    // The directory of the mailboxes is created with the first mailbox, or again if it was removed
+    if (fd == -1 && errno == ENOENT && (mkdir(MAILBOX_DIRECTORY, 0755) == 0 || errno == EEXIST)) {
+        fd = open(path, O_RDWR | O_CREAT, 0644);
+    }
+    if (fd == -1) {
+        perror("Erreur lors de l'ouverture d'une boite aux lettres");
+        return NULL;
+    }
+    if (fstat(fd, &stat_mailbox) == 0 && stat_mailbox.st_size >= (long) sizeof(Message)) {
+        *nb_frames = stat_mailbox.st_size / sizeof(Message);
+        frames = malloc(*nb_frames * sizeof(Message));
+        if (pread(fd, frames, *nb_frames * sizeof(Message), 0) != *nb_frames * (long) sizeof(Message)) {
+            perror("Erreur lors de la lecture d'une boite aux lettres");
+            free(frames);
+            frames = NULL;
+            *nb_frames = 0;
+        }
+        else if (ftruncate(fd, 0) == -1) {
+            perror("Erreur lors du vidage d'une boite aux lettres");
+        }
+    }
+    close(fd);
+    return frames;
+}
+
+// A function that will put back in the mailbox of username the dms that couldn't be sent to him
+
+void mailbox_restore(const char * username, Message * frames, long nb_frames) {
+    char path[sizeof(MAILBOX_DIRECTORY) + USERNAME_SIZE];
+    int fd;
+
+    if (mailbox_path(username, path) == 0) {
+        return;
+    }
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_mailbox);
+    fd = open(path, O_WRONLY | O_APPEND);
+    if (fd != -1) {
+        if (write(fd, frames, nb_frames * sizeof(Message)) != nb_frames * (long) sizeof(Message)) {
+            perror("Erreur lors de l'ecriture dans une boite aux lettres");
+        }
+        close(fd);
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_mailbox);
+}
+
+// A function that will send to the client client_indice, who just connected with username,
+// the dms taken from his mailbox with mailbox_take, with a single write
+// If he disconnected meanwhile, they go back in his mailbox
+
+void mailbox_deliver(int client_indice, int dS, const char * username, Message * frames, long nb_frames) {
+    if (frames == NULL) {
+        return;
+    }
+    if (send_client_frames(client_indice, dS, frames, nb_frames, 0) == -1) {
+        mailbox_restore(username, frames, nb_frames);
+    }
+    else {
+        printf("%ld messages en attente envoyes au client %d\n", nb_frames, client_indice + 1);
+    }
+    free(frames);
+}
+
+// A function that will initialise the mailboxes
+// Their directory is created by mailbox_take, when the first client connects
+
+void mailbox_start() {
+    pthread_mutex_init(&mutex_mailbox, NULL);
+}
+
+
+/*********************************************
+              Federation mesh
+**********************************************/
+
+// Several servers, on one machine or more, can be linked to form a mesh
+// Each server accepts the links of the other servers on its port + 4, and connects itself
+// to the servers given with -f when it starts: a new server is given every server of the mesh
+// Both ends of a link send "hello" with their identifier and the secret of the federation,
+// a link without the right secret or a second link between the same two servers is closed
+// The "hello" also has "ring <boot_id> <pid> <fd>": if the boot_id is ours, the other server is on
+// the same machine and we open its ring to send it all the other frames
+// Each end sends "ready" once the link is in its federation_links array, then tells the other one
+// which users are connected to it and in which channels it has members (see Federation links),
+// and keeps it up to date
+// A link that is cut is made again by the server that made it, every FEDERATION_RETRY seconds
+
+// A function that will give the indice of the link of the server where username is connected,
+// or -1 if he isn't connected to another server
+
+int remote_user_link(const char * username) {
+    RemoteUser * user;
+    int link = -1;
+
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_remote_users);
+    user = remote_users;
+    while (user != NULL && link == -1) {
+        if (strcmp(user->username, username) == 0) {
+            link = user->link;
+        }
+        user = user->next;
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_remote_users);
+    return link;
+}
+
+// A function that will add username to the users of the server of the link (online is 1)
+// or remove him (online is 0)
+
+void remote_user_set(int link, const char * username, int online) {
+    RemoteUser ** place;
+    RemoteUser * user;
+
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_remote_users);
+    place = &remote_users;
+    while (*place != NULL && (strcmp((*place)->username, username) != 0 || (*place)->link != link)) {
+        place = &(*place)->next;
+    }
+    if (online == 1 && *place == NULL) {
+        user = malloc(sizeof(RemoteUser));
+        strcpy(user->username, username);
+        user->link = link;
+        user->next = remote_users;
+        remote_users = user;
+    }
+    if (online == 0 && *place != NULL) {
+        user = *place;
+        *place = user->next;
+        free(user);
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_remote_users);
+}
+
+// A function that will remove all the users of the server of the link, when the link is cut
+
+void remote_users_forget(int link) {
+    RemoteUser ** place;
+    RemoteUser * user;
+
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_remote_users);
+    place = &remote_users;
+    while (*place != NULL) {
+        user = *place;
+        if (user->link == link) {
+            *place = user->next;
+            free(user);
+        }
+        else {
+            place = &user->next;
+        }
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_remote_users);
+}
+
+// A function that will add to list the users connected to the other servers
+// It stops when list is full
+
+void remote_users_list(char * list) {
+    RemoteUser * user;
+
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_remote_users);
+    user = remote_users;
+    while (user != NULL && strlen(list) + USERNAME_SIZE + 1 < MSG_SIZE) {
+        strcat(list, user->username);
+        strcat(list, "\n");
+        user = user->next;
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_remote_users);
+}
+
+// A function that will handle a frame received on the link
+// It returns 0 if the frame can't be understood, and the link must be closed
+
+int federation_receive(int link, FederationFrame * frame) {
+    Message * message = &frame->message;
+    int client_indice;
+
+    // The other server can't make us read past the fields
+    message->from[USERNAME_SIZE - 1] = '\0';
+    message->to[USERNAME_SIZE - 1] = '\0';
+    message->channel[CHANNEL_SIZE - 1] = '\0';
+    message->message[MSG_SIZE - 1] = '\0';
+
+    if (strcmp(frame->type, "sub") == 0 || strcmp(frame->type, "unsub") == 0) {
+        // Lock the mutex
+        pthread_mutex_lock(&federation_links[link].mutex);
+        if (is_in_list(federation_links[link].channels, message->channel) == 1) {
+            remove_element(federation_links[link].channels, message->channel);
+        }
+        if (strcmp(frame->type, "sub") == 0) {
+            add(federation_links[link].channels, message->channel);
+        }
+        // Unlock the mutex
+        pthread_mutex_unlock(&federation_links[link].mutex);
+        return 1;
+    }
+
+    if (strcmp(frame->type, "msg") == 0) {
+        // Our members receive it, and it isn't sent again to the other servers
+        channel_event(message->channel, CHANNEL_BROADCAST, -1, 0, 0, message, 0);
+        return 1;
+    }
+
+    if (strcmp(frame->type, "online") == 0 || strcmp(frame->type, "offline") == 0) {
+        remote_user_set(link, message->from, strcmp(frame->type, "online") == 0);
+        return 1;
+    }
+
+    if (strcmp(frame->type, "dm") == 0) {
+        // If the client has disconnected meanwhile, the dm waits in his mailbox
+        // Lock the mutex
+        pthread_mutex_lock(&mutex_mailbox);
+        client_indice = get_indice_username(message->to);
+        if (client_indice == -1) {
+            mailbox_store(message);
+        }
+        else {
+            // Lock the mutex
+            pthread_mutex_lock(&mutex_tab_client);
+            if (send_client(client_indice, tab_client[client_indice], message, 0) == -1) {
+                printf("Le client: %d s'est deconnecte, donc le message ne s'est pas envoye a lui\n", client_indice + 1);
+            }
+            // Unlock the mutex
+            pthread_mutex_unlock(&mutex_tab_client);
+        }
+        // Unlock the mutex
+        pthread_mutex_unlock(&mutex_mailbox);
+        return 1;
+    }
+
+    return 0;
+}
+
+// A function that will open the ring of the server node, described by text ("ring <boot_id> <pid> <fd>")
+// It returns NULL if the server isn't on the same machine or its ring can't be opened
+
+FederationRing * federation_ring_open(const char * text, const char * node) {
+    FederationRing * ring;
+    struct stat stat_ring;
+    char boot_id[40];
+    char path[64];
+    int pid;
+    int fd_ring;
+    int fd;
+
+    if (federation_ring == NULL || sscanf(text, "ring %39s %d %d", boot_id, &pid, &fd_ring) != 3
+        || strcmp(boot_id, federation_boot_id) != 0) {
+        return NULL;
+    }
+    sprintf(path, "/proc/%d/fd/%d", pid, fd_ring);
+    fd = open(path, O_RDWR);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &stat_ring) == -1 || stat_ring.st_size != sizeof(FederationRing)) {
+        close(fd);
+        return NULL;
+    }
+    ring = mmap(NULL, sizeof(FederationRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED) {
+        return NULL;
+    }
+    // The pid can be the one of another process, in another pid namespace of the machine
+    if (ring->magic != FEDERATION_RING_MAGIC || strcmp(ring->node, node) != 0) {
+        munmap(ring, sizeof(FederationRing));
+        return NULL;
+    }
+    return ring;
+}
+
+// A function that will give the indice of the link with the server node, -1 if there is none
+
+int federation_link_of(const char * node) {
+    int link = -1;
+    int i = 0;
+
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_federation_links);
+    while (i < FEDERATION_LINKS_MAX && link == -1) {
+        if (federation_links[i].socket != 0 && strcmp(federation_links[i].node, node) == 0) {
+            link = i;
+        }
+        i = i + 1;
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_federation_links);
+    return link;
+}
+
+// A function that will free the slot of head for the next turn of the ring,
+// and wake up the writers waiting for a free slot
+
+void federation_ring_free(FederationRing * ring, uint64_t head) {
+    __atomic_store_n(&ring->slots[head % FEDERATION_RING_SLOTS].sequence, head + FEDERATION_RING_SLOTS, __ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&ring->waiting, 0, __ATOMIC_SEQ_CST) == 1) {
+        __atomic_add_fetch(&ring->space, 1, __ATOMIC_SEQ_CST);
+        futex(&ring->space, FUTEX_WAKE, INT_MAX, NULL);
+    }
+}
+
+// A function for the thread that reads the frames written in our ring by the other servers
+
+void * federation_ring_thread(void * arg) {
+    FederationRing * ring = federation_ring;
+    struct FederationSlot * slot;
+    FederationFrame frame;
+    struct timespec timeout;
+    uint64_t head = 0;
+    uint64_t expected;
+    uint32_t seen;
+    time_t taken_since = 0; // When we saw that the slot of head was taken but not written, 0 if it isn't
+    int link;
+
+    while (1) {
+        slot = &ring->slots[head % FEDERATION_RING_SLOTS];
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == head + 1) {
+            memcpy(&frame, &slot->frame, sizeof(FederationFrame));
+            federation_ring_free(ring, head);
+            head = head + 1;
+            taken_since = 0;
+            // The frames of a server whose link is cut are forgotten
+            frame.node[NODE_ID_SIZE - 1] = '\0';
+            link = federation_link_of(frame.node);
+            if (link != -1 && federation_receive(link, &frame) == 0) {
+                printf("Trame inconnue du serveur %s\n", frame.node);
+            }
+            continue;
+        }
+        // If a writer has taken the slot for too long, it will never write it: we skip it,
+        // unless it writes it right now
+        if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) > head) {
+            if (taken_since == 0) {
+                taken_since = time(NULL);
+            }
+            else if (time(NULL) - taken_since >= FEDERATION_RING_WAIT) {
+                expected = head;
+                if (__atomic_compare_exchange_n(&slot->sequence, &expected, head + FEDERATION_RING_SLOTS, 0,
+                                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                    printf("Une trame de l'anneau n'a jamais ete ecrite, elle est sautee\n");
+                    federation_ring_free(ring, head);
+                    head = head + 1;
+                    taken_since = 0;
+                }
+                continue;
+            }
+        }
+        // The ring is empty, we sleep until a writer increments the futex
+        // A writer that doesn't see sleeping at 1 has written before we read the futex
+        __atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+        seen = __atomic_load_n(&ring->futex, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != head + 1) {
+            timeout.tv_sec = 1;
+            timeout.tv_nsec = 0;
+            futex(&ring->futex, FUTEX_WAIT, seen, &timeout);
+        }
+        __atomic_store_n(&ring->sleeping, 0, __ATOMIC_SEQ_CST);
+    }
+    return arg;
+}
+
+// A function that will tell the server of a new link everything it must know:
+// the users connected to this server and the channels in which this server has members
+
+void federation_introduce(int link) {
+    Message message;
+    ChannelActor * actor;
+    char (* names)[CHANNEL_SIZE];
+    int nb_names;
+    int bucket = 0;
+    int i = 0;
+
+    memset(&message, 0, sizeof(Message));
+    // The tab_username array stays locked, so an "offline" can't be sent before the "online"
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_tab_username);
+    while (i < MAX_CLIENT) {
+        if (strcmp(tab_username[i], "") != 0) {
+            strcpy(message.from, tab_username[i]);
+            federation_send(link, "online", &message);
+        }
+        i = i + 1;
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_tab_username);
+
+    // Each actor tells it if it has members, in the order of its other events
+    // The names are copied, an actor can be freed once its list is unlocked
+    while (bucket < ACTOR_BUCKETS) {
+        nb_names = 0;
+        // Lock the mutex
+        pthread_mutex_lock(&mutex_channel_actors[bucket]);
+        actor = channel_actors[bucket];
+        while (actor != NULL) {
+            nb_names = nb_names + 1;
+            actor = actor->next;
+        }
+        names = malloc((nb_names + 1) * CHANNEL_SIZE);
+        nb_names = 0;
+        actor = channel_actors[bucket];
+        while (actor != NULL) {
+            strcpy(names[nb_names], actor->name);
+            nb_names = nb_names + 1;
+            actor = actor->next;
+        }
+        // Unlock the mutex
+        pthread_mutex_unlock(&mutex_channel_actors[bucket]);
+        i = 0;
+        while (i < nb_names) {
+            channel_event(names[i], CHANNEL_ANNOUNCE, link, 0, 0, NULL, 0);
+            i = i + 1;
+        }
+        free(names);
+        bucket = bucket + 1;
+    }
+}
+
+// A function that will check the secret sent by another server in its "hello" frame
+// All the bytes are compared, so the time taken doesn't tell how much of the secret was right
+// It returns 1 if it is our secret, 0 otherwise
+
+int federation_secret_valid(const char * secret) {
+    unsigned char difference = 0;
+    int i = 0;
+
+    while (i < FEDERATION_SECRET_SIZE) {
+        difference = difference | (secret[i] ^ federation_secret[i]);
+        i = i + 1;
+    }
+    return difference == 0;
+}
+
+// A function that will read the secret of the federation in the configuration file
+// ("federation_secret <secret>"), it isn't read again with SIGHUP
+
+void federation_load_secret() {
+    FILE * file;
+    char line[256];
+    char name[64];
+    char value[FEDERATION_SECRET_SIZE];
+
+    file = fopen(CONFIG_FILE, "r");
+    if (file == NULL) {
+        return;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "%63s %127s", name, value) == 2 && strcmp(name, "federation_secret") == 0) {
+            memset(federation_secret, 0, sizeof(federation_secret));
+            strcpy(federation_secret, value);
+        }
+    }
+    fclose(file);
+}
+
+// A function that will run a link with another server on socket, until it is cut
+// It sends and checks the "hello" frames, then handles the frames received
+// The socket is closed at the end
+
+void federation_run(int socket) {
+    FederationFrame frame;
+    FederationLink * federation_link = NULL;
+    FederationRing * ring;
+    struct timeval timeout;
+    int link = -1;
+    int i = 0;
+
+    // The "hello" frame has the secret, then the description of our ring
+    memset(&frame, 0, sizeof(FederationFrame));
+    strcpy(frame.type, "hello");
+    strcpy(frame.node, node_id);
+    strcpy(frame.message.message, federation_secret);
+    if (federation_ring != NULL) {
+        sprintf(frame.message.message + FEDERATION_SECRET_SIZE, "ring %s %d %d",
+                federation_boot_id, (int) getpid(), federation_ring_fd);
+    }
+    // A server that doesn't send its "hello" doesn't keep the thread of the link
+    timeout.tv_sec = FEDERATION_HELLO_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (send_full(socket, &frame, sizeof(FederationFrame)) == -1
+        || recv_full(socket, &frame, sizeof(FederationFrame)) < (ssize_t) sizeof(FederationFrame)
+        || strcmp(frame.type, "hello") != 0) {
+        close(socket);
+        return;
+    }
+    timeout.tv_sec = 0;
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    frame.node[NODE_ID_SIZE - 1] = '\0';
+    frame.message.message[FEDERATION_SECRET_SIZE - 1] = '\0';
+    frame.message.message[MSG_SIZE - 1] = '\0';
+    if (federation_secret_valid(frame.message.message) == 0) {
+        printf("Lien refuse : le serveur %s n'a pas le secret de la federation\n", frame.node);
+        close(socket);
+        return;
+    }
+    ring = federation_ring_open(frame.message.message + FEDERATION_SECRET_SIZE, frame.node);
+
+    // We take a free spot, unless we are already linked to this server (or it is ourselves)
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_federation_links);
+    if (strcmp(frame.node, node_id) != 0) {
+        while (i < FEDERATION_LINKS_MAX) {
+            if (federation_links[i].socket != 0 && strcmp(federation_links[i].node, frame.node) == 0) {
+                link = -1;
+                break;
+            }
+            if (federation_links[i].socket == 0 && link == -1) {
+                link = i;
+            }
+            i = i + 1;
+        }
+    }
+    if (link != -1) {
+        federation_link = &federation_links[link];
+        // Lock the mutex
+        pthread_mutex_lock(&federation_link->mutex);
+        federation_link->socket = socket;
+        strcpy(federation_link->node, frame.node);
+        federation_link->ring = ring;
+        federation_link->ready = 0;
+        // Unlock the mutex
+        pthread_mutex_unlock(&federation_link->mutex);
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_federation_links);
+    if (link == -1) {
+        if (ring != NULL) {
+            munmap(ring, sizeof(FederationRing));
+        }
+        close(socket);
+        return;
+    }
+    if (ring != NULL) {
+        printf("Lien avec le serveur %s, sur la meme machine\n", frame.node);
+    }
+    else {
+        printf("Lien avec le serveur %s\n", frame.node);
+    }
+
+    // The other server can read our frames once it knows this link: we tell it with "ready",
+    // and we send ours once we receive its "ready"
+    memset(&frame, 0, sizeof(FederationFrame));
+    strcpy(frame.type, "ready");
+    strcpy(frame.node, node_id);
+    // Lock the mutex
+    pthread_mutex_lock(&federation_link->mutex);
+    if (send_full(socket, &frame, sizeof(FederationFrame)) == -1) {
+        shutdown(socket, SHUT_RDWR);
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&federation_link->mutex);
+
+    while (recv_full(socket, &frame, sizeof(FederationFrame)) == sizeof(FederationFrame)) {
+        if (strcmp(frame.type, "ready") == 0) {
+            // Lock the mutex
+            pthread_mutex_lock(&federation_link->mutex);
+            federation_link->ready = 1;
+            // Unlock the mutex
+            pthread_mutex_unlock(&federation_link->mutex);
+            federation_introduce(link);
+        }
+        else if (federation_receive(link, &frame) == 0) {
+            break;
+        }
+    }
+
+    // The link is cut: the users and the channels of the other server are forgotten
+    // before its spot can be taken by another link
+    printf("Lien coupe avec le serveur %s\n", federation_link->node);
+    remote_users_forget(link);
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_federation_links);
+    // Lock the mutex
+    pthread_mutex_lock(&federation_link->mutex);
+    federation_link->socket = 0;
+    federation_link->ready = 0;
+    remove_all(federation_link->channels);
+    if (federation_link->ring != NULL) {
+        munmap(federation_link->ring, sizeof(FederationRing));
+        federation_link->ring = NULL;
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&federation_link->mutex);
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_federation_links);
+    close(socket);
+}
+
+// A function for the threads of the links accepted on the federation_socket
+// arg is a pointer to the socket of the link
+
+void * federation_link_thread(void * arg) {
+    int socket = *(int *) arg;
+
+    free(arg);
+    federation_run(socket);
+    return NULL;
+}
+
+// A function for the thread that accepts the links of the other servers
+
+void * federation_accept_thread(void * arg) {
+    struct sockaddr_in address;
+    socklen_t length;
+    pthread_t link_tid;
+    int * socket;
+
+    while (1) {
+        socket = malloc(sizeof(int));
+        length = sizeof(address);
+        *socket = accept(federation_socket, (struct sockaddr *) &address, &length);
+        if (*socket == -1) {
+            perror("Erreur lors de l'acceptation d'un serveur");
+            free(socket);
+            return NULL;
+        }
+        if (pthread_create(&link_tid, NULL, federation_link_thread, socket) != 0) {
+            perror("Erreur lors de la creation du thread");
+            close(*socket);
+            free(socket);
+            continue;
+        }
+        pthread_detach(link_tid);
+    }
+    return arg;
+}
+
+// A function for the threads that connect to the servers given with -f
+// arg is the address of the federation_socket of the server
+// The link is made again each time it is cut
+
+void * federation_connect_thread(void * arg) {
+    struct sockaddr_in * address = (struct sockaddr_in *) arg;
+    int socket_server;
+
+    while (1) {
+        socket_server = socket(PF_INET, SOCK_STREAM, 0);
+        if (socket_server == -1) {
+            perror("Erreur lors de la creation du socket");
+        }
+        else if (connect(socket_server, (struct sockaddr *) address, sizeof(struct sockaddr_in)) == -1) {
+            close(socket_server);
+        }
+        else {
+            federation_run(socket_server);
+        }
+        sleep(FEDERATION_RETRY);
+    }
+    return arg;
+}
+
+// A function that will create our ring and start the thread that reads it
+// Without a ring, the messages of the channels only go through the sockets
+
+void federation_ring_start() {
+    FILE * file;
+    pthread_t ring_tid;
+    int i = 0;
+
+    file = fopen("/proc/sys/kernel/random/boot_id", "r");
+    if (file == NULL) {
+        return;
+    }
+    if (fscanf(file, "%39s", federation_boot_id) != 1) {
+        fclose(file);
+        return;
+    }
+    fclose(file);
+
+    federation_ring_fd = syscall(SYS_memfd_create, "federation", MFD_CLOEXEC);
+    if (federation_ring_fd == -1 || ftruncate(federation_ring_fd, sizeof(FederationRing)) == -1) {
+        perror("Erreur lors de la creation de l'anneau de la federation");
+        return;
+    }
+    federation_ring = mmap(NULL, sizeof(FederationRing), PROT_READ | PROT_WRITE, MAP_SHARED, federation_ring_fd, 0);
+    if (federation_ring == MAP_FAILED) {
+        perror("Erreur lors de la creation de l'anneau de la federation");
+        federation_ring = NULL;
+        return;
+    }
+    federation_ring->magic = FEDERATION_RING_MAGIC;
+    strcpy(federation_ring->node, node_id);
+    while (i < FEDERATION_RING_SLOTS) {
+        federation_ring->slots[i].sequence = i;
+        i = i + 1;
+    }
+    if (pthread_create(&ring_tid, NULL, federation_ring_thread, NULL) != 0) {
+        perror("Erreur lors de la creation du thread");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// A function that will start the federation: the socket for the links of the other servers
+// on port + 4 (only on 127.0.0.1 if there is no federation_secret in the configuration file),
+// and a thread for each server given as "-f <ip>:<port>" in options
+
+void federation_start(int port, char ** options, int nb_options) {
+    struct sockaddr_in ad_federation;
+    struct sockaddr_in * address;
+    pthread_t federation_tid;
+    uint64_t value;
+    char * separator;
+    int i = 0;
+
+    // The identifier is random, two servers of the mesh never have the same one
+    if (getrandom(&value, sizeof(value), 0) != sizeof(value)) {
+        perror("Erreur lors du tirage de l'identifiant du serveur");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(node_id, "%016llx", (unsigned long long) value);
+    pthread_mutex_init(&mutex_federation_links, NULL);
+    pthread_mutex_init(&mutex_remote_users, NULL);
+    while (i < FEDERATION_LINKS_MAX) {
+        federation_links[i].socket = 0;
+        federation_links[i].channels = new_list();
+        federation_links[i].ring = NULL;
+        federation_links[i].ready = 0;
+        pthread_mutex_init(&federation_links[i].mutex, NULL);
+        i = i + 1;
+    }
+    federation_ring_start();
+    federation_load_secret();
+
+    federation_socket = socket(PF_INET, SOCK_STREAM, 0);
+    if (federation_socket == -1) {
+        perror("Erreur lors de la creation du socket");
+        exit(EXIT_FAILURE);
+    }
+    // Without a secret, anyone could link with the server: only this machine is accepted
+    ad_federation.sin_family = AF_INET;
+    if (strcmp(federation_secret, "") == 0) {
+        ad_federation.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+    else {
+        ad_federation.sin_addr.s_addr = INADDR_ANY;
+    }
+    ad_federation.sin_port = htons(port + 4);
+    if (bind(federation_socket, (struct sockaddr *) &ad_federation, sizeof(ad_federation)) == -1) {
+        perror("Erreur lors du nommage du socket");
+        exit(EXIT_FAILURE);
+    }
+    if (listen(federation_socket, 10) == -1) {
+        perror("Erreur lors du passage en mode ecoute");
+        exit(EXIT_FAILURE);
+    }
+    if (pthread_create(&federation_tid, NULL, federation_accept_thread, NULL) != 0) {
+        perror("Erreur lors de la creation du thread");
+        exit(EXIT_FAILURE);
+    }
+    if (strcmp(federation_secret, "") == 0) {
+        printf("Serveur %s, liens de la federation sur le port %d (cette machine seulement)\n", node_id, port + 4);
+    }
+    else {
+        printf("Serveur %s, liens de la federation sur le port %d\n", node_id, port + 4);
+    }
+
+    i = 1;
+    while (i < nb_options) {
+        address = malloc(sizeof(struct sockaddr_in));
+        address->sin_family = AF_INET;
+        separator = strrchr(options[i], ':');
+        if (separator == NULL) {
+            printf("Error: %s is not <ip>:<port>\n", options[i]);
+            exit(EXIT_FAILURE);
+        }
+        *separator = '\0';
+        if (inet_pton(AF_INET, options[i], &address->sin_addr) != 1) {
+            printf("Error: %s is not an IPv4 address\n", options[i]);
+            exit(EXIT_FAILURE);
+        }
+        address->sin_port = htons(atoi(separator + 1) + 4);
+        if (pthread_create(&federation_tid, NULL, federation_connect_thread, address) != 0) {
+            perror("Erreur lors de la creation du thread");
+            exit(EXIT_FAILURE);
+        }
+        i = i + 2;
+    }
+}
+
+
+/*********************************************
+             Transfer scheduler
+**********************************************/
+
+
+// A function that will read the configuration file
+// Each line is "<name> <value>", the lines starting with # are comments
+// "bandwidth" is the limit of all the transfers in bytes per second, it can end with K or M (0 means no limit)
+// "presence_window" is the number of milliseconds during which the arrivals and departures
+// of a channel are put together in one digest (0 means each of them is sent right away)
+// The mutex_sched must be locked
+
+void sched_load_config() {
+    FILE * file;
+    char line[256];
+    char name[64];
+    char unit;
+    long value;
+    long rate = 0;
+    long window = 0;
+    int nb_read;
+
+    file = fopen(CONFIG_FILE, "r");
+    if (file != NULL) {
+        while (fgets(line, sizeof(line), file) != NULL) {
+            unit = ' ';
+            nb_read = sscanf(line, "%63s %ld%c", name, &value, &unit);
+            if (nb_read >= 2 && name[0] != '#' && strcmp(name, "bandwidth") == 0 && value >= 0) {
+                rate = value;
+                if (unit == 'K' || unit == 'k') {
+                    rate = value * 1024;
+                }
+                else if (unit == 'M' || unit == 'm') {
+                    rate = value * 1024 * 1024;
+                }
+            }
+            if (nb_read >= 2 && name[0] != '#' && strcmp(name, "presence_window") == 0 && value >= 0) {
+                window = value;
+            }
+        }
+        fclose(file);
+    }
+
+    sched_rate = rate;
+    // The burst must let the biggest block of a transfer go through
+    sched_burst = rate / 10;
+    if (sched_burst < 2 * COMPRESS_BLOCK) {
+        sched_burst = 2 * COMPRESS_BLOCK;
+    }
+    sched_tokens = sched_burst;
+    clock_gettime(CLOCK_MONOTONIC, &sched_last);
+    if (rate == 0) {
+        printf("Bande passante des transferts : pas de limite\n");
+    }
+    else {
+        printf("Bande passante des transferts : %ld octets/s\n", rate);
+    }
+    // The waiting transfers look at the new limit
+    pthread_cond_broadcast(&cond_sched);
+
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_presence);
+    presence_window = window;
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_presence);
+    printf("Fenetre des arrivees et departs : %ld ms\n", window);
+}
+
+// The handler of SIGHUP, the configuration will be read again by the next transfer
+// or by the presence thread (we can't read a file in a signal handler)
+
+void handle_reload(int signum) {
+    sched_reload = 1;
+}
+
+// A function that will add a transfer of the client client_indice to the scheduler
+// A client who had no transfer starts with as many bytes charged as the client
+// who got the less among the others, and a transfer starts with as many bytes as the
+// other transfers of his client who got the less: this way a new transfer has its share
+// right away, but it doesn't get everything until it has caught up with the others
+// It returns the transfer, to give to sched_charge and sched_end
+
+Transfer * sched_start(int client_indice) {
+    Transfer * transfer = malloc(sizeof(Transfer));
+    Transfer * current;
+    long min_client = -1;
+    long min_transfer = -1;
+    int i;
+
+    transfer->client_indice = client_indice;
+    transfer->want = 0;
+
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_sched);
+    if (sched_client_transfers[client_indice] == 0) {
+        i = 0;
+        while (i < MAX_CLIENT) {
+            if (sched_client_transfers[i] > 0 && (min_client == -1 || sched_client_served[i] < min_client)) {
+                min_client = sched_client_served[i];
+            }
+            i = i + 1;
+        }
+        sched_client_served[client_indice] = min_client == -1 ? 0 : min_client;
+    }
+    current = sched_transfers;
+    while (current != NULL) {
+        if (current->client_indice == client_indice && (min_transfer == -1 || current->served < min_transfer)) {
+            min_transfer = current->served;
+        }
+        current = current->next;
+    }
+    transfer->served = min_transfer == -1 ? 0 : min_transfer;
+    sched_client_transfers[client_indice] = sched_client_transfers[client_indice] + 1;
+    transfer->next = sched_transfers;
+    sched_transfers = transfer;
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_sched);
+    return transfer;
+}
+
+// A function that will remove a transfer from the scheduler and free it
+
+void sched_end(Transfer * transfer) {
+    Transfer ** current;
+
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_sched);
+    current = &sched_transfers;
+    while (*current != NULL && *current != transfer) {
+        current = &(*current)->next;
+    }
+    if (*current != NULL) {
+        *current = transfer->next;
+    }
+    sched_client_transfers[transfer->client_indice] = sched_client_transfers[transfer->client_indice] - 1;
+    // The next waiting transfer may be able to go
+    pthread_cond_broadcast(&cond_sched);
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_sched);
+    free(transfer);
+}
+
+// A function that will charge nb_bytes sent or received by a transfer
+// It returns when the transfer can continue: when there are enough tokens, and no waiting transfer
+// has priority over this one. The waiting transfer with priority is the one of the client
+// with the less bytes charged, and among the transfers of this client the one with the less bytes charged.
+// This shares the bandwidth in bytes, whatever the size of the blocks of each transfer.
+
+void sched_charge(Transfer * transfer, long nb_bytes) {
+    struct timespec now;
+    struct timespec deadline;
+    Transfer * current;
+    Transfer * first;
+    double wait;
+
+    if (nb_bytes <= 0) {
+        return;
+    }
+
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_sched);
+    transfer->want = nb_bytes;
+    while (1) {
+        if (sched_reload == 1) {
+            sched_reload = 0;
+            sched_load_config();
+        }
+        if (sched_rate == 0) {
+            break;
+        }
+
+        // The tokens that came back since the last time
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        sched_tokens = sched_tokens + sched_rate * ((now.tv_sec - sched_last.tv_sec) + (now.tv_nsec - sched_last.tv_nsec) / 1e9);
+        if (sched_tokens > sched_burst) {
+            sched_tokens = sched_burst;
+        }
+        sched_last = now;
+
+        // We look for the waiting transfer with priority
+        first = NULL;
+        current = sched_transfers;
+        while (current != NULL) {
+            if (current->want > 0 && (first == NULL
+                || sched_client_served[current->client_indice] < sched_client_served[first->client_indice]
+                || (sched_client_served[current->client_indice] == sched_client_served[first->client_indice]
+                    && current->served < first->served))) {
+                first = current;
+            }
+            current = current->next;
+        }
+        if (first == transfer && sched_tokens >= nb_bytes) {
+            break;
+        }
+
+        // If it is our turn we wait for the missing tokens, otherwise we are woken up
+        // when the transfer with priority goes (we don't wait more than 100 ms in any case)
+        wait = 0.1;
+        if (first == transfer && (nb_bytes - sched_tokens) / sched_rate < wait) {
+            wait = (nb_bytes - sched_tokens) / sched_rate;
+        }
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec = deadline.tv_nsec + (long) (wait * 1e9);
+        deadline.tv_sec = deadline.tv_sec + deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec = deadline.tv_nsec % 1000000000;
+        pthread_cond_timedwait(&cond_sched, &mutex_sched, &deadline);
+    }
+
+    if (sched_rate > 0) {
+        sched_tokens = sched_tokens - nb_bytes;
+    }
+    transfer->want = 0;
+    transfer->served = transfer->served + nb_bytes;
+    sched_client_served[transfer->client_indice] = sched_client_served[transfer->client_indice] + nb_bytes;
+    // The next waiting transfer may be able to go
+    pthread_cond_broadcast(&cond_sched);
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_sched);
+}
+
+
+/*********************************************
+              Presence digests
+**********************************************/
+
+
+// A function for the thread that asks each channel for its digest once its window is over
+// (see presence_schedule), the actor sends it in its worker
+// It also reads the configuration again after a SIGHUP, even if no transfer is running
+
+void * presence_thread(void * arg) {
+    ChannelActor * actor;
+    char channel[CHANNEL_SIZE];
+    struct timespec now;
+    struct timespec deadline;
+
+    while (1) {
+        actor = NULL;
+        // Lock the mutex
+        pthread_mutex_lock(&mutex_presence);
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (presence_first != NULL && (presence_first->presence_deadline.tv_sec < now.tv_sec
+            || (presence_first->presence_deadline.tv_sec == now.tv_sec
+                && presence_first->presence_deadline.tv_nsec <= now.tv_nsec))) {
+            actor = presence_first;
+            presence_first = actor->next_presence;
+            if (presence_first == NULL) {
+                presence_last = NULL;
+            }
+            actor->presence_queued = 0;
+            // The actor can be freed once the mutex is unlocked
+            strcpy(channel, actor->name);
+        }
+        else {
+            // We wait for the first deadline, or for an actor to ask, but not more than a second
+            deadline = now;
+            deadline.tv_sec = deadline.tv_sec + 1;
+            if (presence_first != NULL && (presence_first->presence_deadline.tv_sec < deadline.tv_sec
+                || (presence_first->presence_deadline.tv_sec == deadline.tv_sec
+                    && presence_first->presence_deadline.tv_nsec < deadline.tv_nsec))) {
+                deadline = presence_first->presence_deadline;
+            }
+            pthread_cond_timedwait(&cond_presence, &mutex_presence, &deadline);
+        }
+        // Unlock the mutex
+        pthread_mutex_unlock(&mutex_presence);
+
+        if (actor != NULL) {
+            channel_event(channel, CHANNEL_DIGEST, -1, 0, 0, NULL, 0);
+        }
+
+        // Lock the mutex
+        pthread_mutex_lock(&mutex_sched);
+        if (sched_reload == 1) {
+            sched_reload = 0;
+            sched_load_config();
+        }
+        // Unlock the mutex
+        pthread_mutex_unlock(&mutex_sched);
+    }
+    return arg;
+}
+
+
+/*********************************************
+                 Disk writer
+**********************************************/
+
+// An upload doesn't write in its file itself: the bytes received are copied into
+// big buffers, and the writer threads write the full buffers in the file
+// This way, when the disk is slow, the upload thread continues to read the socket
+// until WRITER_BUFFERS of its buffers wait to be written, instead of stopping at each write
+// The buffers are taken from a pool of WRITER_POOL_BUFFERS buffers shared by all the uploads,
+// and written by WRITER_THREADS threads, both created when the server starts:
+// the memory and the threads used by the uploads don't grow with their number
+// An upload that can't get a buffer when it starts is refused, the client tries again later
+// The buffers are aligned and the writes fall on multiples of WRITER_BUFFER_SIZE in the file
+// The file is synchronised on the disk once, when the upload ends
+
+typedef struct DiskWriter DiskWriter;
+typedef struct WriterBuffer WriterBuffer;
+
+struct WriterBuffer {
+    char * data;
+    // The upload of the buffer, and where its bytes go in the file
+    DiskWriter * writer;
+    long offset;
+    long length;
+    // The next buffer of the free list or of the queue of the writer threads
+    WriterBuffer * next;
+};
+
+struct DiskWriter {
+    // The file, written with pwrite
+    int fd;
+    // The buffer being filled by the upload thread, and the number of bytes it can take
+    WriterBuffer * filling;
+    long capacity;
+    // The offset in the file of the next byte given to the writer
+    long offset;
+    // The number of buffers of the upload given to the writer threads and not yet written
+    int nb_waiting;
+    // 1 if a write failed, set by a writer thread
+    int error;
+};
+
+// The buffers of the pool, the free ones and the full ones waiting for a writer thread
+WriterBuffer writer_pool[WRITER_POOL_BUFFERS];
+WriterBuffer * writer_free = NULL;
+WriterBuffer * writer_queue_first = NULL;
+WriterBuffer * writer_queue_last = NULL;
+// Mutex to protect the pool and the fields nb_waiting and error of the writers
+// cond_writer_queue wakes up the writer threads, cond_writer_done the uploads when a buffer is written
+pthread_mutex_t mutex_writer;
+pthread_cond_t cond_writer_queue;
+pthread_cond_t cond_writer_done;
+
+
+// A function for the threads that write the full buffers of the uploads in their file
+
+void * writer_thread(void * arg) {
+    WriterBuffer * buffer;
+    long nb_written;
+    ssize_t nb_write;
+    int error;
+
+    while (1) {
+        // Lock the mutex
+        pthread_mutex_lock(&mutex_writer);
+        while (writer_queue_first == NULL) {
+            pthread_cond_wait(&cond_writer_queue, &mutex_writer);
+        }
+        buffer = writer_queue_first;
+        writer_queue_first = buffer->next;
+        if (writer_queue_first == NULL) {
+            writer_queue_last = NULL;
+        }
+        error = buffer->writer->error;
+        // Unlock the mutex
+        pthread_mutex_unlock(&mutex_writer);
+
+        // After a failed write, the other buffers of the upload are not written but still given back
+        nb_written = 0;
+        while (error == 0 && nb_written < buffer->length) {
+            nb_write = pwrite(buffer->writer->fd, buffer->data + nb_written, buffer->length - nb_written,
+                buffer->offset + nb_written);
+            if (nb_write <= 0) {
+                perror("Erreur lors de l'ecriture du fichier");
+                error = 1;
+            }
+            else {
+                nb_written = nb_written + nb_write;
+            }
+        }
+
+        // Lock the mutex
+        pthread_mutex_lock(&mutex_writer);
+        if (error == 1) {
+            buffer->writer->error = 1;
+        }
+        buffer->writer->nb_waiting = buffer->writer->nb_waiting - 1;
+        buffer->writer = NULL;
+        buffer->next = writer_free;
+        writer_free = buffer;
+        pthread_cond_broadcast(&cond_writer_done);
+        // Unlock the mutex
+        pthread_mutex_unlock(&mutex_writer);
+    }
+    return arg;
+}
+
+// A function that will allocate the buffers of the pool and launch the writer threads
+
+void writer_pool_start() {
+    pthread_t writer_tid;
+    int i = 0;
+
+    pthread_mutex_init(&mutex_writer, NULL);
+    pthread_cond_init(&cond_writer_queue, NULL);
+    pthread_cond_init(&cond_writer_done, NULL);
+    while (i < WRITER_POOL_BUFFERS) {
+        if (posix_memalign((void **) &writer_pool[i].data, WRITER_ALIGN, WRITER_BUFFER_SIZE) != 0) {
+            printf("Erreur lors de l'allocation des tampons d'ecriture\n");
+            exit(EXIT_FAILURE);
+        }
+        writer_pool[i].writer = NULL;
+        writer_pool[i].next = writer_free;
+        writer_free = &writer_pool[i];
+        i = i + 1;
+    }
+    i = 0;
+    while (i < WRITER_THREADS) {
+        if (pthread_create(&writer_tid, NULL, writer_thread, NULL) != 0) {
+            perror("Erreur lors de la creation du thread d'ecriture");
+            exit(EXIT_FAILURE);
+        }
+        i = i + 1;
+    }
+    printf("Uploads ecrits par %d threads avec %d tampons de %d Ko\n", WRITER_THREADS, WRITER_POOL_BUFFERS, WRITER_BUFFER_SIZE / 1024);
+}
+
+// A function that will take a buffer of the pool for the upload thread
+// A buffer ends on a multiple of WRITER_BUFFER_SIZE in the file, so only the first one can be smaller
+// If deadline is NULL it waits as long as needed, otherwise until deadline
+// The upload thread never holds a buffer it is filling while it waits, so the buffers always come back
+// It returns 0, -1 if a write of the writer threads failed, or -2 if no buffer was free before deadline
+
+int writer_next_buffer(DiskWriter * writer, struct timespec * deadline) {
+    int error;
+
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_writer);
+    while (writer_free == NULL || writer->nb_waiting >= WRITER_BUFFERS) {
+        if (deadline == NULL) {
+            pthread_cond_wait(&cond_writer_done, &mutex_writer);
+        }
+        else if (pthread_cond_timedwait(&cond_writer_done, &mutex_writer, deadline) != 0) {
+            // Unlock the mutex
+            pthread_mutex_unlock(&mutex_writer);
+            return -2;
+        }
+    }
+    writer->filling = writer_free;
+    writer_free = writer->filling->next;
+    error = writer->error;
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_writer);
+
+    writer->filling->writer = writer;
+    writer->filling->offset = writer->offset;
+    writer->filling->length = 0;
+    writer->filling->next = NULL;
+    writer->capacity = WRITER_BUFFER_SIZE - writer->offset % WRITER_BUFFER_SIZE;
+    if (error == 1) {
+        return -1;
+    }
+    return 0;
+}
+
+// A function that will give the buffer being filled to the writer threads
+
+void writer_submit(DiskWriter * writer) {
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_writer);
+    if (writer_queue_last == NULL) {
+        writer_queue_first = writer->filling;
+    }
+    else {
+        writer_queue_last->next = writer->filling;
+    }
+    writer_queue_last = writer->filling;
+    writer->nb_waiting = writer->nb_waiting + 1;
+    pthread_cond_signal(&cond_writer_queue);
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_writer);
+    writer->filling = NULL;
+}
+
+// A function that will start the writer of an upload, the first byte given will be written at offset
+// It waits WRITER_WAIT seconds at most for a buffer of the pool
+// It returns 0, or -1 if no buffer is free: the upload must be refused
+
+int writer_start(DiskWriter * writer, int fd, long offset) {
+    struct timespec deadline;
+
+    memset(writer, 0, sizeof(DiskWriter));
+    writer->fd = fd;
+    writer->offset = offset;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec = deadline.tv_sec + WRITER_WAIT;
+    if (writer_next_buffer(writer, &deadline) == -2) {
+        printf("Aucun tampon d'ecriture libre, l'upload est refuse\n");
+        return -1;
+    }
+    return 0;
+}
+
+// A function that will give length bytes of data to the writer, they follow the previous ones in the file
+// It only waits if WRITER_BUFFERS buffers of the upload are waiting to be written, or if the pool is empty
+// It returns 0, or -1 if a write of the writer threads failed
+
+int writer_write(DiskWriter * writer, const char * data, long length) {
+    WriterBuffer * buffer;
+    long nb_copy;
+
+    while (length > 0) {
+        buffer = writer->filling;
+        nb_copy = writer->capacity - buffer->length;
+        if (nb_copy > length) {
+            nb_copy = length;
+        }
+        memcpy(buffer->data + buffer->length, data, nb_copy);
+        buffer->length = buffer->length + nb_copy;
+        writer->offset = writer->offset + nb_copy;
+        data = data + nb_copy;
+        length = length - nb_copy;
+
+        // The buffer is full, the writer threads can write it
+        if (buffer->length == writer->capacity) {
+            writer_submit(writer);
+            if (writer_next_buffer(writer, NULL) == -1) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// A function that will write what is left in the buffers, synchronise the file and stop the writer
+// It doesn't close the file
+// It returns 0 if every byte given is on the disk, -1 otherwise
+
+int writer_finish(DiskWriter * writer) {
+    // The buffer being filled is always taken, it is sent if it has bytes and given back otherwise
+    if (writer->filling->length > 0) {
+        writer_submit(writer);
+    }
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_writer);
+    if (writer->filling != NULL) {
+        writer->filling->writer = NULL;
+        writer->filling->next = writer_free;
+        writer_free = writer->filling;
+        writer->filling = NULL;
+        pthread_cond_broadcast(&cond_writer_done);
+    }
+    // We wait until the writer threads have written every buffer of the upload
+    while (writer->nb_waiting > 0) {
+        pthread_cond_wait(&cond_writer_done, &mutex_writer);
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_writer);
+
+    if (writer->error == 0 && fsync(writer->fd) == -1) {
+        perror("Erreur lors de la synchronisation du fichier");
+        writer->error = 1;
+    }
+    if (writer->error == 1) {
+        return -1;
+    }
+    return 0;
+}
+
+
+/*********************************************
+       Upload and Download Thread Functions
+**********************************************/
+
+
+// A function that will put a complete upload in the store, and give it its name in server_files
+// If the same content is already in the store, the upload takes no more disk space
+// If expected is not NULL, it is the hash the client declared, the upload is refused if its content
+// has another hash (for example if chunks of another attempt were mixed with the chunks of this one)
+// It returns 1 if the file can be downloaded, 0 otherwise
+
+int store_upload(char * path_partial, char * name, char * expected) {
+    char hash[SHA256_HEX_SIZE];
+    int fd = open(path_partial, O_RDONLY);
+    if (fd == -1 || sha256_file(fd, hash) == 0) {
+        perror("Erreur lors de la lecture du fichier");
+        if (fd != -1) {
+            close(fd);
+        }
+        return 0;
+    }
+    close(fd);
+    if (expected != NULL && strcmp(hash, expected) != 0) {
+        printf("Le fichier %s a le contenu %s au lieu de %s, il est refuse\n", name, hash, expected);
+        return 0;
+    }
+    if (blob_store(path_partial, hash, name) == 0) {
+        return 0;
+    }
+    // We give the hash to the catalog, so it doesn't read the file again
+    catalog_update(name, hash);
+    printf("Le fichier %s a le contenu %s\n", name, hash);
+    return 1;
+}
+
+// A function that will remove the partial files of the parallel uploads at the start of the server,
+// the chunks they already have are not known anymore
+
+void chunked_uploads_clean() {
+    struct dirent * entry;
+    char path[sizeof(PARTIAL_DIRECTORY) + NAME_MAX + 1];
+    size_t length;
+    DIR * directory = opendir(PARTIAL_DIRECTORY);
+    if (directory == NULL) {
+        return;
+    }
+    while ((entry = readdir(directory)) != NULL) {
+        length = strlen(entry->d_name);
+        if (length > 7 && strcmp(entry->d_name + length - 7, ".chunks") == 0) {
+            sprintf(path, "%s%s", PARTIAL_DIRECTORY, entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(directory);
+}
+
+// A function that will give the parallel upload of the file name, whose content has the given hash,
+// to a thread that is going to receive one of its chunks
+// The upload is created with an empty partial file if no chunk of it was received yet
+// The uploads that got no chunk for CHUNKED_UPLOAD_TIMEOUT seconds are abandoned on the way
+// It returns NULL if the chunk can't be received: the partial file can't be created,
+// the size is not the one of the other chunks, or the file is already complete
+// The thread must give the upload back with chunked_upload_close
+
+ChunkedUpload * chunked_upload_open(const char * hash, const char * name, long size) {
+    ChunkedUpload * current;
+    ChunkedUpload * previous = NULL;
+    ChunkedUpload * next;
+    time_t now = time(NULL);
+
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_chunked_uploads);
+
+    // We remove the uploads of the clients who gave up, with their partial file
+    current = chunked_uploads;
+    while (current != NULL) {
+        next = current->next;
+        if (current->nb_writers == 0 && current->storing == 0 && now - current->last_activity > CHUNKED_UPLOAD_TIMEOUT) {
+            printf("L'envoi du fichier %s est abandonne\n", current->name);
+            if (previous == NULL) {
+                chunked_uploads = next;
+            }
+            else {
+                previous->next = next;
+            }
+            close(current->fd);
+            unlink(current->path);
+            free(current);
+        }
+        else {
+            previous = current;
+        }
+        current = next;
+    }
+
+    // We look for the upload of this file
+    current = chunked_uploads;
+    while (current != NULL && (strcmp(current->hash, hash) != 0 || strcmp(current->name, name) != 0)) {
+        current = current->next;
+    }
+    // If this is the first chunk we receive, we create the upload
+    // A partial file left by an abandoned upload is emptied, its chunks don't count
+    if (current == NULL) {
+        current = malloc(sizeof(ChunkedUpload));
+        strcpy(current->hash, hash);
+        strcpy(current->name, name);
+        current->size = size;
+        sprintf(current->path, "%s%s.%s.chunks", PARTIAL_DIRECTORY, hash, name);
+        current->fd = open(current->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (current->fd == -1) {
+            perror("Erreur lors de la creation du fichier");
+            free(current);
+            current = NULL;
+        }
+        else {
+            current->nb_done = 0;
+            current->bytes_done = 0;
+            current->nb_writers = 0;
+            current->storing = 0;
+            current->next = chunked_uploads;
+            chunked_uploads = current;
+        }
+    }
+    else if (current->size != size || current->storing == 1) {
+        current = NULL;
+    }
+    if (current != NULL) {
+        current->nb_writers = current->nb_writers + 1;
+        current->last_activity = now;
+    }
+
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_chunked_uploads);
+    return current;
+}
+
+// A function that will give back the upload a thread got with chunked_upload_open
+// If verified is 1, the chunk is on the disk and its checksum is right, it is added to the upload
+// Once every byte is received, the last thread to give the upload back puts the partial file in the store
+// (see store_upload), no other chunk can be written in it then
+// It returns 1 if the chunk is verified, 0 if it isn't (the client sends it again),
+// -1 if the complete file doesn't have the hash declared by the client (the client sends the whole file again)
+
+int chunked_upload_close(ChunkedUpload * upload, long offset, long length, int verified) {
+    int status = verified;
+    int complete = 0;
+    int i;
+    ChunkedUpload * current;
+    ChunkedUpload * previous = NULL;
+
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_chunked_uploads);
+
+    // A chunk sent twice (for example if the client didn't get our answer) is only counted once
+    if (verified == 1) {
+        i = 0;
+        while (i < upload->nb_done && upload->done_offsets[i] != offset) {
+            i = i + 1;
+        }
+        if (i == upload->nb_done && upload->nb_done < MAX_CHUNKS) {
+            upload->done_offsets[upload->nb_done] = offset;
+            upload->nb_done = upload->nb_done + 1;
+            upload->bytes_done = upload->bytes_done + length;
+        }
+    }
+    upload->nb_writers = upload->nb_writers - 1;
+    upload->last_activity = time(NULL);
+    // If every byte has been received, the file is complete
+    if (upload->bytes_done >= upload->size && upload->nb_writers == 0 && upload->storing == 0) {
+        printf("Le fichier %s est complet (%d morceaux)\n", upload->name, upload->nb_done);
+        upload->storing = 1;
+        complete = 1;
+    }
+
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_chunked_uploads);
+
+    if (complete == 0) {
+        return status;
+    }
+
+    // The file is put in the store outside of the mutex, its hash takes some time
+    close(upload->fd);
+    if (store_upload(upload->path, upload->name, upload->hash) == 0) {
+        unlink(upload->path);
+        status = -1;
+    }
+
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_chunked_uploads);
+    // We remove the upload from the list
+    current = chunked_uploads;
+    while (current != upload) {
+        previous = current;
+        current = current->next;
+    }
+    if (previous == NULL) {
+        chunked_uploads = upload->next;
+    }
+    else {
+        previous->next = upload->next;
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_chunked_uploads);
+
+    free(upload);
+    return status;
+}
+
+
+// A function that will check that a file name sent by a client can be used in server_files
+// and server_partial: it can't be empty, start with a dot (hidden files, "." and "..") or contain a /
+// It returns 1 if it can, 0 otherwise
+
+int upload_valid_name(const char * name) {
+    return name[0] != '\0' && name[0] != '.' && strchr(name, '/') == NULL && strlen(name) <= NAME_MAX;
+}
+
+// A function that will split "<hash>/<name>" sent by a client in buffer->message
+// The hash is left in buffer->message, it must be a SHA-256 in hexadecimal as it is used in paths
+// It returns the name, or NULL if the hash or the name can't be used
+
+char * upload_split_hash(Message * buffer) {
+    char * name;
+
+    buffer->message[MSG_SIZE - 1] = '\0';
+    name = strchr(buffer->message, '/');
+    if (name == NULL || name - buffer->message != SHA256_HEX_SIZE - 1
+        || strspn(buffer->message, "0123456789abcdef") != SHA256_HEX_SIZE - 1 || upload_valid_name(name + 1) == 0) {
+        return NULL;
+    }
+    *name = '\0';
+    return name + 1;
+}
+
+// A function that will answer a client who asks if we already have the content of a file
+// The client sends "<hash>/<name>" in buffer->message, hash being the SHA-256 of the file
+// If the content is in the store, the name is linked to it and the client doesn't need to send the file
+// We send back 1 if the file is now available under this name, 0 if the client must send it
+
+void receive_hash(int dS_thread_upload, Message * buffer) {
+    char * name;
+    long status = 0;
+
+    name = upload_split_hash(buffer);
+    if (name != NULL) {
+        if (blob_link(buffer->message, name) == 1) {
+            catalog_update(name, buffer->message);
+            printf("Le fichier %s est deja dans le magasin, l'envoi est evite\n", name);
+            status = 1;
+        }
+    }
+    send_int64(dS_thread_upload, &status, 1);
+}
+
+
+// A function that will receive one chunk of a file uploaded in parallel
+// The client has already sent "<hash>/<name>" in buffer->message, hash being the SHA-256 of the file,
+// then he sends the size of the file, the offset and the length of the chunk,
+// the data of the chunk and the CRC32C checksum of the chunk
+// If buffer->to is "deflate", the data is sent in compressed blocks (see send_block)
+// The chunk is written at its place in the partial file of the upload with pwrite,
+// so all the chunks of a file can be written at the same time by different threads
+// We send back 1 if the chunk is verified, 0 if it isn't (the client will send it again),
+// -1 if it was the last chunk and the file doesn't have the declared hash (see chunked_upload_close)
+
+void receive_chunk(int dS_thread_upload, Message * buffer, int client_indice) {
+    long header[3]; // The size of the file, the offset and the length of the chunk
+    long file_size;
+    long offset;
+    long length;
+    long status = 0; // The answer to the client
+    uint32_t crc_client; // The checksum computed by the client
+    uint32_t crc = 0; // The checksum of what we received
+    char * name; // The name of the file, its hash stays in buffer->message
+    char packet[COMPRESS_BLOCK];
+    long nb_recv_total = 0;
+    long wire = 0; // The number of bytes received on the socket
+    long wire_before;
+    int compressed = strcmp(buffer->to, "deflate") == 0;
+    int nb_to_recv;
+    int nb_recv;
+    ChunkedUpload * upload; // The upload the chunk belongs to
+    Transfer * transfer;
+    DiskWriter writer; // Writes the chunk while we receive it
+
+    // The hash and the name are used in the path of the partial file, they can't take us out of server_partial
+    name = upload_split_hash(buffer);
+    if (name == NULL) {
+        printf("Morceau invalide : %s\n", buffer->message);
+        return;
+    }
+
+    // We receive the size of the file, the offset and the length of the chunk
+    if (recv_int64(dS_thread_upload, header, 3) == 0) {
+        printf("Le client s'est deconnecte dans le file upload\n");
+        return;
+    }
+    file_size = header[0];
+    offset = header[1];
+    length = header[2];
+    if (offset < 0 || length <= 0 || offset + length > file_size) {
+        printf("Morceau invalide pour le fichier %s\n", name);
+        send_int64(dS_thread_upload, &status, 1);
+        return;
+    }
+    printf("Morceau de %s : %ld octets a partir de l'octet %ld\n", name, length, offset);
+
+    // Every chunk of the file is written in the partial file of its upload
+    upload = chunked_upload_open(buffer->message, name, file_size);
+    if (upload == NULL) {
+        send_int64(dS_thread_upload, &status, 1);
+        return;
+    }
+    // If the server has no buffer for the chunk, the client sends it again later
+    if (writer_start(&writer, upload->fd, offset) == -1) {
+        chunked_upload_close(upload, offset, length, 0);
+        send_int64(dS_thread_upload, &status, 1);
+        return;
+    }
+
+    // We receive the data of the chunk and give it to the writer, that writes it at its place
+    // The scheduler is charged with the bytes that come on the socket
+    transfer = sched_start(client_indice);
+    while (nb_recv_total < length) {
+        wire_before = wire;
+        if (compressed == 1) {
+            nb_recv = recv_block(dS_thread_upload, packet, &wire);
+        }
+        else {
+            nb_to_recv = BUFFER_SIZE;
+            if (length - nb_recv_total < BUFFER_SIZE) {
+                nb_to_recv = length - nb_recv_total;
+            }
+            nb_recv = recv(dS_thread_upload, packet, nb_to_recv, 0);
+        }
+        if (nb_recv <= 0 || nb_recv > length - nb_recv_total) {
+            printf("Le client s'est deconnecte pendant l'envoi d'un morceau\n");
+            break;
+        }
+        if (writer_write(&writer, packet, nb_recv) == -1) {
+            printf("Erreur lors de l'ecriture du morceau\n");
+            break;
+        }
+        crc = crc32c_update(crc, packet, nb_recv);
+        nb_recv_total = nb_recv_total + nb_recv;
+        sched_charge(transfer, compressed == 1 ? wire - wire_before : nb_recv);
+    }
+    sched_end(transfer);
+    // The chunk is only registered once it is on the disk
+    if (writer_finish(&writer) == -1) {
+        nb_recv_total = -1;
+    }
+    if (nb_recv_total < length) {
+        chunked_upload_close(upload, offset, length, 0);
+        return;
+    }
+
+    // We receive the checksum of the chunk and compare it with ours
+    if (recv_uint32(dS_thread_upload, &crc_client, 1) == 0) {
+        printf("Le client s'est deconnecte avant d'envoyer la somme de controle\n");
+        chunked_upload_close(upload, offset, length, 0);
+        return;
+    }
+    if (compressed == 1) {
+        printf("Morceau de %s recu compresse : %ld octets pour %ld\n", name, wire, length);
+    }
+    if (crc_client != crc) {
+        printf("Somme de controle incorrecte pour un morceau de %s\n", name);
+    }
+    status = chunked_upload_close(upload, offset, length, crc_client == crc);
+    send_int64(dS_thread_upload, &status, 1);
+}
+
+
+// A function for a thread that will receive a file on a connection of the upload socket
+// It takes as an argument a pointer to the socket of the connection
+// The client first sends the ticket he got on his main connection
+// If the client sends the command "chunk", this connection only carries one chunk
+// of a file uploaded in parallel (see receive_chunk)
+// If the client sends the command "have", he only asks if we already have the content (see receive_hash)
+// Otherwise the whole file is sent on this connection:
+// The file is first written in a partial file in ../src/server_partial/
+// named <file name>.<file size>.part
+// After receiving the name and the size of the file, the thread sends back
+// the number of bytes already committed in the partial file, so a client
+// that lost his connection can continue the upload from there, or -1 if the server
+// can't receive the file now (no buffer of the disk writer is free)
+// If buffer->to is "deflate", the data is sent in compressed blocks (see send_block)
+// Once every byte is received, the client sends the CRC32C checksum of the whole file
+// (including the part received before a resume) and we send back 1 if it matches ours,
+// 0 if it doesn't: the partial file is then removed and the client sends the file again
+// Once the file is verified, it is put in the store and linked into ../src/server_files/,
+// so a file in server_files is never a half uploaded file
+
+void * upload_file_thread(void * arg){
+    int nb_recv; // The number of bytes received
+    Message msg_buffer; // The buffer for the messages
+    Message * buffer = &msg_buffer; // A pointer to the buffer
+    int dS_thread_upload = *(int *) arg; // The socket of the connection for the upload
+    int continue_thread = 1; // A variable to know if we continue the thread or not
+    int client_indice; // The indice of the client who sends the file
+    long file_size; // The size of the file
+    long offset = 0; // The number of bytes already in the partial file
+    char path_partial[MSG_SIZE + 50]; // The path of the partial file
+    int fd; // The partial file
+    DiskWriter writer; // Writes the file while we receive it
+    struct stat stat_partial; // To get the size of the partial file
+    uint32_t crc = 0; // The checksum of the file
+    uint32_t crc_client; // The checksum computed by the client
+    long status = 0; // The answer to the client
+    int fd_partial; // To read the part received before a resume
+    long wire = 0; // The number of bytes received on the socket for a compressed upload
+    long wire_before;
+    int compressed = 0; // 1 if the client sends compressed blocks
+    Transfer * transfer; // To share the bandwidth with the other transfers
+
+    pthread_t ThreadId = pthread_self(); // The id of the thread, will be used to cleanup thread once finished
+
+    free(arg);
+
+    // The client first sends his ticket, so we know who he is
+    client_indice = check_ticket(dS_thread_upload, "upload");
+    if (client_indice == -1) {
+        continue_thread = 0;
+    }
+
+    // We receive the name of the file
+    nb_recv = 0;
+    if (continue_thread == 1) {
+        nb_recv = recv_full(dS_thread_upload, buffer, BUFFER_SIZE);
+    }
+    // A connection reset by the client only ends this upload
+    if (nb_recv == -1) {
+        perror("Erreur lors de la reception upload client");
+        continue_thread = 0;
+    }
+    // If ever a client disconnect while we are receiving the messages
+    if (continue_thread == 1 && nb_recv < BUFFER_SIZE) {
+        printf("Le client s'est deconnecte dans le file upload\n");
+        continue_thread = 0;
+    }
+
+    // If this connection only carries one chunk of the file
+    if (continue_thread == 1) {
+        printf("Upload du client %d\n", client_indice + 1);
+    }
+    if (continue_thread == 1 && strcmp(buffer->cmd, "chunk") == 0) {
+        receive_chunk(dS_thread_upload, buffer, client_indice);
+        continue_thread = 0;
+    }
+    // If the client only asks if we already have the content of the file
+    if (continue_thread == 1 && strcmp(buffer->cmd, "have") == 0) {
+        receive_hash(dS_thread_upload, buffer);
+        continue_thread = 0;
+    }
+
+    // The name is used in the paths of the partial file and of the file,
+    // it can't take us out of their directories
+    buffer->message[MSG_SIZE - 1] = '\0';
+    if (continue_thread == 1 && upload_valid_name(buffer->message) == 0) {
+        printf("Nom de fichier invalide : %s\n", buffer->message);
+        continue_thread = 0;
+    }
+
+    // We receive the size of the file
+    if (continue_thread == 1){
+        printf("Le nom du fichier est: %s\n", buffer->message);
+
+        // We receive the size of the file
+        // If ever a client disconnect while we are receiving the messages
+        if (recv_int64(dS_thread_upload, &file_size, 1) == 0) {
+            printf("Le client s'est deconnecte dans le file upload\n");
+            continue_thread = 0;
+        }
+    }
+
+    // We look for a partial file of a previous upload of the same file
+    if (continue_thread == 1){
+        sprintf(path_partial, "../src/server_partial/%s.%ld.part", buffer->message, file_size);
+
+        if (stat(path_partial, &stat_partial) == 0 && stat_partial.st_size <= file_size) {
+            offset = stat_partial.st_size;
+            // The checksum covers the whole file, so we start with the bytes we already have
+            fd_partial = open(path_partial, O_RDONLY);
+            if (fd_partial == -1 || crc32c_file(fd_partial, offset, &crc) == 0) {
+                crc = 0;
+                offset = 0;
+            }
+            if (fd_partial != -1) {
+                close(fd_partial);
+            }
+            fd = open(path_partial, offset > 0 ? O_WRONLY : O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+        else {
+            fd = open(path_partial, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+        if (fd == -1) {
+            perror("Erreur lors de la creation du fichier");
+            continue_thread = 0;
+        }
+    }
+
+    // The writer writes the bytes after the committed offset while we receive the next ones
+    // If the server has no buffer for the upload, we send -1 instead of the offset,
+    // the client will send the file later
+    if (continue_thread == 1 && writer_start(&writer, fd, offset) == -1) {
+        close(fd);
+        offset = -1;
+        send_int64(dS_thread_upload, &offset, 1);
+        continue_thread = 0;
+    }
+
+    // We send the committed offset, the client will only send what is missing
+    if (continue_thread == 1){
+        printf("Le fichier %s reprend a l'octet %ld\n", buffer->message, offset);
+
+        if (send_int64(dS_thread_upload, &offset, 1) == -1) {
+            printf("Le client s'est deconnecte dans le file upload\n");
+            writer_finish(&writer);
+            close(fd);
+            continue_thread = 0;
+        }
+    }
+
+    // Packet for the file data
+    char packet[COMPRESS_BLOCK];
+    long nb_recv_total = offset;
+    int nb_to_recv;
+    
+    // We receive the data in the file
+    if (continue_thread == 1){
+        compressed = strcmp(buffer->to, "deflate") == 0;
+        transfer = sched_start(client_indice);
+        while(nb_recv_total < file_size){
+            wire_before = wire;
+            if (compressed == 1) {
+                nb_recv = recv_block(dS_thread_upload, packet, &wire);
+            }
+            else {
+                nb_to_recv = BUFFER_SIZE;
+                if (file_size - nb_recv_total < BUFFER_SIZE) {
+                    nb_to_recv = file_size - nb_recv_total;
+                }
+                nb_recv = recv(dS_thread_upload, packet, nb_to_recv, 0);
+            }
+            if (nb_recv == -1 || nb_recv > file_size - nb_recv_total) {
+                perror("Erreur lors de la reception");
+                break;
+            }
+            // If ever a client disconnect while we are receiving the messages
+            // the partial file is kept so he can continue later
+            if (nb_recv == 0) {
+                printf("Socket ferme : Le client s'est deconnecte pendant l'upload\n");
+                break;
+            }
+            nb_recv_total = nb_recv_total + nb_recv;
+            crc = crc32c_update(crc, packet, nb_recv);
+                    
+            // We give the bytes to the writer, it only waits if the disk is behind by WRITER_BUFFERS buffers
+            if (writer_write(&writer, packet, nb_recv) == -1) {
+                printf("Erreur lors de l'ecriture du fichier\n");
+                break;
+            }
+            sched_charge(transfer, compressed == 1 ? wire - wire_before : nb_recv);
+        }
+        sched_end(transfer);
+        // We wait for the last writes and close the file
+        // If a write failed, the file is not complete, the client will send the missing part again
+        if (writer_finish(&writer) == -1) {
+            nb_recv_total = -1;
+        }
+        close(fd);
+        printf("Le fichier a ete ferme\n");
+        printf("nb_recv_total: %ld\n", nb_recv_total);
+        printf("La taille du fichier est: %ld\n", file_size);
+        if (compressed == 1) {
+            printf("Recu compresse : %ld octets pour %ld\n", wire, nb_recv_total - offset);
+        }
+
+        // If the file is complete, we receive the checksum of the client and compare it with ours
+        if (nb_recv_total == file_size) {
+            if (recv_uint32(dS_thread_upload, &crc_client, 1) == 0) {
+                printf("Le client s'est deconnecte avant d'envoyer la somme de controle\n");
+                nb_recv_total = -1;
+            }
+            else if (crc_client != crc) {
+                // We don't know which bytes are wrong, the client will send the whole file again
+                printf("Somme de controle incorrecte pour %s\n", buffer->message);
+                remove(path_partial);
+                nb_recv_total = -1;
+            }
+        }
+
+        // If the file is complete and verified, we put it in the store, it is then linked in the server files
+        // The link is renamed over the name, so the others clients never see a half written file
+        if (nb_recv_total == file_size) {
+            if (store_upload(path_partial, buffer->message, NULL) == 1) {
+                printf("Le fichier %s est complet\n", buffer->message);
+                status = 1;
+            }
+        }
+        send_int64(dS_thread_upload, &status, 1);
+    }
+
+    // We close the socket
+    close(dS_thread_upload);
+    
+    // We put the ThreadId in the queue
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_ended_threads);
+    enqueue(ended_threads, ThreadId);
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_ended_threads);
+
+    // We increment the semaphore
     sem_post(&thread_end);
 
     printf("Thread upload termine\n");
@@ -660,180 +6472,597 @@ void * upload_file_thread(void * arg){
 
 
 
-// A function for a thread that will accept a connection using the socket 
-// for downloads and will send the list of files available for download.
-// Once the client has chosen a file, and sent back the file he chose,
-// the thread will send the size of the file and the file itself.
-
-void * download_file_thread(void * arg){
+// A function that will send the list of files available for download
+// The list comes from the catalog, it is sent in pages: the names of the files
+// are separated by "/" in buffer->message, as many as fit in a Message
+// buffer->color is "1" if another page follows, "0" for the last page
+// A name too long to fit in a Message is not listed
+// It returns 1 if the list was sent, 0 if the client disconnected
 
-    int nb_recv; // The number of bytes received
+int send_file_list(int dS_thread_download, Message * buffer) {
     int nb_send; // The number of bytes sent
-    Message msg_buffer; // The buffer for the messages
-    Message * buffer = &msg_buffer; // A pointer to the buffer
-    int dS_thread_download; // The socket for the download for the accept
-    int continue_thread = 1; // A variable to know if we continue the thread or not
-    long file_size; // The size of the file
-    char path[MSG_SIZE]; // The path of the file
-    FILE * file; // The file
+    int length = 0; // The length of the names already in the page
+    int name_length = 0;
+    int i = 0;
+    Message * pages; // The pages of the list, sent once the catalog is unlocked
+    int nb_pages = 1;
+    int capacity = 1;
 
-    pthread_t ThreadId = pthread_self(); // The id of the thread, will be used to cleanup thread once finished
+    strcpy(buffer->cmd, "download");
+    strcpy(buffer->to, buffer->from);
+    strcpy(buffer->from, "Serveur");
+    buffer->message[0] = '\0';
+    pages = malloc(sizeof(Message));
+    memcpy(&pages[0], buffer, sizeof(Message));
+
+    // Lock the mutex, we copy the names while the catalog can't change
+    // A slow client must not keep the catalog locked, so nothing is sent before it is unlocked
+    pthread_mutex_lock(&mutex_catalog);
+    while (i < catalog_count) {
+        name_length = strlen(catalog[i].name);
+        if (name_length + 1 < MSG_SIZE) {
+            // The name goes in a new page when the current one is full
+            if (length + name_length + 1 >= MSG_SIZE) {
+                if (nb_pages == capacity) {
+                    capacity = capacity * 2;
+                    pages = realloc(pages, capacity * sizeof(Message));
+                }
+                memcpy(&pages[nb_pages], buffer, sizeof(Message));
+                nb_pages = nb_pages + 1;
+                length = 0;
+            }
+            memcpy(pages[nb_pages - 1].message + length, catalog[i].name, name_length);
+            pages[nb_pages - 1].message[length + name_length] = '/';
+            length = length + name_length + 1;
+            pages[nb_pages - 1].message[length] = '\0';
+        }
+        i = i + 1;
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_catalog);
+
+    i = 0;
+    while (i < nb_pages) {
+        if (i == nb_pages - 1) {
+            strcpy(pages[i].color, "0");
+        }
+        else {
+            strcpy(pages[i].color, "1");
+        }
+        nb_send = send_full(dS_thread_download, &pages[i], BUFFER_SIZE);
+        // If the client disconnected, we stop the thread
+        if (nb_send == -1) {
+            printf("Le client s'est deconnecte dans le download\n");
+            free(pages);
+            return 0;
+        }
+        i = i + 1;
+    }
+    free(pages);
+    return 1;
+}
 
-    // Initialise file_addr and length
-    struct sockaddr_in file_addr;
-    socklen_t length_file_addr;
 
-    // We accept the connection
-    dS_thread_download = accept(download_socket, (struct sockaddr *) &file_addr, &length_file_addr);
-    if (dS_thread_download == -1) {
-        perror("Erreur lors de l'accept");
-        exit(EXIT_FAILURE);
+// The orders in which a page of the catalog can be sorted
+#define SORT_NAME 0
+#define SORT_SIZE 1
+#define SORT_DATE 2
+
+// A function that will compare two entries of the catalog in the given order
+// Two entries with the same size or date are sorted by name, so the order is always the same
+// It returns a negative number if a goes before b, 0 if they are equal, a positive number otherwise
+
+int catalog_compare(const CatalogEntry * a, const CatalogEntry * b, int sort) {
+    if (sort == SORT_SIZE && a->size != b->size) {
+        return (a->size < b->size) ? -1 : 1;
     }
+    if (sort == SORT_DATE && a->mtime != b->mtime) {
+        return (a->mtime < b->mtime) ? -1 : 1;
+    }
+    return strcmp(a->name, b->name);
+}
 
-    // Directory path
-    const char* directory_path = "../src/server_files/";
+// The functions given to qsort to sort the positions of the files in catalog_order
+// The mutex of the catalog must be locked
 
-    // Open the directory
-    DIR* directory = opendir(directory_path);
-    if (directory == NULL) {
-        printf("Unable to open directory.\n");
-        continue_thread = 0;
+int catalog_compare_size(const void * a, const void * b) {
+    return catalog_compare(&catalog[*(const int *) a], &catalog[*(const int *) b], SORT_SIZE);
+}
+
+int catalog_compare_date(const void * a, const void * b) {
+    return catalog_compare(&catalog[*(const int *) a], &catalog[*(const int *) b], SORT_DATE);
+}
+
+// A function that will give the positions of the files in the order sort (SORT_SIZE or SORT_DATE)
+// They are only sorted if the catalog changed since the last time
+// The mutex of the catalog must be locked
+
+int * catalog_sorted(int sort) {
+    int i = 0;
+
+    if (catalog_order_valid[sort] == 0) {
+        catalog_order[sort] = realloc(catalog_order[sort], (catalog_count + 1) * sizeof(int));
+        if (catalog_order[sort] == NULL) {
+            perror("Erreur lors de l'allocation du catalogue");
+            exit(EXIT_FAILURE);
+        }
+        while (i < catalog_count) {
+            catalog_order[sort][i] = i;
+            i = i + 1;
+        }
+        if (sort == SORT_SIZE) {
+            qsort(catalog_order[sort], catalog_count, sizeof(int), catalog_compare_size);
+        }
+        else {
+            qsort(catalog_order[sort], catalog_count, sizeof(int), catalog_compare_date);
+        }
+        catalog_order_valid[sort] = 1;
     }
-    
-    if (continue_thread == 1){
-        // Read directory entries
-        struct dirent* entry;
-        char file_list[MSG_SIZE];
+    return catalog_order[sort];
+}
 
-        // Put \0 at the beginning of the message to avoid concatenation problems
-        buffer->message[0] = '\0';
+// A function that will give the file at the position k of an order (NULL for the order by name)
+// The mutex of the catalog must be locked
 
+CatalogEntry * catalog_at(int * order, int k) {
+    if (order == NULL) {
+        return &catalog[k];
+    }
+    return &catalog[order[k]];
+}
 
-        while ((entry = readdir(directory)) != NULL) {
-            // Exclude "." and ".." directories
-            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-                // Copy the file name to the file_list
-                strncpy(file_list, entry->d_name, sizeof(file_list));
-                file_list[sizeof(file_list) - 1] = '\0';  // Ensure null-termination
+// A function that will give the position of the first file after the files whose name starts with prefix
+// low is the position of the first of them (see catalog_search), the catalog is sorted by name
+// The mutex of the catalog must be locked
 
-                // Concatentate the file_list to buffer->message
-                strcat(buffer->message, file_list);
-                strcat(buffer->message, "/");
+int catalog_prefix_end(const char * prefix, int low) {
+    int high = catalog_count;
+    int prefix_length = strlen(prefix);
+    int middle;
 
-            }
+    while (low < high) {
+        middle = (low + high) / 2;
+        if (strncmp(catalog[middle].name, prefix, prefix_length) <= 0) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
         }
+    }
+    return low;
+}
 
-        // Close the directory
-        closedir(directory);
+// A function that will give the first position between low and high in the order
+// where the file is after the cursor (or_equal is 1), or not before the cursor (or_equal is 0)
+// The mutex of the catalog must be locked
 
-        // We send the list of files
-        strcpy(buffer->cmd, "download");
-        strcpy(buffer->to, buffer->from);
-        strcpy(buffer->from, "Serveur");
-        nb_send = send(dS_thread_download, buffer, BUFFER_SIZE, 0);
-        if (nb_send == -1) {
-            perror("Erreur lors de l'envoi");
-            exit(EXIT_FAILURE);
+int catalog_bound(int * order, CatalogEntry * cursor, int sort, int or_equal, int low, int high) {
+    int middle;
+    int compare;
+
+    while (low < high) {
+        middle = (low + high) / 2;
+        compare = catalog_compare(catalog_at(order, middle), cursor, sort);
+        if (compare < 0 || (or_equal == 1 && compare == 0)) {
+            low = middle + 1;
         }
-        // If the client disconnected, we stop the thread
-        if (nb_send == 0) {
-            printf("Le client s'est deconnecte dans le download\n");
-            continue_thread = 0;
+        else {
+            high = middle;
         }
     }
+    return low;
+}
 
-    if (continue_thread == 1){
-        // We receive the file name the client wants to download
-        nb_recv = recv(dS_thread_download, buffer, BUFFER_SIZE, 0);
-        if (nb_recv == -1) {
-            perror("Erreur lors de la reception");
-            exit(EXIT_FAILURE);
+// A function that will send one page of the files available for download
+// The client sends:
+//   buffer->to      : the order, "name", "size" or "date", with a "-" before for the reverse order
+//   buffer->channel : the maximum number of files in the page, 0 for as many as fit
+//   buffer->message : "<prefix>/<cursor>", only the files whose name starts with prefix are listed,
+//                     and the page starts right after the cursor (empty for the first page)
+// We send a Message with "<cursor>/<name>/<name>/.../" in buffer->message, the cursor
+// is the one to send back to get the next page, and buffer->color is "1" if there is a next page
+// The cursor is the position of the last file of the page in the order ("<size>:<name>",
+// "<date>:<name>" or "<name>"), so a file added or removed between two pages doesn't shift the pages
+// It returns 1 if the page was sent, 0 if the client disconnected
+
+int send_file_page(int dS_thread_download, Message * buffer) {
+    char prefix[MSG_SIZE];
+    char names[MSG_SIZE];
+    char * separator;
+    char * cursor_text;
+    CatalogEntry cursor; // The last file of the previous page
+    CatalogEntry last; // The last file of the page
+    CatalogEntry * entry;
+    int * sorted = NULL; // The positions of the files in the order, NULL for the order by name
+    int sort = SORT_NAME;
+    int reverse = 0; // 1 for the reverse order
+    int has_cursor = 0;
+    int max_files;
+    int nb_files = 0; // The number of files in the page
+    int length = 0; // The length of the names in the page
+    int name_length;
+    int cursor_length;
+    int prefix_length;
+    int low = 0; // The files that can match the prefix are between low and high
+    int high;
+    int position; // The position of the next file in the order
+    int step = 1; // 1 to go forward in the order, -1 for the reverse order
+    int more = 0; // 1 if there is a next page
+    int found;
+
+    // We read the request
+    buffer->to[USERNAME_SIZE - 1] = '\0';
+    buffer->channel[CHANNEL_SIZE - 1] = '\0';
+    buffer->message[MSG_SIZE - 1] = '\0';
+    char * order = buffer->to;
+    if (order[0] == '-') {
+        reverse = 1;
+        order = order + 1;
+    }
+    if (strcmp(order, "size") == 0) {
+        sort = SORT_SIZE;
+    }
+    else if (strcmp(order, "date") == 0) {
+        sort = SORT_DATE;
+    }
+    max_files = atoi(buffer->channel);
+    strcpy(prefix, buffer->message);
+    cursor_text = "";
+    separator = strchr(prefix, '/');
+    if (separator != NULL) {
+        *separator = '\0';
+        cursor_text = separator + 1;
+    }
+    memset(&cursor, 0, sizeof(CatalogEntry));
+    if (cursor_text[0] != '\0') {
+        has_cursor = 1;
+        // The size or the date is before the first ":", the name can contain other ":"
+        if (sort != SORT_NAME && strchr(cursor_text, ':') != NULL) {
+            cursor.size = atol(cursor_text);
+            cursor.mtime = atol(cursor_text);
+            cursor_text = strchr(cursor_text, ':') + 1;
         }
-        // If the client disconnected, we stop the thread
-        if (nb_recv == 0) {
-            continue_thread = 0;
+        strncpy(cursor.name, cursor_text, NAME_MAX);
+    }
+
+    prefix_length = strlen(prefix);
+
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_catalog);
+    high = catalog_count;
+    if (sort == SORT_NAME) {
+        // The catalog is sorted by name: the files with the prefix are next to each other
+        low = catalog_search(prefix, &found);
+        high = catalog_prefix_end(prefix, low);
+    }
+    else {
+        // The other orders are only sorted again when the catalog changed
+        sorted = catalog_sorted(sort);
+    }
+
+    // We look for the first file after the cursor
+    if (reverse == 0) {
+        position = low;
+        if (has_cursor == 1) {
+            position = catalog_bound(sorted, &cursor, sort, 1, low, high);
         }
-        
-        // If the buffer->cmd is "cancel" we stop the thread
-        if (strcmp(buffer->cmd, "cancel") == 0) {
-            continue_thread = 0;
+    }
+    else {
+        step = -1;
+        position = high - 1;
+        if (has_cursor == 1) {
+            position = catalog_bound(sorted, &cursor, sort, 0, low, high) - 1;
         }
+    }
 
+    // We put as many names as we can in the page, keeping space for the cursor
+    names[0] = '\0';
+    while (position >= low && position < high && more == 0) {
+        entry = catalog_at(sorted, position);
+        if (strncmp(entry->name, prefix, prefix_length) == 0) {
+            name_length = strlen(entry->name);
+            // A name has at most NAME_MAX characters, so the first one always fits
+            if ((max_files > 0 && nb_files == max_files) || length + name_length + 1 + NAME_MAX + 24 >= MSG_SIZE) {
+                more = 1;
+            }
+            else {
+                memcpy(names + length, entry->name, name_length);
+                names[length + name_length] = '/';
+                length = length + name_length + 1;
+                names[length] = '\0';
+                nb_files = nb_files + 1;
+                last = *entry;
+            }
+        }
+        position = position + step;
     }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_catalog);
 
-    if (continue_thread == 1){
-        // We concatenate the path of the file
-        strcpy(path, "../src/server_files/");
-        strcat(path, buffer->message);
+    // The cursor of the page is the position of the last file
+    strcpy(buffer->message, "");
+    if (nb_files > 0) {
+        if (sort == SORT_SIZE) {
+            sprintf(buffer->message, "%ld:", last.size);
+        }
+        else if (sort == SORT_DATE) {
+            sprintf(buffer->message, "%ld:", (long) last.mtime);
+        }
+        strcat(buffer->message, last.name);
+    }
+    cursor_length = strlen(buffer->message);
+    buffer->message[cursor_length] = '/';
+    memcpy(buffer->message + cursor_length + 1, names, length + 1);
+
+    if (more == 1) {
+        strcpy(buffer->color, "1");
+    }
+    else {
+        strcpy(buffer->color, "0");
+    }
+
+    strcpy(buffer->cmd, "page");
+    strcpy(buffer->to, buffer->from);
+    strcpy(buffer->from, "Serveur");
+    if (send_full(dS_thread_download, buffer, BUFFER_SIZE) == -1) {
+        printf("Le client s'est deconnecte dans le download\n");
+        return 0;
+    }
+    return 1;
+}
+
+
+// A function that will send the size of the file buffer->message, taken from the catalog
+// The size is -1 if the file doesn't exist
+// The client uses it to decide if he downloads the file in parallel
+// It returns 1 if the size was sent, 0 if the client disconnected
+
+int send_file_size(int dS_thread_download, Message * buffer) {
+    long file_size = -1;
+    int found;
+    int position;
+
+    buffer->message[MSG_SIZE - 1] = '\0';
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_catalog);
+    position = catalog_search(buffer->message, &found);
+    if (found == 1) {
+        file_size = catalog[position].size;
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_catalog);
+    if (send_int64(dS_thread_download, &file_size, 1) == -1) {
+        printf("Le client s'est deconnecte lors de l'envoi de file_size\n");
+        return 0;
+    }
+    return 1;
+}
+
+
+// A function that will send a part of the file buffer->message
+// The client sends the offset where the download starts and the length he wants
+// (a length of 0 means until the end of the file).
+// We send the total size of the file (-1 if it is not in the catalog), then only the requested bytes,
+// then the CRC32C checksum of the bytes sent so the client can verify them.
+// If buffer->channel is "full", the checksum also covers the bytes before the offset,
+// so a client that resumes a download can verify the whole file.
+// If buffer->to is "deflate", the client accepts compressed blocks: after the size of the file
+// we send 1 if the bytes are sent compressed (see send_block), 0 if they are sent as they are.
+// We only compress the bytes if a sample of them doesn't look already compressed.
+// This way a client can resume an interrupted download from his partial file,
+// or fetch a byte range of the file, for example one chunk of a parallel download.
+// The file is read with pread, so several threads can read the same file at the same time
+// It returns 1 if everything was sent, 0 if the client disconnected
+
+int send_file_range(int dS_thread_download, Message * buffer, int client_indice) {
+    long range[2]; // The offset and the length the client wants
+    long offset;
+    long length;
+    long file_size; // The size of the file
+    long nb_to_send; // The number of bytes we will really send
+    char path[MSG_SIZE + 50]; // The path of the file
+    struct stat stat_file;
+    int fd = -1; // The file, if it is not in the cache
+    CacheEntry * entry = NULL; // The content of the file, if it is in the cache
+    char hash[SHA256_HEX_SIZE]; // The hash of the content of the file
+    uint32_t crc = 0; // The checksum of the bytes sent
+    long compressed = 0; // 1 if we send compressed blocks
+    ssize_t nb_send; // The number of bytes sent on the socket for a block
+    long wire = 0; // The number of bytes sent on the socket
+    Transfer * transfer; // To share the bandwidth with the other transfers
+
+    // We receive the offset and the length the client wants
+    if (recv_int64(dS_thread_download, range, 2) == 0) {
+        printf("Le client s'est deconnecte avant d'envoyer l'offset\n");
+        return 0;
+    }
+    offset = range[0];
+    length = range[1];
+
+    // Only the files of the catalog can be downloaded, the name can't take us out of server_files
+    buffer->message[MSG_SIZE - 1] = '\0';
+    if (upload_valid_name(buffer->message) == 0 || catalog_get(buffer->message, hash, &file_size) == 0) {
+        printf("Le fichier %s n'existe pas\n", buffer->message);
+        file_size = -1;
+        send_int64(dS_thread_download, &file_size, 1);
+        return 0;
+    }
 
-        // We open the file
-        file = fopen(path, "rb");
-        if (file == NULL) {
+    // We take the content of the file from the cache, if it is small enough to be there
+    entry = cache_get(hash, file_size);
+    // Otherwise we open the file
+    if (entry == NULL) {
+        sprintf(path, "../src/server_files/%s", buffer->message);
+        fd = open(path, O_RDONLY);
+        if (fd == -1 || fstat(fd, &stat_file) == -1) {
             perror("Erreur lors de l'ouverture du fichier");
-            continue_thread = 0;
+            file_size = -1;
+            send_int64(dS_thread_download, &file_size, 1);
+            cache_close(NULL, fd);
+            return 0;
         }
+        file_size = stat_file.st_size;
+        printf("Le fichier %s a ete ouvert\n", buffer->message);
+    }
 
+    // We compute the number of bytes to send
+    // An offset outside of the file means that there is nothing to send
+    if (offset < 0 || offset > file_size) {
+        offset = file_size;
+    }
+    nb_to_send = file_size - offset;
+    if (length > 0 && length < nb_to_send) {
+        nb_to_send = length;
     }
+    printf("Envoi de %ld octets a partir de l'octet %ld\n", nb_to_send, offset);
 
-    if (continue_thread == 1){
-        printf("Le fichier %s a ete ouvert\n", buffer->message);
-        // We get the size of the file
-        // Put the cursor at the end of the file
-        fseek(file, 0, SEEK_END);  
-        // Get the size of the file
-        file_size = ftell(file);   
-        // Put the cursor at the beginning of the file     
-        rewind(file);              
-
-        // We send the size of the file
-        nb_send = send(dS_thread_download, &file_size, sizeof(long), 0);
-        if (nb_send == -1) {
-            perror("Erreur lors de l'envoi");
-            exit(EXIT_FAILURE);
-        } 
-        if (nb_send == 0) {
+    // The checksum of the whole file starts with the bytes the client already has
+    buffer->channel[CHANNEL_SIZE - 1] = '\0';
+    if (strcmp(buffer->channel, "full") == 0 && entry != NULL) {
+        crc = crc32c_update(crc, entry->data, offset);
+    }
+    else if (strcmp(buffer->channel, "full") == 0 && crc32c_file(fd, offset, &crc) == 0) {
+        perror("Erreur lors de la lecture du fichier");
+        file_size = -1;
+        send_int64(dS_thread_download, &file_size, 1);
+        cache_close(entry, fd);
+        return 0;
+    }
+
+    // We send the size of the file
+    if (send_int64(dS_thread_download, &file_size, 1) == -1) {
+        printf("Le client s'est deconnecte lors de l'envoi de file_size\n");
+        cache_close(entry, fd);
+        return 0;
+    }
+
+    // We tell the client if the bytes are compressed
+    buffer->to[USERNAME_SIZE - 1] = '\0';
+    if (strcmp(buffer->to, "deflate") == 0) {
+        compressed = nb_to_send > 0 && is_compressible(fd, entry != NULL ? entry->data : NULL, offset, nb_to_send);
+        if (send_int64(dS_thread_download, &compressed, 1) == -1) {
             printf("Le client s'est deconnecte lors de l'envoi de file_size\n");
-            continue_thread = 0;
+            cache_close(entry, fd);
+            return 0;
+        }
+    }
+
+    char packet[COMPRESS_BLOCK];
+    long nb_read_total = 0;
+    int nb_read = 0;
+    int nb_to_read = 0;
+    int packet_size = compressed == 1 ? COMPRESS_BLOCK : BUFFER_SIZE;
+    transfer = sched_start(client_indice);
+    while (nb_read_total < nb_to_send) {
+        nb_to_read = packet_size;
+        if (nb_to_send - nb_read_total < packet_size) {
+            nb_to_read = nb_to_send - nb_read_total;
+        }
+        nb_read = cache_pread(entry, fd, packet, nb_to_read, offset + nb_read_total);
+        if (nb_read <= 0) {
+            // The file has been truncated while we were sending it
+            // we close the connection, the client will see that the download is incomplete
+            printf("Le fichier a ete tronque pendant l'envoi\n");
+            sched_end(transfer);
+            cache_close(entry, fd);
+            return 0;
+        }
+        crc = crc32c_update(crc, packet, nb_read);
+        if (compressed == 1) {
+            nb_send = send_block(dS_thread_download, packet, nb_read);
+        }
+        else {
+            nb_send = send_full(dS_thread_download, packet, nb_read);
+        }
+        if (nb_send == -1) {
+            printf("Le client s'est deconnecte lors de l'envoi du fichier\n");
+            sched_end(transfer);
+            cache_close(entry, fd);
+            return 0;
+        }
+        wire += nb_send;
+        nb_read_total += nb_read;
+        sched_charge(transfer, nb_send);
+    }
+    sched_end(transfer);
+
+    // We close the file
+    cache_close(entry, fd);
+    printf("Le fichier a ete ferme\n");
+    if (compressed == 1) {
+        printf("Envoye compresse : %ld octets pour %ld\n", wire, nb_to_send);
+    }
+
+    // We send the checksum of what we sent
+    if (send_uint32(dS_thread_download, &crc, 1) == -1) {
+        printf("Le client s'est deconnecte lors de l'envoi de la somme de controle\n");
+        return 0;
+    }
+    return 1;
+}
+
+
+// A function for a thread that will answer the requests of a client
+// on a connection of the download socket
+// It takes as an argument a pointer to the socket of the connection
+// The client first sends the ticket he got on his main connection, then
+// he sends a Message for each request:
+//   "list"   : we send the list of files available for download
+//   "page"   : we send one page of the list, filtered and sorted (see send_file_page)
+//   "size"   : we send the size of the file in buffer->message
+//   "get"    : we send a part of the file in buffer->message (see send_file_range)
+//   "cancel" : the client doesn't want anything else
+// The thread stops when the client closes the connection
+
+void * download_file_thread(void * arg){
+
+    int nb_recv; // The number of bytes received
+    Message msg_buffer; // The buffer for the messages
+    Message * buffer = &msg_buffer; // A pointer to the buffer
+    int dS_thread_download = *(int *) arg; // The socket of the connection for the download
+    int continue_thread = 1; // A variable to know if we continue the thread or not
+
+    pthread_t ThreadId = pthread_self(); // The id of the thread, will be used to cleanup thread once finished
+
+    free(arg);
+
+    // The client first sends his ticket, so we know who he is
+    int client_indice = check_ticket(dS_thread_download, "download");
+    if (client_indice == -1) {
+        continue_thread = 0;
+    }
+    else {
+        printf("Download du client %d\n", client_indice + 1);
+    }
+
+    while (continue_thread == 1) {
+        // We receive the request of the client
+        nb_recv = recv_full(dS_thread_download, buffer, BUFFER_SIZE);
+        if (nb_recv == -1) {
+            perror("Erreur lors de la reception");
+            break;
+        }
+        // If the client disconnected, we stop the thread
+        if (nb_recv < BUFFER_SIZE) {
+            break;
         }
-    }
 
-    char packet[BUFFER_SIZE];
-    int nb_read_total = 0;
-    int nb_read = 0;
-    //printf("Envoie du fichier au serveur\n");
-    if (continue_thread == 1){
-        // Envoie le fichier au serveur
-        while(nb_read_total < file_size){
-            nb_read = fread(packet, 1, BUFFER_SIZE, file);
-            nb_read_total += nb_read;
-            // ajouter /0 a la fin du buffer si le fichier est plus petit que BUFFER_SIZE
-            if (nb_read < BUFFER_SIZE){ // inutile mais pour un code robuste
-                packet[nb_read] = '\0';
-            }
-            //printf("Taille du fichier : %ld, Taille lu: %d\n, Taille lu total:%d\n", size_file, nb_read, nb_read_total);
-            if (nb_read < BUFFER_SIZE){
-                nb_send = send(dS_thread_download, packet, nb_read, 0);
-            }else{
-                nb_send = send(dS_thread_download, packet, BUFFER_SIZE, 0);
-            }
-            //printf("Taille envoye: %d\n", nb_send);
-            //printf("Message envoye: %s\n", buffer);
-            if (nb_send == -1) {
-                perror("Erreur lors de l'envoi du message");
-                exit(EXIT_FAILURE);
-            }
-            if (nb_send == 0) {
-                printf("Le client s'est deconnecte lors de l'envoi du fichier\n");
-                continue_thread = 0;
-                break;
-            }
-            bzero(packet, BUFFER_SIZE);
+        if (strcmp(buffer->cmd, "list") == 0) {
+            continue_thread = send_file_list(dS_thread_download, buffer);
+        }
+        else if (strcmp(buffer->cmd, "page") == 0) {
+            continue_thread = send_file_page(dS_thread_download, buffer);
+        }
+        else if (strcmp(buffer->cmd, "size") == 0) {
+            continue_thread = send_file_size(dS_thread_download, buffer);
+        }
+        else if (strcmp(buffer->cmd, "get") == 0) {
+            continue_thread = send_file_range(dS_thread_download, buffer, client_indice);
+        }
+        else {
+            // "cancel" or an unknown request, we stop the thread
+            continue_thread = 0;
         }
-
-        // We close the file
-        fclose(file);
-        printf("Le fichier a ete ferme\n");
-
     }
 
     // We close the socket
@@ -854,42 +7083,86 @@ void * download_file_thread(void * arg){
 } 
 
 
+// A function for a thread that will accept every connection on the upload socket,
+// the download socket or the channel socket, and launch a thread for each of them
+// It takes as an argument a pointer to the function of the thread to launch
+// A client can open several connections at the same time, for example
+// to send or receive the chunks of a big file in parallel
+// The launched thread knows which client the connection belongs to thanks to the ticket
+// the client sends first, so the connections of different clients can't be mixed up
+
+void * accept_thread(void * arg){
+    void * (*connection_thread)(void *) = arg; // The function of the thread to launch
+    int listening_socket; // The socket on which we accept the connections
+    int * dS_connection; // The socket of the accepted connection, given to the thread
+    pthread_t thread_connection;
+
+    if (connection_thread == upload_file_thread) {
+        listening_socket = upload_socket;
+    }
+    else if (connection_thread == download_file_thread) {
+        listening_socket = download_socket;
+    }
+    else {
+        listening_socket = channel_socket;
+    }
+
+    while (1) {
+        dS_connection = malloc(sizeof(int));
+        *dS_connection = accept(listening_socket, NULL, NULL);
+        if (*dS_connection == -1) {
+            // The socket is closed when the server stops
+            perror("Erreur lors de l'accept");
+            free(dS_connection);
+            break;
+        }
+        if (pthread_create(&thread_connection, NULL, connection_thread, (void *) dS_connection) != 0) {
+            perror("Erreur lors de la creation du thread");
+            close(*dS_connection);
+            free(dS_connection);
+        }
+    }
+
+    pthread_exit(0);
+}
+
+
 // A function for a thread that will send the list of channels available
 // and let the client connect and disconnect from channels
 // The client will also be able to create and delete a channel
+// It takes as an argument a pointer to the socket of the connection
+// The client first sends the ticket he got on his main connection
 
 void * channel_thread(void * arg){
 
-    int indice_client = *(int *) arg; // The indice of the client in the tab_client array
-
     int nb_recv; // The number of bytes received
     int nb_send; // The number of bytes sent
     Message msg_buffer; // The buffer for the messages
     Message * buffer = &msg_buffer; // A pointer to the buffer
-    int dS_thread_channel; // The socket for the download for the accept
+    int dS_thread_channel = *(int *) arg; // The socket of the connection for the channels
     int continue_thread = 1; // A variable to know if we continue the thread or not
+    DIR* directory = NULL;
 
     pthread_t ThreadId = pthread_self(); // The id of the thread, will be used to cleanup thread once finished
 
-    // Initialise file_addr and length
-    struct sockaddr_in file_addr;
-    socklen_t length_file_addr;
+    free(arg);
 
-    // We accept the connection
-    dS_thread_channel = accept(channel_socket, (struct sockaddr *) &file_addr, &length_file_addr);
-    if (dS_thread_channel == -1) {
-        perror("Erreur lors de l'accept");
-        exit(EXIT_FAILURE);
+    // The client first sends his ticket, this is how we know who he is
+    int indice_client = check_ticket(dS_thread_channel, "salon"); // The indice of the client in the tab_client array
+    if (indice_client == -1) {
+        continue_thread = 0;
     }
 
     // Directory path
     const char* directory_path = "../src/server_channels/";
 
     // Open the directory
-    DIR* directory = opendir(directory_path);
-    if (directory == NULL) {
-        printf("Unable to open directory.\n");
-        continue_thread = 0;
+    if (continue_thread == 1) {
+        directory = opendir(directory_path);
+        if (directory == NULL) {
+            printf("Unable to open directory.\n");
+            continue_thread = 0;
+        }
     }
     
     if (continue_thread == 1){
@@ -913,9 +7186,13 @@ void * channel_thread(void * arg){
 
                 // Check if the user is in the channel
                 // If he is, we add a * at the start of the channel name
+                // Lock the mutex
+                pthread_mutex_lock(&mutex_tab_channel[indice_client]);
                 if (is_in_list(tab_channel[indice_client], file_list) == 1){
                     strcat(buffer->message, "*");
                 }
+                // Unlock the mutex
+                pthread_mutex_unlock(&mutex_tab_channel[indice_client]);
 
                 // Concatentate the file_list to buffer->message
                 strcat(buffer->message, file_list);
@@ -946,13 +7223,13 @@ void * channel_thread(void * arg){
     if (continue_thread == 1){
         while(1){
             // We receive the a message from the client
-            nb_recv = recv(dS_thread_channel, buffer, BUFFER_SIZE, 0);
+            nb_recv = recv_full(dS_thread_channel, buffer, BUFFER_SIZE);
             if (nb_recv == -1) {
                 perror("Erreur lors de la reception");
                 exit(EXIT_FAILURE);
             }
             // If the client disconnected, we stop the thread
-            if (nb_recv == 0) {
+            if (nb_recv < BUFFER_SIZE) {
                 printf("Le client s'est deconnecte dans le channel co/deco\n");
                 continue_thread = 0;
                 break;
@@ -967,171 +7244,675 @@ void * channel_thread(void * arg){
 
             // If the buffer->cmd is "connect" we add the client to the channel
             if (strcmp(buffer->cmd, "connect") == 0) {
-                // Lock the mutex
-                pthread_mutex_lock(&mutex_tab_channel);
-                // We add the client to the channel
-                add(tab_channel[indice_client], buffer->channel);
-                // Unlock the mutex
-                pthread_mutex_unlock(&mutex_tab_channel);
+                // We add the client to the channel, he sees the last messages of the channel right away
+                channel_join(indice_client, buffer->channel, 1);
                 printf("Le client %d a rejoint le channel %s\n", indice_client + 1, buffer->channel);
                 // Send a message to all the clients in the channel to tell them that the client has joined
                 strcpy(buffer->cmd, "");
                 strcpy(buffer->to, "all");
                 strcpy(buffer->from, "Serveur");
                 strcpy(buffer->message, "Je rejoins le channel");
-                send_to_all(indice_client, buffer);
+                send_presence(indice_client, buffer, CHANNEL_ARRIVAL);
             }
 
             // If the buffer->cmd is "disc" we remove the client from the channel
             if (strcmp(buffer->cmd, "disc") == 0) {
-                // Lock the mutex
-                pthread_mutex_lock(&mutex_tab_channel);
                 // We remove the client from the channel
-                remove_element(tab_channel[indice_client], buffer->channel);
-                // Unlock the mutex
-                pthread_mutex_unlock(&mutex_tab_channel);
+                channel_leave(indice_client, buffer->channel);
                 printf("Le client %d a quitte le channel %s\n", indice_client + 1, buffer->channel);
                 // Send a message to all the clients in the channel to tell them that the client has left
                 strcpy(buffer->cmd, "");
                 strcpy(buffer->to, "all");
                 strcpy(buffer->from, "Serveur");
                 strcpy(buffer->message, "Je quitte le channel");
-                send_to_all(indice_client, buffer);
+                send_presence(indice_client, buffer, CHANNEL_DEPARTURE);
+            }
+
+            // If the buffer->cmd is "create" we create a channel
+            // The client sends us the name of the channel he wants to create in buffer->channel
+            // and then a description of the channel in buffer->message in the next message
+            if (strcmp(buffer->cmd, "create") == 0) {
+                char path[MSG_SIZE]; // The path of the file
+                FILE * file; // The file
+                // We concatenate the path of the file
+                strcpy(path, "../src/server_channels/");
+                strcat(path, buffer->channel);
+
+                // We open the file
+                file = fopen(path, "w");
+                if (file == NULL) {
+                    perror("Erreur lors de la creation du fichier");
+                    continue_thread = 0;
+                }
+
+                // We receive the description of the channel
+                nb_recv = recv_full(dS_thread_channel, buffer, BUFFER_SIZE);
+                if (nb_recv == -1) {
+                    perror("Erreur lors de la reception");
+                    exit(EXIT_FAILURE);
+                }
+                // If the client disconnected, we stop the thread
+                if (nb_recv < BUFFER_SIZE) {
+                    printf("Le client s'est deconnecte dans le channel co/deco\n");
+                    fclose(file);
+                    continue_thread = 0;
+                    break;
+                }
+
+                // We write the description of the channel in the file
+                fprintf(file, "%s", buffer->message);
+
+                // We close the file
+                fclose(file);
+                printf("Le channel %s a ete cree\n", buffer->channel);
+
+                // We add the client to the channel
+                channel_join(indice_client, buffer->channel, 0);
+                printf("Le client %d a rejoint le channel %s\n", indice_client + 1, buffer->channel);
+
+                // We message all of the clients in the global channel to tell them that a new channel has been created
+                strcpy(buffer->cmd, "");
+                strcpy(buffer->to, "all");
+                strcpy(buffer->from, "Serveur");
+                sprintf(buffer->message, "Le nouveau channel: %s a ete cree", buffer->channel);
+                strcpy(buffer->channel, "global");
+                send_to_all(-1, buffer);
+
+                // Once the channel is created, the client is no longer in the menu
+                continue_thread = 0;
+                break;
+            }
+
+            // If the buffer->cmd is "delete" we delete a channel
+            // The client sends us the name of the channel he wants to delete in buffer->channel
+            if (strcmp(buffer->cmd, "delete") == 0) {
+                char path[MSG_SIZE]; // The path of the file
+                // We concatenate the path of the file
+                strcpy(path, "../src/server_channels/");
+                strcat(path, buffer->channel);
+
+                // We delete the file
+                if (remove(path) == 0) {
+                    printf("Le channel %s a ete supprime\n", buffer->channel);
+                }
+                else {
+                    printf("Erreur lors de la suppression du channel %s\n", buffer->channel);
+                }
+
+
+                // We need to send a message to all the clients in the channel to tell them that the channel has been deleted
+                // The actor of the channel removes it from all the clients, and removes its history
+                strcpy(buffer->cmd, "end");
+                strcpy(buffer->to, "all");
+                strcpy(buffer->from, "Serveur");
+                strcpy(buffer->message, "Le channel a ete supprime");
+                channel_delete(buffer);
+
+                printf("Le client %d a supprimer le channel %s\n", indice_client + 1, buffer->channel);
+                // We need to send a message to all the clients in the global channel to tell them that a channel has been deleted
+                strcpy(buffer->cmd, "");
+                strcpy(buffer->to, "all");
+                strcpy(buffer->from, "Serveur");
+                sprintf(buffer->message, "Le channel %s a ete supprime", buffer->channel);
+                strcpy(buffer->channel, "global");
+                send_to_all(-1, buffer);
+
+                // Once the channel is deleted, the client is no longer in the menu
+                continue_thread = 0;
+                break;
+            }
+
+        }
+    }
+
+    // We close the socket
+    close(dS_thread_channel);
+    
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_ended_threads);
+    // We put the thread id in the queue of ended threads
+    enqueue(ended_threads, ThreadId);
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_ended_threads);
+
+    // Increment the semaphore to indicate that a thread has ended
+    sem_post(&thread_end);
+
+    printf("Channel connect/disconnect thread end\n");
+    pthread_exit(0);
+
+}
+
+
+
+
+/*******************************************
+        Multiplexed streams
+*********************************************/
+
+// Instead of opening a connection on the upload, download or channel socket,
+// a client can open a stream on his main connection, so he only needs one connection
+// Every frame of a stream is a Message with the command "mux":
+//   - to is the operation: "open", "data", "credit" or "close"
+//   - channel is the number of the stream, chosen by the client
+//   - color is the kind of the stream for "open" ("upload", "download" or "salon"),
+//     the number of bytes of message for "data", and the number of bytes given back for "credit"
+//   - message is the data for "data"
+// Each side can send MUX_WINDOW bytes of a stream, then it waits for the other side
+// to give credit back once it has passed the data on, so a stream that is not read
+// doesn't fill the connection and the chat messages are not delayed
+//
+// On the server, each stream is given to the usual thread (upload_file_thread,
+// download_file_thread or channel_thread) through a socketpair, as if it was a connection
+// of the upload, download or channel socket, and two threads pass the data between
+// the socketpair and the main connection: mux_write_thread and mux_read_thread
+
+typedef struct MuxStream MuxStream;
+struct MuxStream {
+    // The indice of the client and his main connection
+    int client_indice;
+    int dS_client;
+    // The number of the stream
+    int id;
+    // Our end of the socketpair, the other end is given to the thread of the stream
+    int fd;
+    // The data received from the client and not yet written in the socketpair
+    // It is a circular buffer, the client can't send more than MUX_WINDOW bytes without credit
+    char in_buffer[MUX_WINDOW];
+    int in_start;
+    int in_length;
+    // 1 once the client has closed his side of the stream
+    int in_closed;
+    // The number of bytes we can still send to the client, MUX_WINDOW at most
+    long credit;
+    // 1 if the main connection is lost or the client broke the rules of the stream, the threads must stop
+    int closed;
+    // The number of threads still using the stream, the last one frees it
+    int nb_threads;
+    // The mutex to protect the fields above and the condition to wait for them to change
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    MuxStream * next;
+};
+
+// List of the open streams of all the clients
+MuxStream * mux_streams = NULL;
+// Mutex to protect the mux_streams list, and condition to wait for a stream to be freed
+pthread_mutex_t mutex_mux_streams;
+pthread_cond_t cond_mux_streams;
+
+
+// A function that will send a frame of the stream to the client
+// bulk is 1 for the data, which goes after the chat messages
+
+int mux_send(MuxStream * stream, char * operation, char * argument, char * data, int length, int bulk) {
+    Message frame;
+    memset(&frame, 0, sizeof(Message));
+    strcpy(frame.cmd, "mux");
+    strcpy(frame.from, "Serveur");
+    strcpy(frame.to, operation);
+    snprintf(frame.channel, CHANNEL_SIZE, "%d", stream->id);
+    strcpy(frame.color, argument);
+    if (length > 0) {
+        memcpy(frame.message, data, length);
+    }
+    if (send_client(stream->client_indice, stream->dS_client, &frame, bulk) == -1) {
+        return 0;
+    }
+    return 1;
+}
+
+// A function that will find the stream id of the client
+// The mutex of the mux_streams list must be locked
+
+MuxStream * mux_find(int client_indice, int id) {
+    MuxStream * stream = mux_streams;
+    while (stream != NULL && (stream->client_indice != client_indice || stream->id != id)) {
+        stream = stream->next;
+    }
+    return stream;
+}
+
+// A function that will count the open streams of the client
+// The mutex of the mux_streams list must be locked
+
+int mux_count(int client_indice) {
+    MuxStream * stream = mux_streams;
+    int count = 0;
+    while (stream != NULL) {
+        if (stream->client_indice == client_indice) {
+            count = count + 1;
+        }
+        stream = stream->next;
+    }
+    return count;
+}
+
+// A function that will tell the client that the stream id could not be opened,
+// the client sees it as a stream closed by the server
+
+void mux_refuse(int client_indice, int dS_client, int id) {
+    Message frame;
+    memset(&frame, 0, sizeof(Message));
+    strcpy(frame.cmd, "mux");
+    strcpy(frame.from, "Serveur");
+    strcpy(frame.to, "close");
+    snprintf(frame.channel, CHANNEL_SIZE, "%d", id);
+    send_client(client_indice, dS_client, &frame, 0);
+}
+
+// A function that will be called by mux_read_thread and mux_write_thread when they end,
+// and by mux_open once the threads are launched
+// The last one removes the stream from the list and frees it
+
+void mux_release(MuxStream * stream) {
+    int last;
+    MuxStream ** previous;
+
+    // Lock the mutexes
+    pthread_mutex_lock(&mutex_mux_streams);
+    pthread_mutex_lock(&stream->mutex);
+    stream->nb_threads = stream->nb_threads - 1;
+    last = (stream->nb_threads == 0);
+    // Unlock the mutex
+    pthread_mutex_unlock(&stream->mutex);
+    if (last == 1) {
+        previous = &mux_streams;
+        while (*previous != stream) {
+            previous = &(*previous)->next;
+        }
+        *previous = stream->next;
+        // mux_close_client waits for the streams of a client to be freed
+        pthread_cond_broadcast(&cond_mux_streams);
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_mux_streams);
+
+    if (last == 1) {
+        close(stream->fd);
+        pthread_mutex_destroy(&stream->mutex);
+        pthread_cond_destroy(&stream->cond);
+        free(stream);
+    }
+}
+
+// A function that will put the thread in the queue of ended threads
+
+void mux_thread_end(void) {
+    pthread_t ThreadId = pthread_self();
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_ended_threads);
+    enqueue(ended_threads, ThreadId);
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_ended_threads);
+    // Increment the semaphore to indicate that a thread has ended
+    sem_post(&thread_end);
+}
+
+// A function for a thread that will write in the socketpair the data received from the client,
+// and give the credit back to the client once it is written
+// When the client closes his side, we close ours so the thread of the stream sees the end
+
+void * mux_write_thread(void * arg) {
+    MuxStream * stream = arg;
+    char data[MSG_SIZE];
+    int length;
+    int write_ok = 1; // 0 once the thread of the stream has closed the socketpair
+    char credit[12]; // The number of bytes given back, as text
+
+    // Lock the mutex
+    pthread_mutex_lock(&stream->mutex);
+    while (stream->closed == 0) {
+        if (stream->in_length == 0) {
+            if (stream->in_closed == 1) {
+                break;
             }
+            pthread_cond_wait(&stream->cond, &stream->mutex);
+            continue;
+        }
+        // We take the data until the end of the circular buffer
+        length = stream->in_length;
+        if (length > MUX_WINDOW - stream->in_start) {
+            length = MUX_WINDOW - stream->in_start;
+        }
+        if (length > MSG_SIZE) {
+            length = MSG_SIZE;
+        }
+        memcpy(data, stream->in_buffer + stream->in_start, length);
+        stream->in_start = (stream->in_start + length) % MUX_WINDOW;
+        stream->in_length = stream->in_length - length;
+        // Unlock the mutex while we write, it can wait for the thread of the stream
+        pthread_mutex_unlock(&stream->mutex);
+
+        // If the thread of the stream has stopped reading, the data is thrown away
+        if (write_ok == 1 && send_full(stream->fd, data, length) == -1) {
+            write_ok = 0;
+        }
+        sprintf(credit, "%d", length);
+        mux_send(stream, "credit", credit, NULL, 0, 0);
+
+        // Lock the mutex
+        pthread_mutex_lock(&stream->mutex);
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&stream->mutex);
+
+    // The thread of the stream will receive nothing more
+    shutdown(stream->fd, SHUT_WR);
+
+    mux_release(stream);
+    mux_thread_end();
+    pthread_exit(0);
+}
+
+// A function for a thread that will read what the thread of the stream writes in the socketpair,
+// and send it to the client when he has given us enough credit
+
+void * mux_read_thread(void * arg) {
+    MuxStream * stream = arg;
+    char data[MSG_SIZE];
+    char length_text[12]; // The number of bytes sent, as text
+    int length;
+    int nb_read;
+    int continue_thread = 1;
+
+    while (continue_thread == 1) {
+        // We wait until the client has given us credit
+        // Lock the mutex
+        pthread_mutex_lock(&stream->mutex);
+        while (stream->credit == 0 && stream->closed == 0) {
+            pthread_cond_wait(&stream->cond, &stream->mutex);
+        }
+        length = MSG_SIZE;
+        if (stream->credit < length) {
+            length = stream->credit;
+        }
+        if (stream->closed == 1) {
+            continue_thread = 0;
+        }
+        // Unlock the mutex
+        pthread_mutex_unlock(&stream->mutex);
+        if (continue_thread == 0) {
+            break;
+        }
+
+        nb_read = recv(stream->fd, data, length, 0);
+        if (nb_read <= 0) {
+            break;
+        }
+
+        // Lock the mutex
+        pthread_mutex_lock(&stream->mutex);
+        stream->credit = stream->credit - nb_read;
+        // Unlock the mutex
+        pthread_mutex_unlock(&stream->mutex);
+
+        // The data waits on the condition of the sender until no chat message is waiting,
+        // and the main connection doesn't take it while MUX_QUEUE_LIMIT bytes are not sent yet
+        sprintf(length_text, "%d", nb_read);
+        if (mux_send(stream, "data", length_text, data, nb_read, 1) == 0) {
+            continue_thread = 0;
+        }
+    }
+
+    // The thread of the stream has closed the socketpair, we tell the client
+    // Lock the mutex
+    pthread_mutex_lock(&stream->mutex);
+    continue_thread = (stream->closed == 0);
+    // Unlock the mutex
+    pthread_mutex_unlock(&stream->mutex);
+    if (continue_thread == 1) {
+        mux_send(stream, "close", "", NULL, 0, 0);
+    }
 
-            // If the buffer->cmd is "create" we create a channel
-            // The client sends us the name of the channel he wants to create in buffer->channel
-            // and then a description of the channel in buffer->message in the next message
-            if (strcmp(buffer->cmd, "create") == 0) {
-                char path[MSG_SIZE]; // The path of the file
-                FILE * file; // The file
-                // We concatenate the path of the file
-                strcpy(path, "../src/server_channels/");
-                strcat(path, buffer->channel);
+    mux_release(stream);
+    mux_thread_end();
+    pthread_exit(0);
+}
 
-                // We open the file
-                file = fopen(path, "w");
-                if (file == NULL) {
-                    perror("Erreur lors de la creation du fichier");
-                    continue_thread = 0;
-                }
+// A function that will open a stream of the given kind for the client
+// It creates the socketpair, writes a ticket in it so the thread of the stream
+// knows who the client is, and launches the threads
+// If the client has too many streams or a thread can't be launched, everything is undone
+// and the client receives "close" for the stream
+
+void mux_open(int client_indice, int dS_client, int id, char * kind) {
+    int sv[2];
+    int * dS_stream;
+    void * (*stream_thread)(void *);
+    void * (*mux_threads[2])(void *) = {mux_write_thread, mux_read_thread};
+    pthread_t thread;
+    Message ticket;
+    MuxStream * stream;
+    int opened = 1;
+    int queue_limit = MUX_QUEUE_LIMIT;
+    int i = 0;
 
-                // We receive the description of the channel
-                nb_recv = recv(dS_thread_channel, buffer, BUFFER_SIZE, 0);
-                if (nb_recv == -1) {
-                    perror("Erreur lors de la reception");
-                    exit(EXIT_FAILURE);
-                }
-                // If the client disconnected, we stop the thread
-                if (nb_recv == 0) {
-                    printf("Le client s'est deconnecte dans le channel co/deco\n");
-                    fclose(file);
-                    continue_thread = 0;
-                    break;
-                }
+    if (strcmp(kind, "upload") == 0) {
+        stream_thread = upload_file_thread;
+    }
+    else if (strcmp(kind, "download") == 0) {
+        stream_thread = download_file_thread;
+    }
+    else if (strcmp(kind, "salon") == 0) {
+        stream_thread = channel_thread;
+    }
+    else {
+        printf("Type de stream inconnu : %s\n", kind);
+        mux_refuse(client_indice, dS_client, id);
+        return;
+    }
 
-                // We write the description of the channel in the file
-                fprintf(file, "%s", buffer->message);
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+        perror("Erreur lors de la creation de la socketpair");
+        mux_refuse(client_indice, dS_client, id);
+        return;
+    }
 
-                // We close the file
-                fclose(file);
-                printf("Le channel %s a ete cree\n", buffer->channel);
+    // A send on the main connection waits while MUX_QUEUE_LIMIT bytes are not sent yet,
+    // so the file data of the streams can't fill the socket in front of the chat messages
+    setsockopt(dS_client, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &queue_limit, sizeof(queue_limit));
+
+    stream = malloc(sizeof(MuxStream));
+    stream->client_indice = client_indice;
+    stream->dS_client = dS_client;
+    stream->id = id;
+    stream->fd = sv[0];
+    stream->in_start = 0;
+    stream->in_length = 0;
+    stream->in_closed = 0;
+    stream->credit = MUX_WINDOW;
+    stream->closed = 0;
+    // mux_open holds the stream until the threads are launched, so they can't free it before
+    stream->nb_threads = 1;
+    pthread_mutex_init(&stream->mutex, NULL);
+    pthread_cond_init(&stream->cond, NULL);
 
-                // We add the client to the channel
-                // Lock the mutex
-                pthread_mutex_lock(&mutex_tab_channel);
-                add(tab_channel[indice_client], buffer->channel);
-                // Unlock the mutex
-                pthread_mutex_unlock(&mutex_tab_channel);
-                printf("Le client %d a rejoint le channel %s\n", indice_client + 1, buffer->channel);
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_mux_streams);
+    if (mux_count(client_indice) >= MUX_MAX_STREAMS) {
+        opened = 0;
+    }
+    else {
+        stream->next = mux_streams;
+        mux_streams = stream;
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_mux_streams);
+    if (opened == 0) {
+        printf("Le client %d a deja %d streams ouverts, le stream %d est refuse\n", client_indice + 1, MUX_MAX_STREAMS, id);
+        close(sv[0]);
+        close(sv[1]);
+        pthread_mutex_destroy(&stream->mutex);
+        pthread_cond_destroy(&stream->cond);
+        free(stream);
+        mux_refuse(client_indice, dS_client, id);
+        return;
+    }
 
-                // We message all of the clients in the global channel to tell them that a new channel has been created
-                strcpy(buffer->cmd, "");
-                strcpy(buffer->to, "all");
-                strcpy(buffer->from, "Serveur");
-                sprintf(buffer->message, "Le nouveau channel: %s a ete cree", buffer->channel);
-                strcpy(buffer->channel, "global");
-                send_to_all(-1, buffer);
+    // The thread of the stream starts by checking the ticket, like for a real connection
+    memset(&ticket, 0, sizeof(Message));
+    strcpy(ticket.cmd, "ticket");
+    sprintf(ticket.message, "%016lx", (unsigned long) new_ticket(client_indice, kind));
+    send_full(sv[0], &ticket, BUFFER_SIZE);
 
-                // Once the channel is created, the client is no longer in the menu
-                continue_thread = 0;
-                break;
-            }
+    // The threads that pass the data are launched first: if one of them can't be launched,
+    // the thread of the stream has not started and has nothing to undo
+    while (opened == 1 && i < 2) {
+        // Lock the mutex
+        pthread_mutex_lock(&stream->mutex);
+        stream->nb_threads = stream->nb_threads + 1;
+        // Unlock the mutex
+        pthread_mutex_unlock(&stream->mutex);
+        if (pthread_create(&thread, NULL, mux_threads[i], (void *) stream) != 0) {
+            perror("Erreur lors de la creation du thread");
+            // Lock the mutex
+            pthread_mutex_lock(&stream->mutex);
+            stream->nb_threads = stream->nb_threads - 1;
+            // Unlock the mutex
+            pthread_mutex_unlock(&stream->mutex);
+            opened = 0;
+        }
+        i = i + 1;
+    }
+    if (opened == 1) {
+        dS_stream = malloc(sizeof(int));
+        *dS_stream = sv[1];
+        if (pthread_create(&thread, NULL, stream_thread, (void *) dS_stream) != 0) {
+            perror("Erreur lors de la creation du thread");
+            free(dS_stream);
+            opened = 0;
+        }
+    }
 
-            // If the buffer->cmd is "delete" we delete a channel
-            // The client sends us the name of the channel he wants to delete in buffer->channel
-            if (strcmp(buffer->cmd, "delete") == 0) {
-                char path[MSG_SIZE]; // The path of the file
-                char channel_to_delete[CHANNEL_SIZE]; // The name of the channel to delete
-                // We concatenate the path of the file
-                strcpy(path, "../src/server_channels/");
-                strcat(path, buffer->channel);
-                strcpy(channel_to_delete, buffer->channel);
+    if (opened == 0) {
+        close(sv[1]);
+        // The threads already launched stop, like when the main connection is lost
+        // Lock the mutex
+        pthread_mutex_lock(&stream->mutex);
+        stream->closed = 1;
+        pthread_cond_broadcast(&stream->cond);
+        // Unlock the mutex
+        pthread_mutex_unlock(&stream->mutex);
+        shutdown(stream->fd, SHUT_RDWR);
+        mux_refuse(client_indice, dS_client, id);
+    }
+    mux_release(stream);
+}
 
-                // We delete the file
-                if (remove(path) == 0) {
-                    printf("Le channel %s a ete supprime\n", buffer->channel);
+// A function that will handle a frame "mux" received on the main connection of the client
+
+void mux_receive(int client_indice, int dS_client, Message * buffer) {
+    int id = atoi(buffer->channel);
+    int length;
+    int end;
+    int reset = 0; // 1 if the client sent more than his credit, the stream is closed
+    MuxStream * stream;
+
+    buffer->color[COLOR_SIZE - 1] = '\0';
+    if (strcmp(buffer->to, "open") == 0) {
+        // Lock the mutex
+        pthread_mutex_lock(&mutex_mux_streams);
+        stream = mux_find(client_indice, id);
+        // Unlock the mutex
+        pthread_mutex_unlock(&mutex_mux_streams);
+        if (stream == NULL) {
+            mux_open(client_indice, dS_client, id, buffer->color);
+        }
+        return;
+    }
+
+    // Lock the mutex, the stream can't be freed while we use it
+    pthread_mutex_lock(&mutex_mux_streams);
+    stream = mux_find(client_indice, id);
+    if (stream != NULL) {
+        // Lock the mutex
+        pthread_mutex_lock(&stream->mutex);
+        // Once the stream is being closed, the data and the credit still coming are ignored
+        if (stream->closed == 0 && strcmp(buffer->to, "data") == 0) {
+            length = atoi(buffer->color);
+            // The client can't send more than the credit we gave him
+            // If he does, the stream is closed: its data can't be passed on without a hole
+            if (length < 0 || length > MSG_SIZE || length > MUX_WINDOW - stream->in_length) {
+                printf("Le client %d a envoye trop de donnees sur le stream %d, il est ferme\n", client_indice + 1, id);
+                stream->closed = 1;
+                reset = 1;
+            }
+            else {
+                // We copy the data in the circular buffer, in two parts if it goes around
+                end = (stream->in_start + stream->in_length) % MUX_WINDOW;
+                if (length > MUX_WINDOW - end) {
+                    memcpy(stream->in_buffer + end, buffer->message, MUX_WINDOW - end);
+                    memcpy(stream->in_buffer, buffer->message + MUX_WINDOW - end, length - (MUX_WINDOW - end));
                 }
                 else {
-                    printf("Erreur lors de la suppression du channel %s\n", buffer->channel);
+                    memcpy(stream->in_buffer + end, buffer->message, length);
                 }
+                stream->in_length = stream->in_length + length;
+            }
+        }
+        else if (stream->closed == 0 && strcmp(buffer->to, "credit") == 0) {
+            // The client can't give back more than the window
+            length = atoi(buffer->color);
+            if (length > 0) {
+                stream->credit = stream->credit + length;
+            }
+            if (stream->credit > MUX_WINDOW) {
+                stream->credit = MUX_WINDOW;
+            }
+        }
+        else if (strcmp(buffer->to, "close") == 0) {
+            stream->in_closed = 1;
+        }
+        pthread_cond_broadcast(&stream->cond);
+        // Unlock the mutex
+        pthread_mutex_unlock(&stream->mutex);
+        // The threads waiting on the socketpair stop, like when the main connection is lost
+        if (reset == 1) {
+            shutdown(stream->fd, SHUT_RDWR);
+        }
+    }
+    // Unlock the mutex
+    pthread_mutex_unlock(&mutex_mux_streams);
 
+    // The client sees the stream closed by the server
+    if (reset == 1) {
+        mux_refuse(client_indice, dS_client, id);
+    }
+}
 
-                // We need to send a message to all the clients in the channel to tell them that the channel has been deleted
-                strcpy(buffer->cmd, "end");
-                strcpy(buffer->to, "all");
-                strcpy(buffer->from, "Serveur");
-                strcpy(buffer->message, "Le channel a ete supprime");
-                send_to_all(-1, buffer);
+// A function that will close all the streams of a client whose main connection is lost,
+// and wait until their threads have stopped using the connection
 
-                printf("Le client %d a supprimer le channel %s\n", indice_client + 1, buffer->channel);
-                // We need to send a message to all the clients in the global channel to tell them that a channel has been deleted
-                strcpy(buffer->cmd, "");
-                strcpy(buffer->to, "all");
-                strcpy(buffer->from, "Serveur");
-                sprintf(buffer->message, "Le channel %s a ete supprime", buffer->channel);
-                strcpy(buffer->channel, "global");
-                send_to_all(-1, buffer);
+void mux_close_client(int client_indice) {
+    MuxStream * stream;
+    int remaining = 1;
 
-                // We remove the channel from all the clients
-                int i = 0;
+    // Lock the mutex
+    pthread_mutex_lock(&mutex_mux_streams);
+    while (remaining == 1) {
+        remaining = 0;
+        stream = mux_streams;
+        while (stream != NULL) {
+            if (stream->client_indice == client_indice) {
+                remaining = 1;
                 // Lock the mutex
-                pthread_mutex_lock(&mutex_tab_channel);
-                pthread_mutex_lock(&mutex_tab_client);
-                while (i < MAX_CLIENT) {
-                    if (tab_client[i] != 0) {
-                        remove_element(tab_channel[i], channel_to_delete);
-                    }
-                    i = i + 1;
-                }
+                pthread_mutex_lock(&stream->mutex);
+                stream->closed = 1;
+                pthread_cond_broadcast(&stream->cond);
                 // Unlock the mutex
-                pthread_mutex_unlock(&mutex_tab_channel);
-                pthread_mutex_unlock(&mutex_tab_client);
-
-                // Once the channel is deleted, the client is no longer in the menu
-                continue_thread = 0;
-                break;
+                pthread_mutex_unlock(&stream->mutex);
+                // Wake up the threads waiting on the socketpair
+                shutdown(stream->fd, SHUT_RDWR);
             }
-
+            stream = stream->next;
+        }
+        if (remaining == 1) {
+            pthread_cond_wait(&cond_mux_streams, &mutex_mux_streams);
         }
     }
-
-    // We close the socket
-    close(dS_thread_channel);
-    
-    // Lock the mutex
-    pthread_mutex_lock(&mutex_ended_threads);
-    // We put the thread id in the queue of ended threads
-    enqueue(ended_threads, ThreadId);
     // Unlock the mutex
-    pthread_mutex_unlock(&mutex_ended_threads);
-
-    // Increment the semaphore to indicate that a thread has ended
-    sem_post(&thread_end);
-
-    printf("Channel connect/disconnect thread end\n");
-    pthread_exit(0);
-
+    pthread_mutex_unlock(&mutex_mux_streams);
 }
 
 
@@ -1161,6 +7942,11 @@ void * client_thread(void * dS_client_connection) {
     // This variable will be set to 0 if the client disconnects while he is giving his username
     // It will cause the while loops to stop
     int continue_thread = 1;
+    // The dms of his mailbox, sent once he has his username
+    Message * mailbox_frames;
+    long nb_mailbox_frames;
+    // His username, copied to tell the other servers that he left
+    char username[USERNAME_SIZE];
 
     /********************************
         Unique Username Management
@@ -1197,13 +7983,23 @@ void * client_thread(void * dS_client_connection) {
         // We check if the username is unique
         // If it is, we put the client in the tab_client array
         // If it is not, we send him false and he has to send another username
-        if (get_indice_username(buffer->from) == -1) {
+        // A username connected to another server of the federation is taken too
+        if (get_indice_username(buffer->from) == -1 && remote_user_link(buffer->from) == -1) {
             // We put the client in the tab_client array
             // Lock the mutex because we are going to write in the tab_client array
             pthread_mutex_lock(&mutex_tab_client);
             tab_client[client_indice_connecting] = dSC_connection;
             // Unlock the mutex
             pthread_mutex_unlock(&mutex_tab_client);
+            // He can now join the channels
+            // Lock the mutex
+            pthread_mutex_lock(&mutex_tab_channel[client_indice_connecting]);
+            tab_channel_dS[client_indice_connecting] = dSC_connection;
+            // Unlock the mutex
+            pthread_mutex_unlock(&mutex_tab_channel[client_indice_connecting]);
+            // The dms sent to him wait until his mailbox is sent
+            // Lock the mutex
+            pthread_mutex_lock(&mutex_mailbox);
             // We put the username in the tab_username array
             // Lock the mutex because we are going to write in the tab_username array
             pthread_mutex_lock(&mutex_tab_username);
@@ -1220,6 +8016,16 @@ void * client_thread(void * dS_client_connection) {
                 printf("L'erreur est dans le thread du client : %d\n", client_indice_connecting + 1);
                 exit(EXIT_FAILURE);
             }
+            // We take the dms that were sent while he was disconnected,
+            // the next ones are sent to him directly
+            mailbox_frames = mailbox_take(buffer->to, &nb_mailbox_frames);
+            // Unlock the mutex
+            pthread_mutex_unlock(&mutex_mailbox);
+            // The other servers learn that he is connected, once nothing is locked
+            // because a slow server must not stop the logins and the dms
+            federation_presence("online", buffer->to);
+            // We send them once the mailboxes are unlocked
+            mailbox_deliver(client_indice_connecting, dSC_connection, buffer->to, mailbox_frames, nb_mailbox_frames);
             break;
         } 
         else {
@@ -1249,6 +8055,8 @@ void * client_thread(void * dS_client_connection) {
     int dSC = dSC_connection; // The socket descriptor of the client
 
     if (continue_thread == 1) {
+        // Every client is in the global channel
+        channel_join(client_indice, "global", 0);
         // We tell the other clients that a new client has connected
         // Lock the mutex
         pthread_mutex_lock(&mutex_tab_username);
@@ -1258,24 +8066,27 @@ void * client_thread(void * dS_client_connection) {
         pthread_mutex_unlock(&mutex_tab_username);
         strcpy(buffer->channel, "global");
         strcpy(buffer->message, "Je me connecte. Bonjour!");
-        send_to_all(client_indice, buffer);
+        send_presence(client_indice, buffer, CHANNEL_ARRIVAL);
     }
 
     while (continue_thread == 1) {
 
         // We receive the message from the client
-        nb_recv = recv(dSC, buffer, BUFFER_SIZE, 0);
-        if (nb_recv == -1) {
+        // The frames of the streams are sent right after each other, so we wait for the whole Message
+        nb_recv = recv_full(dSC, buffer, BUFFER_SIZE);
+        // A client that closes his connection while we are still sending him a file resets it,
+        // it is a disconnection like the others
+        if (nb_recv == -1 && errno != ECONNRESET) {
             perror("Erreur lors de la reception");
             printf("L'erreur est dans le thread du client : %d\n", client_indice + 1);
             exit(EXIT_FAILURE);
         }
-        if (nb_recv == 0) {
+        if (nb_recv < BUFFER_SIZE) {
             printf("Client %d s'est deconnecte\n", client_indice + 1);
             strcpy(buffer->channel, "global");
             strcpy(buffer->message, "Je me deconnecte. Au revoir!");
             // We send a message to the other clients to tell them that this client has disconnected
-            send_to_all(client_indice, buffer);
+            send_presence(client_indice, buffer, CHANNEL_DEPARTURE);
             break;
         }
 
@@ -1287,7 +8098,7 @@ void * client_thread(void * dS_client_connection) {
             strcpy(buffer->channel, "global");
             strcpy(buffer->message, "Je me deconnecte. Au revoir!");
             // We send a message to the other clients to tell them that this client has disconnected
-            send_to_all(client_indice, buffer);
+            send_presence(client_indice, buffer, CHANNEL_DEPARTURE);
             break;
         }
 
@@ -1312,8 +8123,10 @@ void * client_thread(void * dS_client_connection) {
             // Unlock the mutexs
             pthread_mutex_unlock(&mutex_tab_client);
             pthread_mutex_unlock(&mutex_tab_username);
+            // And the clients connected to the other servers of the federation
+            remote_users_list(list);
             strcpy(buffer->message, list);
-            nb_send = send(dSC, buffer, BUFFER_SIZE, 0);
+            nb_send = send_client(client_indice, dSC, buffer, 0);
             if (nb_send == -1) {
                 perror("Erreur lors de l'envoi");
                 printf("L'erreur est dans le thread du client: %d\n", client_indice + 1);
@@ -1332,7 +8145,7 @@ void * client_thread(void * dS_client_connection) {
             strcpy(buffer->to, tab_username[client_indice]);
             // Unlock the mutex
             pthread_mutex_unlock(&mutex_tab_username);
-            nb_send = send(dSC, buffer, BUFFER_SIZE, 0);
+            nb_send = send_client(client_indice, dSC, buffer, 0);
             if (nb_send == -1) {
                 perror("Erreur lors de l'envoi");
                 printf("L'erreur est dans le thread du client: %d\n", client_indice + 1);
@@ -1342,16 +8155,45 @@ void * client_thread(void * dS_client_connection) {
         }
 
         // If the client sends "dm", we send the message to the person who's username is in buffer.to
+        // If this person isn't connected but already came, the message is kept in his mailbox
         if (strcmp(buffer->cmd, "dm") == 0) {
+            int stored = 0;
+            int link = -1;
             // We get the indice of the client to send the message to
+            // Lock the mutex
+            pthread_mutex_lock(&mutex_mailbox);
             int client_to_send = get_indice_username(buffer->to);
-            // If the client is not in the array, we send an error message to the client
             if (client_to_send == -1) {
+                link = remote_user_link(buffer->to);
+            }
+            if (client_to_send == -1 && link == -1) {
+                stored = mailbox_store(buffer);
+            }
+            // Unlock the mutex
+            pthread_mutex_unlock(&mutex_mailbox);
+            // If the client is connected to another server, the dm goes through the link with it
+            if (link != -1) {
+                strcpy(buffer->cmd, "dm");
+                federation_send(link, "dm", buffer);
+                continue;
+            }
+            // If the client is not in the array, we tell the client if the message will be delivered
+            if (client_to_send == -1) {
+                strcpy(buffer->cmd, "error");
+                if (stored == 1) {
+                    strcpy(buffer->cmd, "");
+                    sprintf(buffer->message, "%s n'est pas connecte, il recevra le message a sa connexion", buffer->to);
+                }
+                else if (stored == -1) {
+                    sprintf(buffer->message, "Trop de messages attendent %s, le message n'est pas envoye", buffer->to);
+                }
+                else {
+                    strcpy(buffer->message, "Le client n'existe pas");
+                }
                 strcpy(buffer->to, buffer->from);
                 strcpy(buffer->from, "Serveur");
-                strcpy(buffer->cmd, "error");
-                strcpy(buffer->message, "Le client n'existe pas");
-                nb_send = send(dSC, buffer, BUFFER_SIZE, 0);
+                strcpy(buffer->channel, "global");
+                nb_send = send_client(client_indice, dSC, buffer, 0);
                 if (nb_send == -1) {
                     perror("Erreur lors de l'envoi");
                     printf("L'erreur est dans le thread du client: %d\n", client_indice + 1);
@@ -1363,7 +8205,7 @@ void * client_thread(void * dS_client_connection) {
             strcpy(buffer->cmd, "dm");
             // Lock the mutex
             pthread_mutex_lock(&mutex_tab_client);
-            nb_send = send(tab_client[client_to_send], buffer, BUFFER_SIZE, 0);
+            nb_send = send_client(client_to_send, tab_client[client_to_send], buffer, 0);
             // Unlock the mutex
             pthread_mutex_unlock(&mutex_tab_client);
             if (nb_send == -1) {
@@ -1374,74 +8216,85 @@ void * client_thread(void * dS_client_connection) {
             continue;
         }
 
-        // If the client sends "upload", we create a thread to receive the file
-        if (strcmp(buffer->cmd, "upload") == 0) {
-            printf("UPLOAD detected\n");
-
-            // We launch a thread to receive the file
-            pthread_t thread_upload;
-
-            if (pthread_create(&thread_upload, NULL, upload_file_thread, NULL) != 0) {
-                perror("Erreur lors de la creation du thread upload");
+        // If the client sends "history", we send him the last messages of the channel in buffer->channel
+        if (strcmp(buffer->cmd, "history") == 0) {
+            if (send_history(client_indice, dSC, buffer) == -1) {
+                perror("Erreur lors de l'envoi");
                 printf("L'erreur est dans le thread du client: %d\n", client_indice + 1);
                 exit(EXIT_FAILURE);
             }
-            printf("Thread upload cree\n");
-           
-            // We send a message to the other clients to tell them that this client has uploaded a file
-            strcpy(buffer->cmd, "upload");
-            strcpy(buffer->channel, "global");
-            strcpy(buffer->message, "I am uploading a file!");
-            send_to_all(client_indice, buffer);
             continue;
         }
 
-        // If the client sends "download", we launch a thread to send the file
-        if (strcmp(buffer->cmd, "download") == 0) {
-            printf("DOWNLOAD detected\n");
-
-            // We launch a thread to send the file
-            pthread_t thread_download;
-
-            if (pthread_create(&thread_download, NULL, download_file_thread, NULL) != 0) {
-                perror("Erreur lors de la creation du thread download");
+        // If the client sends "search", we send him the messages of the channel that have the words he searched
+        if (strcmp(buffer->cmd, "search") == 0) {
+            if (send_search(client_indice, dSC, buffer) == -1) {
+                perror("Erreur lors de l'envoi");
                 printf("L'erreur est dans le thread du client: %d\n", client_indice + 1);
                 exit(EXIT_FAILURE);
             }
-            printf("Thread download cree\n");
             continue;
         }
 
-        // If the client sens "salon", we launch a thread to send him the list of channels
-        // And let him connect and disconnect freely
-        if (strcmp(buffer->cmd, "salon") == 0) {
-            printf("SALON detected\n");
+        // If the client sends "mux", it is a frame of a stream multiplexed on his connection
+        if (strcmp(buffer->cmd, "mux") == 0) {
+            mux_receive(client_indice, dSC, buffer);
+            continue;
+        }
 
-            // We launch a thread to send the list of channels
-            pthread_t thread_salon;
+        // If the client sends "upload", he will send the file on the upload socket
+        // The connections of the upload socket are accepted by accept_thread
+        if (strcmp(buffer->cmd, "upload") == 0) {
+            printf("UPLOAD detected\n");
+           
+            // We send a message to the other clients to tell them that this client has uploaded a file
+            strcpy(buffer->cmd, "upload");
+            strcpy(buffer->channel, "global");
+            strcpy(buffer->message, "I am uploading a file!");
+            send_to_all(client_indice, buffer);
+            continue;
+        }
 
-            if (pthread_create(&thread_salon, NULL, channel_thread, (void *) &client_indice) != 0) {
-                perror("Erreur lors de la creation du thread salon");
+        // If the client sends "ticket", we give him a ticket for the socket in buffer->message
+        // He will send it first when he connects to this socket
+        // "upload" and "download" for the file sockets, "salon" for the channel menu
+        if (strcmp(buffer->cmd, "ticket") == 0) {
+            char kind[CMD_SIZE];
+            uint64_t ticket = 0;
+            strncpy(kind, buffer->message, CMD_SIZE - 1);
+            kind[CMD_SIZE - 1] = '\0';
+            if (strcmp(kind, "upload") == 0 || strcmp(kind, "download") == 0 || strcmp(kind, "salon") == 0) {
+                ticket = new_ticket(client_indice, kind);
+            }
+            // The client gets "<kind>/<ticket>", with an empty ticket if we couldn't create one
+            strcpy(buffer->to, buffer->from);
+            strcpy(buffer->from, "Serveur");
+            strcpy(buffer->cmd, "ticket");
+            strcpy(buffer->channel, "");
+            if (ticket != 0) {
+                sprintf(buffer->message, "%s/%016lx", kind, (unsigned long) ticket);
+            }
+            else {
+                sprintf(buffer->message, "%s/", kind);
+            }
+            nb_send = send_client(client_indice, dSC, buffer, 0);
+            if (nb_send == -1) {
+                perror("Erreur lors de l'envoi");
                 printf("L'erreur est dans le thread du client: %d\n", client_indice + 1);
                 exit(EXIT_FAILURE);
             }
-            printf("Thread salon cree\n");
             continue;
         }
 
         // If the client sends "exit", we exit the channel that he specified in buffer->channel
         if (strcmp(buffer->cmd, "exit") == 0) {
             printf("EXIT detected\n");
-            // Lock the mutex
-            pthread_mutex_lock(&mutex_tab_channel);
-            remove_element(tab_channel[client_indice], buffer->channel);
-            // Unlock the mutex
-            pthread_mutex_unlock(&mutex_tab_channel);
+            channel_leave(client_indice, buffer->channel);
             printf("Le client %d a quitte le channel %s\n", client_indice + 1, buffer->channel);
             // We send a message to the other clients in the channel to tell them that this client has exited the channel
             strcpy(buffer->cmd, "");
             strcpy(buffer->message, "Je quitte le channel");
-            send_to_all(client_indice, buffer);
+            send_presence(client_indice, buffer, CHANNEL_DEPARTURE);
             // We remove the channel from the list of channels of the client
             continue;
         }
@@ -1457,10 +8310,8 @@ void * client_thread(void * dS_client_connection) {
            End of thread
     ***************************/
 
-    // We close the socket of the client who wanted to disconnect
-    if (close(dSC) == -1) {
-        perror("Erreur lors de la fermeture du descripteur de fichier");
-    }
+    // We close the streams of the client before his socket, they send on it
+    mux_close_client(client_indice);
 
     // We put 0 in the tab_client array
     // Lock the mutex
@@ -1469,6 +8320,16 @@ void * client_thread(void * dS_client_connection) {
     // Unlock the mutex
     pthread_mutex_unlock(&mutex_tab_client);
 
+    // The client leaves his channels, then no actor sends on his socket
+    channel_leave_all(client_indice);
+    // The messages of the channels that wait for him are forgotten
+    outbox_clear(client_indice, dSC);
+
+    // We close the socket of the client who wanted to disconnect
+    if (close(dSC) == -1) {
+        perror("Erreur lors de la fermeture du descripteur de fichier");
+    }
+
     // We put 0 in the tab_client_connecting array
     // Lock the mutex
     pthread_mutex_lock(&mutex_tab_client_connecting);
@@ -1476,12 +8337,20 @@ void * client_thread(void * dS_client_connection) {
     // Unlock the mutex
     pthread_mutex_unlock(&mutex_tab_client_connecting);
 
+    // The tickets of the client can no longer be used
+    revoke_tickets(client_indice);
+
     // We clear the username of the client
     // Lock the mutex
     pthread_mutex_lock(&mutex_tab_username);
+    strcpy(username, tab_username[client_indice]);
     strcpy(tab_username[client_indice], "");
     // Unlock the mutex
     pthread_mutex_unlock(&mutex_tab_username);
+    // The other servers learn that he left, once the mutex is unlocked
+    if (strcmp(username, "") != 0) {
+        federation_presence("offline", username);
+    }
 
     // We get the thread id of the thread that is ending
     // Lock the mutex
@@ -1494,11 +8363,11 @@ void * client_thread(void * dS_client_connection) {
 
     // We reset the channel list of the client
     // Lock the mutex
-    pthread_mutex_lock(&mutex_tab_channel);
+    pthread_mutex_lock(&mutex_tab_channel[client_indice]);
     remove_all(tab_channel[client_indice]);
     add(tab_channel[client_indice], "global");
     // Unlock the mutex
-    pthread_mutex_unlock(&mutex_tab_channel);
+    pthread_mutex_unlock(&mutex_tab_channel[client_indice]);
 
     // We put the thread id in the shared queue of ended threads
     // Lock the mutex
@@ -1564,11 +8433,19 @@ void * cleanup(void * arg) {
 
 int main(int argc, char *argv[]) {
 
-  if (argc != 2) {
-        // We check if the user provided exactly 1 argument
-        printf("Error: You must provide exactly 1 argument.\nUsage: ./serv <port>\n");
+  if (argc < 2 || argc % 2 != 0) {
+        // We check if the user provided the port, then only pairs of -f <ip>:<port>
+        printf("Error: You must provide the port.\nUsage: ./serv <port> [-f <ip>:<port>]...\n");
         exit(EXIT_FAILURE);
     }  
+  int a = 2;
+  while (a < argc) {
+    if (strcmp(argv[a], "-f") != 0) {
+        printf("Error: Unknown option %s.\nUsage: ./serv <port> [-f <ip>:<port>]...\n", argv[a]);
+        exit(EXIT_FAILURE);
+    }
+    a = a + 2;
+  }
 
   printf("Debut du Serveur.\n");
 
@@ -1685,10 +8562,19 @@ int main(int argc, char *argv[]) {
     }
     printf("Mode ecoute channel\n");
 
+  // We create the directory for the partial uploads if it doesn't exist yet
+  if (mkdir("../src/server_partial", 0755) == -1 && errno != EEXIST) {
+    perror("Erreur lors de la creation du dossier server_partial");
+    exit(EXIT_FAILURE);
+  }
+  // The chunks of the parallel uploads that were in progress are lost with the server
+  chunked_uploads_clean();
+
   // We put zeros in the arrays to show that the clients are not connected
   // and that the threads are not created
   memset(tab_client_connecting, 0, sizeof(tab_client_connecting));
   memset(tab_client, 0, sizeof(tab_client));
+  memset(tab_channel_dS, 0, sizeof(tab_channel_dS));
   memset(Threads_id, 0, sizeof(Threads_id));
 
   // We set all usernames to an empty string
@@ -1718,7 +8604,11 @@ int main(int argc, char *argv[]) {
   pthread_mutex_init(&mutex_ended_threads, NULL);
   pthread_mutex_init(&mutex_Threads_id, NULL);
   pthread_mutex_init(&mutex_tab_client, NULL);
-  pthread_mutex_init(&mutex_tab_channel, NULL);
+  j = 0;
+  while (j < MAX_CLIENT) {
+    pthread_mutex_init(&mutex_tab_channel[j], NULL);
+    j = j + 1;
+  }
 
   // Initialise the shared queue of disconnected clients
   ended_threads = new_queue();
@@ -1728,6 +8618,96 @@ int main(int argc, char *argv[]) {
   socklen_t tab_lg[MAX_CLIENT];
   pthread_t tid;
   pthread_t cleanup_tid;
+  pthread_t shutdown_tid;
+
+  // Initialise the table of the checksums
+  crc32c_init();
+  pthread_mutex_init(&mutex_chunked_uploads, NULL);
+
+  // Start the threads that write the uploads on the disk
+  writer_pool_start();
+
+  // Read server_files and keep the catalog of the files up to date
+  pthread_mutex_init(&mutex_cache, NULL);
+  pthread_cond_init(&cond_cache, NULL);
+  catalog_start();
+
+  // Start the thread that writes the history of the channels
+  history_start();
+
+  // The dms of the disconnected clients wait in their mailbox
+  mailbox_start();
+
+  // Start the workers of the channel actors
+  channel_start();
+
+  // Link this server with the other servers of the federation
+  federation_start(atoi(argv[1]), argv + 2, argc - 2);
+
+  // Initialise the scheduler of the transfers with the configuration file
+  memset(sched_client_served, 0, sizeof(sched_client_served));
+  memset(sched_client_transfers, 0, sizeof(sched_client_transfers));
+  pthread_mutex_init(&mutex_sched, NULL);
+  pthread_cond_init(&cond_sched, NULL);
+  pthread_mutex_lock(&mutex_sched);
+  sched_load_config();
+  pthread_mutex_unlock(&mutex_sched);
+
+  // Launch the thread that sends the digests of the arrivals and departures in the channels
+  pthread_t presence_tid;
+  if (pthread_create(&presence_tid, NULL, presence_thread, NULL) != 0) {
+    perror("Erreur lors de la creation du thread");
+    exit(EXIT_FAILURE);
+  }
+
+  // Initialise the senders of the main connections and the multiplexed streams
+  pthread_t sender_tid;
+  int * sender_indice;
+  int l = 0;
+  while (l < MAX_CLIENT) {
+    pthread_mutex_init(&tab_sender[l].mutex, NULL);
+    pthread_cond_init(&tab_sender[l].cond, NULL);
+    tab_sender[l].busy = 0;
+    tab_sender[l].nb_chat_waiting = 0;
+    tab_sender[l].outbox = malloc(OUTBOX_MAX * sizeof(Message));
+    tab_sender[l].outbox_dS = malloc(OUTBOX_MAX * sizeof(int));
+    tab_sender[l].outbox_first = 0;
+    tab_sender[l].nb_outbox = 0;
+    tab_sender[l].outbox_sending = 0;
+    tab_sender[l].outbox_refused = 0;
+    pthread_cond_init(&tab_sender[l].cond_outbox, NULL);
+    sender_indice = malloc(sizeof(int));
+    *sender_indice = l;
+    if (pthread_create(&sender_tid, NULL, sender_thread, sender_indice) != 0) {
+      perror("Erreur lors de la creation du thread");
+      exit(EXIT_FAILURE);
+    }
+    l = l + 1;
+  }
+  pthread_mutex_init(&mutex_mux_streams, NULL);
+  pthread_cond_init(&cond_mux_streams, NULL);
+
+  // Initialise the tickets
+  memset(tab_ticket, 0, sizeof(tab_ticket));
+  pthread_mutex_init(&mutex_tab_ticket, NULL);
+
+  // Launch the threads that will accept the connections for the uploads, the downloads and the channels
+  pthread_t accept_upload_tid;
+  pthread_t accept_download_tid;
+  pthread_t accept_channel_tid;
+  if (pthread_create(&accept_upload_tid, NULL, accept_thread, (void *) upload_file_thread) != 0) {
+    perror("Erreur lors de la creation du thread");
+    exit(EXIT_FAILURE);
+  }
+  if (pthread_create(&accept_download_tid, NULL, accept_thread, (void *) download_file_thread) != 0) {
+    perror("Erreur lors de la creation du thread");
+    exit(EXIT_FAILURE);
+  }
+  if (pthread_create(&accept_channel_tid, NULL, accept_thread, (void *) channel_thread) != 0) {
+    perror("Erreur lors de la creation du thread");
+    exit(EXIT_FAILURE);
+  }
+  printf("Threads d'upload, de download et de channel crees\n");
 
   // Launch the thread that will clean up client threads
   if (pthread_create(&cleanup_tid, NULL, cleanup, NULL) == -1) {
@@ -1736,8 +8716,19 @@ int main(int argc, char *argv[]) {
   }
   printf("Thread de cleanup cree\n");
 
-  // We intercept the Ctrl+C signal
+  // We intercept the Ctrl+C signal, the server is closed by the shutdown thread
+  if (pipe(interrupt_pipe) == -1) {
+    perror("Erreur lors de la creation du pipe");
+    exit(EXIT_FAILURE);
+  }
+  fcntl(interrupt_pipe[1], F_SETFL, O_NONBLOCK);
+  if (pthread_create(&shutdown_tid, NULL, shutdown_thread, NULL) != 0) {
+    perror("Erreur lors de la creation du thread");
+    exit(EXIT_FAILURE);
+  }
   signal(SIGINT, handle_interrupt);
+  // SIGHUP reads the configuration file again
+  signal(SIGHUP, handle_reload);
 
   // Acceptation de la connexion des clients
   printf("En attente de connexion des clients\n");
@@ -0,0 +1,107 @@
+#!/bin/bash
+# Uploads then downloads a big sparse file through the server and the client over 127.0.0.1,
+# checks that the size and the CRC of the file did not change, and prints the throughput
+#
+# => ./test_transfer.sh [size] [port]
+#
+# The size is given to truncate, 5G by default (the file is more than 4 GB, so the offsets need 64 bits)
+# Run ./compil.sh first. The server and the client are started from bin, like by hand
+
+SIZE=${1:-5G}
+PORT=${2:-12345}
+NAME=transfer_test.bin
+
+cd "$(dirname "$0")/bin" || exit 1
+CLIENT_FILE=../src/client_files/$NAME
+SERVER_FILE=../src/server_files/$NAME
+WORK=$(mktemp -d)
+SERVER_PID=
+CLIENT_PID=
+
+cleanup() {
+    exec 3>&-
+    [ -n "$CLIENT_PID" ] && kill "$CLIENT_PID" 2>/dev/null
+    [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null
+    wait 2>/dev/null
+    rm -f "$CLIENT_FILE" "$CLIENT_FILE.part" "$SERVER_FILE"
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "ECHEC: $1"
+    exit 1
+}
+
+# The time in seconds, with the nanoseconds
+now() {
+    date +%s.%N
+}
+
+# Waits until the file $1 exists with $2 bytes, at most $3 seconds
+wait_file() {
+    local end=$(( $(date +%s) + $3 ))
+    while [ "$(stat -c %s "$1" 2>/dev/null)" != "$2" ]; do
+        [ "$(date +%s)" -gt "$end" ] && return 1
+        sleep 0.2
+    done
+    return 0
+}
+
+# Starts a client logged in as $1, its commands are written on the file descriptor 3
+start_client() {
+    rm -f "$WORK/in"
+    mkfifo "$WORK/in"
+    ./client 127.0.0.1 "$PORT" < "$WORK/in" > "$WORK/$1.log" 2>&1 &
+    CLIENT_PID=$!
+    exec 3> "$WORK/in"
+    echo "$1" >&3
+    sleep 0.5
+}
+
+stop_client() {
+    echo "/fin" >&3
+    exec 3>&-
+    wait "$CLIENT_PID" 2>/dev/null
+    CLIENT_PID=
+}
+
+# The sparse file, with random bytes at its start and after 4 GB so that they are really compared
+rm -f "$CLIENT_FILE" "$CLIENT_FILE.part" "$SERVER_FILE"
+truncate -s "$SIZE" "$CLIENT_FILE" || fail "truncate -s $SIZE"
+BYTES=$(stat -c %s "$CLIENT_FILE")
+head -c 1048576 /dev/urandom | dd of="$CLIENT_FILE" conv=notrunc status=none
+if [ "$BYTES" -gt $(( 4 * 1024 * 1024 * 1024 + 1048576 )) ]; then
+    head -c 1048576 /dev/urandom | dd of="$CLIENT_FILE" bs=1048576 seek=4096 conv=notrunc status=none
+fi
+echo "Fichier de $BYTES octets"
+CRC=$(cksum < "$CLIENT_FILE")
+
+./server "$PORT" > "$WORK/server.log" 2>&1 &
+SERVER_PID=$!
+sleep 0.5
+kill -0 "$SERVER_PID" 2>/dev/null || fail "le serveur ne demarre pas (port $PORT)"
+
+# Upload
+start_client upload
+START=$(now)
+echo "/upload $NAME" >&3
+wait_file "$SERVER_FILE" "$BYTES" 3600 || fail "le serveur n'a pas recu tout le fichier"
+UPLOAD=$(awk "BEGIN { print $(now) - $START }")
+stop_client
+[ "$(cksum < "$SERVER_FILE")" = "$CRC" ] || fail "le fichier du serveur est different"
+echo "Upload : $BYTES octets en $UPLOAD s, $(awk "BEGIN { printf \"%.0f\", $BYTES / $UPLOAD / 1000000 }") Mo/s, CRC identique"
+
+# Download, the file of the client is removed first
+rm -f "$CLIENT_FILE"
+start_client download
+START=$(now)
+echo "/download $NAME" >&3
+sleep 0.5
+printf '\033[B\n' >&3
+wait_file "$CLIENT_FILE" "$BYTES" 3600 || fail "le client n'a pas recu tout le fichier"
+DOWNLOAD=$(awk "BEGIN { print $(now) - $START - 0.5 }")
+stop_client
+[ "$(cksum < "$CLIENT_FILE")" = "$CRC" ] || fail "le fichier du client est different"
+echo "Download : $BYTES octets en $DOWNLOAD s, $(awk "BEGIN { printf \"%.0f\", $BYTES / $DOWNLOAD / 1000000 }") Mo/s, CRC identique"
+echo "(les zeros du fichier creux sont compresses par le transfert, le debit est celui des octets du fichier)"